@@ -32,11 +32,14 @@
 
 #include "Archive.h"
 #include "Depot.h"
+#include "Digest.h"
 #include "File.h"
 #include "Utils.h"
 
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,11 +48,61 @@
 #if TARGET_OS_EMBEDDED
 # define COMPACT_SUFFIX ".tar"
 # define COMPACT_COMPRESSION ""
+# define COMPACT_COMPRESSOR NULL
 #else
 # define COMPACT_SUFFIX ".tar.bz2"
 # define COMPACT_COMPRESSION "j"
+# define COMPACT_COMPRESSOR "/usr/bin/bzip2"
 #endif
 
+#define TAR_BLOCK 512
+
+// Formats ArchiveFactory recognizes, the container in the low byte
+// and the compression above it.
+const uint32_t ARCHIVE_FORMAT_UNKNOWN = 0x0000;
+const uint32_t ARCHIVE_FORMAT_DIRECTORY = 0x0001;
+const uint32_t ARCHIVE_FORMAT_TAR = 0x0002;
+const uint32_t ARCHIVE_FORMAT_CPIO = 0x0003;
+const uint32_t ARCHIVE_FORMAT_PAX = 0x0004;
+const uint32_t ARCHIVE_FORMAT_XAR = 0x0005;
+const uint32_t ARCHIVE_FORMAT_ZIP = 0x0006;
+
+const uint32_t ARCHIVE_COMPRESSION_NONE = 0x0000;
+const uint32_t ARCHIVE_COMPRESSION_GZIP = 0x0100;
+const uint32_t ARCHIVE_COMPRESSION_BZIP2 = 0x0200;
+const uint32_t ARCHIVE_COMPRESSION_XZ = 0x0300;
+const uint32_t ARCHIVE_COMPRESSION_ZSTD = 0x0400;
+const uint32_t ARCHIVE_COMPRESSION = 0xff00;
+
+// A decompressor that can use more than one core, and the option that
+// makes it do so.  Some use their threads for reading, writing and
+// checksumming instead, which still beats letting tar do it all.
+struct Decompressor {
+	const char* tool;
+	const char* threads;
+};
+
+static const Decompressor gzip_decompressors[] = {
+	{ "pigz", NULL },
+	{ NULL, NULL }
+};
+
+static const Decompressor bzip2_decompressors[] = {
+	{ "lbzip2", NULL },
+	{ "pbzip2", NULL },
+	{ NULL, NULL }
+};
+
+static const Decompressor xz_decompressors[] = {
+	{ "xz", "-T0" },
+	{ NULL, NULL }
+};
+
+static const Decompressor zstd_decompressors[] = {
+	{ "zstd", NULL },
+	{ NULL, NULL }
+};
+
 extern char** environ;
 
 Archive::Archive(const char* path) {
@@ -57,6 +110,8 @@ Archive::Archive(const char* path) {
 	uuid_generate_random(m_uuid);
 	m_path = strdup(path);
 	m_name = strdup(basename(m_path));
+	m_build = NULL;
+	m_fingerprint = NULL;
 	m_info = 0;
 	m_date_installed = time(NULL);
 	m_is_superseded = -1;  // unknown
@@ -69,6 +124,7 @@ Archive::Archive(uint64_t serial, uuid_t uuid, const char* name, const char* pat
 	m_name = name ? strdup(name) : NULL;
 	m_path = path ? strdup(path) : NULL;
 	m_build = build ? strdup(build) : NULL;
+	m_fingerprint = NULL;
 	m_info = info;
 	m_date_installed = date_installed;
 	m_is_superseded = -1; // unknown
@@ -79,6 +135,7 @@ Archive::~Archive() {
 	if (m_path) free(m_path);
 	if (m_name) free(m_name);
 	if (m_build) free(m_build);
+	if (m_fingerprint) delete m_fingerprint;
 }
 
 uint64_t	Archive::serial()		{ return m_serial; }
@@ -86,6 +143,7 @@ uint8_t*	Archive::uuid()			{ return m_uuid; }
 const char*	Archive::name()			{ return m_name; }
 const char*	Archive::path()			{ return m_path; }
 const char*	Archive::build()		{ return m_build; }
+Digest*		Archive::fingerprint()		{ return m_fingerprint; }
 uint64_t	Archive::info()			{ return m_info; }
 time_t		Archive::date_installed()	{ return m_date_installed; }
 
@@ -116,20 +174,28 @@ char* Archive::create_directory(const char* prefix) {
 int Archive::compact_directory(const char* prefix) {
 	int res = 0;
 	char* tarpath = NULL;
+	char* tmppath = NULL;
 	char uuidstr[37];
 	uuid_unparse_upper(m_uuid, uuidstr);
 	asprintf(&tarpath, "%s/%s" COMPACT_SUFFIX, prefix, uuidstr);
-	if (tarpath) {
+	// compacting again replaces the backing store rather than writing 
+	// through a link to it in an object store
+	if (tarpath) asprintf(&tmppath, "%s.compact", tarpath);
+	if (tmppath) {
 		const char* args[] = {
 			"/usr/bin/tar",
-			"cf" COMPACT_COMPRESSION, tarpath,
+			"cf" COMPACT_COMPRESSION, tmppath,
 			"-C", prefix,
 			uuidstr,
 			NULL
 		};
 		res = exec_with_args(args);
+		if (res == 0) res = rename(tmppath, tarpath);
+		if (res) unlink(tmppath);
 		free(tarpath);
+		free(tmppath);
 	} else {
+		free(tarpath);
 		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
 		res = -1;
 	}
@@ -139,32 +205,56 @@ int Archive::compact_directory(const char* prefix) {
 int Archive::expand_directory(const char* prefix) {
 	int res = 0;
 	char* tarpath = NULL;
+	char* tmppath = NULL;
 	char uuidstr[37];
 	uuid_unparse_upper(m_uuid, uuidstr);
 	asprintf(&tarpath, "%s/%s" COMPACT_SUFFIX, prefix, uuidstr);
-	if (tarpath) {
+	// A backing store shared through an object store was compacted by
+	// whichever archive added it, so the directory in it may be named
+	// after another archive. It is expanded aside and renamed after this one.
+	asprintf(&tmppath, "%s/%s.expand", prefix, uuidstr);
+	if (tarpath && tmppath) {
+		if (is_directory(tmppath)) remove_directory(tmppath);
+		res = mkdir(tmppath, 0700);
+		if (res) perror(tmppath);
 		const char* args[] = {
 			"/usr/bin/tar",
 			"xf" COMPACT_COMPRESSION, tarpath,
-			"-C", prefix,
+			"-C", tmppath,
 			"-p",	// --preserve-permissions
 			NULL
 		};
-		res = exec_with_args(args);
-		free(tarpath);
+		if (res == 0) res = exec_with_args(args);
+		DIR* dir = res == 0 ? opendir(tmppath) : NULL;
+		struct dirent* dp;
+		char* dirpath = NULL;
+		while (dir && !dirpath && (dp = readdir(dir)) != NULL) {
+			if (dp->d_name[0] != '.') join_path(&dirpath, tmppath, dp->d_name);
+		}
+		if (res == 0 && !dirpath) {
+			fprintf(stderr, "%s:%d: nothing in %s\n", __FILE__, __LINE__, tarpath);
+			res = -1;
+		}
+		if (dir) closedir(dir);
+		char* uuidpath = NULL;
+		if (res == 0) join_path(&uuidpath, prefix, uuidstr);
+		if (res == 0) res = rename(dirpath, uuidpath);
+		if (res == 0) res = rmdir(tmppath);
+		if (res) perror(tmppath);
+		free(uuidpath);
+		free(dirpath);
 	} else {
 		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
 		res = -1;
 	}
+	free(tarpath);
+	free(tmppath);
 	return res;
 }
 
 int Archive::prune_compacted_archive(const char* prefix) {
 	int res = 0;
-	char* tarpath = NULL;
-	char uuidstr[37];
-	uuid_unparse_upper(m_uuid, uuidstr);
-	asprintf(&tarpath, "%s/%s" COMPACT_SUFFIX, prefix, uuidstr);
+	char* tarpath = this->compacted_path(prefix);
 	if (tarpath) {
 		res = unlink(tarpath);
 		if (res) perror(tarpath);
@@ -173,6 +263,14 @@ int Archive::prune_compacted_archive(const char* prefix) {
 	return res;
 }
 
+char* Archive::compacted_path(const char* prefix) {
+	char* tarpath = NULL;
+	char uuidstr[37];
+	uuid_unparse_upper(m_uuid, uuidstr);
+	asprintf(&tarpath, "%s/%s" COMPACT_SUFFIX, prefix, uuidstr);
+	return tarpath;
+}
+
 int Archive::extract(const char* destdir) {
 	// not implemented
 	return -1;
@@ -186,6 +284,580 @@ RollbackArchive::RollbackArchive() : Archive("<Rollback>") {
 
 
 
+StreamArchive::StreamArchive(int fd) : Archive("-") {
+	m_fd = fd;
+	m_copy_fd = -1;
+	m_copy_pid = 0;
+	m_remaining = 0;
+	m_padding = 0;
+	m_entry_path = NULL;
+	m_entry_linkpath = NULL;
+}
+
+StreamArchive::~StreamArchive() {
+	if (m_copy_fd != -1) close(m_copy_fd);
+	if (m_copy_pid) wait_for_pid(m_copy_pid);
+	free(m_entry_path);
+	free(m_entry_linkpath);
+}
+
+int StreamArchive::extract(const char* destdir) {
+	const char* args[] = {
+		"/usr/bin/tar",
+		"xf", "-",
+		"-C", destdir,
+		NULL
+	};
+	posix_spawn_file_actions_t fa;
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, m_fd, 0);
+	int res = exec_with_args_fa(args, &fa);
+	posix_spawn_file_actions_destroy(&fa);
+	return res;
+}
+
+int StreamArchive::begin_compact(const char* prefix) {
+	char* tarpath = this->compacted_path(prefix);
+	if (!tarpath) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		return -1;
+	}
+	int fd = open(tarpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "%s:%d: %s: %s (%d)\n", __FILE__, __LINE__, tarpath, 
+				strerror(errno), errno);
+		free(tarpath);
+		return -1;
+	}
+	free(tarpath);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	
+	const char* compressor = COMPACT_COMPRESSOR;
+	if (!compressor) {
+		m_copy_fd = fd;
+		return 0;
+	}
+	
+	int fds[2];
+	if (pipe(fds) == -1) {
+		perror("pipe");
+		close(fd);
+		return -1;
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	posix_spawn_file_actions_t fa;
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, fds[0], 0);
+	posix_spawn_file_actions_adddup2(&fa, fd, 1);
+	const char* args[] = { compressor, "-c", NULL };
+	int res = spawn_with_args(args, &fa, &m_copy_pid);
+	posix_spawn_file_actions_destroy(&fa);
+	close(fds[0]);
+	close(fd);
+	if (res) {
+		m_copy_pid = 0;
+		close(fds[1]);
+		return res;
+	}
+	m_copy_fd = fds[1];
+	return 0;
+}
+
+int StreamArchive::compact_directory(const char* prefix) {
+	int res = 0;
+	if (m_copy_fd != -1 && close(m_copy_fd) == -1) res = -1;
+	m_copy_fd = -1;
+	if (m_copy_pid) {
+		if (wait_for_pid(m_copy_pid) != 0) res = -1;
+		m_copy_pid = 0;
+	}
+	if (res) fprintf(stderr, "Error: unable to write the backing store of %s\n", m_name);
+	return res;
+}
+
+int StreamArchive::read_full(void* buf, size_t size) {
+	size_t len = 0;
+	while (len < size) {
+		ssize_t n = ::read(m_fd, (uint8_t*)buf + len, size - len);
+		if (n == -1 && errno == EINTR) continue;
+		if (n == -1) {
+			perror("read");
+			return -1;
+		}
+		if (n == 0) break;
+		len += n;
+	}
+	return (int)(len == size ? 1 : (len == 0 ? 0 : -1));
+}
+
+int StreamArchive::copy(const void* buf, size_t size) {
+	if (m_copy_fd == -1) return 0;
+	if (write_all(m_copy_fd, buf, size)) {
+		perror("write");
+		return -1;
+	}
+	return 0;
+}
+
+// Reads one header block. Returns 1, 0 at the end of the stream or -1.
+int StreamArchive::read_block(uint8_t* block) {
+	int res = this->read_full(block, TAR_BLOCK);
+	if (res == -1) fprintf(stderr, "Error: the tar stream ended in the middle of a block\n");
+	return res;
+}
+
+int StreamArchive::skip_data() {
+	uint8_t buf[8192];
+	while (m_remaining + m_padding > 0) {
+		if (this->read(buf, sizeof(buf)) == -1) return -1;
+	}
+	return 0;
+}
+
+ssize_t StreamArchive::read(void* buf, size_t size) {
+	if (m_remaining == 0) {
+		// the padding up to the next header, which goes into the copy too
+		if (m_padding) {
+			uint8_t pad[TAR_BLOCK];
+			if (this->read_full(pad, (size_t)m_padding) != 1) {
+				fprintf(stderr, "Error: the tar stream ended in the middle of %s\n", 
+						m_entry_path);
+				return -1;
+			}
+			if (this->copy(pad, (size_t)m_padding)) return -1;
+			m_padding = 0;
+		}
+		return 0;
+	}
+	if ((off_t)size > m_remaining) size = (size_t)m_remaining;
+	ssize_t n;
+	do {
+		n = ::read(m_fd, buf, size);
+	} while (n == -1 && errno == EINTR);
+	if (n <= 0) {
+		if (n == -1) perror("read");
+		fprintf(stderr, "Error: the tar stream ended in the middle of %s\n", m_entry_path);
+		return -1;
+	}
+	if (this->copy(buf, n)) return -1;
+	m_remaining -= n;
+	return n;
+}
+
+// tar(5) numeric fields are octal, or base-256 when the top bit is set
+static uint64_t tar_number(const uint8_t* field, size_t size) {
+	uint64_t value = 0;
+	if (field[0] & 0x80) {
+		value = field[0] & 0x3f;
+		for (size_t i = 1; i < size; i++) value = (value << 8) | field[i];
+		return value;
+	}
+	size_t i = 0;
+	while (i < size && (field[i] == ' ' || field[i] == '\0')) i++;
+	for (; i < size && field[i] >= '0' && field[i] <= '7'; i++) {
+		value = (value << 3) | (field[i] - '0');
+	}
+	return value;
+}
+
+static bool tar_checksum_ok(const uint8_t* block) {
+	uint64_t sum = 0;
+	for (int i = 0; i < TAR_BLOCK; i++) {
+		sum += (i >= 148 && i < 156) ? ' ' : block[i];
+	}
+	return sum == tar_number(block + 148, 8);
+}
+
+static void tar_set_checksum(uint8_t* block) {
+	memset(block + 148, ' ', 8);
+	uint32_t sum = 0;
+	for (int i = 0; i < TAR_BLOCK; i++) sum += block[i];
+	snprintf((char*)block + 148, 8, "%06o", sum);
+}
+
+// copies a fixed size, possibly unterminated header field
+static char* tar_string(const uint8_t* field, size_t size) {
+	size_t len = 0;
+	while (len < size && field[len]) len++;
+	return strndup((const char*)field, len);
+}
+
+// Strips the leading "/" and "./" tar(1) writes in front of names and
+// any trailing "/". Refuses names that would leave the root.
+static int tar_path(char* path) {
+	char* start = path;
+	while (start[0] == '/' || (start[0] == '.' && (start[1] == '/' || start[1] == '\0'))) {
+		start += (start[0] == '/') ? 1 : (start[1] == '\0' ? 1 : 2);
+	}
+	memmove(path, start, strlen(start) + 1);
+	size_t len = strlen(path);
+	while (len > 0 && path[len - 1] == '/') path[--len] = '\0';
+	
+	for (char* p = path; p; p = strchr(p, '/')) {
+		if (*p == '/') p++;
+		if (strncmp(p, "..", 2) == 0 && (p[2] == '/' || p[2] == '\0')) {
+			fprintf(stderr, "Error: %s leaves the root of the tar stream\n", path);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// appends a pax(1) extended header record, "<length> <key>=<value>\n"
+static int pax_record(char** records, size_t* len, const char* key, const char* value) {
+	// the length counts its own digits
+	size_t size = strlen(key) + strlen(value) + 3;
+	size_t total = size + 1;
+	for (;;) {
+		size_t digits = 1;
+		for (size_t n = total; n >= 10; n /= 10) digits++;
+		if (size + digits == total) break;
+		total = size + digits;
+	}
+	char* grown = (char*)realloc(*records, *len + total + 1);
+	if (!grown) return -1;
+	*records = grown;
+	*len += snprintf(*records + *len, total + 1, "%zu %s=%s\n", total, key, value);
+	return 0;
+}
+
+// The copy names every entry with a pax(1) extended header, so nothing
+// in the header itself has to be rewritten.
+int StreamArchive::copy_header(uint8_t* block, const char* path, const char* linkpath,
+							   const char* records, size_t records_len) {
+	if (m_copy_fd == -1) return 0;
+	
+	char uuidstr[37];
+	uuid_unparse_upper(m_uuid, uuidstr);
+	char* copy_records = NULL;
+	size_t copy_len = 0;
+	char* name = NULL;
+	int res = 0;
+	if (records_len) {
+		copy_records = (char*)malloc(records_len);
+		if (copy_records) memcpy(copy_records, records, records_len);
+		copy_len = records_len;
+	}
+	asprintf(&name, "%s/%s", uuidstr, path);
+	if (!name || pax_record(&copy_records, &copy_len, "path", name)) res = -1;
+	free(name);
+	name = NULL;
+	if (res == 0 && linkpath) {
+		// hard links name another entry, which moved too
+		if (block[156] == '1') {
+			asprintf(&name, "%s/%s", uuidstr, linkpath);
+			if (!name) res = -1;
+		}
+		if (res == 0) res = pax_record(&copy_records, &copy_len, "linkpath", 
+									   name ? name : linkpath);
+		free(name);
+	}
+	if (res) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		free(copy_records);
+		return -1;
+	}
+	
+	uint8_t header[TAR_BLOCK];
+	memset(header, 0, sizeof(header));
+	snprintf((char*)header, 100, "%s/PaxHeader", uuidstr);
+	snprintf((char*)header + 100, 8, "%07o", 0644);
+	snprintf((char*)header + 108, 8, "%07o", 0);
+	snprintf((char*)header + 116, 8, "%07o", 0);
+	snprintf((char*)header + 124, 12, "%011llo", (unsigned long long)copy_len);
+	snprintf((char*)header + 136, 12, "%011llo", (unsigned long long)m_date_installed);
+	header[156] = 'x';
+	memcpy(header + 257, "ustar", 6);
+	memcpy(header + 263, "00", 2);
+	tar_set_checksum(header);
+	
+	uint8_t pad[TAR_BLOCK];
+	memset(pad, 0, sizeof(pad));
+	res = this->copy(header, TAR_BLOCK);
+	if (res == 0) res = this->copy(copy_records, copy_len);
+	if (res == 0) res = this->copy(pad, (TAR_BLOCK - copy_len % TAR_BLOCK) % TAR_BLOCK);
+	if (res == 0) res = this->copy(block, TAR_BLOCK);
+	free(copy_records);
+	return res;
+}
+
+// Reads the data of an extended header entry, which copy_header()
+// replaces in the copy.
+char* StreamArchive::read_extended(uint64_t size) {
+	if (size > 1024 * 1024) {
+		fprintf(stderr, "Error: extended header of %llu bytes in the tar stream\n",
+				(unsigned long long)size);
+		return NULL;
+	}
+	size_t padded = (size_t)(size + m_padding);
+	char* data = (char*)malloc(padded + 1);
+	if (!data) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		return NULL;
+	}
+	if (padded && this->read_full(data, padded) != 1) {
+		fprintf(stderr, "Error: the tar stream ended in an extended header\n");
+		free(data);
+		return NULL;
+	}
+	data[size] = '\0';
+	m_remaining = 0;
+	m_padding = 0;
+	return data;
+}
+
+int StreamArchive::next(StreamEntry* ent) {
+	int res = this->skip_data();
+	free(m_entry_path);
+	free(m_entry_linkpath);
+	m_entry_path = NULL;
+	m_entry_linkpath = NULL;
+	
+	// GNU long names and pax(1) extended headers apply to the next entry,
+	// the copy gets the pax records that are not about names
+	char* longname = NULL;
+	char* longlink = NULL;
+	char* records = NULL;
+	size_t records_len = 0;
+	bool have_size = false, have_uid = false, have_gid = false;
+	uint64_t pax_size = 0, pax_uid = 0, pax_gid = 0;
+	
+	uint8_t block[TAR_BLOCK];
+	while (res == 0) {
+		res = this->read_block(block);
+		if (res == 0) {
+			// a stream cut short between two entries still lacks this
+			fprintf(stderr, "Error: the tar stream ended without an end of archive\n");
+			res = -1;
+		}
+		if (res == -1) break;
+		
+		bool zero = true;
+		for (int i = 0; i < TAR_BLOCK && zero; i++) zero = (block[i] == 0);
+		if (zero) {
+			// the end of the archive, which the copy needs as well
+			uint8_t end[TAR_BLOCK * 2];
+			memset(end, 0, sizeof(end));
+			res = this->copy(end, sizeof(end));
+			break;
+		}
+		res = 0;
+		if (!tar_checksum_ok(block)) {
+			fprintf(stderr, "Error: the input is not an uncompressed tar stream\n");
+			res = -1;
+			break;
+		}
+		
+		char type = (char)block[156];
+		uint64_t size = tar_number(block + 124, 12);
+		m_remaining = (off_t)size;
+		m_padding = (off_t)((TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+		
+		if (type == 'L' || type == 'K') {
+			char* data = this->read_extended(size);
+			if (!data) {
+				res = -1;
+				break;
+			}
+			char** target = (type == 'L') ? &longname : &longlink;
+			free(*target);
+			*target = data;
+			continue;
+		}
+		if (type == 'x') {
+			char* data = this->read_extended(size);
+			if (!data) {
+				res = -1;
+				break;
+			}
+			char* rec = data;
+			while (rec < data + size) {
+				char* end = NULL;
+				unsigned long reclen = strtoul(rec, &end, 10);
+				if (!end || *end != ' ' || reclen == 0 || rec + reclen > data + size) break;
+				char* key = end + 1;
+				char* eq = (char*)memchr(key, '=', rec + reclen - key);
+				if (!eq) break;
+				size_t keylen = eq - key;
+				char* value = strndup(eq + 1, rec + reclen - 1 - (eq + 1));
+				if (keylen == 4 && strncmp(key, "path", 4) == 0) {
+					free(longname);
+					longname = value;
+					value = NULL;
+				} else if (keylen == 8 && strncmp(key, "linkpath", 8) == 0) {
+					free(longlink);
+					longlink = value;
+					value = NULL;
+				} else {
+					if (keylen == 4 && strncmp(key, "size", 4) == 0) {
+						have_size = true;
+						pax_size = strtoull(value, NULL, 10);
+					} else if (keylen == 3 && strncmp(key, "uid", 3) == 0) {
+						have_uid = true;
+						pax_uid = strtoull(value, NULL, 10);
+					} else if (keylen == 3 && strncmp(key, "gid", 3) == 0) {
+						have_gid = true;
+						pax_gid = strtoull(value, NULL, 10);
+					}
+					char* grown = (char*)realloc(records, records_len + reclen);
+					if (grown) {
+						records = grown;
+						memcpy(records + records_len, rec, reclen);
+						records_len += reclen;
+					}
+				}
+				free(value);
+				rec += reclen;
+			}
+			free(data);
+			continue;
+		}
+		if (type == 'g' || type == 'V') {
+			// global headers and volume labels go into the copy unchanged
+			res = this->copy(block, TAR_BLOCK);
+			if (res == 0) res = this->skip_data();
+			continue;
+		}
+		
+		// an actual entry
+		if (longname) {
+			m_entry_path = longname;
+			longname = NULL;
+		} else if (memcmp(block + 257, "ustar", 6) == 0 && block[345]) {
+			char* prefix = tar_string(block + 345, 155);
+			char* name = tar_string(block, 100);
+			asprintf(&m_entry_path, "%s/%s", prefix, name);
+			free(prefix);
+			free(name);
+		} else {
+			m_entry_path = tar_string(block, 100);
+		}
+		if (longlink) {
+			m_entry_linkpath = longlink;
+			longlink = NULL;
+		} else if (block[157]) {
+			m_entry_linkpath = tar_string(block + 157, 100);
+		}
+		if (!m_entry_path || tar_path(m_entry_path) ||
+			(type == '1' && m_entry_linkpath && tar_path(m_entry_linkpath))) {
+			res = -1;
+			break;
+		}
+		
+		if (have_size) size = pax_size;
+		mode_t mode = (mode_t)tar_number(block + 100, 8) & ALLPERMS;
+		switch (type) {
+			case '0': case '\0': case '7': case '1':
+				mode |= S_IFREG; break;
+			case '2': mode |= S_IFLNK; break;
+			case '5': mode |= S_IFDIR; break;
+			default: mode = 0; break;
+		}
+		// only regular files carry data, whatever the size field says
+		if (type == '1' || type == '2' || type == '5') size = 0;
+		m_remaining = (off_t)size;
+		m_padding = (off_t)((TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+		
+		ent->path = m_entry_path;
+		ent->linkpath = m_entry_linkpath;
+		ent->type = type;
+		ent->mode = mode;
+		ent->uid = (uid_t)(have_uid ? pax_uid : tar_number(block + 108, 8));
+		ent->gid = (gid_t)(have_gid ? pax_gid : tar_number(block + 116, 8));
+		ent->size = (off_t)size;
+		ent->mtime = (time_t)tar_number(block + 136, 12);
+		res = this->copy_header(block, m_entry_path, m_entry_linkpath, records, records_len);
+		if (res == 0) res = 1;
+		break;
+	}
+	
+	free(longname);
+	free(longlink);
+	free(records);
+	return res;
+}
+
+
+
+// Returns the path of an installed tool, or NULL.
+// Caller must free the returned string.
+// darwinup runs as root, so only tools that nobody but root could have
+// put there are used. The tool and every directory above it must be 
+// owned by root and not writable by anyone else, and the tool must not 
+// be a symlink.
+static bool is_trusted_tool(const char* path) {
+	char* p = strdup(path);
+	if (!p) return false;
+	bool trusted = true;
+	bool tool = true;
+	while (trusted) {
+		struct stat sb;
+		if (lstat(p, &sb) == -1 || sb.st_uid != 0 || 
+			(sb.st_mode & (S_IWGRP | S_IWOTH)) ||
+			(tool ? !S_ISREG(sb.st_mode) : !S_ISDIR(sb.st_mode))) {
+			IF_DEBUG("not using %s, %s is not safe\n", path, p);
+			trusted = false;
+		}
+		tool = false;
+		
+		char* slash = strrchr(p, '/');
+		if (!slash || strcmp(p, "/") == 0) break;
+		if (slash == p) slash[1] = 0;
+		else slash[0] = 0;
+	}
+	free(p);
+	return trusted;
+}
+
+static char* find_tool(const char* tool) {
+	static const char* dirs[] = {
+		"/usr/bin",
+		"/usr/local/bin",
+		"/opt/local/bin",
+		"/opt/homebrew/bin",
+		NULL
+	};
+	for (int i = 0; dirs[i]; i++) {
+		char* path;
+		if (join_path(&path, dirs[i], tool)) return NULL;
+		if (access(path, X_OK) == 0 && is_trusted_tool(path)) return path;
+		free(path);
+	}
+	return NULL;
+}
+
+// Pipes the first of decompressors that is installed into tar(1), or
+// runs args when none is.
+static int extract_with_decompressor(const char* path, const char* destdir,
+									 const Decompressor* decompressors,
+									 const char** args) {
+	for (int i = 0; decompressors[i].tool; i++) {
+		char* tool = find_tool(decompressors[i].tool);
+		if (!tool) continue;
+		
+		const char* decompress[5];
+		int n = 0;
+		decompress[n++] = tool;
+		if (decompressors[i].threads) decompress[n++] = decompressors[i].threads;
+		decompress[n++] = "-dc";
+		decompress[n++] = path;
+		decompress[n++] = NULL;
+		const char* untar[] = {
+			"/usr/bin/tar",
+			"xf", "-",
+			"-C", destdir,
+			NULL
+		};
+		IF_DEBUG("decompressing %s with %s\n", path, tool);
+		int res = exec_pipeline(decompress, untar);
+		free(tool);
+		return res;
+	}
+	return exec_with_args(args);
+}
+
+
 DittoArchive::DittoArchive(const char* path) : Archive(path) {}
 
 int DittoArchive::extract(const char* destdir) {
@@ -245,7 +917,7 @@ int TarGZArchive::extract(const char* destdir) {
 		"-C", destdir,
 		NULL
 	};
-	return exec_with_args(args);
+	return extract_with_decompressor(m_path, destdir, gzip_decompressors, args);
 }
 
 
@@ -258,7 +930,34 @@ int TarBZ2Archive::extract(const char* destdir) {
 		"-C", destdir,
 		NULL
 	};
-	return exec_with_args(args);
+	return extract_with_decompressor(m_path, destdir, bzip2_decompressors, args);
+}
+
+
+TarXZArchive::TarXZArchive(const char* path) : Archive(path) {}
+
+int TarXZArchive::extract(const char* destdir) {
+	const char* args[] = {
+		"/usr/bin/tar",
+		"xJf", m_path,
+		"-C", destdir,
+		NULL
+	};
+	return extract_with_decompressor(m_path, destdir, xz_decompressors, args);
+}
+
+
+TarZstdArchive::TarZstdArchive(const char* path) : Archive(path) {}
+
+int TarZstdArchive::extract(const char* destdir) {
+	// tar(1) detects zstd on its own if it was built with it
+	const char* args[] = {
+		"/usr/bin/tar",
+		"xf", m_path,
+		"-C", destdir,
+		NULL
+	};
+	return extract_with_decompressor(m_path, destdir, zstd_decompressors, args);
 }
 
 #if __MAC_OS_X_VERSION_MIN_REQUIRED >= 1060
@@ -288,12 +987,199 @@ int ZipArchive::extract(const char* destdir) {
 }
 
 
+static uint32_t format_for_suffix(const char* path) {
+	static const struct {
+		const char* suffix;
+		uint32_t format;
+	} suffixes[] = {
+		{ ".cpio", ARCHIVE_FORMAT_CPIO },
+		{ ".cpio.gz", ARCHIVE_FORMAT_CPIO | ARCHIVE_COMPRESSION_GZIP },
+		{ ".cpgz", ARCHIVE_FORMAT_CPIO | ARCHIVE_COMPRESSION_GZIP },
+		{ ".cpio.bz2", ARCHIVE_FORMAT_CPIO | ARCHIVE_COMPRESSION_BZIP2 },
+		{ ".cpbz2", ARCHIVE_FORMAT_CPIO | ARCHIVE_COMPRESSION_BZIP2 },
+		{ ".pax", ARCHIVE_FORMAT_PAX },
+		{ ".pax.gz", ARCHIVE_FORMAT_PAX | ARCHIVE_COMPRESSION_GZIP },
+		{ ".pgz", ARCHIVE_FORMAT_PAX | ARCHIVE_COMPRESSION_GZIP },
+		{ ".pax.bz2", ARCHIVE_FORMAT_PAX | ARCHIVE_COMPRESSION_BZIP2 },
+		{ ".pbz2", ARCHIVE_FORMAT_PAX | ARCHIVE_COMPRESSION_BZIP2 },
+		{ ".tar", ARCHIVE_FORMAT_TAR },
+		{ ".tar.gz", ARCHIVE_FORMAT_TAR | ARCHIVE_COMPRESSION_GZIP },
+		{ ".tgz", ARCHIVE_FORMAT_TAR | ARCHIVE_COMPRESSION_GZIP },
+		{ ".tar.bz2", ARCHIVE_FORMAT_TAR | ARCHIVE_COMPRESSION_BZIP2 },
+		{ ".tbz2", ARCHIVE_FORMAT_TAR | ARCHIVE_COMPRESSION_BZIP2 },
+		{ ".tbz", ARCHIVE_FORMAT_TAR | ARCHIVE_COMPRESSION_BZIP2 },
+		{ ".tar.xz", ARCHIVE_FORMAT_TAR | ARCHIVE_COMPRESSION_XZ },
+		{ ".txz", ARCHIVE_FORMAT_TAR | ARCHIVE_COMPRESSION_XZ },
+		{ ".tar.zst", ARCHIVE_FORMAT_TAR | ARCHIVE_COMPRESSION_ZSTD },
+		{ ".tzst", ARCHIVE_FORMAT_TAR | ARCHIVE_COMPRESSION_ZSTD },
+		{ ".xar", ARCHIVE_FORMAT_XAR },
+		{ ".zip", ARCHIVE_FORMAT_ZIP },
+		{ NULL, 0 }
+	};
+	for (int i = 0; suffixes[i].suffix; i++) {
+		if (has_suffix(path, suffixes[i].suffix)) return suffixes[i].format;
+	}
+	return ARCHIVE_FORMAT_UNKNOWN;
+}
+
+// container of an uncompressed archive that starts with buf
+static uint32_t container_for_header(const uint8_t* buf, ssize_t len) {
+	if (len >= 262 && memcmp(buf + 257, "ustar", 5) == 0) {
+		return ARCHIVE_FORMAT_TAR;
+	}
+	if (len >= 6 && (memcmp(buf, "070707", 6) == 0 || 
+					 memcmp(buf, "070701", 6) == 0 ||
+					 memcmp(buf, "070702", 6) == 0)) {
+		return ARCHIVE_FORMAT_CPIO;
+	}
+	// old binary cpio, in either byte order
+	if (len >= 2 && ((buf[0] == 0xc7 && buf[1] == 0x71) || 
+					 (buf[0] == 0x71 && buf[1] == 0xc7))) {
+		return ARCHIVE_FORMAT_CPIO;
+	}
+	if (len >= 4 && memcmp(buf, "xar!", 4) == 0) {
+		return ARCHIVE_FORMAT_XAR;
+	}
+	if (len >= 4 && buf[0] == 'P' && buf[1] == 'K' && 
+		((buf[2] == 3 && buf[3] == 4) || (buf[2] == 5 && buf[3] == 6))) {
+		return ARCHIVE_FORMAT_ZIP;
+	}
+	return ARCHIVE_FORMAT_UNKNOWN;
+}
+
+static uint32_t compression_for_header(const uint8_t* buf, ssize_t len) {
+	if (len >= 2 && buf[0] == 0x1f && buf[1] == 0x8b) {
+		return ARCHIVE_COMPRESSION_GZIP;
+	}
+	if (len >= 3 && memcmp(buf, "BZh", 3) == 0) {
+		return ARCHIVE_COMPRESSION_BZIP2;
+	}
+	if (len >= 6 && memcmp(buf, "\xfd" "7zXZ\0", 6) == 0) {
+		return ARCHIVE_COMPRESSION_XZ;
+	}
+	if (len >= 4 && buf[0] == 0x28 && buf[1] == 0xb5 && buf[2] == 0x2f && buf[3] == 0xfd) {
+		return ARCHIVE_COMPRESSION_ZSTD;
+	}
+	return ARCHIVE_COMPRESSION_NONE;
+}
+
+// Reads the start of what tool decompresses from path, stops it after that.
+static ssize_t read_decompressed(const char* tool, const char* path, 
+								 uint8_t* buf, size_t size) {
+	int fds[2];
+	if (pipe(fds) == -1) return -1;
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	
+	posix_spawn_file_actions_t fa;
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, fds[1], 1);
+	posix_spawn_file_actions_addclose(&fa, fds[0]);
+	posix_spawn_file_actions_addclose(&fa, fds[1]);
+	posix_spawn_file_actions_addclose(&fa, 2);
+	const char* args[] = { tool, "-dc", path, NULL };
+	pid_t pid;
+	int res = spawn_with_args(args, &fa, &pid);
+	posix_spawn_file_actions_destroy(&fa);
+	close(fds[1]);
+	
+	ssize_t len = 0;
+	while (res == 0 && (size_t)len < size) {
+		ssize_t n = read(fds[0], buf + len, size - len);
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) break;
+		len += n;
+	}
+	// the tool dies of SIGPIPE if it had more to say
+	close(fds[0]);
+	if (res == 0) wait_for_pid(pid);
+	return res ? -1 : len;
+}
+
+// Sniffs the format from the magic number at the start of path. The 
+// container of a compressed archive is only looked for when named, the
+// format its suffix implies, disagrees, since that means decompressing.
+static uint32_t format_for_contents(const char* path, uint32_t named) {
+	uint8_t buf[512];
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) return ARCHIVE_FORMAT_UNKNOWN;
+	ssize_t len = read(fd, buf, sizeof(buf));
+	close(fd);
+	if (len <= 0) return ARCHIVE_FORMAT_UNKNOWN;
+	
+	uint32_t compression = compression_for_header(buf, len);
+	if (compression == ARCHIVE_COMPRESSION_NONE) {
+		uint32_t container = container_for_header(buf, len);
+		// pax writes either tar or cpio
+		if (named == ARCHIVE_FORMAT_PAX && 
+			(container == ARCHIVE_FORMAT_TAR || container == ARCHIVE_FORMAT_CPIO)) {
+			return named;
+		}
+		return container;
+	}
+	
+	if ((named & ARCHIVE_COMPRESSION) == compression) return named;
+	
+	// ditto(1) only handles gzip and bzip2 compressed cpio, so any 
+	// other compressed archive has to be a tar
+	uint32_t container = ARCHIVE_FORMAT_TAR;
+	const char* tool = NULL;
+	if (compression == ARCHIVE_COMPRESSION_GZIP) tool = "/usr/bin/gzip";
+	if (compression == ARCHIVE_COMPRESSION_BZIP2) tool = "/usr/bin/bzip2";
+	if (tool) {
+		len = read_decompressed(tool, path, buf, sizeof(buf));
+		if (container_for_header(buf, len) == ARCHIVE_FORMAT_CPIO) {
+			container = ARCHIVE_FORMAT_CPIO;
+		}
+	}
+	return container | compression;
+}
+
+static Archive* archive_for_format(const char* path, uint32_t format) {
+	switch (format) {
+		case ARCHIVE_FORMAT_DIRECTORY:
+			return new DittoArchive(path);
+		case ARCHIVE_FORMAT_CPIO:
+			return new CpioArchive(path);
+		case ARCHIVE_FORMAT_CPIO | ARCHIVE_COMPRESSION_GZIP:
+			return new CpioGZArchive(path);
+		case ARCHIVE_FORMAT_CPIO | ARCHIVE_COMPRESSION_BZIP2:
+			return new CpioBZ2Archive(path);
+		case ARCHIVE_FORMAT_PAX:
+			return new PaxArchive(path);
+		case ARCHIVE_FORMAT_PAX | ARCHIVE_COMPRESSION_GZIP:
+			return new PaxGZArchive(path);
+		case ARCHIVE_FORMAT_PAX | ARCHIVE_COMPRESSION_BZIP2:
+			return new PaxBZ2Archive(path);
+		case ARCHIVE_FORMAT_TAR:
+			return new TarArchive(path);
+		case ARCHIVE_FORMAT_TAR | ARCHIVE_COMPRESSION_GZIP:
+			return new TarGZArchive(path);
+		case ARCHIVE_FORMAT_TAR | ARCHIVE_COMPRESSION_BZIP2:
+			return new TarBZ2Archive(path);
+		case ARCHIVE_FORMAT_TAR | ARCHIVE_COMPRESSION_XZ:
+			return new TarXZArchive(path);
+		case ARCHIVE_FORMAT_TAR | ARCHIVE_COMPRESSION_ZSTD:
+			return new TarZstdArchive(path);
+#if __MAC_OS_X_VERSION_MIN_REQUIRED >= 1060
+		case ARCHIVE_FORMAT_XAR:
+			return new XarArchive(path);
+#endif
+		case ARCHIVE_FORMAT_ZIP:
+			return new ZipArchive(path);
+	}
+	return NULL;
+}
+
 Archive* ArchiveFactory(const char* path, const char* tmppath) {
 	Archive* archive = NULL;
 
 	// actual path to archive
 	char* actpath = NULL; 
 	
+	// a tar stream on the standard input
+	if (strcmp(path, "-") == 0) return new StreamArchive(STDIN_FILENO);
+	
 	// fetch remote archives if needed
 	if (is_url_path(path)) {
 		actpath = fetch_url(path, tmppath);
@@ -320,36 +1206,17 @@ Archive* ArchiveFactory(const char* path, const char* tmppath) {
 		return NULL;
 	}
 	
-	// use file extension to guess archive format
-	if (is_directory(actpath, true)) {
-		archive = new DittoArchive(actpath);
-	} else if (has_suffix(actpath, ".cpio")) {
-		archive = new CpioArchive(actpath);
-	} else if (has_suffix(actpath, ".cpio.gz") || has_suffix(actpath, ".cpgz")) {
-		archive = new CpioGZArchive(actpath);
-	} else if (has_suffix(actpath, ".cpio.bz2") || has_suffix(actpath, ".cpbz2")) {
-		archive = new CpioBZ2Archive(actpath);
-	} else if (has_suffix(actpath, ".pax")) {
-		archive = new PaxArchive(actpath);
-	} else if (has_suffix(actpath, ".pax.gz") || has_suffix(actpath, ".pgz")) {
-		archive = new PaxGZArchive(actpath);
-	} else if (has_suffix(actpath, ".pax.bz2") || has_suffix(actpath, ".pbz2")) {
-		archive = new PaxBZ2Archive(actpath);		
-	} else if (has_suffix(actpath, ".tar")) {
-		archive = new TarArchive(actpath);
-	} else if (has_suffix(actpath, ".tar.gz") || has_suffix(actpath, ".tgz")) {
-		archive = new TarGZArchive(actpath);
-	} else if (has_suffix(actpath, ".tar.bz2") 
-				|| has_suffix(actpath, ".tbz2") 
-				|| has_suffix(actpath, ".tbz")) {
-		archive = new TarBZ2Archive(actpath);		
-#if __MAC_OS_X_VERSION_MIN_REQUIRED >= 1060
-	} else if (has_suffix(actpath, ".xar")) {
-		archive = new XarArchive(actpath);
-#endif
-	} else if (has_suffix(actpath, ".zip")) {
-		archive = new ZipArchive(actpath);
-	} else {
+	// the suffix says what the archive should be, the magic number 
+	// says what it is
+	uint32_t format = ARCHIVE_FORMAT_DIRECTORY;
+	if (!is_directory(actpath, true)) {
+		uint32_t named = format_for_suffix(actpath);
+		format = format_for_contents(actpath, named);
+		IF_DEBUG("archive format: suffix 0x%04x contents 0x%04x\n", named, format);
+		if (format == ARCHIVE_FORMAT_UNKNOWN) format = named;
+	}
+	archive = archive_for_format(actpath, format);
+	if (!archive) {
 		fprintf(stderr, "Error: unknown archive type: %s\n", path);
 	}
 
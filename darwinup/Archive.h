@@ -56,6 +56,7 @@ const uint64_t ARCHIVE_INFO_ROLLBACK	= 0x0001;
 
 struct Archive;
 struct Depot;
+struct Digest;
 
 ////
 //  Archive
@@ -68,8 +69,10 @@ struct Depot;
 //
 //  ArchiveFactory exists to return the correct
 //  concrete subclass for a given archive to be
-//  installed.  Currently this is determined
-//  by the file's suffix. The tmppath parameter
+//  installed.  This is determined by the magic
+//  number at the start of the file, or by the
+//  file's suffix when the two agree or the magic
+//  number is not recognized. The tmppath parameter
 //  is the path where files can be stored during
 //  processing, such as fetching remote archives. 
 ////
@@ -102,6 +105,11 @@ struct Archive {
 	// the OS build this archive was installed onto
 	virtual const char* build();
 
+	// Hash over the path, mode, owner and digest of every file in the
+	// root, NULL if it is not known.
+	// Do not modify or delete.
+	virtual Digest* fingerprint();
+
 	// ARCHIVE_INFO flags.
 	virtual uint64_t info();
 	
@@ -128,7 +136,7 @@ struct Archive {
 	char* create_directory(const char* prefix);
 	
 	// Compacts the backing-store directory into a single file.
-	int compact_directory(const char* prefix);
+	virtual int compact_directory(const char* prefix);
 	
 	// Expands the backing-store directory from its single file.
 	int expand_directory(const char* prefix);
@@ -136,6 +144,10 @@ struct Archive {
 	// Removes the compacted backing-store file from disk.
 	int prune_compacted_archive(const char* prefix);
 
+	// Returns the path of the compacted archive in the given prefix.
+	// Caller must free the returned string.
+	char* compacted_path(const char* prefix);
+
 	protected:
 
 	// Constructor for subclasses and Depot to use when 
@@ -148,6 +160,7 @@ struct Archive {
 	char*		m_name;
 	char*		m_path;
 	char*       m_build;
+	Digest*     m_fingerprint;
 	uint64_t	m_info;
 	time_t		m_date_installed;
 	
@@ -171,6 +184,70 @@ struct RollbackArchive : public Archive {
 };
 
 
+////
+//  StreamArchive
+//
+//  An uncompressed tar(1) stream read from a file descriptor, such as
+//  the standard input for `darwinup install -`.  Nothing is extracted
+//  up front, the Depot reads one entry at a time and only stages the
+//  files that differ from what is installed.  The backing store is a
+//  copy of the stream written as it is read.
+////
+
+// one entry of a StreamArchive, valid until the next call to next()
+struct StreamEntry {
+	const char* path;      // without a leading "./" or "/", "" for the root
+	const char* linkpath;  // target of a symbolic or hard link
+	char        type;      // tar(5) typeflag
+	mode_t      mode;      // including the file type, 0 if unsupported
+	uid_t       uid;
+	gid_t       gid;
+	off_t       size;      // bytes of data to read()
+	time_t      mtime;
+};
+
+struct StreamArchive : public Archive {
+	StreamArchive(int fd);
+	virtual ~StreamArchive();
+	
+	// Extracts the rest of the stream with tar(1).
+	virtual int extract(const char* destdir);
+	
+	// Writes a copy of everything read from now on as the compacted
+	// backing store in prefix, with the entries moved below the
+	// backing-store directory like compact_directory() would.
+	int begin_compact(const char* prefix);
+	
+	// Finishes the copy started by begin_compact().
+	virtual int compact_directory(const char* prefix);
+	
+	// Reads the header of the next entry.
+	// Returns 1 for an entry, 0 at the end of the stream and -1 on error.
+	int next(StreamEntry* ent);
+	
+	// Reads data of the current entry, returns 0 once all of it was read.
+	ssize_t read(void* buf, size_t size);
+
+	protected:
+	
+	int  read_block(uint8_t* block);
+	int  read_full(void* buf, size_t size);
+	char* read_extended(uint64_t size);
+	int  copy(const void* buf, size_t size);
+	int  copy_header(uint8_t* block, const char* path, const char* linkpath,
+					 const char* records, size_t records_len);
+	int  skip_data();
+	
+	int      m_fd;
+	int      m_copy_fd;     // -1 unless begin_compact() was called
+	pid_t    m_copy_pid;    // compressor writing the copy, 0 if none
+	off_t    m_remaining;   // data left in the current entry
+	off_t    m_padding;     // up to the next header
+	char*    m_entry_path;
+	char*    m_entry_linkpath;
+};
+
+
 ////
 //  DittoArchive
 //
@@ -283,7 +360,7 @@ struct TarArchive : public Archive {
 //
 //  Corresponds to the tar(1) file format, compressed with gzip(1).
 //  This installs archives using the tar(1) command line tool with
-//  the -z option.
+//  the -z option, or reading from pigz(1) when it is installed.
 ////
 struct TarGZArchive : public Archive {
         TarGZArchive(const char* path);
@@ -296,13 +373,41 @@ struct TarGZArchive : public Archive {
 //
 //  Corresponds to the tar(1) file format, compressed with bzip2(1).
 //  This installs archives using the tar(1) command line tool with
-//  the -j option.
+//  the -j option, or reading from lbzip2(1) or pbzip2(1) when one
+//  of them is installed.
 ////
 struct TarBZ2Archive : public Archive {
         TarBZ2Archive(const char* path);
         virtual int extract(const char* destdir);
 };
 
+
+////
+//  TarXZArchive
+//
+//  Corresponds to the tar(1) file format, compressed with xz(1).
+//  This installs archives using the tar(1) command line tool with
+//  the -J option, or reading from a multithreaded xz(1) when it is
+//  installed.
+////
+struct TarXZArchive : public Archive {
+        TarXZArchive(const char* path);
+        virtual int extract(const char* destdir);
+};
+
+
+////
+//  TarZstdArchive
+//
+//  Corresponds to the tar(1) file format, compressed with zstd(1).
+//  This installs archives using zstd(1) and the tar(1) command line
+//  tool, which has to support zstd itself if zstd(1) is not installed.
+////
+struct TarZstdArchive : public Archive {
+        TarZstdArchive(const char* path);
+        virtual int extract(const char* destdir);
+};
+
 #if __MAC_OS_X_VERSION_MIN_REQUIRED >= 1060
 ////
 //  XarArchive
@@ -32,16 +32,71 @@
 
 #include "DB.h"
 
+// files joined with their interned paths, with the same columns as the
+// files table so rows can be read through it with Table::set_view()
+#define FILES_PATHS_VIEW \
+	"CREATE VIEW files_paths AS " \
+	"SELECT files.serial AS serial, files.archive AS archive, " \
+	"       files.info AS info, files.mode AS mode, files.uid AS uid, " \
+	"       files.gid AS gid, files.size AS size, files.digest AS digest, " \
+	"       paths.path AS path, files.path_id AS path_id " \
+	"FROM files JOIN paths ON paths.serial = files.path_id;"
+
+#define FILES_PATH_ID_INDEXES \
+	"CREATE UNIQUE INDEX files_archive_path_id ON files (archive, path_id);" \
+	"CREATE INDEX files_path_id_archive ON files (path_id, archive);"
+
+// files of an archive that an archive installed later also has
+#define FILES_SUPERSEDED \
+	"SELECT f.serial FROM files f WHERE f.archive = ?1 AND EXISTS " \
+	"(SELECT 1 FROM files s WHERE s.path_id = f.path_id AND s.archive > ?1) " \
+	"ORDER BY f.serial;"
+
+// the closest earlier file at each path of an archive, in reverse path order
+#define FILES_PRECEDING \
+	"SELECT p.* FROM files f JOIN files_paths p ON p.path_id = f.path_id " \
+	"WHERE f.archive = ?1 AND p.archive = (SELECT MAX(q.archive) FROM files q " \
+	"WHERE q.path_id = f.path_id AND q.archive < ?1) ORDER BY p.path DESC;"
+
+// every file at the paths of an archive, in reverse path order
+#define FILES_AT_PATHS \
+	"SELECT p.* FROM files f JOIN files_paths p ON p.path_id = f.path_id " \
+	"WHERE f.archive = ?1 ORDER BY p.path DESC, p.archive;"
+
+// the newest file at every path from an active archive that does not
+// have the ?1 flags, in path order
+#define FILES_CURRENT \
+	"SELECT p.* FROM files_paths p WHERE p.archive = (SELECT MAX(q.archive) " \
+	"FROM files q JOIN archives a ON a.serial = q.archive WHERE q.path_id = p.path_id " \
+	"AND a.active = 1 AND (a.info & ?1) = 0) ORDER BY p.path;"
 
 DarwinupDatabase::DarwinupDatabase(const char* path) : Database(path) {
+	this->last_archive = NULL;
+	this->prev_archive = NULL;
+	this->m_path_cache = (PathCacheEntry*)calloc(PATH_CACHE_SIZE, sizeof(PathCacheEntry));
 	this->connect();
+}
+
+DarwinupDatabase::DarwinupDatabase(const char* path, bool connect) : Database(path) {
 	this->last_archive = NULL;
+	this->prev_archive = NULL;
+	this->m_path_cache = NULL;
+	if (connect) {
+		this->m_path_cache = (PathCacheEntry*)calloc(PATH_CACHE_SIZE, 
+													 sizeof(PathCacheEntry));
+		this->connect();
+	} else {
+		this->pre_connect();
+	}
 }
 
 DarwinupDatabase::~DarwinupDatabase() {
 	// parent automatically deallocates schema objects
 
 	if (this->last_archive) delete this->last_archive;
+	if (this->prev_archive) delete this->prev_archive;
+	this->clear_path_cache();
+	free(this->m_path_cache);
 }
 
 int DarwinupDatabase::init_schema() {
@@ -69,20 +124,65 @@ int DarwinupDatabase::init_schema() {
 	ADD_INTEGER(m_files_table, "gid");
 	ADD_INTEGER(m_files_table, "size");
 	ADD_BLOB(m_files_table, "digest");
-	ADD_INDEX(m_files_table, "path", TYPE_TEXT, false);
+	// unused since version 2, see path_id below
+	ADD_TEXT(m_files_table, "path");
 	
-	// custom index to protect from duplicate files
-	assert(this->m_files_table->set_custom_create("CREATE UNIQUE INDEX files_archive_path " 
-												  "ON files (archive, path);") == 0);
-
 
 	SCHEMA_VERSION(1);
 
 	ADD_TEXT(m_archives_table, "osbuild");
+
+
+	SCHEMA_VERSION(2);
+
+	// every distinct path is stored once and files refer to it by serial
+	this->m_paths_table = new Table("paths");
+	ADD_TABLE(this->m_paths_table);
+	ADD_PK(m_paths_table, "serial");
+	ADD_COLUMN(m_paths_table, "path", TYPE_TEXT, false, false, true);
+
+	ADD_INTEGER(m_files_table, "path_id");
+
+	// custom indexes to protect from duplicate files and to find
+	// the files preceding or superseding a path
+	assert(this->m_files_table->set_custom_create(FILES_PATH_ID_INDEXES) == 0);
+	
+	// read files with their path filled in from the paths table
+	assert(this->m_files_table->set_view("files_paths") == 0);
+	
+
+	SCHEMA_VERSION(3);
+	
+	// whole-root fingerprint, for reinstalling an unchanged root
+	ADD_BLOB(m_archives_table, "fingerprint");
 	
 	return 0;
 }
 
+int DarwinupDatabase::post_table_creation() {
+	return this->sql_once(FILES_PATHS_VIEW);
+}
+
+int DarwinupDatabase::post_schema_upgrade(uint32_t version) {
+	int res = DB_OK;
+	
+	if (version < 2) {
+		// move paths out of the files table
+		IF_DEBUG("Migrating file paths into the paths table\n");
+		if (res == DB_OK) res = this->sql_once("INSERT OR IGNORE INTO paths (path) "
+											   "SELECT DISTINCT path FROM files;");
+		if (res == DB_OK) res = this->sql_once("UPDATE files SET path = NULL, path_id = "
+											   "(SELECT serial FROM paths "
+											   " WHERE paths.path = files.path);");
+		if (res == DB_OK) res = this->sql_once("DROP INDEX IF EXISTS files_path;"
+											   "DROP INDEX IF EXISTS files_archive_path;");
+		if (res == DB_OK) res = this->sql_once(FILES_PATH_ID_INDEXES);
+		if (res == DB_OK) res = this->sql_once(FILES_PATHS_VIEW);
+	}
+	
+	return res;
+}
+
 int DarwinupDatabase::activate_archive(uint64_t serial) {
 	uint64_t active = 1;
 	return this->set_archive_active(serial, &active);
@@ -106,7 +206,7 @@ int DarwinupDatabase::set_archive_active(uint64_t serial, uint64_t* active) {
 
 int DarwinupDatabase::update_archive(uint64_t serial, uuid_t uuid, const char* name,
 									 time_t date_added, uint32_t active, uint64_t info,
-									 const char* build) {
+									 const char* build, Digest* fingerprint) {
 	this->clear_last_archive();
 	return this->update(this->m_archives_table, serial,
 						(uint8_t*)uuid,
@@ -115,7 +215,9 @@ int DarwinupDatabase::update_archive(uint64_t serial, uuid_t uuid, const char* n
 						(uint64_t)date_added,
 						(uint64_t)active,
 						(uint64_t)info,
-						build);
+						build,
+						(uint8_t*)(fingerprint ? fingerprint->data() : NULL),
+						(uint32_t)(fingerprint ? fingerprint->size() : 0));
 }
 
 uint64_t DarwinupDatabase::insert_archive(uuid_t uuid, uint64_t info, const char* name, 
@@ -128,7 +230,9 @@ uint64_t DarwinupDatabase::insert_archive(uuid_t uuid, uint64_t info, const char
 						   (uint64_t)date_added,
 						   (uint64_t)0,
 						   (uint64_t)info,
-						   build);
+						   build,
+						   (uint8_t*)NULL,
+						   (uint32_t)0);
 	if (res != SQLITE_OK) {
 		fprintf(stderr, "Error: unable to insert archive %s: %s \n",
 				name, this->error());
@@ -239,6 +343,9 @@ int DarwinupDatabase::update_file(uint64_t serial, Archive* archive, uint64_t in
 								   uid_t uid, gid_t gid, Digest* digest, const char* path) {
 
 	int res = SQLITE_OK;
+	
+	uint64_t path_id = this->insert_path(path);
+	if (!path_id) return DB_ERROR;
 								  
 	// update the information
 	res = this->update(this->m_files_table, serial,
@@ -250,7 +357,8 @@ int DarwinupDatabase::update_file(uint64_t serial, Archive* archive, uint64_t in
 					   (uint64_t)0, 
 					   (uint8_t*)(digest ? digest->data() : NULL), 
 					   (uint32_t)(digest ? digest->size() : 0), 
-					   path);
+					   (const char*)NULL,
+					   path_id);
 
 	if (res != SQLITE_OK) {
 		fprintf(stderr, "Error: unable to update file with serial %llu and path %s: %s \n",
@@ -261,18 +369,23 @@ int DarwinupDatabase::update_file(uint64_t serial, Archive* archive, uint64_t in
 }
 										  
 uint64_t DarwinupDatabase::insert_file(uint64_t info, mode_t mode, uid_t uid, gid_t gid, 
-									   Digest* digest, Archive* archive, const char* path) {
+									   off_t size, Digest* digest, Archive* archive, 
+									   const char* path) {
 	
+	uint64_t path_id = this->insert_path(path);
+	if (!path_id) return 0;
+
 	int res = this->insert(this->m_files_table,
 							(uint64_t)archive->serial(),
 							(uint64_t)info,
 							(uint64_t)mode,
 							(uint64_t)uid,
 							(uint64_t)gid,
-							(uint64_t)0, 
+							(uint64_t)size, 
 							(uint8_t*)(digest ? digest->data() : NULL), 
 							(uint32_t)(digest ? digest->size() : 0), 
-							path);
+							(const char*)NULL,
+							path_id);
 	if (res != SQLITE_OK) {
 		fprintf(stderr, "Error: unable to insert file at %s: %s \n",
 				path, this->error());
@@ -282,6 +395,78 @@ uint64_t DarwinupDatabase::insert_file(uint64_t info, mode_t mode, uid_t uid, gi
 	return this->last_insert_id();
 }
 
+uint64_t DarwinupDatabase::insert_path(const char* path) {
+	uint32_t slot = fnv1a_hash((const uint8_t*)path, strlen(path), FNV1A_INIT) 
+		% PATH_CACHE_SIZE;
+	PathCacheEntry* cached = m_path_cache ? &m_path_cache[slot] : NULL;
+	if (cached && cached->path && strcmp(cached->path, path) == 0) {
+		return cached->serial;
+	}
+	
+	// only a path that is already there is looked up
+	int res = this->text_query("paths__insert_or_ignore",
+							   "INSERT OR IGNORE INTO paths (path) VALUES (?1);", path);
+	if (res != SQLITE_OK) {
+		fprintf(stderr, "Error: unable to insert path %s: %s \n",
+				path, this->error());
+		return 0;
+	}
+	uint64_t result = 0;
+	if (this->changes()) {
+		result = this->last_insert_id();
+	} else {
+		uint64_t* serial;
+		res = this->get_value("path_serial__path",
+							  (void**)&serial,
+							  this->m_paths_table,
+							  this->m_paths_table->column(0), // serial
+							  1,
+							  this->m_paths_table->column(1), // path
+							  '=', path);
+		if (res == SQLITE_ROW) result = *serial;
+		free(serial);
+		if (!result) {
+			fprintf(stderr, "Error: unable to find path %s: %s \n",
+					path, this->error());
+			return 0;
+		}
+	}
+	
+	if (cached) {
+		free(cached->path);
+		cached->path = strdup(path);
+		cached->serial = result;
+	}
+	return result;
+}
+
+int DarwinupDatabase::delete_unused_paths() {
+	this->clear_path_cache();
+	int res = this->sql("delete_unused_paths",
+						"DELETE FROM paths WHERE NOT EXISTS "
+						" (SELECT 1 FROM files WHERE files.path_id = paths.serial);");
+	if (res != SQLITE_OK) return DB_ERROR;
+	return DB_OK;
+}
+
+void DarwinupDatabase::clear_path_cache() {
+	if (!m_path_cache) return;
+	for (uint32_t i = 0; i < PATH_CACHE_SIZE; i++) {
+		free(m_path_cache[i].path);
+		m_path_cache[i].path = NULL;
+	}
+}
+
+int DarwinupDatabase::begin_transaction() {
+	this->clear_path_cache();
+	return Database::begin_transaction();
+}
+
+int DarwinupDatabase::rollback_transaction() {
+	this->clear_path_cache();
+	return Database::rollback_transaction();
+}
+
 uint64_t DarwinupDatabase::count_files(Archive* archive, const char* path) {
 	int res = SQLITE_OK;
 	uint64_t* c;
@@ -322,12 +507,34 @@ uint64_t DarwinupDatabase::count_archives(bool include_rollbacks) {
 	return *c;	
 }
 
-int DarwinupDatabase::delete_archive(Archive* archive) {
-	int res = this->del(this->m_archives_table, archive->serial());
-	if (res != SQLITE_OK) return DB_ERROR;
+int DarwinupDatabase::storage_usage(uint64_t* bytes, uint64_t* units, uint64_t* unused) {
+	uint64_t page_size = 0;
+	int res = this->pragma_value("page_size", &page_size);
+	if (res == SQLITE_OK) res = this->pragma_value("page_count", units);
+	if (res == SQLITE_OK) res = this->pragma_value("freelist_count", unused);
+	if (res != SQLITE_OK) {
+		fprintf(stderr, "Error: unable to read the database page counts: %d \n", res);
+		return DB_ERROR;
+	}
+	*bytes = *units * page_size;
+	return DB_OK;
+}
+
+int DarwinupDatabase::vacuum(uint32_t seconds) {
+	int res = this->delete_unused_paths();
+	if (res) return res;
+	res = this->incremental_vacuum(seconds);
+	if (res != SQLITE_OK) {
+		fprintf(stderr, "Error: unable to vacuum the database: %s \n", this->error());
+		return DB_ERROR;
+	}
 	return DB_OK;
 }
 
+int DarwinupDatabase::delete_archive(Archive* archive) {
+	return this->delete_archive(archive->serial());
+}
+
 int DarwinupDatabase::delete_archive(uint64_t serial) {
 	int res = this->del(this->m_archives_table, serial);
 	if (res != SQLITE_OK) return DB_ERROR;
@@ -350,9 +557,7 @@ int DarwinupDatabase::free_archive(uint8_t* data) {
 }
 
 int DarwinupDatabase::delete_file(File* file) {
-	int res = this->del(this->m_files_table, file->serial());
-	if (res != SQLITE_OK) return DB_ERROR;
-	return DB_OK;
+	return this->delete_file(file->serial());
 }
 
 int DarwinupDatabase::delete_file(uint64_t serial) {
@@ -371,6 +576,22 @@ int DarwinupDatabase::delete_files(Archive* archive) {
 	return DB_OK;
 }
 
+int DarwinupDatabase::delete_files(uint64_t* serials, uint32_t count) {
+	int res = this->del(this->m_files_table, serials, count);
+	if (res != SQLITE_OK) return DB_ERROR;
+	return DB_OK;
+}
+
+int DarwinupDatabase::move_files(uint64_t* serials, uint32_t count, Archive* archive,
+								 uint64_t info) {
+	uint64_t values[2] = { archive->serial(), info };
+	int res = this->serials_query("files__move_serials", 
+								  "UPDATE files SET archive=?, info=?", 
+								  values, 2, serials, count);
+	if (res != SQLITE_OK) return DB_ERROR;
+	return DB_OK;
+}
+
 int DarwinupDatabase::free_file(uint8_t* data) {
 	return this->m_files_table->free_result(data);
 }
@@ -409,6 +630,79 @@ int DarwinupDatabase::get_files(uint8_t*** data, uint32_t* count, Archive* archi
 	return DB_ERROR;
 }
 
+static int compare_serials(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+int DarwinupDatabase::get_uninstall_plan(uint8_t*** files, uint8_t*** preceding, 
+										 uint8_t** superseded, uint32_t* count, 
+										 Archive* archive) {
+	*preceding = NULL;
+	*superseded = NULL;
+	int res = this->get_files(files, count, archive, true);
+	if (res == DB_ERROR) return res;
+	
+	uint64_t* serials = NULL;
+	uint32_t serial_count = 0;
+	uint8_t** rows = NULL;
+	uint32_t row_count = 0;
+	res = this->get_column_query("files_superseded", (void**)&serials, &serial_count,
+								 sizeof(uint64_t), FILES_SUPERSEDED, archive->serial());
+	if (res == SQLITE_DONE) {
+		res = this->get_all_query("files_preceding", &rows, &row_count,
+								  this->m_files_table, FILES_PRECEDING, archive->serial());
+	}
+	*preceding = (uint8_t**)calloc(*count + 1, sizeof(uint8_t*));
+	*superseded = (uint8_t*)calloc(*count + 1, sizeof(uint8_t));
+	if (res != SQLITE_DONE || !*preceding || !*superseded) {
+		free(serials);
+		for (uint32_t i = 0; i < row_count; i++) this->free_file(rows[i]);
+		free(rows);
+		return DB_ERROR;
+	}
+	
+	// both lists are in the same order as the files, so preceding files 
+	// are matched up by path as we go
+	uint32_t next = 0;
+	for (uint32_t i = 0; i < *count; i++) {
+		uint64_t serial;
+		memcpy(&serial, &(*files)[i][this->file_offset(0)], sizeof(uint64_t));
+		(*superseded)[i] = (bsearch(&serial, serials, serial_count, sizeof(uint64_t), 
+									compare_serials) != NULL);
+		if (next < row_count) {
+			char* path;
+			char* other;
+			memcpy(&path, &(*files)[i][this->file_offset(8)], sizeof(char*));
+			memcpy(&other, &rows[next][this->file_offset(8)], sizeof(char*));
+			if (strcmp(path, other) == 0) (*preceding)[i] = rows[next++];
+		}
+	}
+	while (next < row_count) this->free_file(rows[next++]);
+	free(serials);
+	free(rows);
+	
+	if (*count) return (DB_OK | DB_FOUND);
+	return DB_OK;
+}
+
+int DarwinupDatabase::get_path_files(uint8_t*** data, uint32_t* count, Archive* archive) {
+	int res = this->get_all_query("files_at_paths", data, count, this->m_files_table,
+								  FILES_AT_PATHS, archive->serial());
+	if (res == SQLITE_DONE && *count) return (DB_OK | DB_FOUND);
+	if (res == SQLITE_DONE) return DB_OK;
+	return DB_ERROR;
+}
+
+int DarwinupDatabase::get_current_files(uint8_t*** data, uint32_t* count) {
+	int res = this->get_all_query("files_current", data, count, this->m_files_table,
+								  FILES_CURRENT, ARCHIVE_INFO_ROLLBACK);
+	if (res == SQLITE_DONE && *count) return (DB_OK | DB_FOUND);
+	if (res == SQLITE_DONE) return DB_OK;
+	return DB_ERROR;
+}
+
 int DarwinupDatabase::get_file_serials(uint64_t** serials, uint32_t* count) {
 	int res = this->get_column("file_serials", (void**)serials, count, 
 							   this->m_files_table,
@@ -434,8 +728,16 @@ Archive* DarwinupDatabase::make_archive(uint8_t* data) {
 	memcpy(&info, &data[this->archive_offset(5)], sizeof(uint64_t));
 	char* build;
 	memcpy(&build, &data[this->archive_offset(6)], sizeof(char*));
+	uint8_t* fp;
+	memcpy(&fp, &data[this->archive_offset(7)], sizeof(uint8_t*));
 
 	Archive* archive = new Archive(serial, *uuid, name, NULL, info, date_added, build);
+	if (fp) {
+		SHA1Digest* fingerprint = new SHA1Digest();
+		fingerprint->m_size = CC_SHA1_DIGEST_LENGTH;
+		memcpy(fingerprint->m_data, fp, CC_SHA1_DIGEST_LENGTH);
+		archive->m_fingerprint = fingerprint;
+	}
 	this->m_archives_table->free_result(data);
 
 	return archive;
@@ -530,16 +832,22 @@ Archive* DarwinupDatabase::get_last_archive(uint64_t serial) {
 	if (this->last_archive && this->last_archive->serial() == serial) {
 		return this->last_archive;
 	}
+	if (this->prev_archive && this->prev_archive->serial() == serial) {
+		return this->prev_archive;
+	}
 	return NULL;
 }
 
 int DarwinupDatabase::clear_last_archive() {
 	delete this->last_archive;
 	this->last_archive = NULL;
+	delete this->prev_archive;
+	this->prev_archive = NULL;
 	return 0;
 }
 
 int DarwinupDatabase::set_last_archive(uint8_t* data) {
+	this->prev_archive = this->last_archive;
 	this->last_archive = this->make_archive(data);
 	if (this->last_archive) return 0;
 	return 1;
@@ -44,6 +44,21 @@
 #include "Digest.h"
 #include "File.h"
 
+// storage engines, selected with -e when a depot is created
+//  - sqlite: the Database-V100 SQLite database
+//  - log: an append-only log replayed into memory (see LogDB.h)
+#define DB_ENGINE_SQLITE 0
+#define DB_ENGINE_LOG    1
+
+// paths remembered with their serials, for the files of an archive and
+// its rollback archive that are inserted one after the other
+#define PATH_CACHE_SIZE  4096
+
+struct PathCacheEntry {
+	char*    path;
+	uint64_t serial;
+};
+
 
 /**
  *
@@ -52,53 +67,94 @@
  *  up the darwinup database schema, but the parent handles
  *  deallocation. 
  *
+ * The virtual methods below are the storage interface used by
+ *  the Depot. This class implements them with SQLite, other
+ *  storage engines override them (see LogDB.h). Rows are always
+ *  handed out as Table result records so make_archive() and
+ *  make_file() work the same for every engine.
+ *
  */
 struct DarwinupDatabase : Database {
 	DarwinupDatabase(const char* path);
 	virtual ~DarwinupDatabase();
 	int init_schema();
+	int post_table_creation();
+	int post_schema_upgrade(uint32_t version);
 	
-	uint64_t count_files(Archive* archive, const char* path);
-	uint64_t count_archives(bool include_rollbacks);
+	// another process may change the paths while no transaction is open
+	virtual int begin_transaction();
+	virtual int rollback_transaction();
+	
+	virtual uint64_t count_files(Archive* archive, const char* path);
+	virtual uint64_t count_archives(bool include_rollbacks);
+	// bytes of storage the depot takes, in how many units (pages for
+	//  SQLite, records for the log) and how many of those are unused
+	virtual int storage_usage(uint64_t* bytes, uint64_t* units, uint64_t* unused);
+	// give the unused storage back, spending about seconds on it
+	virtual int vacuum(uint32_t seconds);
 	
 	// Archives
 	Archive* make_archive(uint8_t* data);
-	int      get_archives(uint8_t*** data, uint32_t* count, bool include_rollbacks);
-	int      get_archive(uint8_t** data, uuid_t uuid);
-	int      get_archive(uint8_t** data, uint64_t serial);
-	int      get_archive(uint8_t** data, const char* name);
-	int      get_archive(uint8_t** data, archive_keyword_t keyword);
-	int      get_inactive_archive_serials(uint64_t** serials, uint32_t* count);
+	virtual int get_archives(uint8_t*** data, uint32_t* count, bool include_rollbacks);
+	virtual int get_archive(uint8_t** data, uuid_t uuid);
+	virtual int get_archive(uint8_t** data, uint64_t serial);
+	virtual int get_archive(uint8_t** data, const char* name);
+	virtual int get_archive(uint8_t** data, archive_keyword_t keyword);
+	virtual int get_inactive_archive_serials(uint64_t** serials, uint32_t* count);
 	int      archive_offset(int column);
 	int      activate_archive(uint64_t serial);
 	int      deactivate_archive(uint64_t serial);
-	int      update_archive(uint64_t serial, uuid_t uuid, const char* name,
-							time_t date_added, uint32_t active, uint64_t info,
-							const char* build);
-	uint64_t insert_archive(uuid_t uuid, uint64_t info, const char* name, 
-							time_t date, const char* build);
-	int      delete_empty_archives();
+	virtual int update_archive(uint64_t serial, uuid_t uuid, const char* name,
+							   time_t date_added, uint32_t active, uint64_t info,
+							   const char* build, Digest* fingerprint);
+	virtual uint64_t insert_archive(uuid_t uuid, uint64_t info, const char* name, 
+									time_t date, const char* build);
+	virtual int delete_empty_archives();
 	int      delete_archive(Archive* archive);
-	int      delete_archive(uint64_t serial);
+	virtual int delete_archive(uint64_t serial);
 	int      free_archive(uint8_t* data);
 
 	// Files
 	File*    make_file(uint8_t* data);
-	int      get_next_file(uint8_t** data, File* file, file_starseded_t star);
-	int      get_file_serials(uint64_t** serials, uint32_t* count);
-	int      get_file_serial_from_archive(Archive* archive, const char* path, 
-										  uint64_t** serial);
-	int      get_files(uint8_t*** data, uint32_t* count, Archive* archive, bool reverse);
+	virtual int get_next_file(uint8_t** data, File* file, file_starseded_t star);
+	virtual int get_file_serials(uint64_t** serials, uint32_t* count);
+	virtual int get_file_serial_from_archive(Archive* archive, const char* path, 
+											 uint64_t** serial);
+	virtual int get_files(uint8_t*** data, uint32_t* count, Archive* archive, bool reverse);
+	// Everything uninstalling an archive needs at once: its files in
+	//  reverse path order, the file preceding each (NULL if none) and
+	//  whether a newer archive supersedes it
+	virtual int get_uninstall_plan(uint8_t*** files, uint8_t*** preceding, 
+								   uint8_t** superseded, uint32_t* count, 
+								   Archive* archive);
+	// Every file at the paths of an archive, from any archive, in reverse
+	//  path order
+	virtual int get_path_files(uint8_t*** data, uint32_t* count, Archive* archive);
+	// The file each path is installed from, that is the newest one not in
+	//  a rollback archive, in path order
+	virtual int get_current_files(uint8_t*** data, uint32_t* count);
 	int      file_offset(int column);
-	int      update_file(uint64_t serial, Archive* archive, uint64_t info, mode_t mode,
-						 uid_t uid, gid_t gid, Digest* digest, const char* path);
-	uint64_t insert_file(uint64_t info, mode_t mode, uid_t uid, gid_t gid,
-						 Digest* digest, Archive* archive, const char* path);
-	int      delete_file(uint64_t serial);
+	// the size of an updated file is no longer known and reads back as 0
+	virtual int update_file(uint64_t serial, Archive* archive, uint64_t info, mode_t mode,
+							uid_t uid, gid_t gid, Digest* digest, const char* path);
+	virtual uint64_t insert_file(uint64_t info, mode_t mode, uid_t uid, gid_t gid,
+								 off_t size, Digest* digest, Archive* archive, 
+								 const char* path);
+	virtual int delete_file(uint64_t serial);
 	int      delete_file(File* file);
-	int      delete_files(Archive* archive);
+	virtual int delete_files(Archive* archive);
+	virtual int delete_files(uint64_t* serials, uint32_t count);
+	// hand the files with serials over to archive, as if archive had
+	//  inserted them with info
+	virtual int move_files(uint64_t* serials, uint32_t count, Archive* archive, 
+						   uint64_t info);
 	int      free_file(uint8_t* data);
 	
+	// Paths
+	uint64_t insert_path(const char* path);
+	// delete the paths no file refers to anymore
+	virtual int delete_unused_paths();
+	
 	// memoization
 	Archive* get_last_archive(uint64_t serial);
 	int      clear_last_archive();
@@ -107,13 +163,22 @@ struct DarwinupDatabase : Database {
 
 protected:
 	
-	int      set_archive_active(uint64_t serial, uint64_t* active);
+	// for storage engines that only need the schema definition
+	DarwinupDatabase(const char* path, bool connect);
+	
+	virtual int set_archive_active(uint64_t serial, uint64_t* active);
+	void          clear_path_cache();
 	
 	Table*        m_archives_table;
 	Table*        m_files_table;
+	Table*        m_paths_table;
 	
-	// memoize some get_archive calls
+	// memoize some get_archive calls, two so files alternating between
+	//  an archive and its rollback archive both hit
 	Archive*      last_archive;
+	Archive*      prev_archive;
+	
+	PathCacheEntry* m_path_cache; // PATH_CACHE_SIZE entries
 	
 };
 
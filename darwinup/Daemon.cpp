@@ -0,0 +1,639 @@
+/*
+ * Copyright (c) 2010 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <poll.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "Daemon.h"
+#include "Depot.h"
+#include "Utils.h"
+
+static Depot*                daemon_served = NULL;
+static volatile sig_atomic_t daemon_quit = 0;
+static int                   daemon_pipe[2] = { -1, -1 };
+
+// commands that leave the depot as it is. The daemon decides this for
+// itself from the command line, whatever the client would like.
+static const char* daemon_read_only[] = {
+	"list", "files", "dump", "stats", "status", NULL
+};
+
+// options of darwinup that take an argument
+#define DAEMON_OPTARGS "eopst"
+
+
+static int socket_address(struct sockaddr_un* addr, const char* path) {
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) return -1;
+	strlcpy(addr->sun_path, path, sizeof(addr->sun_path));
+	return 0;
+}
+
+
+Daemon::Daemon(Depot* depot, DaemonCommandFunc func) {
+	m_depot = depot;
+	m_func = func;
+	m_listen_fd = -1;
+	m_pids = NULL;
+	m_clients = NULL;
+	m_count = 0;
+	m_max = 0;
+	m_writer = 0;
+	m_queue = NULL;
+	m_queued = 0;
+	m_queue_max = 0;
+	m_pending_count = 0;
+}
+
+Daemon::~Daemon() {
+	if (m_listen_fd != -1) {
+		close(m_listen_fd);
+		unlink(m_depot->daemon_path());
+	}
+	for (uint32_t i = 0; i < m_queued; i++) this->release(&m_queue[i], false);
+	for (uint32_t i = 0; i < m_pending_count; i++) this->release(&m_pending[i], false);
+	free(m_pids);
+	free(m_clients);
+	free(m_queue);
+}
+
+Depot* Daemon::served_depot() {
+	return daemon_served;
+}
+
+bool Daemon::is_read_only(int argc, char** argv) {
+	// skip the program name and the options the way getopt() does
+	int i = 1;
+	while (i < argc && argv[i][0] == '-' && argv[i][1] != '\0') {
+		if (strcmp(argv[i], "--") == 0) {
+			i++;
+			break;
+		}
+		const char* p = argv[i] + 1;
+		while (*p && !strchr(DAEMON_OPTARGS, *p)) p++;
+		// the option argument is the rest of this one or the next one
+		if (*p && p[1] == '\0') i++;
+		i++;
+	}
+	if (i >= argc) return false;
+	
+	for (int j = 0; daemon_read_only[j]; j++) {
+		if (strcmp(argv[i], daemon_read_only[j]) == 0) return true;
+	}
+	return false;
+}
+
+void Daemon::signal_handler(int sig) {
+	int saved_errno = errno;
+	if (sig != SIGCHLD) daemon_quit = 1;
+	// wake up poll() in serve()
+	write(daemon_pipe[1], "", 1);
+	errno = saved_errno;
+}
+
+int Daemon::listen() {
+	const char* path = m_depot->daemon_path();
+	struct sockaddr_un addr;
+	if (socket_address(&addr, path)) {
+		fprintf(stderr, "Error: daemon socket path is too long: %s\n", path);
+		return DEPOT_ERROR;
+	}
+	
+	m_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (m_listen_fd == -1) {
+		perror("socket");
+		return DEPOT_ERROR;
+	}
+	
+	// daemons do not keep the depot locked, so a socket already there
+	// is either still being served or left over from a daemon that did
+	// not exit cleanly
+	int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (probe != -1 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "Error: a daemon is already serving %s\n", m_depot->prefix());
+		close(probe);
+		close(m_listen_fd);
+		m_listen_fd = -1;
+		return DEPOT_ERROR;
+	}
+	if (probe != -1) close(probe);
+	unlink(path);
+	if (bind(m_listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		perror(path);
+		close(m_listen_fd);
+		m_listen_fd = -1;
+		return DEPOT_ERROR;
+	}
+	// access is limited by the depot directory, and commands run
+	// with the credentials of the client
+	chmod(path, 0666);
+	if (::listen(m_listen_fd, SOMAXCONN) == -1) {
+		perror(path);
+		return DEPOT_ERROR;
+	}
+	fcntl(m_listen_fd, F_SETFD, FD_CLOEXEC);
+	
+	return DEPOT_OK;
+}
+
+int Daemon::serve() {
+	int res = this->listen();
+	if (res) return res;
+	
+	if (pipe(daemon_pipe) == -1) {
+		perror("pipe");
+		return DEPOT_ERROR;
+	}
+	fcntl(daemon_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(daemon_pipe[1], F_SETFL, O_NONBLOCK);
+	signal(SIGCHLD, &Daemon::signal_handler);
+	signal(SIGINT, &Daemon::signal_handler);
+	signal(SIGTERM, &Daemon::signal_handler);
+	signal(SIGPIPE, SIG_IGN);
+	
+	// commands open and lock the depot for themselves, so let go of
+	// everything that would keep them out
+	m_depot->update_manifest();
+	char* prefix = strdup(m_depot->prefix());
+	delete m_depot;
+	m_depot = new Depot(prefix);
+	free(prefix);
+	IF_DEBUG("[daemon] listening on %s\n", m_depot->daemon_path());
+	
+	while (!daemon_quit) {
+		// requests being received are polled along with new clients, 
+		// who wait in the backlog while too many are
+		struct pollfd fds[2 + DAEMON_PENDING];
+		fds[0].fd = m_listen_fd;
+		fds[0].events = m_pending_count < DAEMON_PENDING ? POLLIN : 0;
+		fds[0].revents = 0;
+		fds[1].fd = daemon_pipe[0];
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+		uint32_t count = m_pending_count;
+		for (uint32_t i = 0; i < count; i++) {
+			fds[2 + i].fd = m_pending[i].fd;
+			fds[2 + i].events = POLLIN;
+			fds[2 + i].revents = 0;
+		}
+		if (poll(fds, 2 + count, count ? 1000 : -1) == -1) {
+			if (errno == EINTR) continue;
+			perror("poll");
+			res = DEPOT_ERROR;
+			break;
+		}
+		if (fds[1].revents) {
+			char buf[64];
+			while (read(daemon_pipe[0], buf, sizeof(buf)) > 0);
+		}
+		this->reap(false);
+		
+		// from the last one, so taking one out by moving the last one 
+		// in its place leaves the ones still to look at where they were
+		time_t now = time(NULL);
+		for (uint32_t i = count; i > 0; i--) {
+			DaemonCommand* command = &m_pending[i - 1];
+			int done = 0;
+			if (fds[2 + i - 1].revents) done = this->receive(command);
+			if (done == 0 && now - command->started > DAEMON_TIMEOUT) {
+				IF_DEBUG("[daemon] client took too long to send its request\n");
+				done = -1;
+			}
+			if (done == 0) continue;
+			DaemonCommand received = *command;
+			*command = m_pending[--m_pending_count];
+			if (done > 0) {
+				this->dispatch(&received);
+			} else {
+				this->release(&received, false);
+			}
+		}
+		
+		if (!daemon_quit && (fds[0].revents & POLLIN)) this->accept();
+	}
+	
+	// let running and queued commands finish, their clients are 
+	// still waiting
+	close(m_listen_fd);
+	m_listen_fd = -1;
+	unlink(m_depot->daemon_path());
+	for (uint32_t i = 0; i < m_pending_count; i++) this->release(&m_pending[i], false);
+	m_pending_count = 0;
+	while (m_count) this->reap(true);
+	IF_DEBUG("[daemon] exiting\n");
+	
+	close(daemon_pipe[0]);
+	close(daemon_pipe[1]);
+	return res;
+}
+
+int Daemon::accept() {
+	DaemonCommand* command = &m_pending[m_pending_count];
+	memset(command, 0, sizeof(DaemonCommand));
+	command->fd = ::accept(m_listen_fd, NULL, NULL);
+	if (command->fd == -1) {
+		if (errno != EINTR && errno != ECONNABORTED) perror("accept");
+		return DEPOT_ERROR;
+	}
+	fcntl(command->fd, F_SETFD, FD_CLOEXEC);
+	fcntl(command->fd, F_SETFL, fcntl(command->fd, F_GETFL) | O_NONBLOCK);
+	
+	command->uid = (uid_t)-1;
+	command->gid = (gid_t)-1;
+	if (getpeereid(command->fd, &command->uid, &command->gid) == -1) {
+		perror("getpeereid");
+		close(command->fd);
+		return DEPOT_ERROR;
+	}
+	command->started = time(NULL);
+	m_pending_count++;
+	return DEPOT_OK;
+}
+
+// Reads whatever part of the request arrived, returns 1 once all of it
+// did, 0 while more has to, and -1 for a request that is no good.
+int Daemon::receive(DaemonCommand* command) {
+	DaemonRequest* request = &command->request;
+	ssize_t size;
+	
+	// the file descriptors arrive along with the first byte of the request
+	if (command->received == 0) {
+		union {
+			struct cmsghdr hdr;
+			char buf[CMSG_SPACE(sizeof(command->fds))];
+		} control;
+		struct iovec iov;
+		iov.iov_base = request;
+		iov.iov_len = sizeof(DaemonRequest);
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		do {
+			size = recvmsg(command->fd, &msg, 0);
+		} while (size == -1 && errno == EINTR);
+		if (size == -1 && errno == EAGAIN) return 0;
+		
+		// every descriptor that came along belongs to the daemon now, 
+		// those it has no use for are closed right away
+		struct cmsghdr* cmsg = size > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+		for (; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+			// a truncated message may say it carries more than it does
+			size_t len = cmsg->cmsg_len - CMSG_LEN(0);
+			size_t room = (char*)&control + msg.msg_controllen - (char*)CMSG_DATA(cmsg);
+			uint32_t count = (len < room ? len : room) / sizeof(int);
+			for (uint32_t i = 0; i < count; i++) {
+				int fd;
+				memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+				if (command->fd_count < DAEMON_FDS) {
+					command->fds[command->fd_count++] = fd;
+				} else {
+					close(fd);
+				}
+			}
+		}
+		if (size <= 0 || (msg.msg_flags & MSG_CTRUNC) || command->fd_count != DAEMON_FDS) {
+			IF_DEBUG("[daemon] ignoring bad request\n");
+			return -1;
+		}
+		command->received = size;
+	}
+	
+	if (command->received < sizeof(DaemonRequest)) {
+		do {
+			size = read(command->fd, (uint8_t*)request + command->received,
+						sizeof(DaemonRequest) - command->received);
+		} while (size == -1 && errno == EINTR);
+		if (size == -1 && errno == EAGAIN) return 0;
+		if (size <= 0) return -1;
+		command->received += size;
+		if (command->received < sizeof(DaemonRequest)) return 0;
+	}
+	
+	if (!command->buf) {
+		if (request->magic != DAEMON_MAGIC || request->version != DAEMON_VERSION ||
+			request->size > DAEMON_MAX_REQUEST || request->argc == 0) {
+			IF_DEBUG("[daemon] ignoring bad request\n");
+			return -1;
+		}
+		command->argc = request->argc;
+		command->buf = (char*)malloc(request->size + 1);
+		command->argv = (char**)calloc(request->argc + 1, sizeof(char*));
+		if (!command->buf || !command->argv) {
+			fprintf(stderr, "Error: ran out of memory in Daemon::receive\n");
+			return -1;
+		}
+	}
+	
+	size_t offset = command->received - sizeof(DaemonRequest);
+	if (offset < request->size) {
+		do {
+			size = read(command->fd, command->buf + offset, request->size - offset);
+		} while (size == -1 && errno == EINTR);
+		if (size == -1 && errno == EAGAIN) return 0;
+		if (size <= 0) return -1;
+		command->received += size;
+		offset += size;
+		if (offset < request->size) return 0;
+	}
+	
+	// working directory first, then each argument
+	char* buf = command->buf;
+	buf[request->size] = 0;
+	char* p = buf + strlen(buf) + 1;
+	for (uint32_t i = 0; i < request->argc; i++) {
+		if (p >= buf + request->size) return -1;
+		command->argv[i] = p;
+		p += strlen(p) + 1;
+	}
+	
+	// the exit status is written once the command is done
+	fcntl(command->fd, F_SETFL, fcntl(command->fd, F_GETFL) & ~O_NONBLOCK);
+	return 1;
+}
+
+int Daemon::dispatch(DaemonCommand* command) {
+	int res;
+	bool read_only = Daemon::is_read_only(command->argc, command->argv);
+	if (!read_only && (m_writer || m_queued)) {
+		// changes to the depot happen one at a time, in the order
+		// they came in
+		if (this->enqueue(command) == DEPOT_OK) return DEPOT_OK;
+		res = DEPOT_ERROR;
+	} else {
+		res = this->run(command, read_only);
+	}
+	this->release(command, res == DEPOT_OK);
+	return res;
+}
+
+int Daemon::enqueue(DaemonCommand* command) {
+	if (m_queued >= m_queue_max) {
+		m_queue_max = m_queue_max ? m_queue_max * REALLOC_FACTOR : 16;
+		m_queue = (DaemonCommand*)realloc(m_queue, m_queue_max * sizeof(DaemonCommand));
+		if (!m_queue) {
+			fprintf(stderr, "Error: ran out of memory in Daemon::enqueue\n");
+			m_queued = 0;
+			m_queue_max = 0;
+			return DEPOT_ERROR;
+		}
+	}
+	IF_DEBUG("[daemon] modifying command waits for pid %d\n", (int)m_writer);
+	m_queue[m_queued++] = *command;
+	return DEPOT_OK;
+}
+
+void Daemon::release(DaemonCommand* command, bool keep_client) {
+	free(command->buf);
+	free(command->argv);
+	for (uint32_t i = 0; i < command->fd_count; i++) close(command->fds[i]);
+	if (!keep_client) close(command->fd);
+}
+
+int Daemon::run(DaemonCommand* command, bool read_only) {
+	if (m_count >= m_max) {
+		m_max = m_max ? m_max * REALLOC_FACTOR : 16;
+		m_pids = (pid_t*)realloc(m_pids, m_max * sizeof(pid_t));
+		m_clients = (int*)realloc(m_clients, m_max * sizeof(int));
+		if (!m_pids || !m_clients) {
+			fprintf(stderr, "Error: ran out of memory in Daemon::run\n");
+			return DEPOT_ERROR;
+		}
+	}
+	
+	fflush(stdout);
+	fflush(stderr);
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return DEPOT_ERROR;
+	}
+	
+	if (pid == 0) {
+		signal(SIGCHLD, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGPIPE, SIG_DFL);
+		close(m_listen_fd);
+		close(daemon_pipe[0]);
+		close(daemon_pipe[1]);
+		close(command->fd);
+		for (uint32_t i = 0; i < m_count; i++) close(m_clients[i]);
+		for (uint32_t i = 0; i < m_queued; i++) {
+			close(m_queue[i].fd);
+			for (int j = 0; j < DAEMON_FDS; j++) close(m_queue[i].fds[j]);
+		}
+		for (uint32_t i = 0; i < m_pending_count; i++) {
+			close(m_pending[i].fd);
+			for (uint32_t j = 0; j < m_pending[i].fd_count; j++) close(m_pending[i].fds[j]);
+		}
+		for (int i = 0; i < DAEMON_FDS; i++) {
+			if (dup2(command->fds[i], i) == -1) _exit(1);
+			close(command->fds[i]);
+		}
+		// commands have exactly the permissions they would have outside,
+		// and do not run at all with any of the daemon's left over
+		if (command->uid != 0) {
+			struct passwd* pw = getpwuid(command->uid);
+			int res = pw ? initgroups(pw->pw_name, command->gid) 
+			             : setgroups(1, &command->gid);
+			if (res == 0) res = setgid(command->gid);
+			if (res == 0) res = setuid(command->uid);
+			if (res == -1) {
+				perror("setuid");
+				_exit(1);
+			}
+		}
+		if (chdir(command->buf) == -1) {
+			perror(command->buf);
+			_exit(1);
+		}
+		// the command opens and locks the depot on descriptors of its
+		// own, exactly like it would outside the daemon
+		daemon_served = new Depot(m_depot->prefix());
+		exit(m_func(command->argc, command->argv));
+	}
+	
+	IF_DEBUG("[daemon] pid %d running a %s command for uid %d\n", 
+			 (int)pid, read_only ? "read-only" : "modifying", (int)command->uid);
+	m_pids[m_count] = pid;
+	m_clients[m_count] = command->fd;
+	m_count++;
+	if (!read_only) m_writer = pid;
+	return DEPOT_OK;
+}
+
+void Daemon::reap(bool wait) {
+	int status;
+	pid_t pid;
+	if (wait) {
+		while ((pid = waitpid(-1, &status, 0)) == -1 && errno == EINTR);
+		if (pid > 0) this->finish(pid, status);
+	}
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		this->finish(pid, status);
+	}
+}
+
+void Daemon::finish(pid_t pid, int status) {
+	uint32_t i;
+	for (i = 0; i < m_count; i++) {
+		if (m_pids[i] == pid) break;
+	}
+	if (i == m_count) return;
+	
+	int32_t res = 1;
+	if (WIFEXITED(status)) res = WEXITSTATUS(status);
+	if (WIFSIGNALED(status)) res = 128 + WTERMSIG(status);
+	if (write_all(m_clients[i], &res, sizeof(res))) {
+		IF_DEBUG("[daemon] client went away before its command finished\n");
+	}
+	close(m_clients[i]);
+	
+	m_count--;
+	m_pids[i] = m_pids[m_count];
+	m_clients[i] = m_clients[m_count];
+	
+	if (pid == m_writer) m_writer = 0;
+	
+	// start the next modifying command
+	while (!m_writer && m_queued) {
+		DaemonCommand command = m_queue[0];
+		m_queued--;
+		memmove(m_queue, m_queue + 1, m_queued * sizeof(DaemonCommand));
+		int res = this->run(&command, false);
+		this->release(&command, res == DEPOT_OK);
+	}
+}
+
+int Daemon::forward(const char* path, int argc, char** argv) {
+	struct sockaddr_un addr;
+	if (socket_address(&addr, path)) return DAEMON_UNAVAILABLE;
+	
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) return DAEMON_UNAVAILABLE;
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		close(fd);
+		return DAEMON_UNAVAILABLE;
+	}
+	
+	char cwd[PATH_MAX];
+	if (!getcwd(cwd, sizeof(cwd))) {
+		perror("getcwd");
+		close(fd);
+		return 1;
+	}
+	
+	DaemonRequest request;
+	request.magic = DAEMON_MAGIC;
+	request.version = DAEMON_VERSION;
+	request.flags = 0;
+	request.argc = argc;
+	request.size = strlen(cwd) + 1;
+	for (int i = 0; i < argc; i++) request.size += strlen(argv[i]) + 1;
+	if (request.size > DAEMON_MAX_REQUEST) {
+		fprintf(stderr, "Error: too many arguments for the darwinup daemon.\n");
+		close(fd);
+		return 1;
+	}
+	
+	char* buf = (char*)malloc(request.size);
+	char* p = buf;
+	memcpy(p, cwd, strlen(cwd) + 1);
+	p += strlen(cwd) + 1;
+	for (int i = 0; i < argc; i++) {
+		memcpy(p, argv[i], strlen(argv[i]) + 1);
+		p += strlen(argv[i]) + 1;
+	}
+	
+	int fds[DAEMON_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(fds))];
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct iovec iov;
+	iov.iov_base = &request;
+	iov.iov_len = sizeof(request);
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	
+	fflush(stdout);
+	fflush(stderr);
+	int res = 0;
+	ssize_t size;
+	do {
+		size = sendmsg(fd, &msg, 0);
+	} while (size == -1 && errno == EINTR);
+	if (size <= 0 ||
+		write_all(fd, (uint8_t*)&request + size, sizeof(request) - size) ||
+		write_all(fd, buf, request.size)) {
+		res = -1;
+	}
+	free(buf);
+	
+	int32_t status = 1;
+	if (res == 0) res = read_all(fd, &status, sizeof(status));
+	close(fd);
+	if (res) {
+		fprintf(stderr, "Error: lost connection to the darwinup daemon.\n");
+		return 1;
+	}
+	return status;
+}
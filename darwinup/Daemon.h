@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2010 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+
+#ifndef _DAEMON_H
+#define _DAEMON_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DAEMON_MAGIC       0x44555044 // DUPD
+#define DAEMON_VERSION     1
+#define DAEMON_MAX_REQUEST 65536
+#define DAEMON_UNAVAILABLE -100
+#define DAEMON_FDS         3 // stdin, stdout and stderr of the client
+#define DAEMON_PENDING     64 // requests being received at once
+#define DAEMON_TIMEOUT     10 // seconds a client has to send its request
+
+struct Depot;
+
+typedef int (*DaemonCommandFunc)(int argc, char** argv);
+
+/**
+ * Wire protocol, all integers in host byte order since both ends
+ *  are on the same machine:
+ *
+ *  client -> daemon: DaemonRequest, then size bytes holding the
+ *                    client's working directory and its argc command
+ *                    line arguments, each NUL terminated. The client's
+ *                    stdin, stdout and stderr are passed along with
+ *                    the request as SCM_RIGHTS. flags is reserved and 0.
+ *  daemon -> client: int32_t exit status once the command is done.
+ *
+ */
+struct DaemonRequest {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t flags;
+	uint32_t argc;
+	uint32_t size;
+};
+
+// a command line received from a client
+struct DaemonCommand {
+	int      fd;
+	DaemonRequest request;
+	size_t   received; // bytes of the request and buf so far
+	time_t   started;
+	char*    buf;      // working directory, then the arguments
+	char**   argv;
+	uint32_t argc;
+	int      fds[DAEMON_FDS];
+	uint32_t fd_count;
+	uid_t    uid;
+	gid_t    gid;
+};
+
+/**
+ *
+ * Long-lived server for a single depot.
+ *
+ * The daemon listens on a unix socket inside the depot. Every command 
+ *  runs in a forked child that opens and locks the depot for itself, 
+ *  writes straight to the client's terminal, then exits with the 
+ *  status the client should exit with. The daemon holds no lock of 
+ *  its own. Read-only commands run concurrently, anything else waits
+ *  in the daemon's queue for the previous modifying command to finish.
+ *  Requests are read as they arrive, so a client that is slow to send
+ *  its request holds up nobody, and is dropped after DAEMON_TIMEOUT.
+ *
+ */
+struct Daemon {
+	Daemon(Depot* depot, DaemonCommandFunc func);
+	~Daemon();
+	
+	// accept commands until SIGINT or SIGTERM
+	int serve();
+	
+	// run a command through the daemon listening at path, returns 
+	//  its exit status or DAEMON_UNAVAILABLE if nothing is listening
+	static int forward(const char* path, int argc, char** argv);
+	
+	// inside a command run by the daemon, the depot to use
+	static Depot* served_depot();
+	
+	// whether the command in a full darwinup command line leaves the
+	//  depot as it is
+	static bool is_read_only(int argc, char** argv);
+	
+protected:
+	
+	int   listen();
+	int   accept();
+	int   receive(DaemonCommand* command);
+	int   dispatch(DaemonCommand* command);
+	int   enqueue(DaemonCommand* command);
+	int   run(DaemonCommand* command, bool read_only);
+	void  release(DaemonCommand* command, bool keep_client);
+	void  reap(bool wait);
+	void  finish(pid_t pid, int status);
+	
+	static void signal_handler(int sig);
+	
+	Depot*            m_depot;
+	DaemonCommandFunc m_func;
+	int               m_listen_fd;
+	pid_t*            m_pids;
+	int*              m_clients;
+	uint32_t          m_count;
+	uint32_t          m_max;
+	pid_t             m_writer;
+	DaemonCommand*    m_queue;
+	uint32_t          m_queued;
+	uint32_t          m_queue_max;
+	DaemonCommand     m_pending[DAEMON_PENDING];
+	uint32_t          m_pending_count;
+};
+
+#endif
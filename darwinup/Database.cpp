@@ -39,12 +39,44 @@ void dbtrace(void* context, const char* sql) {
 	fprintf(stderr, "[SQL] %s\n", sql);
 }
 
+/**
+ * PRAGMAs for each performance profile, indexed by DB_PROFILE_*
+ *
+ * safe: the rollback journal is truncated instead of deleted and every
+ *       commit is synced, so a crash or power loss never corrupts the
+ *       depot. Temporary tables and indices stay in memory.
+ *
+ * bulk: the journal lives in memory and nothing is synced, trading
+ *       crash safety for speed while adding or removing hundreds of
+ *       thousands of file records.
+ */
+static const char* profile_names[] = { "safe", "bulk" };
+static const char* profile_pragmas[] = {
+	"PRAGMA journal_mode = TRUNCATE;"
+	"PRAGMA synchronous = FULL;"
+	"PRAGMA cache_size = -8192;"
+	"PRAGMA temp_store = MEMORY;"
+	"PRAGMA mmap_size = 67108864;",
+
+	"PRAGMA journal_mode = MEMORY;"
+	"PRAGMA synchronous = OFF;"
+	"PRAGMA cache_size = -131072;"
+	"PRAGMA temp_store = MEMORY;"
+	"PRAGMA mmap_size = 1073741824;",
+};
+#define PROFILE_COUNT (sizeof(profile_names) / sizeof(profile_names[0]))
+
 Database::Database() {
 	m_schema_version = 0;
+	m_profile = DB_PROFILE_SAFE;
+	m_readonly = false;
 	m_table_max = 2;
 	m_table_count = 0;
 	m_tables = (Table**)malloc(sizeof(Table*) * m_table_max);
 	this->init_cache();
+	m_begin_transaction = NULL;
+	m_rollback_transaction = NULL;
+	m_commit_transaction = NULL;
 	m_db = NULL;	
 	m_path = NULL;
 	m_error_size = ERROR_BUF_SIZE;
@@ -53,10 +85,15 @@ Database::Database() {
 
 Database::Database(const char* path) {
 	m_schema_version = 0;
+	m_profile = DB_PROFILE_SAFE;
+	m_readonly = false;
 	m_table_max = 2;
 	m_table_count = 0;
 	m_tables = (Table**)malloc(sizeof(Table*) * m_table_max);
 	this->init_cache();
+	m_begin_transaction = NULL;
+	m_rollback_transaction = NULL;
+	m_commit_transaction = NULL;
 	m_db = NULL;		
 	m_path = strdup(path);
 	if (!m_path) {
@@ -100,6 +137,11 @@ int Database::post_table_creation() {
 	return DB_OK;
 }
 
+int Database::post_schema_upgrade(uint32_t version) {
+	// clients can implement this
+	return DB_OK;
+}
+
 const char* Database::path() {
 	return m_path;
 }
@@ -108,6 +150,25 @@ const char* Database::error() {
 	return m_error;
 }
 
+const char* Database::profile_name(uint32_t profile) {
+	if (profile < PROFILE_COUNT) return profile_names[profile];
+	return NULL;
+}
+
+int Database::profile_value(const char* name, uint32_t* profile) {
+	for (uint32_t i = 0; i < PROFILE_COUNT; i++) {
+		if (strcasecmp(name, profile_names[i]) == 0) {
+			*profile = i;
+			return DB_OK;
+		}
+	}
+	return DB_ERROR;
+}
+
+uint32_t Database::profile() {
+	return m_profile;
+}
+
 int Database::connect() {
 	int res = DB_OK;
 	
@@ -136,6 +197,7 @@ int Database::connect() {
 		// db exists already but we cannot write to it
 		readonly = true;
 	}
+	m_readonly = readonly;
 
 	res = sqlite3_open(m_path, &m_db);
 	if (res) {
@@ -153,7 +215,9 @@ int Database::connect() {
 	}
 
 	if (!exists) {
-		// create schema since it is empty
+		// create schema since it is empty, free pages can only be given
+		// back a few at a time if that is set up first
+		this->sql_once("PRAGMA auto_vacuum = INCREMENTAL;");
 		assert(this->create_tables() == 0);
 		assert(this->set_schema_version(this->m_schema_version) == 0);
 	} else {
@@ -214,10 +278,44 @@ int Database::post_connect() {
 	if (verbosity & VERBOSE_SQL) {
 		sqlite3_trace(m_db, dbtrace, NULL);
 	}
+	
+	// performance settings
+	extern uint32_t db_profile;
+	if (res == DB_OK) res = this->apply_profile(db_profile);
 		
 	return res;
 }
 
+int Database::apply_profile(uint32_t profile) {
+	if (profile >= PROFILE_COUNT) {
+		fprintf(stderr, "Error: unknown database profile: %u \n", profile);
+		return DB_ERROR;
+	}
+	IF_DEBUG("applying database profile: %s \n", profile_names[profile]);
+	int res = this->sql_once(profile_pragmas[profile]);
+	if (res == DB_OK) m_profile = profile;
+	return res;
+}
+
+int Database::record_profile() {
+	int res = SQLITE_OK;
+	char** recorded = NULL;
+	const char* name = profile_names[m_profile];
+	// a database that cannot be written keeps what it has
+	if (m_readonly) return DB_OK;
+	// only write when the profile changes so read-only
+	// commands do not take a write lock on every run
+	res = this->get_information_value("profile", &recorded);
+	bool same = false;
+	if (res == SQLITE_ROW) {
+		same = (*recorded && strcmp(*recorded, name) == 0);
+		free(*recorded);
+	}
+	free(recorded);
+	if (same) return DB_OK;
+	return this->update_information_value("profile", name);
+}
+
 int Database::connect(const char* path) {
 	this->m_path = strdup(path);
 	if (!m_path) {
@@ -422,35 +520,110 @@ int Database::get_all_ordered(const char* name, uint8_t*** output,
 	__get_stmt(table->get_row_ordered(m_db, order_by, order, count, args));
 	int res = SQLITE_OK;
 	this->bind_va_columns(stmt, count, args);
-	uint8_t* current = NULL;
-	*result_count = 0;
-	uint32_t output_max = INITIAL_ROWS;
-	*output = (uint8_t**)calloc(output_max, sizeof(uint8_t*));
-	
-	res = SQLITE_ROW;
-	while (res == SQLITE_ROW) {
-		if ((*result_count) >= output_max) {
-			output_max *= REALLOC_FACTOR;
-			*output = (uint8_t**)realloc((*output), output_max * sizeof(uint8_t*));
-			if (!(*output)) {
-				fprintf(stderr, "Error: ran out of memory trying to realloc output"
-						        "in get_all_ordered.\n");
-				return DB_ERROR;
-			}
-		}
-		current = table->alloc_result();
-		res = this->step_once(stmt, current, NULL);
-		if (res == SQLITE_ROW) {
-			(*output)[(*result_count)] = current;
-			(*result_count)++;
-		} else {
-			table->free_result(current);
+	res = this->step_rows(stmt, table, output, result_count);
+	sqlite3_reset(stmt);
+	cache_release_value(m_statement_cache, pps);
+	va_end(args);
+	return res;
+}
+
+sqlite3_stmt** Database::cached_statement(const char* name, const char* query) {
+	sqlite3_stmt** pps;
+	char* key = strdup(name);
+	cache_get_and_retain(m_statement_cache, key, (void**)&pps);
+	if (!pps) {
+		pps = (sqlite3_stmt**)malloc(sizeof(sqlite3_stmt*));
+		int res = sqlite3_prepare_v2(m_db, query, -1, pps, NULL);
+		if (res != SQLITE_OK) {
+			fprintf(stderr, "Error: unable to prepare statement for query: %s\n"
+					        "Error: %s\n", query, sqlite3_errmsg(m_db));
+			free(pps);
+			free(key);
+			return NULL;
 		}
+		cache_set_and_retain(m_statement_cache, key, pps, 0);
 	}
+	free(key);
+	return pps;
+}
 
+int Database::incremental_vacuum(uint32_t seconds) {
+	uint64_t mode = 0;
+	int res = this->pragma_value("auto_vacuum", &mode);
+	if (res == SQLITE_OK && mode != VACUUM_INCREMENTAL) {
+		// databases created before incremental vacuuming are converted
+		// by a full vacuum, which also frees every page
+		IF_DEBUG("converting %s to incremental vacuuming\n", m_path);
+		res = this->sql_once("PRAGMA auto_vacuum = INCREMENTAL;");
+		if (res == SQLITE_OK) res = this->sql_once("VACUUM;");
+		return res;
+	}
+	
+	time_t deadline = time(NULL) + seconds;
+	uint64_t free_pages = 0;
+	if (res == SQLITE_OK) res = this->pragma_value("freelist_count", &free_pages);
+	while (res == SQLITE_OK && free_pages && time(NULL) <= deadline) {
+		res = this->sql_once("PRAGMA incremental_vacuum(%d);", VACUUM_PAGES);
+		if (res == SQLITE_OK) res = this->pragma_value("freelist_count", &free_pages);
+	}
+	IF_DEBUG("%llu free pages left in %s\n", free_pages, m_path);
+	return res;
+}
+
+int Database::pragma_value(const char* pragma, uint64_t* value) {
+	char* query = NULL;
+	asprintf(&query, "PRAGMA %s", pragma);
+	if (!query) return SQLITE_NOMEM;
+	sqlite3_stmt** pps = this->cached_statement(query, query);
+	free(query);
+	if (!pps) return SQLITE_ERROR;
+	sqlite3_stmt* stmt = *pps;
+	int res = sqlite3_step(stmt);
+	if (res == SQLITE_ROW) {
+		*value = (uint64_t)sqlite3_column_int64(stmt, 0);
+		res = SQLITE_OK;
+	}
 	sqlite3_reset(stmt);
 	cache_release_value(m_statement_cache, pps);
-	va_end(args);
+	return res;
+}
+
+int Database::get_all_query(const char* name, uint8_t*** output, uint32_t* result_count,
+							Table* table, const char* query, uint64_t param) {
+	*output = NULL;
+	*result_count = 0;
+	sqlite3_stmt** pps = this->cached_statement(name, query);
+	if (!pps) return SQLITE_ERROR;
+	sqlite3_stmt* stmt = *pps;
+	int res = sqlite3_bind_int64(stmt, 1, param);
+	if (res == SQLITE_OK) res = this->step_rows(stmt, table, output, result_count);
+	sqlite3_reset(stmt);
+	cache_release_value(m_statement_cache, pps);
+	return res;
+}
+
+int Database::get_column_query(const char* name, void** output, uint32_t* result_count,
+							   uint32_t size, const char* query, uint64_t param) {
+	*result_count = 0;
+	*output = malloc(INITIAL_ROWS * size);
+	sqlite3_stmt** pps = this->cached_statement(name, query);
+	if (!pps || !*output) return SQLITE_ERROR;
+	sqlite3_stmt* stmt = *pps;
+	int res = sqlite3_bind_int64(stmt, 1, param);
+	if (res == SQLITE_OK) res = this->step_all(stmt, output, INITIAL_ROWS * size, result_count);
+	sqlite3_reset(stmt);
+	cache_release_value(m_statement_cache, pps);
+	return res;
+}
+
+int Database::text_query(const char* name, const char* query, const char* param) {
+	sqlite3_stmt** pps = this->cached_statement(name, query);
+	if (!pps) return SQLITE_ERROR;
+	sqlite3_stmt* stmt = *pps;
+	int res = sqlite3_bind_text(stmt, 1, param, -1, SQLITE_STATIC);
+	if (res == SQLITE_OK) res = this->execute(stmt);
+	sqlite3_clear_bindings(stmt);
+	cache_release_value(m_statement_cache, pps);
 	return res;
 }
 
@@ -569,10 +742,84 @@ int Database::del(Table* table, uint64_t serial) {
 	return res;
 }
 
+// SQLite allows 999 parameters per statement by default
+#define DEL_SERIALS_CHUNK 500
+
+int Database::del(Table* table, uint64_t* serials, uint32_t count) {
+	char* name = NULL;
+	char* statement = NULL;
+	asprintf(&name, "%s__del_serials", table->name());
+	asprintf(&statement, "DELETE FROM %s", table->name());
+	int res = SQLITE_NOMEM;
+	if (name && statement) {
+		res = this->serials_query(name, statement, NULL, 0, serials, count);
+	} else {
+		fprintf(stderr, "Error: ran out of memory in Database::del \n");
+	}
+	free(statement);
+	free(name);
+	return res;
+}
+
+int Database::serials_query(const char* name, const char* statement, uint64_t* values, 
+							uint32_t value_count, uint64_t* serials, uint32_t count) {
+	int res = SQLITE_OK;
+	for (uint32_t first = 0; res == SQLITE_OK && first < count; first += DEL_SERIALS_CHUNK) {
+		uint32_t n = count - first;
+		if (n > DEL_SERIALS_CHUNK) n = DEL_SERIALS_CHUNK;
+		
+		// full chunks share a cached statement, the last one is prepared once
+		size_t size = 64 + strlen(statement) + 2 * n;
+		char* query = (char*)malloc(size);
+		if (!query) {
+			fprintf(stderr, "Error: ran out of memory in Database::serials_query \n");
+			res = SQLITE_NOMEM;
+			break;
+		}
+		snprintf(query, size, "%s WHERE serial IN (?", statement);
+		for (uint32_t i = 1; i < n; i++) strlcat(query, ",?", size);
+		strlcat(query, ");", size);
+		sqlite3_stmt* stmt = NULL;
+		sqlite3_stmt** pps = NULL;
+		if (n == DEL_SERIALS_CHUNK) {
+			pps = this->cached_statement(name, query);
+			if (pps) stmt = *pps;
+		} else if (sqlite3_prepare_v2(m_db, query, -1, &stmt, NULL) != SQLITE_OK) {
+			fprintf(stderr, "Error: unable to prepare statement for query: %s\n"
+					        "Error: %s\n", query, sqlite3_errmsg(m_db));
+			stmt = NULL;
+		}
+		free(query);
+		if (!stmt) {
+			res = SQLITE_ERROR;
+			break;
+		}
+		
+		for (uint32_t i = 0; res == SQLITE_OK && i < value_count; i++) {
+			res = sqlite3_bind_int64(stmt, i + 1, values[i]);
+		}
+		for (uint32_t i = 0; res == SQLITE_OK && i < n; i++) {
+			res = sqlite3_bind_int64(stmt, value_count + i + 1, serials[first + i]);
+		}
+		if (res == SQLITE_OK) res = this->execute(stmt);
+		if (pps) {
+			sqlite3_reset(stmt);
+			cache_release_value(m_statement_cache, pps);
+		} else {
+			sqlite3_finalize(stmt);
+		}
+	}
+	return res;
+}
+
 uint64_t Database::last_insert_id() {
 	return (uint64_t)sqlite3_last_insert_rowid(m_db);
 }
 
+uint64_t Database::changes() {
+	return (uint64_t)sqlite3_changes(m_db);
+}
+
 
 
 int Database::sql_once(const char* fmt, ...) {
@@ -711,7 +958,7 @@ int Database::upgrade_schema(uint32_t version) {
 		} else {
 			// table is same version, so check for new columns
 			for (uint32_t ci = 0; res == DB_OK && ci < m_tables[ti]->column_count(); ci++) {
-				if (m_tables[ti]->column(ci)->version() < version) {
+				if (m_tables[ti]->column(ci)->version() < m_tables[ti]->version()) {
 					// this should never happen
 					fprintf(stderr, "Error: internal error with schema versioning."
 									" Column %s is older than its table %s. \n",
@@ -731,6 +978,14 @@ int Database::upgrade_schema(uint32_t version) {
 		}
 	}
 	
+	if (res == DB_OK) {
+		res = this->post_schema_upgrade(version);
+		if (res != DB_OK) {
+			fprintf(stderr, "Error: unable to migrate data from schema version %u.\n",
+					version);
+		}
+	}
+	
 	if (res == DB_OK) {
 		this->commit_transaction();
 	} else {
@@ -897,6 +1152,36 @@ int Database::step_once(sqlite3_stmt* stmt, uint8_t* output, uint32_t* used) {
 	return res;
 }
 
+int Database::step_rows(sqlite3_stmt* stmt, Table* table, uint8_t*** output, 
+						uint32_t* count) {
+	uint8_t* current = NULL;
+	*count = 0;
+	uint32_t output_max = INITIAL_ROWS;
+	*output = (uint8_t**)calloc(output_max, sizeof(uint8_t*));
+	
+	int res = SQLITE_ROW;
+	while (res == SQLITE_ROW) {
+		if ((*count) >= output_max) {
+			output_max *= REALLOC_FACTOR;
+			*output = (uint8_t**)realloc((*output), output_max * sizeof(uint8_t*));
+			if (!(*output)) {
+				fprintf(stderr, "Error: ran out of memory trying to realloc output"
+						        "in step_rows.\n");
+				return DB_ERROR;
+			}
+		}
+		current = table->alloc_result();
+		res = this->step_once(stmt, current, NULL);
+		if (res == SQLITE_ROW) {
+			(*output)[(*count)] = current;
+			(*count)++;
+		} else {
+			table->free_result(current);
+		}
+	}
+	return res;
+}
+
 int Database::step_all(sqlite3_stmt* stmt, void** output, uint32_t size, 
 					   uint32_t* count) {
 	uint32_t used = 0;
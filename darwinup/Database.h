@@ -42,6 +42,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "Table.h"
 #include "Digest.h"
@@ -66,6 +67,18 @@
 // test return code to see if actual results were found
 #define FOUND(x)  ((x & DB_FOUND) && !(x & DB_ERROR))
 
+// performance profiles applied to each connection in post_connect()
+//  - safe: full durability, modest cache and mmap
+//  - bulk: in-memory journal and no syncing, large cache and mmap,
+//          for installing and uninstalling very large roots
+#define DB_PROFILE_SAFE 0
+#define DB_PROFILE_BULK 1
+
+// PRAGMA auto_vacuum value that lets incremental_vacuum() free pages
+#define VACUUM_INCREMENTAL 2
+// pages freed by each step of incremental_vacuum()
+#define VACUUM_PAGES 64
+
 // Schema creation macros
 #define SCHEMA_VERSION(v) this->schema_version(v);
 #define ADD_TABLE(t) assert(this->add_table(t)==0);
@@ -132,15 +145,28 @@ struct Database {
 	// initial sets of data
 	virtual int  post_table_creation();
 	
+	// called after new tables and columns are added during an
+	// upgrade from version, inside the upgrade transaction, so
+	// clients can migrate existing data
+	virtual int  post_schema_upgrade(uint32_t version);
+	
 	const char*  path();
 	const char*  error();
 	int          connect();
 	int          connect(const char* path);
-	bool         is_connected();
+	virtual bool is_connected();
 	
-	int          begin_transaction();
-	int          rollback_transaction();
-	int          commit_transaction();
+	virtual int  begin_transaction();
+	virtual int  rollback_transaction();
+	virtual int  commit_transaction();
+
+	// performance profile names, used on the command line and
+	//  recorded in the database_information table
+	static const char* profile_name(uint32_t profile);
+	static int         profile_value(const char* name, uint32_t* profile);
+	uint32_t           profile();
+	// remember which profile last wrote to the database
+	int                record_profile();
 	
 	/**
 	 * statement caching and execution
@@ -195,8 +221,36 @@ struct Database {
 	
 	// delete row with primary key equal to serial
 	int  del(Table* table, uint64_t serial);
+	// delete rows with primary keys in serials, many per statement
+	int  del(Table* table, uint64_t* serials, uint32_t count);
+	// run statement on the rows with primary keys in serials, many at a 
+	//  time, statement's own parameters are bound to values first
+	int  serials_query(const char* name, const char* statement, uint64_t* values, 
+					   uint32_t value_count, uint64_t* serials, uint32_t count);
+	
+	/**
+	 * hand-written queries
+	 *
+	 * For queries the Table cannot generate, such as joins. The statement
+	 * is cached with name and param is bound to ?1 in the query. Rows
+	 * must have the columns of table, in order.
+	 */
+	int  get_all_query(const char* name, uint8_t*** output, uint32_t* result_count,
+					   Table* table, const char* query, uint64_t param);
+	int  get_column_query(const char* name, void** output, uint32_t* result_count,
+						  uint32_t size, const char* query, uint64_t param);
+	// executes a query that returns no rows, with param bound to ?1
+	int  text_query(const char* name, const char* query, const char* param);
 	
 	uint64_t last_insert_id();
+	// rows changed by the last insert, update or delete
+	uint64_t changes();
+	
+	// value of a PRAGMA that returns a single integer, such as page_count
+	int  pragma_value(const char* pragma, uint64_t* value);
+	// give free pages back to the file system until there are none left
+	//  or about seconds have passed
+	int  incremental_vacuum(uint32_t seconds);
 	
 	
 protected:
@@ -205,6 +259,9 @@ protected:
 	int   pre_connect();
 	int   post_connect();
 	
+	// set PRAGMAs for the requested performance profile
+	int   apply_profile(uint32_t profile);
+	
 	int   upgrade_schema(uint32_t version);
 	int   upgrade_internal_schema(uint32_t version);
 	int   init_internal_schema();
@@ -248,6 +305,10 @@ protected:
 	size_t store_column(sqlite3_stmt* stmt, int column, uint8_t* output);
 	int step_once(sqlite3_stmt* stmt, uint8_t* output, uint32_t* used);
 	int step_all(sqlite3_stmt* stmt, void** output, uint32_t size, uint32_t* count);
+	int step_rows(sqlite3_stmt* stmt, Table* table, uint8_t*** output, uint32_t* count);
+	
+	// prepare query the first time name is used
+	sqlite3_stmt** cached_statement(const char* name, const char* query);
 	
 	// libcache
 	void init_cache();
@@ -257,6 +318,8 @@ protected:
 	sqlite3*         m_db;
 	
 	uint32_t         m_schema_version;
+	uint32_t         m_profile;
+	bool             m_readonly;
 	Table*           m_information_table;
 	sqlite3_stmt*    m_get_information_value;
 	
@@ -0,0 +1,411 @@
+/*
+ * Copyright (c) 2010 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#include <copyfile.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "Delta.h"
+#include "Utils.h"
+
+#define DELTA_HEADER_SIZE (DELTA_MAGIC_SIZE + CC_SHA1_DIGEST_LENGTH + 8)
+
+struct DeltaBuffer {
+	uint8_t* data;
+	size_t   size;
+	size_t   max;
+	size_t   limit;  // give up past this many bytes
+};
+
+static bool delta_reserve(DeltaBuffer* buf, size_t size) {
+	if (buf->size + size > buf->limit) return false;
+	if (buf->size + size > buf->max) {
+		size_t max = buf->max ? buf->max : DELTA_BLOCK_SIZE;
+		while (max < buf->size + size) max *= 2;
+		uint8_t* data = (uint8_t*)realloc(buf->data, max);
+		if (!data) return false;
+		buf->data = data;
+		buf->max = max;
+	}
+	return true;
+}
+
+static void delta_put(DeltaBuffer* buf, uint64_t value, int bytes) {
+	for (int i = 0; i < bytes; i++) buf->data[buf->size++] = (uint8_t)(value >> (8 * i));
+}
+
+static uint64_t delta_get(const uint8_t* data, int bytes) {
+	uint64_t value = 0;
+	for (int i = 0; i < bytes; i++) value |= (uint64_t)data[i] << (8 * i);
+	return value;
+}
+
+static bool delta_literal(DeltaBuffer* buf, const uint8_t* data, size_t size) {
+	while (size) {
+		uint32_t len = size > 0x7fffffff ? 0x7fffffff : (uint32_t)size;
+		if (!delta_reserve(buf, 5 + len)) return false;
+		buf->data[buf->size++] = 'D';
+		delta_put(buf, len, 4);
+		memcpy(buf->data + buf->size, data, len);
+		buf->size += len;
+		data += len;
+		size -= len;
+	}
+	return true;
+}
+
+static bool delta_copy(DeltaBuffer* buf, uint64_t offset, size_t size) {
+	while (size) {
+		uint32_t len = size > 0x7fffffff ? 0x7fffffff : (uint32_t)size;
+		if (!delta_reserve(buf, 13)) return false;
+		buf->data[buf->size++] = 'C';
+		delta_put(buf, offset, 8);
+		delta_put(buf, len, 4);
+		offset += len;
+		size -= len;
+	}
+	return true;
+}
+
+// maps the file at path, data is NULL for an empty file
+static int map_file(const char* path, uint8_t** data, size_t* size) {
+	*data = NULL;
+	*size = 0;
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) return -1;
+	struct stat sb;
+	int res = fstat(fd, &sb);
+	if (res == 0 && sb.st_size > 0) {
+		void* map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			res = -1;
+		} else {
+			*data = (uint8_t*)map;
+			*size = (size_t)sb.st_size;
+		}
+	}
+	close(fd);
+	return res;
+}
+
+static void unmap_file(uint8_t* data, size_t size) {
+	if (data) munmap(data, size);
+}
+
+// replaces the file at path with data, keeping its owner, mode, times 
+// and extended attributes. The data goes to a file next to it first, so
+// a crash leaves either the old file or the new one.
+static int rewrite_file(const char* path, struct stat* sb, const uint8_t* data, size_t size) {
+	char* tmp = NULL;
+	asprintf(&tmp, "%s.XXXXXX", path);
+	int fd = tmp ? mkstemp(tmp) : -1;
+	if (fd == -1) {
+		perror(path);
+		free(tmp);
+		return -1;
+	}
+	struct timeval times[2];
+	times[0].tv_sec = sb->st_atime;
+	times[0].tv_usec = 0;
+	times[1].tv_sec = sb->st_mtime;
+	times[1].tv_usec = 0;
+	int res = write_all(fd, data, size);
+	if (res == 0) res = fchown(fd, sb->st_uid, sb->st_gid);
+	if (res == 0) res = fchmod(fd, sb->st_mode & ALLPERMS);
+	if (res == 0) res = fsync(fd);
+	if (close(fd) && res == 0) res = -1;
+	if (res == 0) res = copyfile(path, tmp, NULL, COPYFILE_ACL | COPYFILE_XATTR);
+	if (res == 0) res = utimes(tmp, times);
+	if (res == 0) res = rename(tmp, path);
+	if (res) {
+		perror(path);
+		unlink(tmp);
+	}
+	free(tmp);
+	return res;
+}
+
+// the rsync weak checksum of a block, a in the low half and b in the high
+static uint32_t weak_sum(const uint8_t* data, size_t size) {
+	uint32_t a = 0, b = 0;
+	for (size_t i = 0; i < size; i++) {
+		a += data[i];
+		b += (uint32_t)(size - i) * data[i];
+	}
+	return (a & 0xffff) | (b << 16);
+}
+
+static uint32_t weak_bucket(uint32_t sum, uint32_t mask) {
+	return (sum * 2654435761U) >> 7 & mask;
+}
+
+// describes target in terms of base, false if that does not fit in buf
+static bool delta_build(DeltaBuffer* buf, const uint8_t* base, size_t base_size,
+						const uint8_t* target, size_t target_size) {
+	const size_t B = DELTA_BLOCK_SIZE;
+	uint32_t blocks = (uint32_t)(base_size / B);
+	uint32_t buckets = 1;
+	while (buckets < blocks * 2) buckets <<= 1;
+	uint32_t* heads = (uint32_t*)calloc(buckets, sizeof(uint32_t));
+	uint32_t* next = (uint32_t*)calloc(blocks + 1, sizeof(uint32_t));
+	uint32_t* sums = (uint32_t*)calloc(blocks + 1, sizeof(uint32_t));
+	if (!heads || !next || !sums) {
+		fprintf(stderr, "Error: ran out of memory in delta_build\n");
+		free(heads);
+		free(next);
+		free(sums);
+		return false;
+	}
+	// chains are 1-based, later blocks first
+	for (uint32_t i = 0; i < blocks; i++) {
+		sums[i] = weak_sum(base + (size_t)i * B, B);
+		uint32_t bucket = weak_bucket(sums[i], buckets - 1);
+		next[i] = heads[bucket];
+		heads[bucket] = i + 1;
+	}
+	
+	bool ok = true;
+	size_t literal = 0;  // start of the data not yet described
+	size_t pos = 0;
+	uint32_t a = 0, b = 0;
+	bool rolled = false;
+	while (ok && blocks && pos + B <= target_size) {
+		if (!rolled) {
+			uint32_t sum = weak_sum(target + pos, B);
+			a = sum & 0xffff;
+			b = sum >> 16;
+			rolled = true;
+		}
+		uint32_t sum = (a & 0xffff) | (b << 16);
+		uint32_t found = heads[weak_bucket(sum, buckets - 1)];
+		while (found && (sums[found - 1] != sum || 
+						 memcmp(base + (size_t)(found - 1) * B, target + pos, B) != 0)) {
+			found = next[found - 1];
+		}
+		if (found) {
+			size_t offset = (size_t)(found - 1) * B;
+			size_t len = B;
+			while (offset + len < base_size && pos + len < target_size &&
+				   base[offset + len] == target[pos + len]) {
+				len++;
+			}
+			ok = delta_literal(buf, target + literal, pos - literal) && 
+				 delta_copy(buf, offset, len);
+			pos += len;
+			literal = pos;
+			rolled = false;
+		} else {
+			if (pos + B < target_size) {
+				uint8_t out = target[pos];
+				uint8_t in = target[pos + B];
+				a = a - out + in;
+				b = b - (uint32_t)B * out + a;
+			}
+			pos++;
+		}
+	}
+	if (ok) ok = delta_literal(buf, target + literal, target_size - literal);
+	if (ok) ok = delta_reserve(buf, 1);
+	if (ok) buf->data[buf->size++] = 'E';
+	
+	free(heads);
+	free(next);
+	free(sums);
+	return ok;
+}
+
+int delta_encode(const char* base, const char* path, off_t* saved) {
+	*saved = 0;
+	struct stat sb;
+	if (lstat(path, &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_size < DELTA_MIN_SIZE ||
+		sb.st_size > DELTA_MAX_SIZE) {
+		return 0;
+	}
+	uint8_t* base_data;
+	size_t base_size;
+	uint8_t* data;
+	size_t size;
+	if (map_file(base, &base_data, &base_size)) {
+		IF_DEBUG("[delta] unable to read %s\n", base);
+		return 0;
+	}
+	if (base_size > DELTA_MAX_SIZE || map_file(path, &data, &size)) {
+		IF_DEBUG("[delta] unable to read %s\n", path);
+		unmap_file(base_data, base_size);
+		return 0;
+	}
+	
+	DeltaBuffer buf;
+	buf.data = NULL;
+	buf.size = 0;
+	buf.max = 0;
+	buf.limit = size - size / 4;
+	bool ok = delta_reserve(&buf, DELTA_HEADER_SIZE);
+	if (ok) {
+		SHA1Digest digest(base_data, (uint32_t)base_size);
+		memcpy(buf.data, DELTA_MAGIC, DELTA_MAGIC_SIZE);
+		memcpy(buf.data + DELTA_MAGIC_SIZE, digest.data(), CC_SHA1_DIGEST_LENGTH);
+		buf.size = DELTA_MAGIC_SIZE + CC_SHA1_DIGEST_LENGTH;
+		delta_put(&buf, size, 8);
+		ok = delta_build(&buf, base_data, base_size, data, size);
+	}
+	unmap_file(base_data, base_size);
+	unmap_file(data, size);
+	
+	int res = 0;
+	if (ok) {
+		IF_DEBUG("[delta] %s: %llu bytes as %llu\n", path, 
+				 (unsigned long long)size, (unsigned long long)buf.size);
+		res = rewrite_file(path, &sb, buf.data, buf.size);
+		if (res == 0) *saved = size - buf.size;
+	}
+	free(buf.data);
+	return res;
+}
+
+bool delta_is_encoded(const char* path) {
+	uint8_t md[CC_SHA1_DIGEST_LENGTH];
+	return delta_base_digest(path, md) == 0;
+}
+
+int delta_base_digest(const char* path, uint8_t* md) {
+	uint8_t header[DELTA_MAGIC_SIZE + CC_SHA1_DIGEST_LENGTH];
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) return -1;
+	ssize_t len = read(fd, header, sizeof(header));
+	close(fd);
+	if (len != sizeof(header) || memcmp(header, DELTA_MAGIC, DELTA_MAGIC_SIZE) != 0) {
+		return -1;
+	}
+	memcpy(md, header + DELTA_MAGIC_SIZE, CC_SHA1_DIGEST_LENGTH);
+	return 0;
+}
+
+int delta_decode(const char* base, const char* path, Digest* digest, off_t expected) {
+	struct stat sb;
+	uint8_t* base_data = NULL;
+	size_t base_size = 0;
+	uint8_t* delta = NULL;
+	size_t delta_size = 0;
+	if (lstat(path, &sb) == -1 || map_file(path, &delta, &delta_size)) {
+		perror(path);
+		return -1;
+	}
+	if (map_file(base, &base_data, &base_size)) {
+		perror(base);
+		unmap_file(delta, delta_size);
+		return -1;
+	}
+	
+	const char* error = NULL;
+	uint8_t* data = NULL;
+	size_t size = 0;
+	if (delta_size < DELTA_HEADER_SIZE || 
+		memcmp(delta, DELTA_MAGIC, DELTA_MAGIC_SIZE) != 0) {
+		error = "not a delta";
+	}
+	if (!error) {
+		SHA1Digest base_digest(base_data, (uint32_t)base_size);
+		if (memcmp(base_digest.data(), delta + DELTA_MAGIC_SIZE, CC_SHA1_DIGEST_LENGTH)) {
+			error = "made against different data";
+		}
+	}
+	if (!error) {
+		// the header is only trusted as far as what the encoder writes
+		// and what the depot recorded for the file
+		uint64_t recorded = delta_get(delta + DELTA_MAGIC_SIZE + CC_SHA1_DIGEST_LENGTH, 8);
+		if (recorded > DELTA_MAX_SIZE || recorded >= SIZE_MAX ||
+			(expected && recorded != (uint64_t)expected)) {
+			error = "size out of range";
+		} else {
+			size = (size_t)recorded;
+			data = (uint8_t*)malloc(size + 1);
+			if (!data) error = "out of memory";
+		}
+	}
+	
+	size_t pos = DELTA_HEADER_SIZE;
+	size_t out = 0;
+	while (!error) {
+		char op = pos < delta_size ? delta[pos++] : 0;
+		if (op == 'E') {
+			if (out != size) error = "truncated";
+			break;
+		} else if (op == 'C' && pos + 12 <= delta_size) {
+			uint64_t offset = delta_get(delta + pos, 8);
+			uint64_t len = delta_get(delta + pos + 8, 4);
+			pos += 12;
+			if (offset > base_size || len > base_size - offset || len > size - out) {
+				error = "copy out of range";
+			} else {
+				memcpy(data + out, base_data + offset, len);
+				out += len;
+			}
+		} else if (op == 'D' && pos + 4 <= delta_size) {
+			uint64_t len = delta_get(delta + pos, 4);
+			pos += 4;
+			if (len > delta_size - pos || len > size - out) {
+				error = "data out of range";
+			} else {
+				memcpy(data + out, delta + pos, len);
+				pos += len;
+				out += len;
+			}
+		} else {
+			error = "corrupt";
+		}
+	}
+	unmap_file(base_data, base_size);
+	unmap_file(delta, delta_size);
+	
+	if (!error) {
+		SHA1Digest result(data, (uint32_t)size);
+		if (!digest || !Digest::equal(&result, digest)) error = "digest mismatch";
+	}
+	int res = -1;
+	if (error) {
+		fprintf(stderr, "Error: unable to reconstruct %s from its delta: %s\n", path, error);
+	} else {
+		IF_DEBUG("[delta] %s: %llu bytes from %llu\n", path, 
+				 (unsigned long long)size, (unsigned long long)delta_size);
+		res = rewrite_file(path, &sb, data, size);
+	}
+	free(data);
+	return res;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2010 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#ifndef _DELTA_H
+#define _DELTA_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "Digest.h"
+
+// first bytes of a file holding a delta
+#define DELTA_MAGIC      "DUDELTA1"
+#define DELTA_MAGIC_SIZE 8
+// bytes of the base looked up at a time
+#define DELTA_BLOCK_SIZE 512
+// files smaller than this are not worth a delta
+#define DELTA_MIN_SIZE   4096
+// ops have 32-bit lengths, so files larger than this are left alone
+#define DELTA_MAX_SIZE   0xffffffffLL
+
+/**
+ *
+ * Rollback data stored as a delta against the file installed over it.
+ *
+ *  Blocks of the base are indexed by an rsync-style rolling checksum and
+ *  looked for at every offset of the file, matches are checked byte for
+ *  byte and grown as far as they go. The delta is the magic, the SHA-1
+ *  digest of the base, the size of the file and then a list of ops: 'C'
+ *  copies a 32-bit length from a 64-bit offset of the base, 'D' is a 
+ *  32-bit length of literal data, 'E' ends the list. Integers are little
+ *  endian.
+ *
+ *  A delta replaces the contents of the file it describes, so the mode,
+ *  owner, times and extended attributes of the file stay the same.
+ *
+ */
+
+// Replaces the file at path with a delta against the file at base when
+//  that saves at least a quarter of it. Sets saved to the bytes saved, 0
+//  if path was left alone.
+int delta_encode(const char* base, const char* path, off_t* saved);
+
+// Whether the file at path holds a delta.
+bool delta_is_encoded(const char* path);
+
+// Copies the digest of the base the delta at path was made against to md,
+//  which has room for CC_SHA1_DIGEST_LENGTH bytes.
+int delta_base_digest(const char* path, uint8_t* md);
+
+// Replaces the delta at path with the data it describes. base has to be
+//  the data the delta was made against and the result has to have digest
+//  and, unless it is 0, the size expected.
+int delta_decode(const char* base, const char* path, Digest* digest, off_t expected);
+
+#endif
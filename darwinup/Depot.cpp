@@ -31,21 +31,32 @@
  */
 
 #include "Archive.h"
+#include "Delta.h"
 #include "Depot.h"
+#include "DirtyLog.h"
+#include "Durability.h"
 #include "File.h"
+#include "HardLinks.h"
+#include "Journal.h"
+#include "LogDB.h"
 #include "SerialSet.h"
+#include "Store.h"
 #include "Utils.h"
 #include <assert.h>
+#include <dirent.h>
 #include <copyfile.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 
 
@@ -53,8 +64,23 @@ Depot::Depot() {
 	m_prefix = NULL;
 	m_depot_path = NULL;
 	m_database_path = NULL;
+	m_log_path = NULL;
+	m_manifest_path = NULL;
+	m_daemon_path = NULL;
+	m_dirty_path = NULL;
+	m_engine = DB_ENGINE_SQLITE;
 	m_archives_path = NULL;
 	m_downloads_path = NULL;
+	m_trash_path = NULL;
+	m_store_path = NULL;
+	m_share_path = NULL;
+	m_store = NULL;
+	m_journal = NULL;
+	m_trash_count = 0;
+	m_fetched_paths = NULL;
+	m_fetched_files = NULL;
+	m_fetched_count = 0;
+	m_staging = NULL;
 	m_build = NULL;
 	m_db = NULL;
 	m_lock_fd = -1;
@@ -73,28 +99,59 @@ Depot::Depot(const char* prefix) {
 	m_is_dirty = false;
 	m_modified_extensions = false;
 	m_modified_xpc_services = false;
+	m_engine = DB_ENGINE_SQLITE;
+	m_trash_count = 0;
+	m_fetched_paths = NULL;
+	m_fetched_files = NULL;
+	m_fetched_count = 0;
+	m_staging = NULL;
+	m_share_path = NULL;
+	m_store = NULL;
 	
 	asprintf(&m_prefix, "%s", prefix);
 	join_path(&m_depot_path, m_prefix, "/.DarwinDepot");
 	join_path(&m_database_path, m_depot_path, "/Database-V100");
+	join_path(&m_log_path, m_depot_path, "/Log-V1");
+	join_path(&m_manifest_path, m_depot_path, "/Manifest-V1");
+	join_path(&m_daemon_path, m_depot_path, "/Daemon-V1");
+	join_path(&m_dirty_path, m_depot_path, "/Dirty-V1");
 	join_path(&m_archives_path, m_depot_path, "/Archives");
 	join_path(&m_downloads_path, m_depot_path, "/Downloads");
+	join_path(&m_trash_path, m_depot_path, "/Trash");
+	join_path(&m_store_path, m_depot_path, "/Store");
+	
+	char* journal_path;
+	join_path(&journal_path, m_depot_path, "/Journal-V1");
+	m_journal = new Journal(journal_path);
+	free(journal_path);
 }
 
 Depot::~Depot() {
-	
-	// XXX: this is expensive, but is it necessary?
-	//this->check_consistency();
-
+	this->unstage();
 	if (m_lock_fd != -1)	this->unlock();
 	delete m_db;
+	delete m_journal;
+	delete m_store;
 	if (m_prefix)           free(m_prefix);
 	if (m_depot_path)	free(m_depot_path);
 	if (m_database_path)	free(m_database_path);
+	if (m_log_path)         free(m_log_path);
+	if (m_manifest_path)	free(m_manifest_path);
+	if (m_daemon_path)	free(m_daemon_path);
+	if (m_dirty_path)	free(m_dirty_path);
 	if (m_archives_path)	free(m_archives_path);
 	if (m_downloads_path)	free(m_downloads_path);
+	if (m_trash_path)	free(m_trash_path);
+	if (m_store_path)	free(m_store_path);
+	if (m_share_path)	free(m_share_path);
+	for (int i = 0; i < m_fetched_count; i++) free(m_fetched_files[i]);
+	free(m_fetched_paths);
+	free(m_fetched_files);
 }
 
+const char*	Depot::database_path()		      { return m_engine == DB_ENGINE_LOG ? m_log_path : m_database_path; }
+const char*	Depot::manifest_path()		      { return m_manifest_path; }
+const char*	Depot::daemon_path()		      { return m_daemon_path; }
 const char*	Depot::archives_path()		      { return m_archives_path; }
 const char*	Depot::downloads_path()		      { return m_downloads_path; }
 const char* Depot::prefix()                   { return m_prefix; }
@@ -102,8 +159,12 @@ bool        Depot::is_dirty()                 { return m_is_dirty; }
 bool        Depot::has_modified_extensions()  { return m_modified_extensions; }
 bool        Depot::has_modified_xpc_services(){ return m_modified_xpc_services; }
 
-int Depot::connect() {
-	m_db = new DarwinupDatabase(m_database_path);
+int Depot::connect(bool writable) {
+	if (m_engine == DB_ENGINE_LOG) {
+		m_db = new DarwinupLogDatabase(m_log_path, writable);
+	} else {
+		m_db = new DarwinupDatabase(m_database_path);
+	}
 	if (!m_db || !m_db->is_connected()) {
 		fprintf(stderr, "Error: unable to connect to database.\n");
 		return DB_ERROR;
@@ -146,15 +207,52 @@ int Depot::create_storage() {
 		perror(m_downloads_path);
 		return res;
 	}
+	
+	res = mkdir(m_trash_path, m_depot_mode);
+	res = chmod(m_trash_path, m_depot_mode);
+	res = chown(m_trash_path, uid, gid);
+	if (res && errno != EEXIST) {
+		perror(m_trash_path);
+		return res;
+	}
+	
+	// point the depot at the object store it was asked to share
+	if (m_share_path) {
+		char link[PATH_MAX];
+		ssize_t len = readlink(m_store_path, link, sizeof(link) - 1);
+		if (len >= 0) link[len] = '\0';
+		if (len == -1 || strcmp(link, m_share_path) != 0) {
+			res = mkdir(m_share_path, m_depot_mode);
+			if (res == 0) {
+				chmod(m_share_path, m_depot_mode);
+				chown(m_share_path, uid, gid);
+			}
+			if (res && errno != EEXIST) {
+				perror(m_share_path);
+				return res;
+			}
+			unlink(m_store_path);
+			res = symlink(m_share_path, m_store_path);
+			if (res) {
+				perror(m_store_path);
+				return res;
+			}
+		}
+	}
 	return DEPOT_OK;
 }
 
+void Depot::share_objects(const char* path) {
+	free(m_share_path);
+	m_share_path = strdup(path);
+}
+
 // Initialize the depot
 int Depot::initialize(bool writable) {
 	int res = 0;
 	
 	// initialization requires all these paths to be set
-	if (!(m_prefix && m_depot_path && m_database_path && 
+	if (!(m_prefix && m_depot_path && m_database_path && m_log_path &&
 		  m_archives_path && m_downloads_path)) {
 		return DEPOT_ERROR;
 	}
@@ -168,6 +266,7 @@ int Depot::initialize(bool writable) {
 		
 		res = this->create_storage();
 		if (res) return res;
+		if (is_directory(m_store_path, true)) m_store = new Store(m_store_path);
 #if __MAC_OS_X_VERSION_MIN_REQUIRED >= 1060				
 		build_number_for_path(&m_build, m_prefix);
 #else 
@@ -176,8 +275,10 @@ int Depot::initialize(bool writable) {
 #endif
 	}
 	
+	this->select_engine();
+	
 	struct stat sb;
-	res = stat(m_database_path, &sb);
+	res = stat(this->database_path(), &sb);
 	if (!writable && res == -1 && (errno == ENOENT || errno == ENOTDIR)) {
 		// depot does not exist
 		return DEPOT_NOT_EXIST; 
@@ -187,12 +288,23 @@ int Depot::initialize(bool writable) {
 		return DEPOT_PERM_DENIED;
 	}
 
-	// take an exclusive lock
-	res = this->lock(LOCK_EX);
+	// take an exclusive lock to change the depot, commands that only
+	// read it can run alongside each other
+	res = this->lock(writable ? LOCK_EX : LOCK_SH);
 	if (res) return res;
 	m_is_locked = 1;			
 		
-	res = this->connect();
+	res = this->connect(writable);
+	
+	// only commands that change the depot say which profile last did
+	if (writable && res == 0 && m_engine != DB_ENGINE_LOG) {
+		res = m_db->record_profile();
+	}
+	
+	// finish whatever an interrupted install or uninstall left behind
+	extern uint32_t dryrun;
+	if (writable && !dryrun && res == 0) res = m_journal->open();
+	if (writable && !dryrun && res == 0) res = this->recover();
 
 	return res;
 }
@@ -201,6 +313,47 @@ int Depot::is_initialized() {
 	return (m_db != NULL);
 }
 
+int Depot::open_manifest(Manifest* manifest) {
+	int res = 0;
+	
+	if (!(m_prefix && m_depot_path && m_database_path && m_log_path &&
+		  m_manifest_path)) {
+		return DEPOT_ERROR;
+	}
+	if (access(m_manifest_path, R_OK)) return DEPOT_ERROR;
+	
+	this->select_engine();
+
+	// a shared lock keeps writers out while we compare the manifest
+	// with the database, the mapping stays valid after that
+	bool locked = m_is_locked;
+	if (!locked) res = this->lock(LOCK_SH);
+	if (res) return res;
+	res = manifest->open(m_manifest_path, this->database_path());
+	if (res) {
+		if (!locked) this->unlock();
+		return res;
+	}
+	m_is_locked = 1;
+	
+	IF_DEBUG("using manifest %s\n", m_manifest_path);
+	return DEPOT_OK;
+}
+
+int Depot::update_manifest() {
+	if (!m_db) return DEPOT_ERROR;
+	
+	if (Manifest::is_current(m_manifest_path, this->database_path())) return DEPOT_OK;
+	
+	int res = Manifest::write(m_manifest_path, this->database_path(), m_db);
+	if (res) {
+		// the manifest is only a cache, read-only commands will use the database
+		IF_DEBUG("unable to update manifest %s\n", m_manifest_path);
+		unlink(m_manifest_path);
+	}
+	return res;
+}
+
 // Unserialize an archive from the database.
 // Find the archive by UUID.
 Archive* Depot::archive(uuid_t uuid) {
@@ -349,19 +502,66 @@ uint64_t Depot::count_archives() {
 	return c;
 }
 
+struct AnalyzeContext {
+	AnalyzeContext(Depot* d, Archive* a, Archive* r, Archive* p, SerialSet* c, int* n) {
+		depot = d;
+		archive = a;
+		rollback = r;
+		replacing = p;
+		carried = c;
+		rollback_files = n;
+		info = FILE_INFO_NONE;
+		fingerprint = NULL;
+		links = NULL;
+	}
+
+	Depot* depot;
+	Archive* archive;
+	Archive* rollback;
+	Archive* replacing; // for upgrade
+	SerialSet* carried; // for upgrade
+	int* rollback_files;
+	uint64_t info;      // of the file analyze_file() saw last
+	CC_SHA1_CTX* fingerprint; // of the root, when it is walked in order
+	HardLinks* links;   // of the root, when it is walked
+};
+
+// worked out on the walker's threads ahead of analyze_file()
+struct AnalyzeEntry {
+	File* file;
+	File* actual;
+	char* actpath;
+};
+
 struct InstallContext {
 	InstallContext(Depot* d, Archive* a) {
+		extern uint32_t durability;
 		depot = d;
 		archive = a;
 		files_modified = 0;
 		files_added = 0;
 		files_removed = 0;
 		files_to_remove = new SerialSet();
+		files_to_carry = new SerialSet();
 		reverse_files = false;
+		resume_path = NULL;
+		resuming = false;
+		output = stdout;
+		planned = false;
+		preceding = NULL;
+		superseded = false;
+		dirty = new Durability(durability);
+		fingerprint = NULL;
+		delta_base = NULL;
+		delta_saved = 0;
+		links = NULL;
+		changed = NULL;
 	}
 	
 	~InstallContext() {
 		delete files_to_remove;
+		delete files_to_carry;
+		delete dirty;
 	}
 	
 	Depot* depot;
@@ -370,7 +570,20 @@ struct InstallContext {
 	uint64_t files_added;
 	uint64_t files_removed;
 	SerialSet* files_to_remove;	// for uninstall
+	SerialSet* files_to_carry;  // for upgrade
 	bool reverse_files; // for uninstall
+	const char* resume_path; // file an interrupted command stopped at
+	bool resuming;           // set while recovering
+	FILE* output; // for files and verify
+	bool planned;     // uninstall_files looked up the next two
+	File* preceding;  // for uninstall
+	bool superseded;  // for uninstall
+	Durability* dirty; // files changed since the last sync
+	CC_SHA1_CTX* fingerprint; // of the files backed up, for sharing them
+	Archive* delta_base;   // for backup, root the rollback data is a delta against
+	uint64_t delta_saved;  // bytes the deltas saved
+	HardLinks* links;      // for backup, files already backed up as links
+	DirtyLog* changed;     // for verify, paths changed since they were compared
 };
 
 int Depot::iterate_archives(ArchiveIteratorFunc func, void* context) {
@@ -410,577 +623,1946 @@ int Depot::iterate_files(Archive* archive, FileIteratorFunc func, void* context)
 	return res;
 }
 
+// Adds a file to the fingerprint of its root: the hash of the path, mode,
+// owner and digest of each file, in the order the Walker visits them.
+static void fingerprint_file(CC_SHA1_CTX* fingerprint, File* file) {
+	CC_SHA1_CTX ctx;
+	CC_SHA1_Init(&ctx);
+	CC_SHA1_Update(&ctx, file->path(), (CC_LONG)strlen(file->path()) + 1);
+	uint32_t meta[3] = { (uint32_t)file->mode(), (uint32_t)file->uid(), 
+						 (uint32_t)file->gid() };
+	CC_SHA1_Update(&ctx, meta, (CC_LONG)sizeof(meta));
+	Digest* digest = file->digest();
+	if (digest) CC_SHA1_Update(&ctx, digest->data(), (CC_LONG)digest->size());
+	uint8_t md[CC_SHA1_DIGEST_LENGTH];
+	CC_SHA1_Final(md, &ctx);
+	CC_SHA1_Update(fingerprint, md, (CC_LONG)sizeof(md));
+}
+
+// The file staged at ent, the links of one inode are only hashed once.
+static File* stage_file(AnalyzeContext* context, WalkEntry* ent) {
+	if (ent->info != WALK_F || !context->links) return FileFactory(context->archive, ent);
+	Digest* digest = context->links->digest(ent->path, &ent->st);
+	return FileFactory(0, context->archive, FILE_INFO_NONE, ent->relpath, ent->st.st_mode,
+					   ent->st.st_uid, ent->st.st_gid, ent->st.st_size, digest);
+}
+
 int Depot::analyze_stage(const char* path, Archive* archive, Archive* rollback,
-						 int* rollback_files) {
-	extern uint32_t force;
-	extern uint32_t dryrun;
-	int res = 0;
+						 Archive* replacing, SerialSet* carried, int* rollback_files) {
 	assert(archive != NULL);
 	assert(rollback != NULL);
 	assert(rollback_files != NULL);
 
 	*rollback_files = 0;
 
-	const char* path_argv[] = { path, NULL };
-	
 	IF_DEBUG("[analyze] analyzing path: %s\n", path);
 
-	FTS* fts = fts_open((char**)path_argv, FTS_PHYSICAL | FTS_COMFOLLOW | FTS_XDEV, fts_compare);
-	FTSENT* ent = fts_read(fts); // throw away the entry for path itself
-	while (res != -1 && (ent = fts_read(fts)) != NULL) {
-		File* file = FileFactory(archive, ent);
-		if (file) {
-			char state = '?';
+	AnalyzeContext context(this, archive, rollback, replacing, carried, rollback_files);
+	CC_SHA1_CTX fingerprint;
+	CC_SHA1_Init(&fingerprint);
+	context.fingerprint = &fingerprint;
+	HardLinks links;
+	context.links = &links;
+	Walker walker(path);
+	// hash the root and the files it replaces on the walker's threads,
+	// analyze_file() still sees every file in order
+	walker.prepare(&Depot::analyze_prepare, &Depot::analyze_release, &context);
+	int res = walker.walk(&Depot::analyze_file, &context);
+	// links to the same inode from outside the root never come along
+	for (HardLink* link = links.first(); res == 0 && link; link = links.next(link)) {
+		if (link->count) res = record_links(&context, link);
+	}
+	if (res == 0) {
+		delete archive->m_fingerprint;
+		archive->m_fingerprint = new SHA1Digest(&fingerprint);
+	}
+	return res;
+}
 
-			IF_DEBUG("[analyze] %s\n", file->path());
+int Depot::analyze_prepare(WalkEntry* ent, void* ctx) {
+	AnalyzeContext* context = (AnalyzeContext*)ctx;
+	if (ent->level == 0) return 0;
+	if (ent->info != WALK_D && ent->info != WALK_F && ent->info != WALK_SL) return 0;
+
+	AnalyzeEntry* entry = (AnalyzeEntry*)malloc(sizeof(AnalyzeEntry));
+	if (!entry) return 0;
+	entry->file = stage_file(context, ent);
+	entry->actpath = NULL;
+	entry->actual = NULL;
+	if (entry->file) {
+		join_path(&entry->actpath, context->depot->prefix(), entry->file->path());
+		entry->actual = FileFactory(entry->actpath);
+	}
+	ent->data = entry;
+	return 0;
+}
 
-			if (strcasestr(file->path(), ".DarwinDepot")) {
-				fprintf(stderr, "Error: Root contains a .DarwinDepot, "
-						"aborting to avoid damaging darwinup metadata.\n");
-				return DEPOT_ERROR;
-			}
+int Depot::analyze_release(WalkEntry* ent, void* ctx) {
+	AnalyzeEntry* entry = (AnalyzeEntry*)ent->data;
+	delete entry->file;
+	delete entry->actual;
+	free(entry->actpath);
+	free(entry);
+	ent->data = NULL;
+	return 0;
+}
 
-			// Perform a three-way-diff between the file to be installed (file),
-			// the file we last installed in this location (preceding),
-			// and the file that actually exists in this location (actual).
-		
-			char* actpath;
-			join_path(&actpath, this->prefix(), file->path());
-			File* actual = FileFactory(actpath);
-			File* preceding = this->file_preceded_by(file);
-			
-			if (actual == NULL) {
-				// No actual file exists already, so we create a placeholder.
-				actual = new NoEntry(file->path());
-				IF_DEBUG("[analyze]    actual == NULL\n");
-			}
-			
-			if (preceding == NULL) {
-				// Nothing is known about this file.
-				// We'll insert this file into the rollback archive as a
-				// base system file.  Back up its data (if not a directory).
-				actual->info_set(FILE_INFO_BASE_SYSTEM);
-				IF_DEBUG("[analyze]    base system\n");
-				if (!S_ISDIR(actual->mode()) && !INFO_TEST(actual->info(), FILE_INFO_NO_ENTRY)) {
-					IF_DEBUG("[analyze]    needs base system backup, and installation\n");
-					actual->info_set(FILE_INFO_ROLLBACK_DATA);
-					file->info_set(FILE_INFO_INSTALL_DATA);
-				}
-				// if actual is a dir and file is not, recurse to save its children
-				if (S_ISDIR(actual->mode()) && !S_ISDIR(file->mode())) {
-					IF_DEBUG("[analyze]    directory being replaced by file, save children\n");
-					const char* sub_argv[] = { actual->path(), NULL };
-					FTS* subfts = fts_open((char**)sub_argv, 
-										   FTS_PHYSICAL | FTS_COMFOLLOW | FTS_XDEV, 
-										   fts_compare);
-					FTSENT* subent = fts_read(subfts); // throw away actual
-					while ((subent = fts_read(subfts)) != NULL) {
-						IF_DEBUG("saving child: %s\n", subent->fts_path);
-						// skip post-order visits
-						if (subent->fts_info == FTS_DP) {
-							continue;
-						}
-						File* subact = FileFactory(subent->fts_path);
-						subact->info_set(FILE_INFO_BASE_SYSTEM);
-						if (subent->fts_info != FTS_D) {
-							IF_DEBUG("saving file data\n");
-							subact->info_set(FILE_INFO_ROLLBACK_DATA);
-						}
-						if (!dryrun) {
-							res = this->insert(rollback, subact);
-						}
-						*rollback_files += 1;
-					}
-				}
-				preceding = actual;
-			}
-		
-			uint32_t actual_flags = File::compare(file, actual);
-			uint32_t preceding_flags = File::compare(actual, preceding);
-			
-			// If file == actual && actual == preceding then nothing needs to be done.
-			if (actual_flags == FILE_INFO_IDENTICAL && preceding_flags == FILE_INFO_IDENTICAL) {
-				state = ' ';
-				IF_DEBUG("[analyze]    no changes\n");
-			}
-			
-			// If file != actual, but actual == preceding, then install file
-			//   but we don't need to save actual, since it's already saved by preceding.
-			//   i.e. no user changes since last installation
-			// If file != actual, and actual != preceding, then install file
-			//  after saving actual in the rollback archive.
-			//  i.e. user changes since last installation
-			if (actual_flags != FILE_INFO_IDENTICAL) {
-				this->m_is_dirty = true;
-				if (INFO_TEST(actual->info(), FILE_INFO_NO_ENTRY)) {
-					state = 'A';
-				} else {
-					if (INFO_TEST(actual_flags, FILE_INFO_TYPE_DIFFERS) && !force) {
-						// the existing file on disk is a different type than what
-						// we are trying to install, so require the force option,
-						// otherwise print an error and bail
-						mode_t file_type = file->mode() & S_IFMT;
-						mode_t actual_type = actual->mode() & S_IFMT;
-						fprintf(stderr, FILE_OBJ_CHANGE_ERROR, actual->path(), 
-								FILE_TYPE_STRING(file_type),
-								FILE_TYPE_STRING(actual_type));
-						return DEPOT_OBJ_CHANGE;
-					}
-					state = 'U';
-				}
-				
-				
-				
-				if (INFO_TEST(actual_flags, FILE_INFO_TYPE_DIFFERS) ||
-				    INFO_TEST(actual_flags, FILE_INFO_DATA_DIFFERS)) {
-					IF_DEBUG("[analyze]    needs installation\n");
-					file->info_set(FILE_INFO_INSTALL_DATA);
-
-					if ((INFO_TEST(preceding_flags, FILE_INFO_TYPE_DIFFERS) ||
-					    INFO_TEST(preceding_flags, FILE_INFO_DATA_DIFFERS)) &&
-					    !INFO_TEST(actual->info(), FILE_INFO_NO_ENTRY)) {
-						IF_DEBUG("[analyze]    needs user data backup\n");
-						actual->info_set(FILE_INFO_ROLLBACK_DATA);
-					}
-				}
-				
-				if (!this->m_modified_extensions && 
-					(strncmp(file->path(), "/System/Library/Extensions", 26) == 0)) {
-					IF_DEBUG("[analyze]    kernel extension detected\n");
-					this->m_modified_extensions = true;
-				}
+int Depot::analyze_file(WalkEntry* ent, void* ctx) {
+	AnalyzeContext* context = (AnalyzeContext*)ctx;
+	Depot* depot = context->depot;
+	extern uint32_t force;
+	extern uint32_t dryrun;
+	int res = 0;
 
-				if (!this->m_modified_xpc_services) {
-					if ((strstr(file->path(), ".xpc/") != NULL) && has_suffix(file->path(), "Info.plist")) {
-						IF_DEBUG("[analyze]    xpc service detected\n");
-						this->m_modified_xpc_services = true;
-					}
+	// the root itself and post-order visits carry nothing to install
+	if (ent->level == 0 || ent->info == WALK_DP) return 0;
 
-					if ((strncmp(file->path(), "/System/Library/Sandbox/Profiles", 32) == 0) ||
-						(has_suffix(file->path(), "framework.sb"))) {
-						IF_DEBUG("[analyze]    profile modification detected\n");
-						this->m_modified_xpc_services = true;
-					}
-				}
-			}
+	AnalyzeEntry* entry = (AnalyzeEntry*)ent->data;
+	File* file = entry ? entry->file : stage_file(context, ent);
+	if (!file) {
+		if (entry) analyze_release(ent, ctx);
+		return 0;
+	}
 
-			// if file == actual, but actual != preceding, then an external
-			// process changed actual to be the same as what we are installing
-			// now (OS upgrade?). We do not need to save actual, but make
-			// a special state so the user knows what happened and does not
-			// get a ?.
-			if (actual_flags == FILE_INFO_IDENTICAL && preceding_flags != FILE_INFO_IDENTICAL) {
-				IF_DEBUG("[analyze]    external changes but file same as actual\n");
-				state = 'E';
-			}
-						
-			if ((state != ' ' && preceding_flags != FILE_INFO_IDENTICAL) ||
-				INFO_TEST(actual->info(), FILE_INFO_BASE_SYSTEM | FILE_INFO_ROLLBACK_DATA)) {
-				*rollback_files += 1;
-				if (!this->has_file(rollback, actual)) {
-					IF_DEBUG("[analyze]    insert rollback\n");
-					if (!dryrun) res = this->insert(rollback, actual);
-				}
-				assert(res == 0);
+	char state = '?';
 
-				if (!INFO_TEST(actual->info(), FILE_INFO_NO_ENTRY)) {
-					// need to save parent directories as well
-					FTSENT *pent = ent->fts_parent;
-					
-					// while we have a valid path that is below the prefix
-					while (pent && pent->fts_level > 0) {
-						File* parent = FileFactory(rollback, pent);
-						
-						// if parent dir does not exist, we are
-						//  generating a rollback of base system
-						//  which does not have matching directories,
-						//  so we can just move on.
-						if (!parent) {
-							IF_DEBUG("[analyze]      parent path not found, skipping parents\n");
-							break;
-						}
-						
-						if (!this->has_file(rollback, parent)) {
-							IF_DEBUG("[analyze]      adding parent to rollback: %s \n", 
-									 parent->path());
-							if (!dryrun) res = this->insert(rollback, parent);
-						}
-						assert(res == 0);
-						pent = pent->fts_parent;
-					}
-				}
-			}
+	IF_DEBUG("[analyze] %s\n", file->path());
 
-			fprintf(stdout, "%c %s\n", state, file->path());
-			if (!dryrun) res = this->insert(archive, file);
-			assert(res == 0);
-			if (preceding && preceding != actual) delete preceding;
-			if (actual) delete actual;
-			free(actpath);
+	if (strcasestr(file->path(), ".DarwinDepot")) {
+		fprintf(stderr, "Error: Root contains a .DarwinDepot, "
+				"aborting to avoid damaging darwinup metadata.\n");
+		if (entry) {
+			analyze_release(ent, ctx);
+		} else {
 			delete file;
 		}
+		return DEPOT_ERROR;
+	}
+	
+	if (context->fingerprint) fingerprint_file(context->fingerprint, file);
+	// and so is which of its files are links to the same data
+	if (context->fingerprint && context->links && ent->info == WALK_F) {
+		const char* first = context->links->remember(file->path(), &ent->st);
+		if (first) CC_SHA1_Update(context->fingerprint, first, (CC_LONG)strlen(first) + 1);
 	}
-	if (fts) fts_close(fts);
-	return res;
-}
-
-int Depot::backup_file(File* file, void* ctx) {
-	InstallContext* context = (InstallContext*)ctx;
-	int res = 0;
-
-	IF_DEBUG("[backup] backup_file: %s , %s \n", file->path(), context->archive->m_name);
-
-	if (INFO_TEST(file->info(), FILE_INFO_ROLLBACK_DATA)) {
-		char *path;        // the file's path
-		char *dstpath;     // the path inside the archives
-		char *relpath;     // the file's path minus the destination prefix
-		char *uuidpath;    // archives path plus the uuid
-		char uuidstr[37];
 
-		// If we're going to need to squirrel away data, create
-		// the directory hierarchy now.
-		char backup_path[PATH_MAX];
-		char* backup_dirpath;
+	// Perform a three-way-diff between the file to be installed (file),
+	// the file we last installed in this location (preceding),
+	// and the file that actually exists in this location (actual).
 
-		// we need the path minus our destination prefix for moving to the archive
-		IF_DEBUG("[backup] file->path() = %s \n", file->path());
-		strlcpy(backup_path, file->path(), sizeof(backup_path));
-		IF_DEBUG("[backup] backup_path = %s \n", backup_path);
-			
-		const char* dir = dirname(backup_path);
-		assert(dir != NULL);
-		IF_DEBUG("[backup] dir = %s \n", dir);
+	char* actpath = entry ? entry->actpath : NULL;
+	File* actual = entry ? entry->actual : NULL;
+	if (!entry) {
+		join_path(&actpath, depot->prefix(), file->path());
+		actual = FileFactory(actpath);
+	}
+	free(entry);
+	File* preceding = depot->file_preceded_by(file);
+	
+	if (actual == NULL) {
+		// No actual file exists already, so we create a placeholder.
+		actual = new NoEntry(file->path());
+		IF_DEBUG("[analyze]    actual == NULL\n");
+	}
+	
+	if (preceding == NULL) {
+		// Nothing is known about this file.
+		// We'll insert this file into the rollback archive as a
+		// base system file.  Back up its data (if not a directory).
+		actual->info_set(FILE_INFO_BASE_SYSTEM);
+		IF_DEBUG("[analyze]    base system\n");
+		if (!S_ISDIR(actual->mode()) && !INFO_TEST(actual->info(), FILE_INFO_NO_ENTRY)) {
+			IF_DEBUG("[analyze]    needs base system backup, and installation\n");
+			actual->info_set(FILE_INFO_ROLLBACK_DATA);
+			file->info_set(FILE_INFO_INSTALL_DATA);
+		}
+		// if actual is a dir and file is not, recurse to save its children
+		if (S_ISDIR(actual->mode()) && !S_ISDIR(file->mode())) {
+			IF_DEBUG("[analyze]    directory being replaced by file, save children\n");
+			Walker subwalker(actual->path());
+			res = subwalker.walk(&Depot::analyze_child, context);
+		}
+		preceding = actual;
+	}
 
-		uuid_unparse_upper(context->archive->uuid(), uuidstr);
-		asprintf(&uuidpath, "%s/%s", context->depot->m_archives_path, uuidstr);
-		assert(uuidpath != NULL);
-		IF_DEBUG("[backup] uuidpath = %s \n", uuidpath);
-		join_path(&backup_dirpath, uuidpath, dir);
-		assert(backup_dirpath != NULL);
-		
-		IF_DEBUG("mkdir_p: %s\n", backup_dirpath);
-		res = mkdir_p(backup_dirpath);
-		if (res != 0 && errno != EEXIST) {
-			fprintf(stderr, "%s:%d: %s: %s (%d)\n", 
-					__FILE__, __LINE__, backup_dirpath, strerror(errno), errno);
+	uint32_t actual_flags = File::compare(file, actual);
+	uint32_t preceding_flags = File::compare(actual, preceding);
+	
+	// If file == actual && actual == preceding then nothing needs to be done.
+	if (actual_flags == FILE_INFO_IDENTICAL && preceding_flags == FILE_INFO_IDENTICAL) {
+		state = ' ';
+		IF_DEBUG("[analyze]    no changes\n");
+	}
+	
+	// If file != actual, but actual == preceding, then install file
+	//   but we don't need to save actual, since it's already saved by preceding.
+	//   i.e. no user changes since last installation
+	// If file != actual, and actual != preceding, then install file
+	//  after saving actual in the rollback archive.
+	//  i.e. user changes since last installation
+	if (actual_flags != FILE_INFO_IDENTICAL) {
+		depot->m_is_dirty = true;
+		if (INFO_TEST(actual->info(), FILE_INFO_NO_ENTRY)) {
+			state = 'A';
 		} else {
-			res = 0;
+			if (INFO_TEST(actual_flags, FILE_INFO_TYPE_DIFFERS) && !force) {
+				// the existing file on disk is a different type than what
+				// we are trying to install, so require the force option,
+				// otherwise print an error and bail
+				mode_t file_type = file->mode() & S_IFMT;
+				mode_t actual_type = actual->mode() & S_IFMT;
+				fprintf(stderr, FILE_OBJ_CHANGE_ERROR, actual->path(), 
+						FILE_TYPE_STRING(file_type),
+						FILE_TYPE_STRING(actual_type));
+				return DEPOT_OBJ_CHANGE;
+			}
+			state = 'U';
 		}
 		
-		// we need the path minus our destination path for moving to the archive
-		size_t prefixlen = strlen(context->depot->m_prefix);
-		if (strncmp(context->archive->m_name, "<Rollback>", strlen("<Rollback>")) == 0) {
-		  join_path(&path, context->depot->m_prefix, file->path());
-		} else {
-		  asprintf(&path, "%s", file->path());
+		
+		
+		if (INFO_TEST(actual_flags, FILE_INFO_TYPE_DIFFERS) ||
+		    INFO_TEST(actual_flags, FILE_INFO_DATA_DIFFERS)) {
+			IF_DEBUG("[analyze]    needs installation\n");
+			file->info_set(FILE_INFO_INSTALL_DATA);
+
+			if ((INFO_TEST(preceding_flags, FILE_INFO_TYPE_DIFFERS) ||
+			    INFO_TEST(preceding_flags, FILE_INFO_DATA_DIFFERS)) &&
+			    !INFO_TEST(actual->info(), FILE_INFO_NO_ENTRY)) {
+				IF_DEBUG("[analyze]    needs user data backup\n");
+				actual->info_set(FILE_INFO_ROLLBACK_DATA);
+			}
 		}
-		relpath = path;
-		if (strncmp(path, context->depot->m_prefix, prefixlen) == 0) {
-		        relpath += prefixlen - 1;
+		
+		if (!depot->m_modified_extensions && 
+			(strncmp(file->path(), "/System/Library/Extensions", 26) == 0)) {
+			IF_DEBUG("[analyze]    kernel extension detected\n");
+			depot->m_modified_extensions = true;
 		}
 
-		join_path(&dstpath, uuidpath, relpath);
-		assert(dstpath != NULL);
-
-		IF_DEBUG("[backup] path = %s \n", path);
-		IF_DEBUG("[backup] relpath = %s \n", relpath);
-		IF_DEBUG("[backup] dstpath = %s \n", dstpath);
-
+		if (!depot->m_modified_xpc_services) {
+			if ((strstr(file->path(), ".xpc/") != NULL) && has_suffix(file->path(), "Info.plist")) {
+				IF_DEBUG("[analyze]    xpc service detected\n");
+				depot->m_modified_xpc_services = true;
+			}
 
-		++context->files_modified;
+			if ((strncmp(file->path(), "/System/Library/Sandbox/Profiles", 32) == 0) ||
+				(has_suffix(file->path(), "framework.sb"))) {
+				IF_DEBUG("[analyze]    profile modification detected\n");
+				depot->m_modified_xpc_services = true;
+			}
+		}
+	}
 
-		// XXX: res = file->backup()
-		IF_DEBUG("[backup] copyfile(%s, %s)\n", path, dstpath);
-		res = copyfile(path, dstpath, NULL, COPYFILE_ALL|COPYFILE_NOFOLLOW);
+	// if file == actual, but actual != preceding, then an external
+	// process changed actual to be the same as what we are installing
+	// now (OS upgrade?). We do not need to save actual, but make
+	// a special state so the user knows what happened and does not
+	// get a ?.
+	if (actual_flags == FILE_INFO_IDENTICAL && preceding_flags != FILE_INFO_IDENTICAL) {
+		IF_DEBUG("[analyze]    external changes but file same as actual\n");
+		state = 'E';
+	}
+				
+	if ((state != ' ' && preceding_flags != FILE_INFO_IDENTICAL) ||
+		INFO_TEST(actual->info(), FILE_INFO_BASE_SYSTEM | FILE_INFO_ROLLBACK_DATA)) {
+		*context->rollback_files += 1;
+		if (!depot->has_file(context->rollback, actual)) {
+			IF_DEBUG("[analyze]    insert rollback\n");
+			if (!dryrun) res = depot->insert(context->rollback, actual);
+		}
+		assert(res == 0);
 
-		if (res != 0) fprintf(stderr, "%s:%d: backup failed: %s: %s (%d)\n", 
-							  __FILE__, __LINE__, dstpath, strerror(errno), errno);
+		if (!INFO_TEST(actual->info(), FILE_INFO_NO_ENTRY)) {
+			// need to save parent directories as well
+			WalkEntry* pent = ent->parent;
+			
+			// while we have a valid path that is below the prefix
+			while (pent && pent->level > 0) {
+				File* parent = FileFactory(context->rollback, pent);
+				
+				// if parent dir does not exist, we are
+				//  generating a rollback of base system
+				//  which does not have matching directories,
+				//  so we can just move on.
+				if (!parent) {
+					IF_DEBUG("[analyze]      parent path not found, skipping parents\n");
+					break;
+				}
+				
+				if (!depot->has_file(context->rollback, parent)) {
+					IF_DEBUG("[analyze]      adding parent to rollback: %s \n", 
+							 parent->path());
+					if (!dryrun) res = depot->insert(context->rollback, parent);
+				}
+				assert(res == 0);
+				pent = pent->parent;
+			}
+		}
+	}
 
-		// XXX: we cant propagate error from callback, but its safe to die here
-		assert(res == 0);
-		
-		free(path);
-		free(dstpath);
-		free(uuidpath);
-		free(backup_dirpath);
+	// an unchanged file of the archive being upgraded keeps its record,
+	// which is handed over to the new archive when it is activated
+	bool carry = (context->replacing && state == ' ' && preceding != actual &&
+				  preceding->archive() && 
+				  preceding->archive()->serial() == context->replacing->serial());
+
+	context->info = file->info();
+	HardLink* link = context->links ? context->links->group(&ent->st) : NULL;
+	if (link) {
+		res = analyze_link(context, link, file, actpath, state, 
+						   carry ? preceding->serial() : 0);
+		file = NULL;
+	} else {
+		fprintf(stdout, "%c %s\n", state, file->path());
+		if (!dryrun && carry) {
+			IF_DEBUG("[analyze]    carried over from %s\n", context->replacing->name());
+			res = context->carried->append(preceding->serial());
+		} else if (!dryrun) {
+			res = depot->insert(context->archive, file);
+		}
 	}
+	assert(res == 0);
+	if (preceding && preceding != actual) delete preceding;
+	if (actual) delete actual;
+	free(actpath);
+	delete file;
 	return res;
 }
 
-
-int Depot::install_file(File* file, void* ctx) {
-	InstallContext* context = (InstallContext*)ctx;
-	int res = 0;
-
-	// Strip the quarantine xattr off all files to avoid them being rendered useless.
-	if (file->unquarantine(context->depot->m_archives_path) != 0) {
-		fprintf(stderr, "Error: unable to unquarantine file in staging area.\n");
+int Depot::analyze_link(void* ctx, HardLink* link, File* file, const char* actpath,
+						char state, uint64_t carry) {
+	AnalyzeContext* context = (AnalyzeContext*)ctx;
+	
+	file->info_set(FILE_INFO_HARDLINK);
+	if (INFO_TEST(file->info(), FILE_INFO_INSTALL_DATA)) link->install = true;
+	
+	// the installed links have to be links to each other too
+	struct stat sb;
+	if (lstat(actpath, &sb) == -1) {
+		link->split = true;
+	} else if (!link->has_actual) {
+		link->has_actual = true;
+		link->actual_dev = sb.st_dev;
+		link->actual_ino = sb.st_ino;
+	} else if (sb.st_dev != link->actual_dev || sb.st_ino != link->actual_ino) {
+		link->split = true;
+	}
+	
+	HardLinkMember* members = (HardLinkMember*)realloc(link->members, 
+										(link->count + 1) * sizeof(HardLinkMember));
+	if (!members) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		delete file;
 		return DEPOT_ERROR;
 	}
+	link->members = members;
+	link->members[link->count].file = file;
+	link->members[link->count].state = state;
+	link->members[link->count].carry = carry;
+	link->count++;
+	
+	if (link->count < link->nlink) return DEPOT_OK;
+	return record_links(context, link);
+}
 
-	if (INFO_TEST(file->info(), FILE_INFO_INSTALL_DATA)) {
-		++context->files_modified;
-
-		res = file->install(context->depot->m_archives_path,
-                        context->depot->m_prefix,
-                        context->reverse_files);
-	} else {
-		res = file->install_info(context->depot->m_prefix);
+int Depot::record_links(void* ctx, HardLink* link) {
+	AnalyzeContext* context = (AnalyzeContext*)ctx;
+	extern uint32_t dryrun;
+	int res = DEPOT_OK;
+	
+	// the staged links are renamed into place together, so that they
+	// are one inode again once installed
+	bool install = link->install || link->split;
+	for (uint32_t i = 0; i < link->count; i++) {
+		HardLinkMember* member = &link->members[i];
+		File* file = member->file;
+		if (install && !INFO_TEST(file->info(), FILE_INFO_INSTALL_DATA)) {
+			IF_DEBUG("[analyze]    %s installs with its links\n", file->path());
+			file->info_set(FILE_INFO_INSTALL_DATA);
+			context->depot->m_is_dirty = true;
+			member->state = 'U';
+			member->carry = 0;
+		}
+		fprintf(stdout, "%c %s\n", member->state, file->path());
+		if (res == 0 && !dryrun && member->carry) {
+			IF_DEBUG("[analyze]    carried over from %s\n", context->replacing->name());
+			res = context->carried->append(member->carry);
+		} else if (res == 0 && !dryrun) {
+			res = context->depot->insert(context->archive, file);
+		}
+		delete file;
 	}
-	if (res != 0) fprintf(stderr, "%s:%d: install failed: %s: %s (%d)\n", 
-						  __FILE__, __LINE__, file->path(), strerror(errno), errno);
+	link->count = 0;
 	return res;
 }
 
+int Depot::analyze_child(WalkEntry* ent, void* ctx) {
+	AnalyzeContext* context = (AnalyzeContext*)ctx;
+	extern uint32_t dryrun;
+	int res = 0;
 
-int Depot::install(const char* path) {
-	int res = 0;
-	char uuid[37];
-	Archive* archive = ArchiveFactory(path, this->downloads_path());
-	if (archive) {
-		res = this->install(archive);
-		if (res == 0) {
-			fprintf(stdout, "Installed archive: %llu %s \n", 
-					archive->serial(), archive->name());
-			uuid_unparse_upper(archive->uuid(), uuid);
-			fprintf(stdout, "%s\n", uuid);
-		} else {
-			fprintf(stderr, "Error: Install failed.\n");				
-			if (res != DEPOT_OBJ_CHANGE && res != DEPOT_PREINSTALL_ERR) {
-				// object change errors come from analyze stage,
-				// and pre-install errors happen early,
-				// so there is no installation to roll back
-				fprintf(stderr, "Rolling back installation.\n");
-				res = this->uninstall(archive);
-				if (res) {
-					fprintf(stderr, "Error: Unable to rollback installation. "
-							"Your system is in an inconsistent state! File a bug!\n");
-				} else {
-					fprintf(stdout, "Rollback successful.\n");
-				}
-			}
-			res = DEPOT_ERROR;
-		}
-	} else {
-		fprintf(stdout, "Error: unable to load \"%s\". Either the path is missing, invalid or"
-				         " the file is in an unknown format.\n", path);
-		return DEPOT_ERROR;
+	// skip the directory being replaced, it is saved by analyze_file()
+	if (ent->level == 0) return 0;
+
+	IF_DEBUG("saving child: %s\n", ent->path);
+	// skip post-order visits
+	if (ent->info == WALK_DP) return 0;
+	File* subact = FileFactory(ent->path);
+	subact->info_set(FILE_INFO_BASE_SYSTEM);
+	if (ent->info != WALK_D) {
+		IF_DEBUG("saving file data\n");
+		subact->info_set(FILE_INFO_ROLLBACK_DATA);
 	}
-
+	if (!dryrun) {
+		res = context->depot->insert(context->rollback, subact);
+	}
+	*context->rollback_files += 1;
 	return res;
 }
 
+// Opens the directory in stage that relpath goes in, without following
+// symlinks, and sets name to the last component of relpath. Entries are
+// only made relative to it, so a stream that puts a symlink where a 
+// directory goes cannot get anything written outside of the stage.
+static int stream_parent(const char* stage, const char* relpath, const char** name) {
+	int fd = open(stage, O_RDONLY | O_DIRECTORY);
+	const char* p = relpath;
+	while (*p == '/') p++;
+	const char* slash;
+	while (fd != -1 && (slash = strchr(p, '/'))) {
+		char* part = strndup(p, slash - p);
+		int sub = part ? openat(fd, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW) : -1;
+		int saved = part ? errno : ENOMEM;
+		free(part);
+		close(fd);
+		errno = saved;
+		fd = sub;
+		p = slash + 1;
+		while (*p == '/') p++;
+	}
+	if (fd == -1 && (errno == ELOOP || errno == ENOTDIR)) {
+		fprintf(stderr, "Error: %s is below something in the stream that is not "
+				"a directory\n", relpath);
+		errno = ENOTDIR;
+	}
+	*name = p;
+	return fd;
+}
 
-int Depot::install(Archive* archive) {
-	extern uint32_t dryrun;
+// A directory above the stream entries being analyzed, where
+// analyze_file() expects to find it through WalkEntry::parent.
+static WalkEntry* stream_directory(WalkEntry* parent, const char* stage, 
+								   const char* relpath) {
+	WalkEntry* ent = (WalkEntry*)calloc(1, sizeof(WalkEntry));
+	if (!ent) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		return NULL;
+	}
+	ent->parent = parent;
+	ent->level = parent ? parent->level + 1 : 0;
+	ent->info = WALK_D;
+	ent->relpath = strdup(relpath);
+	join_path(&ent->path, stage, relpath);
+	ent->name = strrchr(ent->path, '/') + 1;
 	int res = 0;
-	Archive* rollback = new RollbackArchive();
-
-	if (this->m_build) {
-		rollback->m_build = strdup(this->m_build);
-		archive->m_build = strdup(this->m_build);
+	if (relpath[0] == '\0') {
+		res = lstat(ent->path, &ent->st);
+	} else {
+		const char* name;
+		int fd = stream_parent(stage, relpath, &name);
+		res = (fd == -1) ? -1 : fstatat(fd, name, &ent->st, AT_SYMLINK_NOFOLLOW);
+		int saved = errno;
+		if (fd != -1) close(fd);
+		errno = saved;
 	}
-	
-	assert(rollback != NULL);
-	assert(archive != NULL);
-
-	if (res != 0) return res;
-
-	//
-	// The fun starts here
-	//
-	if (!dryrun && res == 0) res = this->begin_transaction();	
+	// what comes below it would go wherever a symlink points
+	if (res == 0 && !S_ISDIR(ent->st.st_mode)) {
+		fprintf(stderr, "Error: %s in the stream is not a directory\n", relpath);
+		errno = ENOTDIR;
+		res = -1;
+	}
+	if (res == -1) {
+		fprintf(stderr, "%s:%d: %s: %s (%d)\n", __FILE__, __LINE__, ent->path, 
+				strerror(errno), errno);
+		free(ent->path);
+		free((char*)ent->relpath);
+		free(ent);
+		return NULL;
+	}
+	return ent;
+}
 
-	//
-	// Insert the rollback archive before the new archive to install, thus keeping
-	// the chronology of the serial numbers correct.  We may later choose to delete
-	// the rollback archive if we determine that it was not necessary.
-	//
-	if (!dryrun && res == 0) res = this->insert(rollback);
-	if (!dryrun && res == 0) res = this->insert(archive);
+// frees dir and returns its parent
+static WalkEntry* stream_leave(WalkEntry* dir) {
+	WalkEntry* parent = dir->parent;
+	free(dir->path);
+	free((char*)dir->relpath);
+	free(dir);
+	return parent;
+}
 
-	//
-	// Create the stage directory and rollback backing store directories
-	//
-	char* archive_path = archive->create_directory(m_archives_path);
-	assert(archive_path != NULL);
-	char* rollback_path = rollback->create_directory(m_archives_path);
-	assert(rollback_path != NULL);
+// whether relpath is below the directory dir
+static bool stream_is_below(const char* relpath, WalkEntry* dir) {
+	size_t len = strlen(dir->relpath);
+	return strncmp(relpath, dir->relpath, len) == 0 && relpath[len] == '/';
+}
 
-	// Extract the archive into its backing store directory
-	if (res == 0) res = archive->extract(archive_path);
+static int stream_error(const char* path) {
+	fprintf(stderr, "%s:%d: %s: %s (%d)\n", __FILE__, __LINE__, path, 
+			strerror(errno), errno);
+	return -1;
+}
 
-	// Analyze the files in the archive backing store directory
-	// Inserts new file records into the database for both the new archive being
-	// installed and the rollback archive.
-	int rollback_files = 0;
-	if (res == 0) res = this->analyze_stage(archive_path, archive, rollback, &rollback_files);
-	
-	// we can stop now if analyze failed or this is a dry run
-	if (res || dryrun) {
-		remove_directory(archive_path);
-		remove_directory(rollback_path);
-		free(rollback_path);
-		free(archive_path);
-		if (!dryrun && res) {
-			this->rollback_transaction();
-			return DEPOT_PREINSTALL_ERR;
-		}
-		return res;
-	}
+// Digests the data of a regular file in the stream while comparing it
+// with the installed file at actpath. Only once they differ is the file
+// written to stage, starting with the part that matched.
+static int stream_regular(StreamArchive* stream, StreamEntry* sent, const char* relpath,
+						  int dirfd, const char* name, const char* stage, 
+						  const char* actpath, File** file, File** actual, bool* staged) {
+	int res = 0;
+	CC_SHA1_CTX ctx;
+	CC_SHA1_Init(&ctx);
 	
-	// If no files were added to the rollback archive, delete the rollback archive.
-	if (res == 0 && rollback_files == 0) {
-		res = this->remove(rollback);
+	struct stat sb;
+	int actfd = -1;
+	if (lstat(actpath, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size == sent->size) {
+		actfd = open(actpath, O_RDONLY);
 	}
-
-	// Commit the archive and its list of files to the database.
-	// Note that the archive's "active" flag is still not set.
-	if (res == 0) {
-		res = this->commit_transaction();
-	} else {
-		this->rollback_transaction();
+	int fd = -1;
+	if (actfd == -1) {
+		unlinkat(dirfd, name, 0);
+		fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+		if (fd == -1) res = stream_error(stage);
 	}
-
-	// Save a copy of the backing store directory now, we will soon
-	// be moving the files into place.
-	if (res == 0) res = archive->compact_directory(m_archives_path);
-
-	//
-	// Move files from the root file system to the rollback archive's backing store,
-	// then move files from the archive backing directory to the root filesystem
-	//
-	InstallContext rollback_context(this, rollback);
-	if (res == 0) res = this->iterate_files(rollback, &Depot::backup_file, &rollback_context);
-
-	// compact the rollback archive (if we actually added any files)
-	if (rollback_context.files_modified > 0) {
-		if (res == 0) res = rollback->compact_directory(m_archives_path);
+	
+	uint8_t buf[32768];
+	uint8_t cmp[32768];
+	off_t offset = 0;
+	while (res == 0) {
+		ssize_t n = stream->read(buf, sizeof(buf));
+		if (n <= 0) {
+			if (n == -1) res = -1;
+			break;
+		}
+		CC_SHA1_Update(&ctx, buf, (CC_LONG)n);
+		if (actfd != -1 && (pread_all(actfd, cmp, n, offset) != n || 
+							memcmp(buf, cmp, n) != 0)) {
+			IF_DEBUG("[analyze]    %s differs at %lld\n", sent->path, (long long)offset);
+			unlinkat(dirfd, name, 0);
+			fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+			if (fd == -1) res = stream_error(stage);
+			for (off_t done = 0; res == 0 && done < offset; ) {
+				size_t len = (size_t)(offset - done < (off_t)sizeof(cmp) ? 
+									  offset - done : (off_t)sizeof(cmp));
+				if (pread_all(actfd, cmp, len, done) != (ssize_t)len ||
+					write_all(fd, cmp, len)) {
+					res = stream_error(stage);
+				}
+				done += len;
+			}
+			close(actfd);
+			actfd = -1;
+		}
+		if (res == 0 && fd != -1 && write_all(fd, buf, n)) res = stream_error(stage);
+		offset += n;
 	}
-
-	InstallContext install_context(this, archive);
-	if (res == 0) res = this->iterate_files(archive, &Depot::install_file, &install_context);
-
-	// Installation is complete.  Activate the archive in the database.
-	if (res == 0) res = this->begin_transaction();
-	if (res == 0) {
-		res = this->m_db->activate_archive(rollback->serial());
-		if (res) this->rollback_transaction();
+	
+	if (fd != -1) {
+		struct timeval times[2] = { { sent->mtime, 0 }, { sent->mtime, 0 } };
+		if (res == 0 && fchmod(fd, sent->mode & ALLPERMS)) res = stream_error(stage);
+		if (res == 0 && fchown(fd, sent->uid, sent->gid)) res = stream_error(stage);
+		if (res == 0 && futimes(fd, times)) res = stream_error(stage);
+		close(fd);
+		*staged = true;
 	}
+	
 	if (res == 0) {
-		res = this->m_db->activate_archive(archive->serial());
-		if (res) this->rollback_transaction();
+		*file = FileFactory(0, stream, FILE_INFO_NONE, relpath, sent->mode, 
+							sent->uid, sent->gid, sent->size, new SHA1Digest(&ctx));
+		// the installed file was just read, so it keeps the same digest
+		*actual = (actfd != -1) ? FileFactory(actpath, new SHA1Digest(&ctx)) 
+			                    : FileFactory(actpath);
 	}
-	if (res == 0) res = this->commit_transaction();
-
-	// Remove the stage and rollback directories (save disk space)
-	remove_directory(archive_path);
-	remove_directory(rollback_path);
-	free(rollback_path);
-	free(archive_path);
-
+	if (actfd != -1) close(actfd);
 	return res;
 }
 
-// deletes expanded backing store directories in m_archives_path
-int Depot::prune_directories() {
-	int res = 0;
+int Depot::analyze_stream(StreamArchive* stream, const char* path, Archive* rollback,
+						  Archive* replacing, SerialSet* carried, int* rollback_files) {
+	assert(stream != NULL);
+	assert(rollback != NULL);
+	assert(rollback_files != NULL);
+	
+	*rollback_files = 0;
 	
-	const char* path_argv[] = { m_archives_path, NULL };
+	IF_DEBUG("[analyze] analyzing stream staged in: %s\n", path);
 	
-	FTS* fts = fts_open((char**)path_argv, FTS_PHYSICAL | FTS_COMFOLLOW | FTS_XDEV, fts_compare);
-	FTSENT* ent = fts_read(fts); // get the entry for m_archives_path itself
-	ent = fts_children(fts, 0);
-	while (res != -1 && ent != NULL) {
-		if (ent->fts_info == FTS_D) {
-			char path[PATH_MAX];
-			snprintf(path, PATH_MAX, "%s/%s", m_archives_path, ent->fts_name);
-			res = remove_directory(path);
+	AnalyzeContext context(this, stream, rollback, replacing, carried, rollback_files);
+	WalkEntry* dir = stream_directory(NULL, path, "");
+	if (!dir) return DEPOT_ERROR;
+	
+	StreamEntry sent;
+	int res = 0;
+	while (res == 0 && (res = stream->next(&sent)) == 1) {
+		res = 0;
+		// the root itself carries nothing to install
+		if (sent.path[0] == '\0') continue;
+		
+		char* relpath = NULL;
+		asprintf(&relpath, "/%s", sent.path);
+		if (!relpath) {
+			fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+			res = DEPOT_ERROR;
+			break;
+		}
+		
+		// tar(1) writes directories before what is in them, so only the
+		// directories above the last entry have to be remembered
+		while (dir->level > 0 && !stream_is_below(relpath, dir)) dir = stream_leave(dir);
+		
+		// directories the stream left out are created the way tar(1)
+		// would, and analyzed like any other
+		char* slash;
+		while (res == 0 && (slash = strchr(relpath + strlen(dir->relpath) + 1, '/'))) {
+			*slash = '\0';
+			const char* name;
+			int dirfd = stream_parent(path, relpath, &name);
+			bool created = (dirfd != -1 && mkdirat(dirfd, name, 0777) == 0);
+			if (dirfd != -1) close(dirfd);
+			WalkEntry* sub = stream_directory(dir, path, relpath);
+			if (!sub) {
+				res = DEPOT_ERROR;
+			} else {
+				dir = sub;
+				if (created) res = analyze_file(dir, &context);
+			}
+			*slash = '/';
+		}
+		
+		if (res == 0) res = this->analyze_stream_entry(stream, &sent, dir, path, &context);
+		
+		// and what comes next is probably in this directory
+		if (res == 0 && S_ISDIR(sent.mode)) {
+			WalkEntry* sub = stream_directory(dir, path, relpath);
+			if (sub) {
+				dir = sub;
+			} else {
+				res = DEPOT_ERROR;
+			}
 		}
-		ent = ent->fts_link;
+		free(relpath);
 	}
-	if (fts) fts_close(fts);
+	while (dir) dir = stream_leave(dir);
 	return res;
 }
 
-// delete the unexpanded tarball from archives storage
-int Depot::prune_archive(Archive* archive) {
+int Depot::analyze_stream_entry(StreamArchive* stream, StreamEntry* sent, 
+								WalkEntry* parent, const char* path, void* ctx) {
+	AnalyzeContext* context = (AnalyzeContext*)ctx;
+	extern uint32_t dryrun;
 	int res = 0;
 	
-	// clean up database
-	res = this->m_db->delete_empty_archives();
-	if (res) {
-		fprintf(stderr, "Error: unable to prune archives from database.\n");
-		return res;
+	WalkEntry ent;
+	memset(&ent, 0, sizeof(ent));
+	ent.parent = parent;
+	ent.level = parent->level + 1;
+	char* relpath = NULL;
+	asprintf(&relpath, "/%s", sent->path);
+	ent.relpath = relpath;
+	join_path(&ent.path, path, relpath);
+	ent.name = strrchr(ent.path, '/') + 1;
+	
+	char* actpath = NULL;
+	join_path(&actpath, m_prefix, relpath);
+	
+	const char* name;
+	int dirfd = stream_parent(path, relpath, &name);
+	
+	if (dirfd == -1) {
+		res = stream_error(ent.path);
+	} else if (S_ISDIR(sent->mode)) {
+		// a directory that was created for the entries in it before it
+		// came along was already analyzed
+		ent.info = WALK_D;
+		if (mkdirat(dirfd, name, 0700) == 0) {
+			if (fchmodat(dirfd, name, sent->mode & ALLPERMS, 0) || 
+				fchownat(dirfd, name, sent->uid, sent->gid, AT_SYMLINK_NOFOLLOW) ||
+				fstatat(dirfd, name, &ent.st, AT_SYMLINK_NOFOLLOW) == -1) {
+				res = stream_error(ent.path);
+			}
+			if (res == 0) res = analyze_file(&ent, context);
+		} else if (errno != EEXIST) {
+			res = stream_error(ent.path);
+		}
+	} else if (S_ISLNK(sent->mode)) {
+		ent.info = WALK_SL;
+		unlinkat(dirfd, name, 0);
+		if (symlinkat(sent->linkpath ? sent->linkpath : "", dirfd, name) == -1) {
+			res = stream_error(ent.path);
+		}
+		if (res == 0 && fchownat(dirfd, name, sent->uid, sent->gid, AT_SYMLINK_NOFOLLOW)) {
+			res = stream_error(ent.path);
+		}
+		if (res == 0 && fstatat(dirfd, name, &ent.st, AT_SYMLINK_NOFOLLOW) == -1) {
+			res = stream_error(ent.path);
+		}
+		if (res == 0) res = analyze_file(&ent, context);
+	} else if (S_ISREG(sent->mode) && sent->type == '1') {
+		// a hard link to a file that was not staged is a copy of the
+		// installed file it matched, one through a symlink in the stage
+		// is refused like tar(1) does
+		const char* linkpath = sent->linkpath ? sent->linkpath : "";
+		const char* target = NULL;
+		int targetfd = stream_parent(path, linkpath, &target);
+		struct stat sb;
+		bool missing = false;
+		bool found = false;
+		if (targetfd == -1) {
+			missing = (errno == ENOENT);
+		} else if (fstatat(targetfd, target, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+			missing = (errno == ENOENT);
+		} else if (S_ISREG(sb.st_mode)) {
+			found = true;
+		} else {
+			fprintf(stderr, "Error: %s links to %s, which is not a file\n", 
+					relpath, linkpath);
+			errno = EINVAL;
+		}
+		
+		ent.info = WALK_F;
+		unlinkat(dirfd, name, 0);
+		if (linkpath[0] == '\0') {
+			fprintf(stderr, "Error: %s is a hard link to nothing\n", relpath);
+			res = DEPOT_ERROR;
+		} else if (missing) {
+			char* acttarget = NULL;
+			join_path(&acttarget, m_prefix, linkpath);
+			if (copyfile(acttarget, ent.path, NULL, COPYFILE_ALL|COPYFILE_NOFOLLOW) ||
+				fchmodat(dirfd, name, sent->mode & ALLPERMS, 0) ||
+				fchownat(dirfd, name, sent->uid, sent->gid, AT_SYMLINK_NOFOLLOW)) {
+				res = stream_error(ent.path);
+			}
+			free(acttarget);
+		} else if (!found || linkat(targetfd, target, dirfd, name, 0) == -1) {
+			res = stream_error(ent.path);
+		}
+		if (targetfd != -1) close(targetfd);
+		if (res == 0 && fstatat(dirfd, name, &ent.st, AT_SYMLINK_NOFOLLOW) == -1) {
+			res = stream_error(ent.path);
+		}
+		if (res == 0) res = analyze_file(&ent, context);
+	} else if (S_ISREG(sent->mode)) {
+		bool staged = false;
+		AnalyzeEntry* entry = (AnalyzeEntry*)calloc(1, sizeof(AnalyzeEntry));
+		if (!entry) {
+			fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+			res = DEPOT_ERROR;
+		} else {
+			res = stream_regular(stream, sent, relpath, dirfd, name, ent.path, actpath, 
+								 &entry->file, &entry->actual, &staged);
+		}
+		if (res == 0 && entry->file) {
+			ent.info = WALK_F;
+			ent.st.st_mode = sent->mode;
+			ent.st.st_uid = sent->uid;
+			ent.st.st_gid = sent->gid;
+			ent.st.st_size = sent->size;
+			ent.st.st_mtime = sent->mtime;
+			entry->actpath = strdup(actpath);
+			ent.data = entry;
+			entry = NULL;
+			res = analyze_file(&ent, context);
+			
+			// the same data replacing a base system file still gets
+			// installed, and the installed file has it
+			if (res == 0 && !staged && !dryrun && 
+				INFO_TEST(context->info, FILE_INFO_INSTALL_DATA)) {
+				IF_DEBUG("[analyze]    staging the installed copy\n");
+				if (copyfile(actpath, ent.path, NULL, COPYFILE_ALL|COPYFILE_NOFOLLOW) ||
+					fchmodat(dirfd, name, sent->mode & ALLPERMS, 0)) {
+					res = stream_error(ent.path);
+				}
+				if (res == 0 && fchownat(dirfd, name, sent->uid, sent->gid, AT_SYMLINK_NOFOLLOW)) {
+					res = stream_error(ent.path);
+				}
+			}
+		}
+		if (entry) {
+			delete entry->file;
+			delete entry->actual;
+			free(entry);
+		}
+	} else {
+		// FileFactory() has nothing for devices and named pipes, which
+		// tar(1) only lets the super-user create anyway
+		IF_DEBUG("[analyze] skipping %s of type %c\n", relpath, sent->type);
 	}
 	
-	// clean up disk
-	res = archive->prune_compacted_archive(m_archives_path);
+	if (dirfd != -1) close(dirfd);
+	free(ent.path);
+	free(relpath);
+	free(actpath);
 	return res;
 }
 
-int Depot::uninstall_file(File* file, void* ctx) {
-	extern uint32_t dryrun;
+int Depot::backup_file(File* file, void* ctx) {
 	InstallContext* context = (InstallContext*)ctx;
 	int res = 0;
-	char state = ' ';
 
-	IF_DEBUG("[uninstall] %s\n", file->path());
+	IF_DEBUG("[backup] backup_file: %s , %s \n", file->path(), context->archive->m_name);
 
-	// We never uninstall a file that was part of the base system
-	if (INFO_TEST(file->info(), FILE_INFO_BASE_SYSTEM)) {
-		IF_DEBUG("[uninstall]    base system; skipping\n");
-		return DEPOT_OK;
-	}
-	
-	char* actpath;
-	join_path(&actpath, context->depot->m_prefix, file->path());
-	IF_DEBUG("[uninstall] actual path is %s\n", actpath);
-	File* actual = FileFactory(actpath);
-	uint32_t flags = File::compare(file, actual);
-	
-	if (actual == NULL) {
-		IF_DEBUG("[uninstall]    actual file missing, "
-				 "possibly due to parent being removed already\n");
-		state = '!';
-	} else if (flags != FILE_INFO_IDENTICAL) {
-		IF_DEBUG("[uninstall]    changes since install; skipping\n");
-	} else {
-		File* superseded = context->depot->file_superseded_by(file);
-		if (superseded == NULL) {
-			// no one's using this file anymore
-			File* preceding = context->depot->file_preceded_by(file);
-			assert(preceding != NULL);
-			if (INFO_TEST(preceding->info(), FILE_INFO_NO_ENTRY)) {
-				context->depot->m_is_dirty = true;
-				state = 'R';
-				IF_DEBUG("[uninstall]    removing file\n");
-				if (!dryrun && actual && res == 0) res = actual->remove();
-			} else {
-				// copy the preceding file back out to the system
-				// if it's different from what's already there
-				uint32_t flags = File::compare(file, preceding);
-				if (INFO_TEST(flags, FILE_INFO_DATA_DIFFERS)) {
-					context->depot->m_is_dirty = true;
-					state = 'U';
-					IF_DEBUG("[uninstall]    restoring\n");
-					if (!dryrun && res == 0) {
-						if (INFO_TEST(flags, FILE_INFO_TYPE_DIFFERS) &&
-							S_ISDIR(preceding->mode())) {
-							// use rename instead of mkdir so children are restored
-							res = preceding->dirrename(context->depot->m_archives_path, 
-													               context->depot->m_prefix,
-                                         context->reverse_files);							
+	if (INFO_TEST(file->info(), FILE_INFO_ROLLBACK_DATA)) {
+		res = context->depot->m_journal->file(file->path(), 0);
+		if (res) return res;
+		if (context->fingerprint) fingerprint_file(context->fingerprint, file);
 
-						} else {
-							res = preceding->install(context->depot->m_archives_path, 
-													             context->depot->m_prefix,
-                                       context->reverse_files);
-						}
-					}
-				} else if (INFO_TEST(flags, FILE_INFO_MODE_DIFFERS) ||
-					   INFO_TEST(flags, FILE_INFO_GID_DIFFERS) ||
-					   INFO_TEST(flags, FILE_INFO_UID_DIFFERS)) {
+		char *path;        // the file's path
+		char *dstpath;     // the path inside the archives
+		char *relpath;     // the file's path minus the destination prefix
+		char *uuidpath;    // archives path plus the uuid
+		char uuidstr[37];
+
+		// If we're going to need to squirrel away data, create
+		// the directory hierarchy now.
+		char backup_path[PATH_MAX];
+		char* backup_dirpath;
+
+		// we need the path minus our destination prefix for moving to the archive
+		IF_DEBUG("[backup] file->path() = %s \n", file->path());
+		strlcpy(backup_path, file->path(), sizeof(backup_path));
+		IF_DEBUG("[backup] backup_path = %s \n", backup_path);
+			
+		const char* dir = dirname(backup_path);
+		assert(dir != NULL);
+		IF_DEBUG("[backup] dir = %s \n", dir);
+
+		uuid_unparse_upper(context->archive->uuid(), uuidstr);
+		asprintf(&uuidpath, "%s/%s", context->depot->m_archives_path, uuidstr);
+		assert(uuidpath != NULL);
+		IF_DEBUG("[backup] uuidpath = %s \n", uuidpath);
+		join_path(&backup_dirpath, uuidpath, dir);
+		assert(backup_dirpath != NULL);
+		
+		IF_DEBUG("mkdir_p: %s\n", backup_dirpath);
+		res = mkdir_p(backup_dirpath);
+		if (res != 0 && errno != EEXIST) {
+			fprintf(stderr, "%s:%d: %s: %s (%d)\n", 
+					__FILE__, __LINE__, backup_dirpath, strerror(errno), errno);
+		} else {
+			res = 0;
+		}
+		
+		// we need the path minus our destination path for moving to the archive
+		size_t prefixlen = strlen(context->depot->m_prefix);
+		if (strncmp(context->archive->m_name, "<Rollback>", strlen("<Rollback>")) == 0) {
+		  join_path(&path, context->depot->m_prefix, file->path());
+		} else {
+		  asprintf(&path, "%s", file->path());
+		}
+		relpath = path;
+		if (strncmp(path, context->depot->m_prefix, prefixlen) == 0) {
+		        relpath += prefixlen - 1;
+		}
+
+		join_path(&dstpath, uuidpath, relpath);
+		assert(dstpath != NULL);
+
+		IF_DEBUG("[backup] path = %s \n", path);
+		IF_DEBUG("[backup] relpath = %s \n", relpath);
+		IF_DEBUG("[backup] dstpath = %s \n", dstpath);
+
+
+		++context->files_modified;
+
+		// the links of one inode are backed up as links again
+		struct stat sb;
+		const char* linked = NULL;
+		bool multiple = (context->links && lstat(path, &sb) == 0 && 
+						 S_ISREG(sb.st_mode) && sb.st_nlink > 1);
+		if (multiple) linked = context->links->remember(dstpath, &sb);
+
+		// XXX: res = file->backup()
+		if (linked) {
+			IF_DEBUG("[backup] link(%s, %s)\n", linked, dstpath);
+			res = link(linked, dstpath);
+			// which files share their data is part of the backing store
+			const char* linkrel = linked + strlen(uuidpath);
+			if (context->fingerprint) CC_SHA1_Update(context->fingerprint, linkrel, 
+													 (CC_LONG)strlen(linkrel) + 1);
+		} else {
+			IF_DEBUG("[backup] copyfile(%s, %s)\n", path, dstpath);
+			res = copyfile(path, dstpath, NULL, COPYFILE_ALL|COPYFILE_NOFOLLOW);
+		}
+
+		if (res != 0) fprintf(stderr, "%s:%d: backup failed: %s: %s (%d)\n", 
+							  __FILE__, __LINE__, dstpath, strerror(errno), errno);
+
+		// XXX: we cant propagate error from callback, but its safe to die here
+		assert(res == 0);
+		
+		if (multiple) {
+			file->info_set(FILE_INFO_HARDLINK);
+			res = context->depot->m_db->update_file(file->serial(), file->archive(), 
+													file->info(), file->mode(), 
+													file->uid(), file->gid(), 
+													file->digest(), file->path());
+		}
+		
+		// the copy is usually close to the file about to replace it, a
+		// delta is rewritten and would no longer be shared by the links
+		if (res == 0 && context->delta_base && S_ISREG(file->mode()) && !multiple) {
+			res = context->depot->backup_delta(file, dstpath, context);
+		}
+		
+		free(path);
+		free(dstpath);
+		free(uuidpath);
+		free(backup_dirpath);
+	}
+	return res;
+}
+
+int Depot::backup_delta(File* file, const char* dstpath, void* ctx) {
+	InstallContext* context = (InstallContext*)ctx;
+	char* basedir = context->delta_base->directory_name(m_archives_path);
+	char* basepath = NULL;
+	if (basedir) join_path(&basepath, basedir, file->path());
+	free(basedir);
+	if (!basepath) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		return DEPOT_ERROR;
+	}
+	
+	// roots from a stream only stage what differs from the installed files
+	int res = 0;
+	off_t saved = 0;
+	struct stat sb;
+	if (lstat(basepath, &sb) == 0 && S_ISREG(sb.st_mode)) {
+		res = delta_encode(basepath, dstpath, &saved);
+	}
+	free(basepath);
+	if (res == 0 && saved > 0) {
+		context->delta_saved += saved;
+		file->info_set(FILE_INFO_ROLLBACK_DELTA);
+		res = m_db->update_file(file->serial(), file->archive(), file->info(), file->mode(),
+								file->uid(), file->gid(), file->digest(), file->path());
+		// the backing store is only the same as another depot's if the
+		// deltas were made against the same data
+		uint8_t md[CC_SHA1_DIGEST_LENGTH];
+		if (res == 0 && context->fingerprint && delta_base_digest(dstpath, md) == 0) {
+			CC_SHA1_Update(context->fingerprint, DELTA_MAGIC, DELTA_MAGIC_SIZE);
+			CC_SHA1_Update(context->fingerprint, md, CC_SHA1_DIGEST_LENGTH);
+		}
+	}
+	return res;
+}
+
+int Depot::inflate(File* file, File* base, File* actual, bool* inflated) {
+	int res = 0;
+	char* path = NULL;
+	char* basepath = NULL;
+	*inflated = false;
+	
+	// both backing stores are expanded on demand, like File::install does
+	char* dirpath = file->archive()->directory_name(m_archives_path);
+	if (dirpath && !is_directory(dirpath)) res = file->archive()->expand_directory(m_archives_path);
+	if (dirpath && res == 0) join_path(&path, dirpath, file->path());
+	free(dirpath);
+	if (res == 0 && path && !delta_is_encoded(path)) {
+		free(path);
+		return DEPOT_OK;
+	}
+	
+	if (res == 0 && actual && !INFO_TEST(File::compare(base, actual), FILE_INFO_DATA_DIFFERS)) {
+		join_path(&basepath, m_prefix, base->path());
+	} else if (res == 0) {
+		dirpath = base->archive()->directory_name(m_archives_path);
+		if (dirpath && !is_directory(dirpath)) {
+			res = base->archive()->expand_directory(m_archives_path);
+		}
+		if (dirpath && res == 0) join_path(&basepath, dirpath, base->path());
+		free(dirpath);
+	}
+	if (res == 0 && (!path || !basepath)) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		res = DEPOT_ERROR;
+	}
+	
+	IF_DEBUG("[delta] inflating %s against %s\n", path, basepath);
+	if (res == 0) res = delta_decode(basepath, path, file->digest(), file->size());
+	if (res == 0) *inflated = true;
+	free(path);
+	free(basepath);
+	return res;
+}
+
+int Depot::inflate_rollbacks(uint32_t count, File** deltas, File** bases, File** actuals) {
+	extern uint32_t durability;
+	int res = 0;
+	SerialSet rollbacks;
+	File** inflated = (File**)calloc(count + 1, sizeof(File*));
+	if (!inflated) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		return DEPOT_ERROR;
+	}
+	uint32_t n = 0;
+	for (uint32_t i = 0; res == 0 && i < count; i++) {
+		bool done;
+		res = this->inflate(deltas[i], bases[i], actuals[i], &done);
+		if (res == 0 && done) {
+			inflated[n++] = deltas[i];
+			res = rollbacks.add(deltas[i]->archive()->serial());
+		}
+	}
+	
+	// the backing stores are rewritten before the records say so
+	Durability dirty(durability);
+	for (uint32_t i = 0; res == 0 && i < rollbacks.count; i++) {
+		Archive* rollback = this->archive(rollbacks.values[i]);
+		if (!rollback) continue;
+		IF_DEBUG("[delta] compacting rollback %llu again\n", rollback->serial());
+		res = rollback->compact_directory(m_archives_path);
+		char* compacted = rollback->compacted_path(m_archives_path);
+		if (res == 0) res = dirty.add(compacted);
+		free(compacted);
+		delete rollback;
+	}
+	if (res == 0) res = dirty.sync();
+	
+	if (res == 0 && n) res = this->begin_transaction();
+	for (uint32_t i = 0; res == 0 && i < n; i++) {
+		File* file = inflated[i];
+		file->info_clr(FILE_INFO_ROLLBACK_DELTA);
+		res = m_db->update_file(file->serial(), file->archive(), file->info(), file->mode(),
+								file->uid(), file->gid(), file->digest(), file->path());
+	}
+	if (res == 0 && n) {
+		res = this->commit_transaction();
+	} else if (n) {
+		this->rollback_transaction();
+	}
+	free(inflated);
+	return res;
+}
+
+int Depot::install_file(File* file, void* ctx) {
+	extern uint32_t dryrun;
+	InstallContext* context = (InstallContext*)ctx;
+	int res = 0;
+
+	// the files before the one an interrupted install stopped at are done
+	if (context->resume_path) {
+		if (strcmp(file->path(), context->resume_path) != 0) return DEPOT_OK;
+		context->resume_path = NULL;
+	}
+	
+	// files that already left the stage were moved into place before the
+	// install was interrupted, even if the journal did not get to say so
+	if (context->resuming && INFO_TEST(file->info(), FILE_INFO_INSTALL_DATA) &&
+		!S_ISDIR(file->mode())) {
+		char* dirpath = file->archive()->directory_name(context->depot->m_archives_path);
+		char* srcpath = NULL;
+		if (dirpath) join_path(&srcpath, dirpath, file->path());
+		struct stat sb;
+		bool moved = (srcpath && is_directory(dirpath) && 
+					  lstat(srcpath, &sb) == -1 && errno == ENOENT);
+		free(srcpath);
+		free(dirpath);
+		if (moved) {
+			IF_DEBUG("[install] already moved %s\n", file->path());
+			return DEPOT_OK;
+		}
+	}
+	
+	if (!dryrun) res = context->depot->m_journal->file(file->path(), 0);
+	if (res) return res;
+
+	// Strip the quarantine xattr off all files to avoid them being rendered useless.
+	// Only the files that get installed have to be in the stage.
+	if (INFO_TEST(file->info(), FILE_INFO_INSTALL_DATA) &&
+		file->unquarantine(context->depot->m_archives_path) != 0) {
+		fprintf(stderr, "Error: unable to unquarantine file in staging area.\n");
+		return DEPOT_ERROR;
+	}
+
+	if (INFO_TEST(file->info(), FILE_INFO_INSTALL_DATA)) {
+		++context->files_modified;
+
+		res = file->install(context->depot->m_archives_path,
+                        context->depot->m_prefix,
+                        context->reverse_files);
+	} else {
+		res = file->install_info(context->depot->m_prefix);
+	}
+	if (res != 0) fprintf(stderr, "%s:%d: install failed: %s: %s (%d)\n", 
+						  __FILE__, __LINE__, file->path(), strerror(errno), errno);
+	if (res == 0 && !dryrun) {
+		char* path = NULL;
+		join_path(&path, context->depot->m_prefix, file->path());
+		res = path ? context->dirty->add(path) : DEPOT_ERROR;
+		free(path);
+	}
+	return res;
+}
+
+
+struct PrefetchContext {
+	PrefetchContext(Depot* d, int c, char** p, char** f) {
+		depot = d;
+		count = c;
+		paths = p;
+		files = f;
+		next = 0;
+		pthread_mutex_init(&lock, NULL);
+	}
+	~PrefetchContext() {
+		pthread_mutex_destroy(&lock);
+	}
+	
+	Depot* depot;
+	int count;
+	char** paths;
+	char** files;
+	int next;
+	pthread_mutex_t lock;
+};
+
+static void* prefetch_worker(void* ctx) {
+	PrefetchContext* context = (PrefetchContext*)ctx;
+	for (;;) {
+		pthread_mutex_lock(&context->lock);
+		int i = context->next++;
+		pthread_mutex_unlock(&context->lock);
+		if (i >= context->count) break;
+		
+		const char* path = context->paths[i];
+		const char* dstpath = context->depot->downloads_path();
+		if (is_url_path(path)) {
+			context->files[i] = fetch_url(path, dstpath);
+		} else {
+			context->files[i] = fetch_userhost(path, dstpath);
+		}
+		IF_DEBUG("prefetched %s to %s\n", path, context->files[i]);
+	}
+	return NULL;
+}
+
+int Depot::prefetch(int count, char** paths) {
+	// only the remote roots need fetching
+	m_fetched_paths = (char**)calloc(count, sizeof(char*));
+	m_fetched_files = (char**)calloc(count, sizeof(char*));
+	if (!m_fetched_paths || !m_fetched_files) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		return DEPOT_ERROR;
+	}
+	m_fetched_count = 0;
+	for (int i = 0; i < count; i++) {
+		if (is_url_path(paths[i]) || is_userhost_path(paths[i])) {
+			m_fetched_paths[m_fetched_count++] = paths[i];
+		}
+	}
+	// one at a time is what install() would do anyway
+	if (m_fetched_count < 2) {
+		m_fetched_count = 0;
+		return DEPOT_OK;
+	}
+	
+	PrefetchContext context(this, m_fetched_count, m_fetched_paths, m_fetched_files);
+	pthread_t threads[PREFETCH_THREADS];
+	int nthreads = 0;
+	while (nthreads < PREFETCH_THREADS && nthreads < m_fetched_count) {
+		if (pthread_create(&threads[nthreads], NULL, &prefetch_worker, &context)) break;
+		nthreads++;
+	}
+	// fetch on this thread too if none could be started
+	if (nthreads == 0) prefetch_worker(&context);
+	for (int i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+	return DEPOT_OK;
+}
+
+const char* Depot::prefetched(const char* path) {
+	for (int i = 0; i < m_fetched_count; i++) {
+		if (strcmp(m_fetched_paths[i], path) == 0) return m_fetched_files[i];
+	}
+	return NULL;
+}
+
+// a root extracted on another thread while the one before it is installed
+struct StageJob {
+	Archive* archive;  // NULL if the root could not be loaded
+	const char* path;  // as given to stage()
+	char* stage_path;
+	int res;
+	bool running;
+	pthread_t thread;
+	StageJob* next;
+};
+
+static void* stage_worker(void* ctx) {
+	StageJob* job = (StageJob*)ctx;
+	job->res = job->archive->extract(job->stage_path);
+	return NULL;
+}
+
+int Depot::stage(const char* path) {
+	// a stream is analyzed as it is read, there is nothing to extract
+	if (strcmp(path, "-") == 0) return DEPOT_OK;
+	
+	// remote roots that were not prefetched are left to install()
+	const char* fetched = this->prefetched(path);
+	if (!fetched && (is_url_path(path) || is_userhost_path(path))) return DEPOT_OK;
+	
+	StageJob* job = (StageJob*)calloc(1, sizeof(StageJob));
+	if (!job) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		return DEPOT_ERROR;
+	}
+	job->path = path;
+	
+	// install() reports a root that could not be loaded
+	job->archive = ArchiveFactory(fetched ? fetched : path, this->downloads_path());
+	if (job->archive) {
+		job->stage_path = job->archive->create_directory(m_archives_path);
+		if (job->stage_path) {
+			job->running = (pthread_create(&job->thread, NULL, &stage_worker, job) == 0);
+		}
+		if (!job->running) {
+			// install() creates the stage itself
+			if (job->stage_path) rmdir(job->stage_path);
+			free(job->stage_path);
+			delete job->archive;
+			free(job);
+			return DEPOT_ERROR;
+		}
+		IF_DEBUG("staging %s in %s\n", path, job->stage_path);
+	}
+	job->next = m_staging;
+	m_staging = job;
+	return DEPOT_OK;
+}
+
+StageJob* Depot::staged(const char* path) {
+	for (StageJob* job = m_staging; job; job = job->next) {
+		if (strcmp(job->path, path) == 0) return job;
+	}
+	return NULL;
+}
+
+bool Depot::join_stage(Archive* archive, char** path, int* res) {
+	StageJob** pjob = &m_staging;
+	while (*pjob && (*pjob)->archive != archive) pjob = &(*pjob)->next;
+	StageJob* job = *pjob;
+	if (!job || !archive) return false;
+	*pjob = job->next;
+	pthread_join(job->thread, NULL);
+	*path = job->stage_path;
+	*res = job->res;
+	free(job);
+	return true;
+}
+
+int Depot::unstage() {
+	int res = DEPOT_OK;
+	while (m_staging) {
+		StageJob* job = m_staging;
+		m_staging = job->next;
+		if (job->running) {
+			pthread_join(job->thread, NULL);
+			IF_DEBUG("discarding the stage of %s\n", job->path);
+			if (this->trash(job->stage_path)) res = DEPOT_ERROR;
+		}
+		free(job->stage_path);
+		delete job->archive;
+		free(job);
+	}
+	return res;
+}
+
+int Depot::prune_downloads() {
+	Walker walker(m_downloads_path);
+	walker.max_level(1);
+	return walker.walk(&Depot::prune_download, this);
+}
+
+int Depot::prune_download(WalkEntry* ent, void* context) {
+	if (ent->level != 1 || ent->info == WALK_DP || ent->info == WALK_NS) return 0;
+	if (ent->st.st_mtime + DOWNLOAD_CACHE_DAYS * 24 * 60 * 60 > time(NULL)) return 0;
+	IF_DEBUG("pruning unused download %s\n", ent->path);
+	return ((Depot*)context)->trash(ent->path);
+}
+
+int Depot::install(const char* path) {
+	return this->install(path, NULL);
+}
+
+int Depot::install(const char* path, Archive* replacing) {
+	int res = 0;
+	char uuid[37];
+	// roots fetched by prefetch() are installed from their local copy
+	const char* fetched = this->prefetched(path);
+	Archive* archive;
+	StageJob* job = this->staged(path);
+	if (job) {
+		// stage() already loaded it
+		archive = job->archive;
+	} else {
+		archive = ArchiveFactory(fetched ? fetched : path, this->downloads_path());
+	}
+	if (archive && m_store && archive->path()) this->share_download(archive->path());
+	if (archive) {
+		res = this->install(archive, replacing);
+		if (res == 0) {
+			fprintf(stdout, "Installed archive: %llu %s \n", 
+					archive->serial(), archive->name());
+			uuid_unparse_upper(archive->uuid(), uuid);
+			fprintf(stdout, "%s\n", uuid);
+		} else {
+			fprintf(stderr, "Error: Install failed.\n");				
+			// the roots after this one are not going to be installed
+			this->unstage();
+			if (res != DEPOT_OBJ_CHANGE && res != DEPOT_PREINSTALL_ERR) {
+				// object change errors come from analyze stage,
+				// and pre-install errors happen early,
+				// so there is no installation to roll back
+				fprintf(stderr, "Rolling back installation.\n");
+				res = this->uninstall(archive);
+				if (res) {
+					fprintf(stderr, "Error: Unable to rollback installation. "
+							"Your system is in an inconsistent state! File a bug!\n");
+				} else {
+					fprintf(stdout, "Rollback successful.\n");
+				}
+			}
+			res = DEPOT_ERROR;
+		}
+	} else {
+		fprintf(stdout, "Error: unable to load \"%s\". Either the path is missing, invalid or"
+				         " the file is in an unknown format.\n", path);
+		this->unstage();
+		return DEPOT_ERROR;
+	}
+
+	return res;
+}
+
+
+int Depot::install(Archive* archive) {
+	return this->install(archive, NULL);
+}
+
+int Depot::upgrade(const char* path, Archive* old) {
+	extern uint32_t force;
+	extern uint32_t dryrun;
+	
+	// old only gives up files when it is going to be uninstalled, uninstall()
+	// refuses rollbacks and roots from another build without -f
+	bool carry = (!dryrun && !INFO_TEST(old->info(), ARCHIVE_INFO_ROLLBACK) &&
+				  (force || !m_build || !old->build() || 
+				   strcmp(m_build, old->build()) == 0));
+	int res = this->install(path, carry ? old : NULL);
+	if (res == 0) res = this->uninstall(old);
+	return res;
+}
+
+// what is_unchanged() needs while it walks a staged root
+struct UnchangedContext {
+	Depot* depot;
+	Archive* installed;
+	CC_SHA1_CTX fingerprint;
+	HardLinks links;
+};
+
+static int unchanged_prepare(WalkEntry* ent, void* ctx) {
+	UnchangedContext* context = (UnchangedContext*)ctx;
+	if (ent->level == 0) return 0;
+	if (ent->info != WALK_D && ent->info != WALK_F && ent->info != WALK_SL) return 0;
+	ent->data = FileFactory(context->installed, ent);
+	return 0;
+}
+
+static int unchanged_release(WalkEntry* ent, void* ctx) {
+	delete (File*)ent->data;
+	ent->data = NULL;
+	return 0;
+}
+
+// stops the walk at the first file that is not in place like it was staged
+static int unchanged_file(WalkEntry* ent, void* ctx) {
+	UnchangedContext* context = (UnchangedContext*)ctx;
+	if (ent->level == 0 || ent->info == WALK_DP) return 0;
+	File* file = ent->data ? (File*)ent->data : FileFactory(context->installed, ent);
+	ent->data = NULL;
+	if (!file) return 0;
+	
+	// installed files were mostly renamed out of the stage, so they still
+	// have the modification time of the staged copy, only the others are
+	// hashed again
+	char* actpath;
+	join_path(&actpath, context->depot->prefix(), file->path());
+	struct stat sb;
+	int res = lstat(actpath, &sb);
+	if (res == 0 && (sb.st_mode != ent->st.st_mode || sb.st_uid != ent->st.st_uid ||
+					 sb.st_gid != ent->st.st_gid)) {
+		res = -1;
+	}
+	if (res == 0 && !S_ISDIR(sb.st_mode) && sb.st_size != ent->st.st_size) res = -1;
+	if (res == 0 && !S_ISDIR(sb.st_mode) && sb.st_mtime != ent->st.st_mtime) {
+		Digest* digest;
+		if (S_ISLNK(sb.st_mode)) {
+			digest = new SHA1DigestSymlink(actpath);
+		} else {
+			digest = new SHA1Digest(actpath);
+		}
+		if (!Digest::equal(digest, file->digest())) res = -1;
+		delete digest;
+	}
+	if (res) {
+		IF_DEBUG("[install] changed since it was installed: %s\n", actpath);
+	} else {
+		// like analyze_file() fingerprinted it
+		fingerprint_file(&context->fingerprint, file);
+		if (ent->info == WALK_F) {
+			const char* first = context->links.remember(file->path(), &ent->st);
+			if (first) CC_SHA1_Update(&context->fingerprint, first, (CC_LONG)strlen(first) + 1);
+		}
+	}
+	free(actpath);
+	delete file;
+	return res;
+}
+
+Archive* Depot::fingerprinted(Archive* archive) {
+	uint8_t** archlist;
+	uint32_t count = 0;
+	int res = this->m_db->get_archives(&archlist, &count, false);
+	if (!FOUND(res)) return NULL;
+
+	// the newest archive with the same name
+	Archive* installed = NULL;
+	for (uint32_t i = 0; i < count; i++) {
+		char* name;
+		memcpy(&name, &archlist[i][this->m_db->archive_offset(2)], sizeof(char*));
+		if (!installed && name && strcmp(name, archive->name()) == 0) {
+			installed = this->m_db->make_archive(archlist[i]);
+		} else {
+			this->m_db->free_archive(archlist[i]);
+		}
+	}
+	free(archlist);
+	if (!installed) return NULL;
+	
+	// reinstalling would record the current build
+	bool same = (installed->fingerprint() != NULL && 
+				 ((!m_build && !installed->build()) ||
+				  (m_build && installed->build() && strcmp(m_build, installed->build()) == 0)));
+
+	// and bring files back from under the archives installed since, a
+	// directory they share is the same either way if it is still in place
+	uint8_t** rows = NULL;
+	uint32_t n = 0;
+	if (same && m_db->get_path_files(&rows, &n, installed) == DB_ERROR) same = false;
+	for (uint32_t i = 0; i < n; i++) {
+		uint64_t serial;
+		uint64_t mode;
+		memcpy(&serial, &rows[i][m_db->file_offset(1)], sizeof(uint64_t));
+		memcpy(&mode, &rows[i][m_db->file_offset(3)], sizeof(uint64_t));
+		if (serial > installed->serial() && !S_ISDIR(mode)) same = false;
+		m_db->free_file(rows[i]);
+	}
+	free(rows);
+	
+	if (!same) {
+		delete installed;
+		return NULL;
+	}
+	return installed;
+}
+
+bool Depot::is_unchanged(const char* path, Archive* installed) {
+	UnchangedContext context;
+	context.depot = this;
+	context.installed = installed;
+	CC_SHA1_Init(&context.fingerprint);
+	Walker walker(path);
+	walker.prepare(&unchanged_prepare, &unchanged_release, &context);
+	if (walker.walk(&unchanged_file, &context)) return false;
+	
+	SHA1Digest fingerprint(&context.fingerprint);
+	return Digest::equal(&fingerprint, installed->fingerprint()) == 1;
+}
+
+int Depot::install(Archive* archive, Archive* replacing) {
+	extern uint32_t dryrun;
+	extern uint32_t rollback_deltas;
+	int res = 0;
+	Archive* rollback = new RollbackArchive();
+	StreamArchive* stream = dynamic_cast<StreamArchive*>(archive);
+	
+	// look for the same root installed before, ahead of inserting archive
+	Archive* installed = NULL;
+	if (!replacing && !stream) installed = this->fingerprinted(archive);
+
+	if (this->m_build) {
+		rollback->m_build = strdup(this->m_build);
+		archive->m_build = strdup(this->m_build);
+	}
+	
+	assert(rollback != NULL);
+	assert(archive != NULL);
+
+	if (res != 0) return res;
+
+	//
+	// The fun starts here
+	//
+	if (!dryrun && res == 0) res = m_journal->begin_install(archive, rollback);
+	if (!dryrun && res == 0) res = this->begin_transaction();	
+
+	//
+	// Insert the rollback archive before the new archive to install, thus keeping
+	// the chronology of the serial numbers correct.  We may later choose to delete
+	// the rollback archive if we determine that it was not necessary.
+	//
+	if (!dryrun && res == 0) res = this->insert(rollback);
+	if (!dryrun && res == 0) res = this->insert(archive);
+
+	//
+	// Create the stage directory and rollback backing store directories,
+	// unless stage() already extracted the archive
+	//
+	char* archive_path = NULL;
+	int extract_res = 0;
+	bool extracted = this->join_stage(archive, &archive_path, &extract_res);
+	if (!extracted) archive_path = archive->create_directory(m_archives_path);
+	assert(archive_path != NULL);
+	char* rollback_path = rollback->create_directory(m_archives_path);
+	assert(rollback_path != NULL);
+
+	// Extract the archive into its backing store directory, a stream is
+	// read as it is analyzed and only the files that changed get staged
+	if (res == 0 && stream && !dryrun) res = stream->begin_compact(m_archives_path);
+	if (res == 0 && !stream) res = extracted ? extract_res : archive->extract(archive_path);
+
+	// Reinstalling a root that has not changed since it was installed, 
+	// over files that have not changed either, would not change anything
+	if (res == 0 && installed && this->is_unchanged(archive_path, installed)) {
+		fprintf(stdout, "No changes, %s is installed as archive %llu.\n",
+				installed->name(), installed->serial());
+		this->trash(archive_path);
+		this->trash(rollback_path);
+		free(rollback_path);
+		free(archive_path);
+		if (!dryrun) {
+			this->rollback_transaction();
+			m_journal->commit();
+		}
+		archive->m_serial = installed->serial();
+		uuid_copy(archive->m_uuid, installed->uuid());
+		archive->m_date_installed = installed->date_installed();
+		delete installed;
+		return DEPOT_OK;
+	}
+	delete installed;
+
+	// Analyze the files in the archive backing store directory
+	// Inserts new file records into the database for both the new archive being
+	// installed and the rollback archive.
+	int rollback_files = 0;
+	InstallContext install_context(this, archive);
+	if (res == 0 && stream) {
+		res = this->analyze_stream(stream, archive_path, rollback, replacing,
+								   install_context.files_to_carry, &rollback_files);
+	} else if (res == 0) {
+		res = this->analyze_stage(archive_path, archive, rollback, replacing,
+								  install_context.files_to_carry, &rollback_files);
+	}
+	
+	// we can stop now if analyze failed or this is a dry run
+	if (res || dryrun) {
+		if (stream && !dryrun) {
+			stream->compact_directory(m_archives_path);
+			archive->prune_compacted_archive(m_archives_path);
+		}
+		this->trash(archive_path);
+		this->trash(rollback_path);
+		free(rollback_path);
+		free(archive_path);
+		if (!dryrun && res) {
+			this->rollback_transaction();
+			m_journal->commit();
+			return DEPOT_PREINSTALL_ERR;
+		}
+		return res;
+	}
+	
+	// Remember the fingerprint for installing the same root again
+	if (res == 0 && archive->fingerprint()) {
+		res = m_db->update_archive(archive->serial(), archive->uuid(), archive->name(),
+								   archive->date_installed(), 0, archive->info(),
+								   archive->build(), archive->fingerprint());
+	}
+	
+	// If no files were added to the rollback archive, delete the rollback archive.
+	if (res == 0 && rollback_files == 0) {
+		res = this->remove(rollback);
+	}
+
+	// Commit the archive and its list of files to the database.
+	// Note that the archive's "active" flag is still not set.
+	if (res == 0) {
+		res = this->commit_transaction();
+	} else {
+		this->rollback_transaction();
+	}
+
+	// Save a copy of the backing store directory now, we will soon
+	// be moving the files into place.
+	if (res == 0) res = archive->compact_directory(m_archives_path);
+
+	//
+	// Move files from the root file system to the rollback archive's backing store,
+	// then move files from the archive backing directory to the root filesystem
+	//
+	InstallContext rollback_context(this, rollback);
+	CC_SHA1_CTX backed_up;
+	CC_SHA1_Init(&backed_up);
+	CC_SHA1_Update(&backed_up, rollback->name(), (CC_LONG)strlen(rollback->name()));
+	rollback_context.fingerprint = &backed_up;
+	HardLinks backed_up_links;
+	rollback_context.links = &backed_up_links;
+	if (rollback_deltas) {
+		// the records of the deltas are committed before they are compacted
+		rollback_context.delta_base = archive;
+		if (res == 0) res = this->begin_transaction();
+	}
+	if (res == 0) res = this->iterate_files(rollback, &Depot::backup_file, &rollback_context);
+	if (rollback_deltas && res == 0) {
+		res = this->commit_transaction();
+	} else if (rollback_deltas) {
+		this->rollback_transaction();
+	}
+	if (res == 0 && rollback_context.delta_saved) {
+		fprintf(stdout, "Rollback deltas saved %llu bytes\n", rollback_context.delta_saved);
+	}
+
+	// compact the rollback archive (if we actually added any files)
+	if (rollback_context.files_modified > 0) {
+		if (res == 0) res = rollback->compact_directory(m_archives_path);
+	}
+	
+	// other depots may already have the same backing stores, a store
+	// that cannot be shared is kept to ourselves
+	if (res == 0 && m_store && archive->fingerprint()) {
+		this->share(archive, archive->fingerprint());
+	}
+	if (res == 0 && m_store && rollback_context.files_modified > 0) {
+		SHA1Digest fingerprint(&backed_up);
+		this->share(rollback, &fingerprint);
+	}
+
+	// the copies have to be on disk before anything is moved over them
+	if (res == 0 && !dryrun) {
+		char* compacted = archive->compacted_path(m_archives_path);
+		res = install_context.dirty->add(compacted);
+		free(compacted);
+		if (res == 0 && rollback_context.files_modified > 0) {
+			compacted = rollback->compacted_path(m_archives_path);
+			res = install_context.dirty->add(compacted);
+			free(compacted);
+		}
+		if (res == 0) res = install_context.dirty->sync();
+	}
+
+	// From here on an interrupted install is finished rather than undone
+	if (res == 0) res = m_journal->carry(install_context.files_to_carry);
+	if (res == 0) res = m_journal->begin_move();
+
+	if (res == 0) {
+		res = this->finish_install(archive, rollback, &install_context);
+	} else {
+		this->trash(archive_path);
+		this->trash(rollback_path);
+	}
+	
+	free(rollback_path);
+	free(archive_path);
+
+	return res;
+}
+
+int Depot::finish_install(Archive* archive, Archive* rollback, void* context) {
+	SerialSet* carried = ((InstallContext*)context)->files_to_carry;
+	int res = this->iterate_files(archive, &Depot::install_file, context);
+
+	// Installation is complete.  Activate the archive in the database,
+	// once the installed files are as safe as the record of them.
+	if (res == 0) res = ((InstallContext*)context)->dirty->sync();
+	if (res == 0) res = this->begin_transaction();
+	if (res == 0 && rollback) {
+		res = this->m_db->activate_archive(rollback->serial());
+		if (res) this->rollback_transaction();
+	}
+	if (res == 0 && carried->count) {
+		res = this->m_db->move_files(carried->values, carried->count, archive, 
+									 FILE_INFO_NONE);
+		if (res) this->rollback_transaction();
+	}
+	if (res == 0) {
+		res = this->m_db->activate_archive(archive->serial());
+		if (res) this->rollback_transaction();
+	}
+	if (res == 0) res = this->commit_transaction();
+	if (res == 0) res = m_journal->commit();
+
+	// Remove the stage and rollback directories (save disk space)
+	char* archive_path = archive->directory_name(m_archives_path);
+	char* rollback_path = rollback ? rollback->directory_name(m_archives_path) : NULL;
+	if (archive_path && is_directory(archive_path)) this->trash(archive_path);
+	if (rollback_path && is_directory(rollback_path)) this->trash(rollback_path);
+	free(rollback_path);
+	free(archive_path);
+
+	return res;
+}
+
+// deletes expanded backing store directories in m_archives_path
+int Depot::prune_directories() {
+	this->unstage();
+	Walker walker(m_archives_path);
+	walker.max_level(1);
+	return walker.walk(&Depot::prune_directory, this);
+}
+
+int Depot::prune_directory(WalkEntry* ent, void* context) {
+	if (ent->level == 1 && ent->info == WALK_D) {
+		return ((Depot*)context)->trash(ent->path);
+	}
+	return 0;
+}
+
+// delete the unexpanded tarball from archives storage
+int Depot::prune_archive(Archive* archive) {
+	int res = 0;
+	
+	// clean up database
+	res = this->m_db->delete_empty_archives();
+	if (res == 0) res = this->m_db->delete_unused_paths();
+	if (res) {
+		fprintf(stderr, "Error: unable to prune archives from database.\n");
+		return res;
+	}
+	
+	// clean up disk
+	char* tarpath = archive->compacted_path(m_archives_path);
+	if (!tarpath) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		return DEPOT_ERROR;
+	}
+	res = this->trash(tarpath);
+	free(tarpath);
+	return res;
+}
+
+int Depot::share(Archive* archive, Digest* fingerprint) {
+	char* tarpath = archive->compacted_path(m_archives_path);
+	char* name = fingerprint->string();
+	int res = DEPOT_ERROR;
+	if (tarpath && name) {
+		res = m_store->share(tarpath, name);
+	} else {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+	}
+	free(tarpath);
+	free(name);
+	return res;
+}
+
+// Downloads are named after their data, once. A download that is already
+// a link is in the store.
+int Depot::share_download(const char* path) {
+	size_t len = strlen(m_downloads_path);
+	struct stat sb;
+	if (strncmp(path, m_downloads_path, len) != 0 || path[len] != '/' ||
+		lstat(path, &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_nlink > 1) {
+		return DEPOT_OK;
+	}
+	SHA1Digest digest(path);
+	char* name = digest.string();
+	int res = name ? m_store->share(path, name) : DEPOT_ERROR;
+	free(name);
+	return res;
+}
+
+int Depot::trash(const char* path) {
+	int res = 0;
+	char* trashpath = NULL;
+	
+	// the trash is on the same volume, so this is one rename no matter
+	// how big the tree is
+	asprintf(&trashpath, "%s/%lx.%d.%u", m_trash_path, (long)time(NULL), 
+			 getpid(), m_trash_count);
+	if (trashpath) res = rename(path, trashpath);
+	if (res == 0) m_trash_count++;
+	// nothing to move is as good as moved
+	struct stat sb;
+	if (trashpath && res && errno == ENOENT && 
+		lstat(path, &sb) == -1 && errno == ENOENT) {
+		res = 0;
+	} else if (!trashpath || res) {
+		IF_DEBUG("unable to move %s to the trash, removing it\n", path);
+		if (is_directory(path)) {
+			res = remove_directory(path);
+		} else {
+			res = unlink(path);
+			if (res) perror(path);
+		}
+	}
+	free(trashpath);
+	return res;
+}
+
+int Depot::empty_trash() {
+	// only commands that moved something to the trash fork to empty it,
+	// whatever an earlier process left there goes along with it
+	if (m_trash_count == 0) return DEPOT_OK;
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return DEPOT_ERROR;
+	}
+	if (pid) return DEPOT_OK;
+
+	// detach from the terminal and from anyone reading our output, and
+	// let go of the depot lock and database
+	setsid();
+	int fd = open("/dev/null", O_RDWR);
+	if (fd != -1) {
+		dup2(fd, 0);
+		dup2(fd, 1);
+		dup2(fd, 2);
+	}
+	for (fd = getdtablesize() - 1; fd > 2; fd--) close(fd);
+
+	// one process empties the trash at a time, it keeps going 
+	// while other invocations add to it
+	fd = open(m_trash_path, O_RDONLY);
+	if (fd == -1 || flock(fd, LOCK_EX | LOCK_NB)) _exit(0);
+	uint32_t removed;
+	do {
+		removed = 0;
+		Walker walker(m_trash_path);
+		walker.max_level(1);
+		walker.walk(&Depot::trash_entry, &removed);
+	} while (removed);
+	// backing stores in the trash may have been the last links to objects
+	if (m_store) m_store->collect();
+	_exit(0);
+}
+
+int Depot::trash_entry(WalkEntry* ent, void* context) {
+	if (ent->level != 1 || ent->info == WALK_DP) return 0;
+	int res;
+	if (ent->info == WALK_D) {
+		res = remove_directory(ent->path);
+	} else {
+		res = unlink(ent->path);
+	}
+	if (res == 0) *(uint32_t*)context += 1;
+	return 0;
+}
+
+int Depot::uninstall_file(File* file, void* ctx) {
+	extern uint32_t dryrun;
+	InstallContext* context = (InstallContext*)ctx;
+	int res = 0;
+	char state = ' ';
+
+	IF_DEBUG("[uninstall] %s\n", file->path());
+
+	// the files before the one an interrupted uninstall stopped at are done
+	if (context->resume_path) {
+		if (strcmp(file->path(), context->resume_path) != 0) return DEPOT_OK;
+		context->resume_path = NULL;
+	}
+
+	// We never uninstall a file that was part of the base system
+	if (INFO_TEST(file->info(), FILE_INFO_BASE_SYSTEM)) {
+		IF_DEBUG("[uninstall]    base system; skipping\n");
+		return DEPOT_OK;
+	}
+	
+	char* actpath;
+	join_path(&actpath, context->depot->m_prefix, file->path());
+	IF_DEBUG("[uninstall] actual path is %s\n", actpath);
+	File* actual = FileFactory(actpath);
+	uint32_t flags = File::compare(file, actual);
+	
+	if (actual == NULL) {
+		IF_DEBUG("[uninstall]    actual file missing, "
+				 "possibly due to parent being removed already\n");
+		state = '!';
+	} else if (flags != FILE_INFO_IDENTICAL) {
+		IF_DEBUG("[uninstall]    changes since install; skipping\n");
+	} else {
+		File* superseded = NULL;
+		if (!context->planned) {
+			superseded = context->depot->file_superseded_by(file);
+		} else if (context->superseded) {
+			superseded = file;
+		}
+		if (superseded == NULL) {
+			// no one's using this file anymore
+			File* preceding;
+			if (context->planned) {
+				preceding = context->preceding;
+				context->preceding = NULL;
+			} else {
+				preceding = context->depot->file_preceded_by(file);
+			}
+			assert(preceding != NULL);
+			
+			// the rollback record goes away once the file is uninstalled
+			uint64_t info = preceding->info();
+			bool obsolete = (INFO_TEST(info, FILE_INFO_NO_ENTRY | FILE_INFO_ROLLBACK_DATA) &&
+							 !INFO_TEST(info, FILE_INFO_BASE_SYSTEM));
+			if (!dryrun) res = context->depot->m_journal->file(file->path(), 
+									obsolete ? preceding->serial() : 0);
+			if (INFO_TEST(preceding->info(), FILE_INFO_NO_ENTRY)) {
+				context->depot->m_is_dirty = true;
+				state = 'R';
+				IF_DEBUG("[uninstall]    removing file\n");
+				if (!dryrun && actual && res == 0) res = actual->remove();
+			} else {
+				// copy the preceding file back out to the system
+				// if it's different from what's already there
+				uint32_t flags = File::compare(file, preceding);
+				if (INFO_TEST(flags, FILE_INFO_DATA_DIFFERS)) {
+					context->depot->m_is_dirty = true;
+					state = 'U';
+					IF_DEBUG("[uninstall]    restoring\n");
+					if (!dryrun && res == 0) {
+						if (INFO_TEST(flags, FILE_INFO_TYPE_DIFFERS) &&
+							S_ISDIR(preceding->mode())) {
+							// use rename instead of mkdir so children are restored
+							res = preceding->dirrename(context->depot->m_archives_path, 
+													               context->depot->m_prefix,
+                                         context->reverse_files);							
+
+						} else {
+							bool inflated;
+							if (INFO_TEST(preceding->info(), FILE_INFO_ROLLBACK_DELTA)) {
+								res = context->depot->inflate(preceding, file, actual, &inflated);
+							}
+							if (res == 0) res = preceding->install(context->depot->m_archives_path, 
+													             context->depot->m_prefix,
+                                       context->reverse_files);
+						}
+					}
+				} else if (INFO_TEST(flags, FILE_INFO_MODE_DIFFERS) ||
+					   INFO_TEST(flags, FILE_INFO_GID_DIFFERS) ||
+					   INFO_TEST(flags, FILE_INFO_UID_DIFFERS)) {
 					context->depot->m_is_dirty = true;
 					state = 'M';
 					if (!dryrun && res == 0) {
@@ -989,251 +2571,1264 @@ int Depot::uninstall_file(File* file, void* ctx) {
 				} else {
 					IF_DEBUG("[uninstall]    no changes; leaving in place\n");
 				}
-				if (!context->depot->m_modified_extensions &&
-					(strncmp(file->path(), "/System/Library/Extensions", 26) == 0)) {
+				if (!context->depot->m_modified_extensions &&
+					(strncmp(file->path(), "/System/Library/Extensions", 26) == 0)) {
+					IF_DEBUG("[uninstall]    kernel extension detected\n");
+					context->depot->m_modified_extensions = true;
+				}
+			}
+			if (obsolete) {
+				if (!dryrun && res == 0) {
+					res = context->files_to_remove->add(preceding->serial());
+				}
+			}
+			delete preceding;
+		} else {
+			IF_DEBUG("[uninstall]    in use by newer installation; leaving in place\n");
+			if (superseded != file) delete superseded;
+		}
+	}
+
+	fprintf(stdout, "%c %s\n", state, file->path());
+
+	if (res != 0) fprintf(stderr, "%s:%d: uninstall failed: %s\n", 
+						  __FILE__, __LINE__, file->path());
+	if (res == 0 && !dryrun && (state == 'R' || state == 'U' || state == 'M')) {
+		res = context->dirty->add(actpath);
+	}
+
+	free(actpath);
+	return res;
+}
+
+// whether archive may be uninstalled, sets skip if it should not be
+int Depot::uninstall_check(Archive* archive, bool* skip) {
+	extern uint32_t verbosity;
+	extern uint32_t force;
+
+	*skip = true;
+	if (INFO_TEST(archive->info(), ARCHIVE_INFO_ROLLBACK)) {
+		// if in debug mode, get_all_archives returns rollbacks too, so just ignore
+		if (verbosity & VERBOSE_DEBUG) {
+			fprintf(stderr, "[uninstall] skipping uninstall since archive is a rollback.\n");
+			return DEPOT_OK;
+		}
+		fprintf(stderr, "%s:%d: cannot uninstall a rollback archive.\n", __FILE__, __LINE__);
+		return DEPOT_ERROR;
+	}
+
+	/** 
+	 * require -f to force uninstalling an archive installed on top of an older
+	 * base system since the rollback archive we'll use will potentially damage
+	 * the base system.
+	 */
+	if (!force && 
+		this->m_build &&
+		archive->build() &&
+		(strcmp(this->m_build, archive->build()) != 0) &&
+		!this->is_superseded(archive)
+		) {
+		fprintf(stderr, 
+				"-------------------------------------------------------------------------------\n"
+				"The %s root was installed on a different base OS build (%s). The current    \n"
+				"OS build is %s. Uninstalling a root that was installed on a different OS     \n"
+				"build has the potential to damage your OS install due to the fact that the   \n"
+				"rollback data is from the wrong OS version.\n\n"
+				" You must use the force (-f) option to make this potentially unsafe operation  \n"
+				"happen.\n"
+				"-------------------------------------------------------------------------------\n",
+				archive->name(), archive->build(), m_build);
+		return DEPOT_BUILD_MISMATCH;
+	}
+	
+	*skip = false;
+	return DEPOT_OK;
+}
+
+int Depot::uninstall(Archive* archive) {
+	extern uint32_t dryrun;
+	int res = 0;
+
+	assert(archive != NULL);
+	uint64_t serial = archive->serial();
+
+	bool skip;
+	res = this->uninstall_check(archive, &skip);
+	if (skip || res != 0) return res;
+
+	if (!dryrun) {
+		if (res == 0) res = m_journal->begin_uninstall(archive);
+
+		// XXX: this may be superfluous
+		// uninstall_file should be smart enough to do a mtime check...
+		if (res == 0) res = this->prune_directories();
+
+		// We do this here to get an exclusive lock on the database.
+		if (res == 0) res = this->begin_transaction();
+		if (res == 0) res = m_db->deactivate_archive(serial);
+		if (res == 0) res = this->commit_transaction();
+	}
+	
+	InstallContext context(this, archive);
+	context.reverse_files = true; // uninstall children before parents
+	if (res == 0) res = this->uninstall_files(archive, &context);
+	if (!dryrun && res == 0) res = this->finish_uninstall(archive, &context);
+	
+	if (res == 0) fprintf(stdout, "Uninstalled archive: %llu %s \n",
+						  archive->serial(), archive->name());
+
+	return res;
+}
+
+int Depot::uninstall_files(Archive* archive, void* ctx) {
+	extern uint32_t dryrun;
+	InstallContext* context = (InstallContext*)ctx;
+	uint8_t** filelist;
+	uint8_t** preceding;
+	uint8_t* superseded;
+	uint32_t count = 0;
+	uint32_t i;
+	int res = m_db->get_uninstall_plan(&filelist, &preceding, &superseded, &count, archive);
+	if (res == DB_ERROR) return res;
+	res = DEPOT_OK;
+	
+	// files made early, followed by the files preceding them
+	File** made = (File**)calloc(2 * count + 1, sizeof(File*));
+	File** actuals = (File**)calloc(count + 1, sizeof(File*));
+	File** deltas = (File**)calloc(count + 1, sizeof(File*));
+	File** bases = (File**)calloc(count + 1, sizeof(File*));
+	if (!made || !actuals || !deltas || !bases) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		res = DEPOT_ERROR;
+	}
+	
+	// rollback deltas against files of the archive are written out in full
+	// while the rollbacks are whole, unless restoring them uses them up
+	uint32_t n = 0;
+	for (i = 0; !dryrun && res == 0 && i < count; i++) {
+		uint64_t info;
+		if (!preceding[i]) continue;
+		memcpy(&info, &preceding[i][m_db->file_offset(2)], sizeof(uint64_t));
+		if (!INFO_TEST(info, FILE_INFO_ROLLBACK_DELTA)) continue;
+		File* file = made[i] = m_db->make_file(filelist[i]);
+		File* delta = made[count + i] = m_db->make_file(preceding[i]);
+		filelist[i] = NULL;
+		preceding[i] = NULL;
+		if (!file || !delta) {
+			fprintf(stderr, "%s:%d: DB::make_file returned NULL\n", __FILE__, __LINE__);
+			res = -1;
+			break;
+		}
+		char* actpath;
+		join_path(&actpath, m_prefix, file->path());
+		File* actual = FileFactory(actpath);
+		free(actpath);
+		bool used = (!superseded[i] && File::compare(file, actual) == FILE_INFO_IDENTICAL &&
+					 !INFO_TEST(delta->info(), FILE_INFO_BASE_SYSTEM));
+		if (used) {
+			delete actual;
+			continue;
+		}
+		deltas[n] = delta;
+		bases[n] = file;
+		actuals[n++] = actual;
+	}
+	if (res == 0 && n) res = this->inflate_rollbacks(n, deltas, bases, actuals);
+	
+	// like iterate_files, keep going after a file fails
+	bool ready = (res == 0);
+	context->planned = true;
+	for (i = 0; ready && i < count; i++) {
+		File* file = made[i];
+		if (!file && filelist[i]) file = m_db->make_file(filelist[i]);
+		filelist[i] = NULL;
+		made[i] = NULL;
+		context->superseded = superseded[i];
+		context->preceding = made[count + i];
+		made[count + i] = NULL;
+		if (!context->preceding && preceding[i]) {
+			context->preceding = m_db->make_file(preceding[i]);
+			preceding[i] = NULL;
+		}
+		if (file) {
+			res = uninstall_file(file, context);
+			delete file;
+		} else {
+			fprintf(stderr, "%s:%d: DB::make_file returned NULL\n", __FILE__, __LINE__);
+			res = -1;
+			break;
+		}
+		delete context->preceding;
+		context->preceding = NULL;
+	}
+	context->planned = false;
+	
+	// whatever an error left behind
+	for (i = 0; i < count; i++) {
+		if (filelist[i]) m_db->free_file(filelist[i]);
+		if (preceding[i]) m_db->free_file(preceding[i]);
+		if (made) delete made[i];
+		if (made) delete made[count + i];
+	}
+	for (i = 0; i < n; i++) delete actuals[i];
+	free(made);
+	free(actuals);
+	free(deltas);
+	free(bases);
+	free(filelist);
+	free(preceding);
+	free(superseded);
+	return res;
+}
+
+int Depot::uninstall(uint32_t count, Archive** archives) {
+	extern uint32_t dryrun;
+	int res = 0;
+	
+	Archive** list = (Archive**)malloc((count + 1) * sizeof(Archive*));
+	if (!list) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		return DEPOT_ERROR;
+	}
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		bool skip;
+		int check = this->uninstall_check(archives[i], &skip);
+		if (check != 0) res = check;
+		if (!skip) list[n++] = archives[i];
+	}
+	
+	int uninstalled = 0;
+	if (n == 1) {
+		uninstalled = this->uninstall(list[0]);
+	} else if (n > 1) {
+		if (!dryrun) {
+			for (uint32_t i = 0; uninstalled == 0 && i < n; i++) {
+				uninstalled = m_journal->begin_uninstall(list[i]);
+			}
+			if (uninstalled == 0) uninstalled = this->prune_directories();
+			if (uninstalled == 0) uninstalled = this->begin_transaction();
+			for (uint32_t i = 0; uninstalled == 0 && i < n; i++) {
+				uninstalled = m_db->deactivate_archive(list[i]->serial());
+			}
+			if (uninstalled == 0) uninstalled = this->commit_transaction();
+		}
+		
+		InstallContext context(this, list[0]);
+		context.reverse_files = true;
+		if (uninstalled == 0) uninstalled = this->uninstall_plan(n, list, &context);
+		if (!dryrun && uninstalled == 0) {
+			uninstalled = this->finish_uninstall(n, list, &context);
+		}
+		for (uint32_t i = 0; uninstalled == 0 && i < n; i++) {
+			fprintf(stdout, "Uninstalled archive: %llu %s \n",
+					list[i]->serial(), list[i]->name());
+		}
+	}
+	if (uninstalled != 0) res = uninstalled;
+	
+	free(list);
+	return res;
+}
+
+struct PlanPath {
+	uint32_t first;   // the files at this path are files[first, first + count)
+	uint32_t count;
+	File* actual;     // what was on disk before the plan
+	File* data;       // the contents the path ends up with, actual if unchanged
+	File* state;      // what the path ends up as, NULL if removed
+};
+
+// reverse path order, then oldest archive first
+static int compare_plan_files(const void* a, const void* b) {
+	File* fa = *(File**)a;
+	File* fb = *(File**)b;
+	int res = strcmp(fb->path(), fa->path());
+	if (res) return res;
+	uint64_t sa = fa->archive()->serial();
+	uint64_t sb = fb->archive()->serial();
+	if (sa != sb) return (sa < sb) ? -1 : 1;
+	if (fa->serial() != fb->serial()) return (fa->serial() < fb->serial()) ? -1 : 1;
+	return 0;
+}
+
+// Works out what uninstalling archives one after another would leave at 
+// each of their paths, without touching anything, then gets every path
+// there in one step. Restoring a file that a later archive would remove 
+// or replace again is skipped, and so is the rollback data in between.
+int Depot::uninstall_plan(uint32_t count, Archive** archives, void* ctx) {
+	extern uint32_t dryrun;
+	InstallContext* context = (InstallContext*)ctx;
+	int res = 0;
+	
+	// every file at every path any of the archives has
+	File** files = NULL;
+	uint32_t total = 0;
+	for (uint32_t k = 0; res == 0 && k < count; k++) {
+		uint8_t** rows = NULL;
+		uint32_t n = 0;
+		if (m_db->get_path_files(&rows, &n, archives[k]) == DB_ERROR) {
+			res = DEPOT_ERROR;
+			break;
+		}
+		File** more = (File**)realloc(files, (total + n + 1) * sizeof(File*));
+		if (!more) {
+			fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+			res = DEPOT_ERROR;
+		} else {
+			files = more;
+		}
+		for (uint32_t j = 0; j < n; j++) {
+			File* file = res ? NULL : m_db->make_file(rows[j]);
+			if (file) {
+				files[total++] = file;
+			} else if (res == 0) {
+				fprintf(stderr, "%s:%d: DB::make_file returned NULL\n", __FILE__, __LINE__);
+				res = DEPOT_ERROR;
+			} else {
+				m_db->free_file(rows[j]);
+			}
+		}
+		free(rows);
+	}
+	
+	// the same file turns up once for each archive sharing its path
+	uint32_t n = 0;
+	if (total) qsort(files, total, sizeof(File*), compare_plan_files);
+	for (uint32_t i = 0; i < total; i++) {
+		if (n && files[n - 1]->serial() == files[i]->serial()) {
+			delete files[i];
+		} else {
+			files[n++] = files[i];
+		}
+	}
+	total = n;
+	
+	int* order = (int*)calloc(total + 1, sizeof(int));      // index into archives
+	char* states = (char*)calloc(total + 1, sizeof(char));  // what to print
+	char* gone = (char*)calloc(total + 1, sizeof(char));    // no longer in the depot
+	PlanPath* paths = (PlanPath*)calloc(total + 1, sizeof(PlanPath));
+	if (res == 0 && (!order || !states || !gone || !paths)) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		res = DEPOT_ERROR;
+	}
+	uint32_t path_count = 0;
+	for (uint32_t i = 0; res == 0 && i < total; i++) {
+		order[i] = -1;
+		for (uint32_t k = 0; k < count; k++) {
+			if (files[i]->archive()->serial() == archives[k]->serial()) order[i] = k;
+		}
+		if (i == 0 || strcmp(files[i]->path(), files[i - 1]->path()) != 0) {
+			paths[path_count++].first = i;
+		}
+		paths[path_count - 1].count++;
+	}
+	
+	// go through the archives in order at each path, the same steps as
+	// uninstall_file() but against the planned state of the path
+	const char* resume = context->resume_path;
+	for (uint32_t p = 0; res == 0 && p < path_count; p++) {
+		PlanPath* path = &paths[p];
+		uint32_t first = path->first;
+		uint32_t last = first + path->count;
+		const char* filepath = files[first]->path();
+		
+		// the paths before the one an interrupted uninstall stopped at are done
+		if (resume) {
+			if (strcmp(filepath, resume) != 0) continue;
+			resume = NULL;
+		}
+		
+		char* actpath;
+		join_path(&actpath, m_prefix, filepath);
+		path->actual = FileFactory(actpath);
+		path->data = path->actual;
+		path->state = path->actual;
+		free(actpath);
+		
+		for (uint32_t k = 0; k < count; k++) {
+			uint32_t i;
+			for (i = first; i < last && order[i] != (int)k; i++);
+			if (i == last) continue;
+			File* file = files[i];
+			gone[i] = 1;
+			
+			// We never uninstall a file that was part of the base system
+			if (INFO_TEST(file->info(), FILE_INFO_BASE_SYSTEM)) continue;
+			
+			states[i] = ' ';
+			if (path->state == NULL) {
+				states[i] = '!';
+				continue;
+			}
+			if (File::compare(file, path->state) != FILE_INFO_IDENTICAL) continue;
+			
+			File* superseded = NULL;
+			File* preceding = NULL;
+			for (uint32_t j = first; j < last; j++) {
+				if (gone[j]) continue;
+				uint64_t serial = files[j]->archive()->serial();
+				if (serial > file->archive()->serial()) superseded = files[j];
+				if (serial < file->archive()->serial()) preceding = files[j];
+			}
+			if (superseded) continue;
+			assert(preceding != NULL);
+			
+			uint64_t info = preceding->info();
+			if (INFO_TEST(info, FILE_INFO_NO_ENTRY | FILE_INFO_ROLLBACK_DATA) &&
+				!INFO_TEST(info, FILE_INFO_BASE_SYSTEM)) {
+				for (uint32_t j = first; j < last; j++) {
+					if (files[j] == preceding) gone[j] = 2;
+				}
+			}
+			if (INFO_TEST(info, FILE_INFO_NO_ENTRY)) {
+				states[i] = 'R';
+				path->data = NULL;
+				path->state = NULL;
+			} else {
+				uint32_t flags = File::compare(file, preceding);
+				if (INFO_TEST(flags, FILE_INFO_DATA_DIFFERS)) {
+					states[i] = 'U';
+					path->data = preceding;
+					path->state = preceding;
+				} else if (INFO_TEST(flags, FILE_INFO_MODE_DIFFERS) ||
+						   INFO_TEST(flags, FILE_INFO_GID_DIFFERS) ||
+						   INFO_TEST(flags, FILE_INFO_UID_DIFFERS)) {
+					states[i] = 'M';
+					path->state = preceding;
+				}
+				if (!m_modified_extensions &&
+					(strncmp(filepath, "/System/Library/Extensions", 26) == 0)) {
 					IF_DEBUG("[uninstall]    kernel extension detected\n");
-					context->depot->m_modified_extensions = true;
+					m_modified_extensions = true;
 				}
 			}
-			uint64_t info = preceding->info();
-			if (INFO_TEST(info, FILE_INFO_NO_ENTRY | FILE_INFO_ROLLBACK_DATA) &&
-			    !INFO_TEST(info, FILE_INFO_BASE_SYSTEM)) {
-				if (!dryrun && res == 0) {
-					res = context->files_to_remove->add(preceding->serial());
+			if (states[i] != ' ') m_is_dirty = true;
+		}
+	}
+	
+	for (uint32_t k = 0; res == 0 && k < count; k++) {
+		for (uint32_t i = 0; i < total; i++) {
+			if (order[i] == (int)k && states[i]) {
+				fprintf(stdout, "%c %s\n", states[i], files[i]->path());
+			}
+		}
+	}
+	
+	// rollback deltas against the files of these archives are written out 
+	// in full while the rollbacks are whole, unless restoring them uses 
+	// them up, a delta is against the file that came after it
+	File** deltas = (File**)calloc(total + 1, sizeof(File*));
+	File** bases = (File**)calloc(total + 1, sizeof(File*));
+	File** actuals = (File**)calloc(total + 1, sizeof(File*));
+	if (res == 0 && (!deltas || !bases || !actuals)) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		res = DEPOT_ERROR;
+	}
+	uint32_t inflate_count = 0;
+	for (uint32_t p = 0; !dryrun && res == 0 && p < path_count; p++) {
+		PlanPath* path = &paths[p];
+		uint32_t last = path->first + path->count;
+		for (uint32_t j = path->first; j + 1 < last; j++) {
+			if (INFO_TEST(files[j]->info(), FILE_INFO_ROLLBACK_DELTA) && gone[j] != 2 &&
+				order[j + 1] >= 0) {
+				deltas[inflate_count] = files[j];
+				bases[inflate_count] = files[j + 1];
+				actuals[inflate_count++] = path->actual;
+			}
+		}
+	}
+	if (res == 0 && inflate_count) res = this->inflate_rollbacks(inflate_count, deltas, bases, actuals);
+	free(deltas);
+	free(bases);
+	free(actuals);
+	
+	// children before parents, as uninstall_file() would
+	for (uint32_t p = 0; !dryrun && res == 0 && p < path_count; p++) {
+		PlanPath* path = &paths[p];
+		uint32_t first = path->first;
+		uint32_t last = first + path->count;
+		const char* filepath = files[first]->path();
+		if (!path->actual) continue;
+		
+		bool obsolete = false;
+		for (uint32_t j = first; res == 0 && j < last; j++) {
+			if (gone[j] != 2) continue;
+			obsolete = true;
+			res = m_journal->file(filepath, files[j]->serial());
+			if (res == 0) res = context->files_to_remove->add(files[j]->serial());
+		}
+		if (path->data == path->actual && path->state == path->actual) continue;
+		if (res == 0 && !obsolete) res = m_journal->file(filepath, 0);
+		
+		if (res == 0 && path->data == NULL) {
+			IF_DEBUG("[uninstall] removing %s\n", filepath);
+			res = path->actual->remove();
+		} else if (res == 0 && path->data != path->actual) {
+			IF_DEBUG("[uninstall] restoring %s\n", filepath);
+			uint32_t flags = File::compare(path->actual, path->data);
+			if (INFO_TEST(flags, FILE_INFO_TYPE_DIFFERS) && S_ISDIR(path->data->mode())) {
+				// use rename instead of mkdir so children are restored
+				res = path->data->dirrename(m_archives_path, m_prefix, true);
+			} else {
+				for (uint32_t j = first; j + 1 < last; j++) {
+					bool inflated;
+					if (files[j] == path->data &&
+						INFO_TEST(files[j]->info(), FILE_INFO_ROLLBACK_DELTA)) {
+						res = this->inflate(files[j], files[j + 1], path->actual, &inflated);
+					}
 				}
+				if (res == 0) res = path->data->install(m_archives_path, m_prefix, true);
 			}
-			delete preceding;
-		} else {
-			IF_DEBUG("[uninstall]    in use by newer installation; leaving in place\n");
-			delete superseded;
 		}
+		if (res == 0 && path->state && path->state != path->data) {
+			res = path->state->install_info(m_prefix);
+		}
+		if (res != 0) fprintf(stderr, "%s:%d: uninstall failed: %s\n", 
+							  __FILE__, __LINE__, filepath);
+		if (res == 0) res = context->dirty->add(path->actual->path());
 	}
+	
+	for (uint32_t p = 0; paths && p < path_count; p++) delete paths[p].actual;
+	for (uint32_t i = 0; i < total; i++) delete files[i];
+	free(files);
+	free(order);
+	free(states);
+	free(gone);
+	free(paths);
+	return res;
+}
 
-	fprintf(stdout, "%c %s\n", state, file->path());
+int Depot::finish_uninstall(Archive* archive, void* ctx) {
+	return this->finish_uninstall(1, &archive, ctx);
+}
 
-	if (res != 0) fprintf(stderr, "%s:%d: uninstall failed: %s\n", 
-						  __FILE__, __LINE__, file->path());
+int Depot::finish_uninstall(uint32_t count, Archive** archives, void* ctx) {
+	InstallContext* context = (InstallContext*)ctx;
+	// the restored files go to disk before their records go away
+	int res = context->dirty->sync();
+	if (res == 0) res = this->begin_transaction();
+	if (res == 0) res = m_db->delete_files(context->files_to_remove->values,
+										   context->files_to_remove->count);
+	for (uint32_t i = 0; res == 0 && i < count; i++) {
+		res = this->remove(archives[i]);
+	}
+	if (res == 0) res = this->commit_transaction();
+	if (res == 0) res = m_journal->commit();
 
-	free(actpath);
+	// delete all of the expanded archive backing stores to save disk space
+	if (res == 0) res = this->prune_directories();
+
+	for (uint32_t i = 0; res == 0 && i < count; i++) {
+		res = this->prune_archive(archives[i]);
+	}
+	
 	return res;
 }
 
-int Depot::uninstall(Archive* archive) {
-	extern uint32_t verbosity;
-	extern uint32_t force;
-	extern uint32_t dryrun;
+int Depot::verify_file(File* file, void* ctx) {
+	InstallContext* context = (InstallContext*)ctx;
+	
+	// the file installed at a path that did not change since it was last
+	// compared is still the same, without hashing it again, unless it 
+	// changed too recently to tell
+	if (context->changed && !context->changed->is_changed(file->path()) &&
+		!context->changed->is_recent(file->path())) {
+		File* superseded = context->depot->file_superseded_by(file);
+		delete superseded;
+		if (!superseded) {
+			fprintf(context->output, "  ");
+			file->print(context->output);
+			return DEPOT_OK;
+		}
+	}
+	
+	File* actual = FileFactory(file->path());
+	if (actual) {
+		uint32_t flags = File::compare(file, actual);
+		
+		if (flags != FILE_INFO_IDENTICAL) {
+			fprintf(context->output, "M ");
+		} else {
+			fprintf(context->output, "  ");
+		}
+	} else {
+		fprintf(context->output, "R ");
+	}
+	file->print(context->output);
+	return DEPOT_OK;
+}
+
+void Depot::archive_header() {
+	archive_header(stdout);
+}
+
+void Depot::archive_header(FILE* stream) {
+	fprintf(stream, "%-6s %-36s  %-12s  %-7s  %s\n", 
+			"Serial", "UUID", "Date", "Build", "Name");
+	fprintf(stream, "====== ====================================  "
+			"============  =======  =================\n");	
+}
+
+int Depot::verify(Archive* archive, FILE* output) {
 	int res = 0;
+	InstallContext context(this, archive);
+	context.output = output;
+	DirtyLog changed(m_dirty_path, m_prefix);
+	if (changed.read() == 0 && changed.complete()) context.changed = &changed;
+	this->archive_header(output);
+	list_archive(archive, output);	
+	hr(output);
+	if (res == 0) res = this->iterate_files(archive, &Depot::verify_file, &context);
+	hr(output);
+	fprintf(output, "\n");
+	return res;
+}
 
-	assert(archive != NULL);
+int Depot::list_archive(Archive* archive, void* context) {	
 	uint64_t serial = archive->serial();
+	
+	char uuid[37];
+	uuid_unparse_upper(archive->uuid(), uuid);
 
-	if (INFO_TEST(archive->info(), ARCHIVE_INFO_ROLLBACK)) {
-		// if in debug mode, get_all_archives returns rollbacks too, so just ignore
-		if (verbosity & VERBOSE_DEBUG) {
-			fprintf(stderr, "[uninstall] skipping uninstall since archive is a rollback.\n");
-			return DEPOT_OK;
+	char date[100];
+	struct tm local;
+	time_t seconds = archive->date_installed();
+	localtime_r(&seconds, &local);
+	strftime(date, sizeof(date), "%b %e %H:%M", &local);
+
+	fprintf((FILE*)context, "%-6llu %-36s  %-12s  %-7s  %s\n", 
+			serial, uuid, date, (archive->build()?archive->build():""), archive->name());
+	
+	return DEPOT_OK;
+}
+
+int Depot::list() {
+	return this->list(0, NULL);
+}
+
+int Depot::list(int count, char** args) {
+	int res = 0;
+
+	this->archive_header();
+	
+	// handle the default case of "all"
+	if (count == 0) return this->iterate_archives(&Depot::list_archive, stdout);
+
+	Archive** list;
+	Archive* archive;
+	uint32_t archcnt;
+	for (int i = 0; res == 0 && i < count; i++) {
+		list = NULL;
+		archive = NULL;
+		archcnt = 0;
+		// check for special keywords
+		if (strncasecmp(args[i], "all", 3) == 0 && strlen(args[i]) == 3) {
+			list = this->get_all_archives(&archcnt);
+		} else if (strncasecmp(args[i], "superseded", 10) == 0 && strlen(args[i]) == 10) {
+			list = this->get_superseded_archives(&archcnt);
+		} 
+		if (archcnt) {
+			// loop over special keyword results
+			for (uint32_t j = 0; res == 0 && j < archcnt; j++) {
+				res = this->list_archive(list[j], stdout);
+			}
+		} else {
+			// arg is a single-archive specifier
+			archive = this->get_archive(args[i]);
+			if (archive) res = this->list_archive(archive, stdout);
 		}
-		fprintf(stderr, "%s:%d: cannot uninstall a rollback archive.\n", __FILE__, __LINE__);
+	}
+
+	return res;
+}
+
+int Depot::print_file(File* file, void* ctx) {
+	extern uint32_t verbosity;
+	InstallContext* context = (InstallContext*)ctx;
+	if (verbosity & VERBOSE_DEBUG) fprintf(context->output, "%04llx ", file->info());
+	file->print(context->output);
+	return DEPOT_OK;
+}
+
+int Depot::files(Archive* archive, FILE* output) {
+	int res = 0;
+	this->archive_header(output);
+	res = this->dump_archive(archive, output);
+	return res;
+}
+
+int Depot::dump_archive(Archive* archive, FILE* output) {
+	int res = 0;
+	InstallContext context(this, archive);
+	context.output = output;
+	list_archive(archive, output);
+	hr(output);
+	if (res == 0) res = this->iterate_files(archive, &Depot::print_file, &context);
+	hr(output);
+	fprintf(output, "\n");
+	return res;
+}
+
+int Depot::dump() {
+	extern uint32_t verbosity;
+	verbosity = 0xFFFFFFFF; // dump is intrinsically a debug command
+	int res = 0;
+	this->archive_header();
+	
+	uint32_t count = 0;
+	Archive** list = this->get_all_archives(&count);
+	FILE** outputs = (FILE**)calloc(count + 1, sizeof(FILE*));
+	int* results = (int*)calloc(count + 1, sizeof(int));
+	if (!outputs || !results) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
 		return DEPOT_ERROR;
 	}
+	this->read_archives("dump", count, list, outputs, results);
+	for (uint32_t i = 0; i < count; i++) {
+		if (outputs[i]) {
+			res = copy_output(outputs[i], stdout);
+			if (res == 0) res = results[i];
+		} else {
+			res = this->dump_archive(list[i], stdout);
+		}
+	}
+	free_read_results(count, list, outputs, results);
+	return res;
+}
 
-	/** 
-	 * require -f to force uninstalling an archive installed on top of an older
-	 * base system since the rollback archive we'll use will potentially damage
-	 * the base system.
-	 */
-	if (!force && 
-		this->m_build &&
-		archive->build() &&
-		(strcmp(this->m_build, archive->build()) != 0) &&
-		!this->is_superseded(archive)
-		) {
-		fprintf(stderr, 
-				"-------------------------------------------------------------------------------\n"
-				"The %s root was installed on a different base OS build (%s). The current    \n"
-				"OS build is %s. Uninstalling a root that was installed on a different OS     \n"
-				"build has the potential to damage your OS install due to the fact that the   \n"
-				"rollback data is from the wrong OS version.\n\n"
-				" You must use the force (-f) option to make this potentially unsafe operation  \n"
-				"happen.\n"
-				"-------------------------------------------------------------------------------\n",
-				archive->name(), archive->build(), m_build);
-		return DEPOT_BUILD_MISMATCH;
+struct StatsContext {
+	StatsContext() {
+		files = 0;
+		digests = NULL;
+		digest_count = 0;
+		digest_max = 0;
 	}
+	~StatsContext() {
+		free(digests);
+	}
+	
+	uint64_t files;   // of the archive being counted
+	uint8_t* digests; // of every file, CC_SHA1_DIGEST_LENGTH bytes each
+	uint32_t digest_count;
+	uint32_t digest_max;
+};
 
-	if (res != 0) return res;
+int Depot::stats_file(File* file, void* ctx) {
+	StatsContext* context = (StatsContext*)ctx;
+	context->files++;
+	Digest* digest = file->digest();
+	if (!digest || digest->size() != CC_SHA1_DIGEST_LENGTH) return DEPOT_OK;
+	if (context->digest_count >= context->digest_max) {
+		uint32_t max = context->digest_max ? context->digest_max * REALLOC_FACTOR 
+		                                   : INITIAL_ROWS;
+		uint8_t* digests = (uint8_t*)realloc(context->digests, 
+											 max * CC_SHA1_DIGEST_LENGTH);
+		if (!digests) {
+			fprintf(stderr, "Error: ran out of memory in Depot::stats_file\n");
+			return DEPOT_ERROR;
+		}
+		context->digests = digests;
+		context->digest_max = max;
+	}
+	memcpy(context->digests + context->digest_count * CC_SHA1_DIGEST_LENGTH, 
+		   digest->data(), CC_SHA1_DIGEST_LENGTH);
+	context->digest_count++;
+	return DEPOT_OK;
+}
 
-	if (!dryrun) {
-		// XXX: this may be superfluous
-		// uninstall_file should be smart enough to do a mtime check...
-		if (res == 0) res = this->prune_directories();
+static int compare_digests(const void* a, const void* b) {
+	return memcmp(a, b, CC_SHA1_DIGEST_LENGTH);
+}
 
-		// We do this here to get an exclusive lock on the database.
-		if (res == 0) res = this->begin_transaction();
-		if (res == 0) res = m_db->deactivate_archive(serial);
-		if (res == 0) res = this->commit_transaction();
+struct ArchiveStats {
+	Archive* archive;
+	uint64_t files;
+	uint64_t stored;  // bytes of the compacted backing store
+	bool     shared;  // through the object store
+};
+
+// largest backing store first, then oldest
+static int compare_archive_stats(const void* a, const void* b) {
+	const ArchiveStats* x = *(const ArchiveStats**)a;
+	const ArchiveStats* y = *(const ArchiveStats**)b;
+	if (x->stored != y->stored) return x->stored > y->stored ? -1 : 1;
+	if (x->archive->serial() != y->archive->serial()) {
+		return x->archive->serial() < y->archive->serial() ? -1 : 1;
+	}
+	return 0;
+}
+
+static void json_string(FILE* output, const char* str) {
+	fputc('"', output);
+	for (const unsigned char* c = (const unsigned char*)str; c && *c; c++) {
+		if (*c == '"' || *c == '\\') {
+			fprintf(output, "\\%c", *c);
+		} else if (*c < 0x20) {
+			fprintf(output, "\\u%04x", *c);
+		} else {
+			fputc(*c, output);
+		}
+	}
+	fputc('"', output);
+}
+
+int Depot::stats(bool json) {
+	int res = 0;
+	uint8_t** data = NULL;
+	uint32_t count = 0;
+	if (m_db->get_archives(&data, &count, true) & DB_ERROR) {
+		fprintf(stderr, "Error: unable to read the archives.\n");
+		return DEPOT_ERROR;
+	}
+	ArchiveStats* archives = (ArchiveStats*)calloc(count + 1, sizeof(ArchiveStats));
+	ArchiveStats** largest = (ArchiveStats**)calloc(count + 1, sizeof(ArchiveStats*));
+	if (!archives || !largest) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		return DEPOT_ERROR;
 	}
 	
-	InstallContext context(this, archive);
-	context.reverse_files = true; // uninstall children before parents
-	if (res == 0) res = this->iterate_files(archive, &Depot::uninstall_file, &context);
+	// archives come newest first
+	StatsContext context;
+	uint32_t rollbacks = 0;
+	uint64_t files = 0;
+	uint64_t stored = 0;
+	uint64_t shared = 0;
+	for (uint32_t i = 0; res == 0 && i < count; i++) {
+		ArchiveStats* stats = &archives[count - 1 - i];
+		stats->archive = m_db->make_archive(data[i]);
+		largest[count - 1 - i] = stats;
+		if (INFO_TEST(stats->archive->info(), ARCHIVE_INFO_ROLLBACK)) rollbacks++;
+		
+		context.files = 0;
+		res = this->iterate_files(stats->archive, &Depot::stats_file, &context);
+		stats->files = context.files;
+		files += context.files;
+		
+		char* tarpath = stats->archive->compacted_path(m_archives_path);
+		struct stat sb;
+		if (tarpath && lstat(tarpath, &sb) == 0) {
+			stats->stored = sb.st_size;
+			stats->shared = (sb.st_nlink > 1);
+			stored += sb.st_size;
+			if (stats->shared) shared += sb.st_size;
+		}
+		free(tarpath);
+	}
+	free(data);
 	
-	if (!dryrun) {
-		if (res == 0) res = this->begin_transaction();
-		uint32_t i;
-		for (i = 0; i < context.files_to_remove->count; ++i) {
-			uint64_t serial = context.files_to_remove->values[i];
-			if (res == 0) res = m_db->delete_file(serial);
+	// files with the same digest could share their data
+	uint32_t distinct = 0;
+	qsort(context.digests, context.digest_count, CC_SHA1_DIGEST_LENGTH, compare_digests);
+	for (uint32_t i = 0; i < context.digest_count; i++) {
+		if (i == 0 || compare_digests(context.digests + (i - 1) * CC_SHA1_DIGEST_LENGTH,
+									  context.digests + i * CC_SHA1_DIGEST_LENGTH)) {
+			distinct++;
+		}
+	}
+	
+	uint64_t db_bytes = 0;
+	uint64_t units = 0;
+	uint64_t unused = 0;
+	if (res == 0 && m_db->storage_usage(&db_bytes, &units, &unused)) res = DEPOT_ERROR;
+	double fragmented = units ? 100.0 * unused / units : 0.0;
+	bool log = (m_engine == DB_ENGINE_LOG);
+	
+	if (res == 0) qsort(largest, count, sizeof(ArchiveStats*), compare_archive_stats);
+	uint32_t top = count < STATS_LARGEST ? count : STATS_LARGEST;
+	
+	if (res == 0 && json) {
+		fprintf(stdout, "{\n");
+		fprintf(stdout, "  \"archives\": %u,\n", count);
+		fprintf(stdout, "  \"roots\": %u,\n", count - rollbacks);
+		fprintf(stdout, "  \"rollbacks\": %u,\n", rollbacks);
+		fprintf(stdout, "  \"files\": %llu,\n", files);
+		fprintf(stdout, "  \"digests\": %u,\n", context.digest_count);
+		fprintf(stdout, "  \"distinct_digests\": %u,\n", distinct);
+		fprintf(stdout, "  \"backing_store_bytes\": %llu,\n", stored);
+		fprintf(stdout, "  \"shared_bytes\": %llu,\n", shared);
+		fprintf(stdout, "  \"database\": {\n");
+		fprintf(stdout, "    \"engine\": \"%s\",\n", log ? "log" : "sqlite");
+		fprintf(stdout, "    \"bytes\": %llu,\n", db_bytes);
+		fprintf(stdout, "    \"%s\": %llu,\n", log ? "records" : "pages", units);
+		fprintf(stdout, "    \"%s\": %llu,\n", 
+				log ? "unused_records" : "free_pages", unused);
+		fprintf(stdout, "    \"fragmentation\": %.1f\n", fragmented);
+		fprintf(stdout, "  },\n");
+		fprintf(stdout, "  \"per_archive\": [");
+		for (uint32_t i = 0; i < count; i++) {
+			ArchiveStats* stats = &archives[i];
+			char uuid[37];
+			uuid_unparse_upper(stats->archive->uuid(), uuid);
+			fprintf(stdout, "%s\n    { \"serial\": %llu, \"uuid\": \"%s\", \"name\": ", 
+					i ? "," : "", stats->archive->serial(), uuid);
+			json_string(stdout, stats->archive->name());
+			fprintf(stdout, ", \"rollback\": %s, \"files\": %llu, "
+					"\"backing_store_bytes\": %llu, \"shared\": %s }",
+					INFO_TEST(stats->archive->info(), ARCHIVE_INFO_ROLLBACK) ? "true" : "false",
+					stats->files, stats->stored, 
+					stats->shared ? "true" : "false");
 		}
-		if (res == 0) res = this->commit_transaction();
-
-		if (res == 0) res = this->begin_transaction();	
-		if (res == 0) res = this->remove(archive);
-		if (res == 0) res = this->commit_transaction();
-
-		// delete all of the expanded archive backing stores to save disk space
-		if (res == 0) res = this->prune_directories();
-
-		if (res == 0) res = this->prune_archive(archive);
+		fprintf(stdout, "%s],\n", count ? "\n  " : "");
+		fprintf(stdout, "  \"largest\": [");
+		for (uint32_t i = 0; i < top; i++) {
+			fprintf(stdout, "%s%llu", i ? ", " : "", largest[i]->archive->serial());
+		}
+		fprintf(stdout, "]\n}\n");
+	} else if (res == 0) {
+		fprintf(stdout, "Archives:        %u (%u roots, %u rollbacks)\n", 
+				count, count - rollbacks, rollbacks);
+		fprintf(stdout, "Files:           %llu\n", files);
+		fprintf(stdout, "Digests:         %u (%u distinct)\n", context.digest_count, distinct);
+		fprintf(stdout, "Backing stores:  %llu bytes (%llu shared)\n", stored, shared);
+		fprintf(stdout, "Database:        %s, %llu bytes\n", log ? "log" : "sqlite", db_bytes);
+		fprintf(stdout, "                 %llu %s, %llu %s (%.1f%% fragmented)\n", units, 
+				log ? "records" : "pages", unused, log ? "unused" : "free", fragmented);
+		fprintf(stdout, "\n");
+		fprintf(stdout, "%-6s %-10s %-12s  %s\n", "Serial", "Files", "Stored", "Name");
+		fprintf(stdout, "====== ========== ============  =================\n");
+		for (uint32_t i = 0; i < count; i++) {
+			ArchiveStats* stats = &archives[i];
+			fprintf(stdout, "%-6llu %-10llu %-12llu%s %s\n", 
+					stats->archive->serial(), stats->files, stats->stored,
+					stats->shared ? "*" : " ", stats->archive->name());
+		}
+		if (top) fprintf(stdout, "\nLargest:        ");
+		for (uint32_t i = 0; i < top; i++) {
+			fprintf(stdout, " %llu", largest[i]->archive->serial());
+		}
+		if (top) fprintf(stdout, "\n");
 	}
 	
-	if (res == 0) fprintf(stdout, "Uninstalled archive: %llu %s \n",
-						  archive->serial(), archive->name());
-
+	for (uint32_t i = 0; i < count; i++) delete archives[i].archive;
+	free(archives);
+	free(largest);
 	return res;
 }
 
-int Depot::verify_file(File* file, void* context) {
-	File* actual = FileFactory(file->path());
-	if (actual) {
-		uint32_t flags = File::compare(file, actual);
-		
-		if (flags != FILE_INFO_IDENTICAL) {
-			fprintf(stdout, "M ");
-		} else {
-			fprintf(stdout, "  ");
-		}
-	} else {
-		fprintf(stdout, "R ");
-	}
-	file->print(stdout);
+int Depot::count_file(File* file, void* context) {
+	(*(uint64_t*)context)++;
 	return DEPOT_OK;
 }
 
-void Depot::archive_header() {
-	fprintf(stdout, "%-6s %-36s  %-12s  %-7s  %s\n", 
-			"Serial", "UUID", "Date", "Build", "Name");
-	fprintf(stdout, "====== ====================================  "
-			"============  =======  =================\n");	
+static int gc_size(WalkEntry* ent, void* context) {
+	if (ent->info == WALK_F || ent->info == WALK_SL) {
+		*(uint64_t*)context += ent->st.st_size;
+	}
+	return 0;
 }
 
-int Depot::verify(Archive* archive) {
-	int res = 0;
-	this->archive_header();
-	list_archive(archive, stdout);	
-	hr();
-	if (res == 0) res = this->iterate_files(archive, &Depot::verify_file, NULL);
-	hr();
-	fprintf(stdout, "\n");
-	return res;
+static int compare_names(const void* a, const void* b) {
+	return strcmp(*(const char**)a, *(const char**)b);
 }
 
-int Depot::list_archive(Archive* archive, void* context) {	
-	uint64_t serial = archive->serial();
-	
-	char uuid[37];
-	uuid_unparse_upper(archive->uuid(), uuid);
+struct GCContext {
+	Depot*    depot;
+	char**    known;   // names of the backing stores in use, sorted
+	uint32_t  known_count;
+	uint64_t  bytes;
+};
 
-	char date[100];
-	struct tm local;
-	time_t seconds = archive->date_installed();
-	localtime_r(&seconds, &local);
-	strftime(date, sizeof(date), "%b %e %H:%M", &local);
+int Depot::reclaim(const char* path, uint64_t* bytes) {
+	extern uint32_t dryrun;
+	uint64_t size = 0;
+	Walker walker(path);
+	walker.walk(&gc_size, &size);
+	fprintf(stdout, "%12llu  %s\n", size, path);
+	*bytes += size;
+	if (dryrun) return DEPOT_OK;
+	return this->trash(path);
+}
 
-	fprintf((FILE*)context, "%-6llu %-36s  %-12s  %-7s  %s\n", 
-			serial, uuid, date, (archive->build()?archive->build():""), archive->name());
-	
-	return DEPOT_OK;
+// anything at the top of the archives directory that is not the backing
+// store of an archive: stages and expansions left by an interrupted 
+// install, and backing stores of archives that are gone
+int Depot::gc_archive(WalkEntry* ent, void* ctx) {
+	GCContext* context = (GCContext*)ctx;
+	if (ent->level != 1 || ent->info == WALK_DP) return 0;
+	const char* name = ent->name;
+	if (bsearch(&name, context->known, context->known_count, sizeof(char*), 
+				compare_names)) {
+		return 0;
+	}
+	return context->depot->reclaim(ent->path, &context->bytes);
 }
 
-int Depot::list() {
-	return this->list(0, NULL);
+// partial downloads and downloads prune_downloads would remove
+int Depot::gc_download(WalkEntry* ent, void* ctx) {
+	GCContext* context = (GCContext*)ctx;
+	if (ent->level != 1 || ent->info == WALK_DP || ent->info == WALK_NS) return 0;
+	if (strncmp(ent->name, ".download.", 10) != 0 &&
+		ent->st.st_mtime + DOWNLOAD_CACHE_DAYS * 24 * 60 * 60 > time(NULL)) {
+		return 0;
+	}
+	return context->depot->reclaim(ent->path, &context->bytes);
 }
 
-int Depot::list(int count, char** args) {
+int Depot::gc(uint32_t seconds) {
+	extern uint32_t dryrun;
 	int res = 0;
-
-	this->archive_header();
+	uint8_t** data = NULL;
+	uint32_t count = 0;
+	if (m_db->get_archives(&data, &count, true) & DB_ERROR) {
+		fprintf(stderr, "Error: unable to read the archives.\n");
+		return DEPOT_ERROR;
+	}
+	GCContext context;
+	context.depot = this;
+	context.known = (char**)calloc(count + 1, sizeof(char*));
+	context.known_count = 0;
+	context.bytes = 0;
+	if (!context.known) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		free(data);
+		return DEPOT_ERROR;
+	}
 	
-	// handle the default case of "all"
-	if (count == 0) return this->iterate_archives(&Depot::list_archive, stdout);
-
-	Archive** list;
-	Archive* archive;
-	uint32_t archcnt;
-	for (int i = 0; res == 0 && i < count; i++) {
-		list = NULL;
-		archive = NULL;
-		archcnt = 0;
-		// check for special keywords
-		if (strncasecmp(args[i], "all", 3) == 0 && strlen(args[i]) == 3) {
-			list = this->get_all_archives(&archcnt);
-		} else if (strncasecmp(args[i], "superseded", 10) == 0 && strlen(args[i]) == 10) {
-			list = this->get_superseded_archives(&archcnt);
-		} 
-		if (archcnt) {
-			// loop over special keyword results
-			for (uint32_t j = 0; res == 0 && j < archcnt; j++) {
-				res = this->list_archive(list[j], stdout);
+	// rollbacks that saved no files have nothing to roll back, and their
+	// backing stores are collected below along with the other orphans
+	if (!dryrun) res = this->begin_transaction();
+	for (uint32_t i = 0; res == 0 && i < count; i++) {
+		Archive* archive = m_db->make_archive(data[i]);
+		uint64_t files = 0;
+		bool rollback = INFO_TEST(archive->info(), ARCHIVE_INFO_ROLLBACK);
+		if (rollback) res = this->iterate_files(archive, &Depot::count_file, &files);
+		if (res == 0 && rollback && files == 0) {
+			fprintf(stdout, "%12s  empty rollback %llu\n", "-", archive->serial());
+			if (!dryrun && m_db->delete_archive(archive)) res = DEPOT_ERROR;
+		} else if (res == 0) {
+			char* tarpath = archive->compacted_path(m_archives_path);
+			char* name = tarpath ? strdup(strrchr(tarpath, '/') + 1) : NULL;
+			free(tarpath);
+			if (!name) {
+				fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+				res = DEPOT_ERROR;
+			} else {
+				context.known[context.known_count++] = name;
 			}
-		} else {
-			// arg is a single-archive specifier
-			archive = this->get_archive(args[i]);
-			if (archive) res = this->list_archive(archive, stdout);
 		}
+		delete archive;
+	}
+	free(data);
+	if (!dryrun && res == 0) res = this->commit_transaction();
+	if (!dryrun && res) {
+		this->rollback_transaction();
+		fprintf(stderr, "Error: unable to remove empty rollbacks.\n");
+	}
+	
+	qsort(context.known, context.known_count, sizeof(char*), compare_names);
+	if (res == 0 && m_journal->pending() != JOURNAL_NONE) {
+		// a dry run does not recover, and recovery needs what is staged
+		IF_DEBUG("[gc] skipping %s until it is recovered\n", m_archives_path);
+	} else if (res == 0) {
+		Walker walker(m_archives_path);
+		walker.max_level(1);
+		res = walker.walk(&Depot::gc_archive, &context);
+	}
+	if (res == 0) {
+		Walker walker(m_downloads_path);
+		walker.max_level(1);
+		res = walker.walk(&Depot::gc_download, &context);
+	}
+	for (uint32_t i = 0; i < context.known_count; i++) free(context.known[i]);
+	free(context.known);
+	
+	// a dry run can only estimate what the database would give back
+	uint64_t db_bytes = 0;
+	uint64_t units = 0;
+	uint64_t unused = 0;
+	if (res == 0 && m_db->storage_usage(&db_bytes, &units, &unused)) res = DEPOT_ERROR;
+	uint64_t db_reclaimed = units ? db_bytes * unused / units : 0;
+	if (res == 0 && !dryrun) {
+		uint64_t before = db_bytes;
+		res = m_db->vacuum(seconds);
+		if (res == 0) res = m_db->storage_usage(&db_bytes, &units, &unused);
+		if (res) res = DEPOT_ERROR;
+		db_reclaimed = before > db_bytes ? before - db_bytes : 0;
+	}
+	if (res == 0) {
+		fprintf(stdout, "%12llu  database\n", db_reclaimed);
+		context.bytes += db_reclaimed;
+		fprintf(stdout, "%llu bytes %s\n", context.bytes, 
+				dryrun ? "reclaimable" : "reclaimed");
 	}
-
 	return res;
 }
 
-int Depot::print_file(File* file, void* context) {
-	extern uint32_t verbosity;
-	if (verbosity & VERBOSE_DEBUG) fprintf((FILE*)context, "%04llx ", file->info());
-	file->print((FILE*)context);
-	return DEPOT_OK;
-}
 
-int Depot::files(Archive* archive) {
-	int res = 0;
-	this->archive_header();
-	list_archive(archive, stdout);
-	hr();
-	if (res == 0) res = this->iterate_files(archive, &Depot::print_file, stdout);
-	hr();
-	fprintf(stdout, "\n");
-	return res;
+// the paths status compares, spread over several threads
+struct StatusContext {
+	StatusContext(const char* p, uint32_t c, File** f, char* s) {
+		prefix = p;
+		count = c;
+		files = f;
+		states = s;
+		next = 0;
+		pthread_mutex_init(&lock, NULL);
+	}
+	~StatusContext() {
+		pthread_mutex_destroy(&lock);
+	}
+	
+	const char* prefix;
+	uint32_t count;
+	File** files;
+	char* states;   // the status letter of each file, ' ' if it is the same
+	uint32_t next;
+	pthread_mutex_t lock;
+};
+
+// Only what lstat cannot tell apart is read and digested: a path of
+// another type, ownership or mode, or a regular file of another size
+// has changed whatever its data is. A size of 0 is that of an empty
+// file or one the database did not record, which is digested.
+static char status_compare(const char* prefix, File* file) {
+	char* path;
+	join_path(&path, prefix, file->path());
+	struct stat sb;
+	int res = lstat(path, &sb);
+	char state = ' ';
+	if (res == -1 && (errno == ENOENT || errno == ENOTDIR)) {
+		state = 'R';
+	} else if (res == -1) {
+		fprintf(stderr, "%s:%d: %s: %s (%d)\n", 
+				__FILE__, __LINE__, path, strerror(errno), errno);
+		state = '?';
+	} else if ((sb.st_mode & S_IFMT) != (file->mode() & S_IFMT)) {
+		state = 'T';
+	} else if (sb.st_mode != file->mode() || sb.st_uid != file->uid() ||
+			   sb.st_gid != file->gid()) {
+		state = 'M';
+	} else if (S_ISREG(sb.st_mode) && file->size() && sb.st_size != file->size()) {
+		state = 'M';
+	} else {
+		File* actual = FileFactory(0, NULL, FILE_INFO_NONE, path, sb.st_mode, 
+								   sb.st_uid, sb.st_gid, sb.st_size, NULL);
+		if (File::compare(file, actual) != FILE_INFO_IDENTICAL) state = 'M';
+		delete actual;
+	}
+	free(path);
+	return state;
 }
 
-int Depot::dump_archive(Archive* archive, void* context) {
-	Depot* depot = (Depot*)context;
-	int res = 0;
-	list_archive(archive, stdout);
-	hr();
-	if (res == 0) res = depot->iterate_files(archive, &Depot::print_file, stdout);
-	hr();
-	fprintf(stdout, "\n");
-	return res;
+static void* status_worker(void* ctx) {
+	StatusContext* context = (StatusContext*)ctx;
+	for (;;) {
+		pthread_mutex_lock(&context->lock);
+		uint32_t i = context->next++;
+		pthread_mutex_unlock(&context->lock);
+		if (i >= context->count) break;
+		context->states[i] = status_compare(context->prefix, context->files[i]);
+	}
+	return NULL;
 }
 
-int Depot::dump() {
-	extern uint32_t verbosity;
-	verbosity = 0xFFFFFFFF; // dump is intrinsically a debug command
-	int res = 0;
-	this->archive_header();
-	if (res == 0) res = this->iterate_archives(&Depot::dump_archive, this);
+// Paths are compared with the files the depot last installed there:
+//   M  the path is different
+//   T  the path is no longer the same type of file
+//   R  nothing is at the path anymore
+// Without a complete dirty log, or once the prefix itself changed, every
+// path is compared, which starts a new baseline for the log if a watcher 
+// is keeping it. A log this process cannot append to is not used at all.
+int Depot::status() {
+	DirtyLog log(m_dirty_path, m_prefix);
+	int res = log.read();
+	bool record = (res == 0 && log.writable());
+	bool everything = !record || !log.complete() || log.is_changed("/");
+	if (record && everything) res = log.baseline();
+	if (res) return res;
+	
+	uint8_t** rows = NULL;
+	uint32_t count = 0;
+	res = m_db->get_current_files(&rows, &count);
+	if (res == DB_ERROR) return DEPOT_ERROR;
+	res = DEPOT_OK;
+	
+	// the database is only read on this thread
+	File** files = (File**)calloc(count ? count : 1, sizeof(File*));
+	char* states = (char*)calloc(count ? count : 1, sizeof(char));
+	if (!files || !states) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		for (uint32_t i = 0; i < count; i++) m_db->free_file(rows[i]);
+		free(rows);
+		free(files);
+		free(states);
+		return DEPOT_ERROR;
+	}
+	uint32_t nfiles = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		char* path;
+		memcpy(&path, &rows[i][m_db->file_offset(8)], sizeof(char*));
+		if (!everything && !log.is_changed(path)) {
+			m_db->free_file(rows[i]);
+			continue;
+		}
+		File* file = m_db->make_file(rows[i]);
+		if (!file) {
+			fprintf(stderr, "%s:%d: DB::make_file returned NULL\n", __FILE__, __LINE__);
+			m_db->free_file(rows[i]);
+			res = DEPOT_ERROR;
+			continue;
+		}
+		// a placeholder has nothing to compare
+		if (INFO_TEST(file->info(), FILE_INFO_NO_ENTRY)) {
+			delete file;
+			continue;
+		}
+		files[nfiles++] = file;
+	}
+	free(rows);
+	
+	IF_DEBUG("[status] comparing %u of %u paths\n", nfiles, count);
+	StatusContext context(m_prefix, nfiles, files, states);
+	pthread_t threads[STATUS_THREADS];
+	uint32_t nthreads = 0;
+	while (nthreads < STATUS_THREADS && nthreads < nfiles) {
+		if (pthread_create(&threads[nthreads], NULL, &status_worker, &context)) break;
+		nthreads++;
+	}
+	// compare on this thread too if none could be started
+	if (nthreads == 0) status_worker(&context);
+	for (uint32_t i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+	
+	uint32_t differ = 0;
+	for (uint32_t i = 0; i < nfiles; i++) {
+		char state = states[i];
+		if (state == '?') res = DEPOT_ERROR;
+		if (state != ' ' && state != '?') {
+			fprintf(stdout, "%c %s\n", state, files[i]->path());
+			differ++;
+		}
+		
+		// what was found different stays changed, also when it was only
+		// compared for a directory above it, and what turned out to be 
+		// the same no longer has to be compared, unless it changed too
+		// recently for the log to say so yet
+		if (record && res == DEPOT_OK && state != ' ') {
+			res = log.changed(files[i]->path());
+		}
+		if (record && res == DEPOT_OK && state == ' ' && !everything &&
+			!log.is_recent(files[i]->path())) {
+			res = log.clean(files[i]->path());
+		}
+		delete files[i];
+	}
+	free(files);
+	free(states);
+	IF_DEBUG("[status] %u paths differ\n", differ);
+	
+	// a baseline missing some of the paths that differ cannot be trusted
+	if (record && res != DEPOT_OK && everything) log.overflow();
+	if (log.flush() && res == DEPOT_OK) res = DEPOT_ERROR;
 	return res;
 }
 
+int Depot::watch() {
+	// other commands have to be able to open the depot meanwhile
+	if (m_lock_fd != -1) this->unlock();
+	DirtyLog log(m_dirty_path, m_prefix);
+	return log.watch();
+}
 
 File* Depot::file_superseded_by(File* file) {
 	uint8_t* data;
@@ -1249,50 +3844,96 @@ File* Depot::file_preceded_by(File* file) {
 	return NULL;
 }
 
-int Depot::check_consistency() {
+int Depot::recover() {
 	int res = 0;
+	char pending = m_journal->pending();
+	if (pending == JOURNAL_NONE) return DEPOT_OK;
+	
+	Archive* archive = this->archive(*m_journal->pending_archive());
+	Archive* rollback = NULL;
+	if (pending != JOURNAL_UNINSTALL) {
+		rollback = this->archive(*m_journal->pending_rollback());
+	}
 
-	SerialSet* inactive = new SerialSet();
-	assert(inactive != NULL);
-	
-	// get inactive archives serials from the database
-	uint64_t* serials;
-	uint32_t  count;
-	this->m_db->get_inactive_archive_serials(&serials, &count);
-	for (uint32_t i=0; i < count; i++) {
-		inactive->add(serials[i]);
-	}
-	free(serials);
-	
-	// print a list of inactive archives
-	if (res == 0 && inactive && inactive->count > 0) {
-		fprintf(stderr, "The following archive%s in an inconsistent state and must be uninstalled "
-						"before proceeding:\n\n", inactive->count > 1 ? "s are" : " is");
-		uint32_t i;
-		this->archive_header();
-		for (i = 0; i < inactive->count; ++i) {
-			Archive* archive = this->archive(inactive->values[i]);
-			if (archive) {
-				list_archive(archive, stdout);
-				delete archive;
-			}
+	if (!archive) {
+		// interrupted before anything was committed, only the stage is left
+		IF_DEBUG("[recover] nothing to recover\n");
+		res = m_journal->commit();
+		if (res == 0) res = this->prune_directories();
+	} else if (pending == JOURNAL_INSTALL) {
+		// no files were moved yet, so undo the install
+		fprintf(stdout, "Rolling back interrupted install of %s\n", archive->name());
+		res = this->begin_transaction();
+		if (res == 0) res = this->remove(archive);
+		if (res == 0 && rollback) res = this->remove(rollback);
+		if (res == 0) res = this->commit_transaction();
+		if (res == 0) res = m_journal->commit();
+		if (res == 0) res = this->prune_directories();
+		for (int i = 0; res == 0 && i < 2; i++) {
+			Archive* a = i ? rollback : archive;
+			char* tarpath = a ? a->compacted_path(m_archives_path) : NULL;
+			if (tarpath && is_regular_file(tarpath)) res = this->trash(tarpath);
+			free(tarpath);
 		}
-		fprintf(stderr, "\nWould you like to uninstall %s now? [y/n] ", 
-				inactive->count > 1 ? "them" : "it");
-		int c = getchar();
-		fprintf(stderr, "\n");
-		if (c == 'y' || c == 'Y') {
-			for (i = 0; i < inactive->count; ++i) {
-				Archive* archive = this->archive(inactive->values[i]);
-				if (archive) {
-					res = this->uninstall(archive);
-					delete archive;
-				}
-				if (res != 0) break;
-			}
+	} else if (pending == JOURNAL_MOVE) {
+		// pick up with the file the install stopped at
+		fprintf(stdout, "Finishing interrupted install of %s\n", archive->name());
+		InstallContext context(this, archive);
+		context.resume_path = m_journal->pending_path();
+		context.resuming = true;
+		SerialSet* carried = m_journal->pending_carried();
+		for (uint32_t i = 0; i < carried->count; i++) {
+			context.files_to_carry->append(carried->values[i]);
+		}
+		res = this->finish_install(archive, rollback, &context);
+		if (res) {
+			fprintf(stderr, "Error: unable to finish installing %s, "
+					"uninstalling it.\n", archive->name());
+			res = this->uninstall(archive);
+		}
+	} else if (pending == JOURNAL_UNINSTALL) {
+		// pick up with the file the uninstall stopped at, the rollback 
+		// records of the files before it are already obsolete
+		uint32_t count = 0;
+		uuid_t* uuids = m_journal->pending_uninstalls(&count);
+		Archive** list = (Archive**)calloc(count + 1, sizeof(Archive*));
+		if (!list) {
+			fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+			res = DEPOT_ERROR;
+		}
+		for (uint32_t i = 0; res == 0 && i < count; i++) {
+			list[i] = i ? this->archive(uuids[i]) : archive;
+			if (!list[i]) res = DEPOT_ERROR;
+			if (list[i]) fprintf(stdout, "Finishing interrupted uninstall of %s\n", 
+								 list[i]->name());
+		}
+		InstallContext context(this, archive);
+		context.reverse_files = true;
+		context.resume_path = m_journal->pending_path();
+		SerialSet* serials = m_journal->pending_serials();
+		for (uint32_t i = 0; i < serials->count; i++) {
+			context.files_to_remove->add(serials->values[i]);
 		}
+		if (res == 0) res = this->begin_transaction();
+		for (uint32_t i = 0; res == 0 && i < count; i++) {
+			res = m_db->deactivate_archive(list[i]->serial());
+		}
+		if (res == 0) res = this->commit_transaction();
+		if (res == 0 && count > 1) {
+			res = this->uninstall_plan(count, list, &context);
+			if (res == 0) res = this->finish_uninstall(count, list, &context);
+		} else if (res == 0) {
+			res = this->uninstall_files(archive, &context);
+			if (res == 0) res = this->finish_uninstall(archive, &context);
+		}
+		for (uint32_t i = 1; list && i < count; i++) delete list[i];
+		free(list);
 	}
 	
+	if (res) fprintf(stderr, "Error: unable to recover from an interrupted %s.\n", 
+					 pending == JOURNAL_UNINSTALL ? "uninstall" : "install");
+	delete archive;
+	delete rollback;
 	return res;
 }
 
@@ -1371,6 +4012,19 @@ int Depot::lock(int operation) {
 	return res;
 }
 
+void Depot::select_engine() {
+	// an existing depot keeps the storage engine it was created with
+	extern uint32_t db_engine;
+	struct stat sb;
+	m_engine = db_engine;
+	if (stat(m_log_path, &sb) == 0) {
+		m_engine = DB_ENGINE_LOG;
+	} else if (stat(m_database_path, &sb) == 0) {
+		m_engine = DB_ENGINE_SQLITE;
+	}
+	if (m_engine != db_engine) IF_DEBUG("using the storage engine of the existing depot\n");
+}
+
 int Depot::unlock(void) {
 	int res = 0;
 	res = flock(m_lock_fd, LOCK_UN);
@@ -1404,7 +4058,7 @@ int Depot::insert(Archive* archive, File* file) {
 	}
 
 	file->m_serial = m_db->insert_file(file->info(), file->mode(), file->uid(), file->gid(), 
-									   file->digest(), archive, relpath);
+									   file->size(), file->digest(), archive, relpath);
 	if (!file->m_serial) {
 		fprintf(stderr, "Error: unable to insert file at path %s for archive %s \n", 
 				relpath, archive->name());
@@ -1453,20 +4107,308 @@ int Depot::remove(File* file) {
 
 // helper to dispatch the actual command for process_archive()
 int Depot::dispatch_command(Archive* archive, const char* command) {
+	return this->dispatch_command(archive, command, stdout);
+}
+
+int Depot::dispatch_command(Archive* archive, const char* command, FILE* output) {
 	int res = 0;
 
 	if (strncasecmp((char*)command, "files", 5) == 0) {
-		res = this->files(archive);
+		res = this->files(archive, output);
 	} else if (strncasecmp((char*)command, "uninstall", 9) == 0) {
 		res = this->uninstall(archive);
 	} else if (strncasecmp((char*)command, "verify", 6) == 0) {
-		res = this->verify(archive);
+		res = this->verify(archive, output);
+	} else if (strncasecmp((char*)command, "dump", 4) == 0) {
+		// only used by dump() to have read_archives() do its work
+		res = this->dump_archive(archive, output);
+		return res;
 	} else {
 		fprintf(stderr, "Error: unknown command given to dispatch_command.\n");
 	}
 	if (res != 0) {
-		fprintf(stdout, "An error occurred.\n");
+		fprintf(output, "An error occurred.\n");
+	}
+	return res;
+}
+
+struct ReadContext {
+	ReadContext(const char* c, uint32_t n, Archive** a, FILE** o, int* r) {
+		command = c;
+		count = n;
+		archives = a;
+		outputs = o;
+		results = r;
+		next = 0;
+		pthread_mutex_init(&lock, NULL);
+	}
+	~ReadContext() {
+		pthread_mutex_destroy(&lock);
+	}
+	
+	const char* command;
+	uint32_t count;
+	Archive** archives;
+	FILE** outputs;
+	int* results;
+	uint32_t next;
+	pthread_mutex_t lock;
+};
+
+struct ReadWorker {
+	ReadContext* context;
+	Depot* depot;
+};
+
+static void* read_worker(void* ctx) {
+	ReadContext* context = ((ReadWorker*)ctx)->context;
+	Depot* depot = ((ReadWorker*)ctx)->depot;
+	for (;;) {
+		pthread_mutex_lock(&context->lock);
+		uint32_t i = context->next++;
+		pthread_mutex_unlock(&context->lock);
+		if (i >= context->count) break;
+		
+		// anything that fails here is done again by the caller
+		FILE* output = tmpfile();
+		if (!output) continue;
+		context->results[i] = depot->dispatch_command(context->archives[i], 
+													  context->command, output);
+		context->outputs[i] = output;
+	}
+	return NULL;
+}
+
+// Runs a read-only command on several archives at a time. Each thread
+// has its own connection to the database and writes what the command
+// prints to a temporary file, which the caller copies out in order.
+// The log engine keeps the depot in memory and is not shared between
+// threads, so archives are left to the caller there.
+int Depot::read_archives(const char* command, uint32_t count, Archive** archives,
+						 FILE** outputs, int* results) {
+	if (m_engine == DB_ENGINE_LOG || count < 2) return DEPOT_OK;
+	
+	ReadContext context(command, count, archives, outputs, results);
+	ReadWorker workers[READER_THREADS];
+	pthread_t threads[READER_THREADS];
+	int nthreads = 0;
+	while (nthreads < READER_THREADS && (uint32_t)nthreads < count) {
+		Depot* reader = new Depot(m_prefix);
+		reader->m_engine = m_engine;
+		if (reader->connect(false)) {
+			delete reader;
+			break;
+		}
+		workers[nthreads].context = &context;
+		workers[nthreads].depot = reader;
+		if (pthread_create(&threads[nthreads], NULL, &read_worker, &workers[nthreads])) {
+			delete reader;
+			break;
+		}
+		nthreads++;
+	}
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+		delete workers[i].depot;
+	}
+	return DEPOT_OK;
+}
+
+int Depot::copy_output(FILE* output, FILE* stream) {
+	char buf[BUFSIZ];
+	size_t len;
+	rewind(output);
+	while ((len = fread(buf, 1, sizeof(buf), output)) > 0) {
+		if (fwrite(buf, 1, len, stream) != len) return DEPOT_ERROR;
+	}
+	return ferror(output) ? DEPOT_ERROR : DEPOT_OK;
+}
+
+void Depot::free_read_results(uint32_t count, Archive** archives, FILE** outputs, 
+							  int* results) {
+	for (uint32_t i = 0; i < count; i++) {
+		delete archives[i];
+		if (outputs[i]) fclose(outputs[i]);
+	}
+	free(archives);
+	free(outputs);
+	free(results);
+}
+
+// perform a read-only command on several archive specifications, with
+// finds the archives of each archive specification, up to the first one
+// that is missing, which is left as a NULL at the end of the list. specs
+// says which specification each archive came from.
+Archive** Depot::find_archives(int count, char** archspecs, uint32_t* total, int** specs) {
+	Archive** archives = NULL;
+	*total = 0;
+	*specs = NULL;
+	bool missing = false;
+	for (int i = 0; !missing && i < count; i++) {
+		const char* archspec = archspecs[i];
+		uint32_t n = 0;
+		Archive** list = NULL;
+		if (strncasecmp(archspec, "all", 3) == 0 && strlen(archspec) == 3) {
+			list = this->get_all_archives(&n);
+		} else if (strncasecmp(archspec, "superseded", 10) == 0 && strlen(archspec) == 10) {
+			list = this->get_superseded_archives(&n);
+		} else {
+			list = (Archive**)malloc(sizeof(Archive*));
+			list[0] = this->get_archive(archspec);
+			n = 1;
+		}
+		archives = (Archive**)realloc(archives, (*total + n + 1) * sizeof(Archive*));
+		*specs = (int*)realloc(*specs, (*total + n + 1) * sizeof(int));
+		if (!archives || !*specs) {
+			fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+			return NULL;
+		}
+		for (uint32_t j = 0; j < n; j++) {
+			archives[*total] = list[j];
+			(*specs)[*total] = i;
+			(*total)++;
+			if (!list[j]) missing = true;
+		}
+		free(list);
+	}
+	if (!archives) archives = (Archive**)calloc(1, sizeof(Archive*));
+	return archives;
+}
+
+// uninstall on each archive specification, uninstalling their archives
+// together up to the first specification that fails
+int Depot::uninstall_archives(int count, char** archspecs) {
+	extern uint32_t verbosity;
+	int res = 0;
+	const char* missing = NULL;
+	Archive** batch = (Archive**)malloc(sizeof(Archive*));
+	uint32_t found = 0;
+	if (!batch) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		return DEPOT_ERROR;
+	}
+	
+	for (int i = 0; res == 0 && !missing && i < count; i++) {
+		uint32_t n = 0;
+		int* specs = NULL;
+		Archive** list = this->find_archives(1, archspecs + i, &n, &specs);
+		free(specs);
+		
+		// a specification matching an archive that is already going to be 
+		// uninstalled means the one after it, as if the archives before 
+		// had been uninstalled already, so do that first
+		bool repeated = false;
+		for (uint32_t j = 0; list && j < n; j++) {
+			for (uint32_t k = 0; list[j] && k < found; k++) {
+				if (batch[k]->serial() == list[j]->serial()) repeated = true;
+			}
+		}
+		if (repeated) {
+			for (uint32_t j = 0; j < n; j++) delete list[j];
+			free(list);
+			res = this->uninstall_batch(batch, &found);
+			list = NULL;
+			if (res == 0) list = this->find_archives(1, archspecs + i, &n, &specs);
+			free(specs);
+		}
+		if (!list) {
+			if (res == 0) res = DEPOT_ERROR;
+			break;
+		}
+		
+		Archive** more = (Archive**)realloc(batch, (found + n + 1) * sizeof(Archive*));
+		if (!more) {
+			fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+			res = DEPOT_ERROR;
+		} else {
+			batch = more;
+		}
+		for (uint32_t j = 0; j < n; j++) {
+			if (res != 0 || missing || !list[j]) {
+				if (!list[j]) missing = archspecs[i];
+				delete list[j];
+				continue;
+			}
+			if (verbosity & VERBOSE_DEBUG) {
+				char uuid[37];
+				uuid_unparse_upper(list[j]->uuid(), uuid);
+				fprintf(stdout, "Found archive: %s\n", uuid);
+			}
+			// like process_archive(), only the last archive of a 
+			// specification decides whether it failed
+			bool skip;
+			int check = this->uninstall_check(list[j], &skip);
+			if (j + 1 == n && check != 0) res = check;
+			if (skip) {
+				delete list[j];
+			} else {
+				batch[found++] = list[j];
+			}
+		}
+		free(list);
+	}
+	
+	int uninstalled = this->uninstall_batch(batch, &found);
+	if (res == 0) res = uninstalled;
+	if (res != 0) fprintf(stdout, "An error occurred.\n");
+	if (res == 0 && missing) {
+		fprintf(stdout, "Archive not found: %s\n", missing);
+		res = DEPOT_ERROR;
+	}
+	free(batch);
+	return res;
+}
+
+int Depot::uninstall_batch(Archive** archives, uint32_t* count) {
+	int res = 0;
+	if (*count) res = this->uninstall(*count, archives);
+	for (uint32_t i = 0; i < *count; i++) delete archives[i];
+	*count = 0;
+	return res;
+}
+
+// the same output and result as calling process_archive() on each in turn
+// until one fails
+int Depot::process_archives(const char* command, int count, char** archspecs) {
+	extern uint32_t verbosity;
+	int res = 0;
+	uint32_t total = 0;
+	int* specs = NULL;
+	Archive** archives = this->find_archives(count, archspecs, &total, &specs);
+	if (!archives) return DEPOT_ERROR;
+	bool missing = (total && !archives[total - 1]);
+	
+	FILE** outputs = (FILE**)calloc(total + 1, sizeof(FILE*));
+	int* results = (int*)calloc(total + 1, sizeof(int));
+	if (!outputs || !results) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		return DEPOT_ERROR;
+	}
+	this->read_archives(command, missing ? total - 1 : total, archives, outputs, results);
+	
+	for (uint32_t i = 0; i < total; i++) {
+		if (!archives[i]) {
+			fprintf(stdout, "Archive not found: %s\n", archspecs[specs[i]]);
+			res = DEPOT_ERROR;
+			break;
+		}
+		if (verbosity & VERBOSE_DEBUG) {
+			char uuid[37];
+			uuid_unparse_upper(archives[i]->uuid(), uuid);
+			fprintf(stdout, "Found archive: %s\n", uuid);
+		}
+		if (outputs[i]) {
+			res = copy_output(outputs[i], stdout);
+			if (res == 0) res = results[i];
+		} else {
+			res = this->dispatch_command(archives[i], command, stdout);
+		}
+		// stop after the archive specification that failed
+		if (res && (i + 1 == total || specs[i + 1] != specs[i])) break;
 	}
+	
+	free_read_results(total, archives, outputs, results);
+	free(specs);
 	return res;
 }
 
@@ -1542,7 +4484,8 @@ int Depot::rename_archive(const char* archspec, const char* name) {
 							   archive->date_installed(),
 							   1,
 							   archive->info(),
-							   archive->build());
+							   archive->build(),
+							   archive->fingerprint());
 
 	if (res == 0) fprintf(stdout, "Renamed archive %s to '%s'.\n", 
 						  uuid, archive->name());
@@ -34,10 +34,14 @@
 #define _DEPOT_H
 
 #include <Availability.h>
+#include <stdio.h>
 #include <sys/types.h>
 #include <uuid/uuid.h>
 #include "DB.h"
 #include "Archive.h"
+#include "Manifest.h"
+#include "SerialSet.h"
+#include "Walker.h"
 
 #define DEPOT_OK              0
 #define DEPOT_ERROR          -1
@@ -48,10 +52,28 @@
 #define DEPOT_USAGE_ERROR    -6
 #define DEPOT_PREINSTALL_ERR -7
 
+// remote roots fetched at the same time
+#define PREFETCH_THREADS 4
+// downloads unused for this long are deleted
+#define DOWNLOAD_CACHE_DAYS 30
+// archives read at the same time by files, verify and dump
+#define READER_THREADS 4
+// paths status compares at the same time
+#define STATUS_THREADS 4
+// archives stats lists as the largest
+#define STATS_LARGEST 5
+// how long gc spends giving database pages back by default
+#define GC_VACUUM_SECONDS 10
+
 
 struct Archive;
 struct File;
+struct HardLink;
 struct DarwinupDatabase;
+struct Manifest;
+struct Journal;
+struct StageJob;
+struct Store;
 
 typedef int (*ArchiveIteratorFunc)(Archive* archive, void* context);
 typedef int (*FileIteratorFunc)(File* file, void* context);
@@ -63,18 +85,30 @@ struct Depot {
 	virtual ~Depot();
 
 	// establish database connection
-	int connect();
+	int connect(bool writable);
 
 	// create directories we need for storage
 	int create_storage();
 	
+	// link the depot to the object store at path the next time it is
+	//  initialized for writing, see Store
+	void share_objects(const char* path);
+	
 	// use initialize() to connect to database 
 	//  and (optionally) create the storage directories
 	int initialize(bool writable);
 	int is_initialized();
 	
+	// use open_manifest() instead of initialize() for read-only
+	//  commands that the manifest can answer, fails if it is stale
+	int open_manifest(Manifest* manifest);
+	// rewrite the manifest if the database changed since it was written
+	int update_manifest();
+	
 	const char* prefix();
 	const char*	database_path();
+	const char*	manifest_path();
+	const char*	daemon_path();
 	const char*	archives_path();
 	const char*	downloads_path();
 
@@ -94,7 +128,23 @@ struct Depot {
 	uint64_t count_archives();
 	
 	int dump();
-	static int dump_archive(Archive* archive, void* context);
+	int dump_archive(Archive* archive, FILE* output);
+	// how big the depot is and where that goes, as text or JSON
+	int stats(bool json);
+	static int stats_file(File* file, void* context);
+	// remove what the database no longer refers to: empty rollbacks,
+	//  backing stores and downloads nobody uses, then spend about seconds
+	//  giving unused database storage back. With dryrun it only reports.
+	int gc(uint32_t seconds);
+	static int gc_archive(WalkEntry* ent, void* context);
+	static int gc_download(WalkEntry* ent, void* context);
+	static int count_file(File* file, void* context);
+	// compares each path with the file the depot installed there, only
+	//  the paths a watcher saw change if it kept the dirty log since the
+	//  last time every path was compared
+	int status();
+	// keeps the dirty log until SIGINT or SIGTERM
+	int watch();
 	
 	int list();
 	int list(int count, char** args);
@@ -102,16 +152,40 @@ struct Depot {
 
 	int install(const char* path);
 	int install(Archive* archive);
+	// same result as install(path) followed by uninstall(old), but files 
+	//  that did not change are left in place and handed over to the new
+	//  archive instead of being installed again and uninstalled
+	int upgrade(const char* path, Archive* old);
+	
+	// fetch the remote roots among paths before installing them, several
+	//  at a time, install(path) then uses what was fetched
+	int prefetch(int count, char** paths);
+	const char* prefetched(const char* path);
+	// extract the root at path on another thread, install(path) then
+	//  picks up the extracted root, unstage() discards the roots that
+	//  are not going to be installed
+	int stage(const char* path);
+	int unstage();
+	// move cached downloads that have not been used in a while to the trash
+	int prune_downloads();
+	static int prune_download(WalkEntry* ent, void* context);
 	static int install_file(File* file, void* context);
 	static int backup_file(File* file, void* context);
 
 	int uninstall(Archive* archive);
+	// uninstalls archives in order, with the same result as uninstalling
+	//  them one at a time but changing each path at most once
+	int uninstall(uint32_t count, Archive** archives);
 	static int uninstall_file(File* file, void* context);
+	
+	// rolls an install or uninstall that was interrupted forward, or an
+	//  install back if it had not moved any files yet
+	int recover();
 
-	int verify(Archive* archive);
+	int verify(Archive* archive, FILE* output);
 	static int verify_file(File* file, void* context);
 
-	int files(Archive* archive);
+	int files(Archive* archive, FILE* output);
 	static int print_file(File* file, void* context);
 
 	int iterate_files(Archive* archive, FileIteratorFunc func, void* context);
@@ -120,7 +194,14 @@ struct Depot {
 	// processes an archive according to command
 	//  arg is an archive identifier, such as serial or uuid
 	int dispatch_command(Archive* archive, const char* command);
+	int dispatch_command(Archive* archive, const char* command, FILE* output);
 	int process_archive(const char* command, const char* archspec);
+	// same as process_archive() on each archspec until one fails, for
+	//  read-only commands, which run on several archives at a time
+	int process_archives(const char* command, int count, char** archspecs);
+	// same as process_archive() with uninstall on each archspec, all of
+	//  the archives are uninstalled together
+	int uninstall_archives(int count, char** archspecs);
 	
 	int rename_archive(const char* archspec, const char* name);
 	
@@ -129,17 +210,25 @@ struct Depot {
 
 	bool is_superseded(Archive* archive);
 
-	void    archive_header();
+	static void archive_header();
+	static void archive_header(FILE* stream);
 	
 	bool    is_dirty();
 	bool    has_modified_extensions();
 	bool    has_modified_xpc_services();
 	
+	// Deletes whatever trash() moved aside in a background process,
+	// once this process no longer needs the depot lock.
+	int     empty_trash();
+	
 protected:
 
 	// Serialize access to the Depot via flock(2).
 	int     lock(int operation);
 	int     unlock(void);
+	
+	// picks the storage engine of an existing depot or the -e option
+	void    select_engine();
 
 	// Inserts an Archive into the database.
 	// This modifies the Archive's serial number.
@@ -160,16 +249,92 @@ protected:
 	// Removes a File from the database.
 	int     remove(File* file);
 
-	int		analyze_stage(const char* path, Archive* archive, Archive* rollback, int* rollback_files);
+	// replacing is the archive an upgrade replaces, the serials of its files
+	//  that archive can take over unchanged are added to carried
+	int		install(const char* path, Archive* replacing);
+	int		install(Archive* archive, Archive* replacing);
+	// the last archive installed with the name of archive, if reinstalling
+	//  it over the same files would not change anything else
+	Archive* fingerprinted(Archive* archive);
+	// true if the root staged in path has the fingerprint of installed
+	//  and its files are still in place, going by lstat(2)
+	bool	is_unchanged(const char* path, Archive* installed);
+	// what stage() did with path, or NULL
+	StageJob* staged(const char* path);
+	// waits for stage() to finish extracting archive, false if it is not
+	bool	join_stage(Archive* archive, char** path, int* res);
+	int		analyze_stage(const char* path, Archive* archive, Archive* rollback, 
+						  Archive* replacing, SerialSet* carried, int* rollback_files);
+	static int analyze_prepare(WalkEntry* ent, void* context);
+	static int analyze_release(WalkEntry* ent, void* context);
+	static int analyze_file(WalkEntry* ent, void* context);
+	static int analyze_child(WalkEntry* ent, void* context);
+	// holds on to file, one of the links of link, until the last of them
+	//  was analyzed, so that either all of them get installed or none
+	static int analyze_link(void* context, HardLink* link, File* file, 
+							const char* actpath, char state, uint64_t carry);
+	// prints and inserts the links held on to for link
+	static int record_links(void* context, HardLink* link);
+	// analyzes the entries of stream as they are read, staging in path
+	//  only the files that differ from what is installed
+	int		analyze_stream(StreamArchive* stream, const char* path, Archive* rollback, 
+						   Archive* replacing, SerialSet* carried, int* rollback_files);
+	int		analyze_stream_entry(StreamArchive* stream, StreamEntry* sent, 
+								 WalkEntry* parent, const char* path, void* context);
 
 	// removes expand and unexpanded files from archives path
 	int		prune_directories();
+	static int prune_directory(WalkEntry* ent, void* context);
 	int		prune_archive(Archive* archive);
 	
+	// Moves a file or directory out of the way into the depot's trash.
+	// Removes it right away if it cannot be moved.
+	int		trash(const char* path);
+	static int trash_entry(WalkEntry* ent, void* context);
+	// prints how big path is, adds it to bytes and trashes it unless
+	//  this is a dry run
+	int		reclaim(const char* path, uint64_t* bytes);
+	
+	// stores the backed up copy of file at dstpath as a delta against the
+	//  file replacing it, if that is smaller
+	int		backup_delta(File* file, const char* dstpath, void* context);
+	// writes the rollback data of file out in full if it is a delta against
+	//  base, the data of base is read from actual when they are the same
+	//  and from the backing store of its archive otherwise
+	int		inflate(File* file, File* base, File* actual, bool* inflated);
+	// inflates each of deltas, compacts the rollbacks that changed again
+	//  and then records that they no longer hold those deltas
+	int		inflate_rollbacks(uint32_t count, File** deltas, File** bases, 
+							  File** actuals);
+	
 	File*	file_superseded_by(File* file);
 	File*	file_preceded_by(File* file);
 
-	int		check_consistency();
+	// runs a read-only command on several archives at a time, leaving
+	//  what it printed for each archive in outputs
+	int		read_archives(const char* command, uint32_t count, Archive** archives,
+						  FILE** outputs, int* results);
+	static int copy_output(FILE* output, FILE* stream);
+	static void free_read_results(uint32_t count, Archive** archives, FILE** outputs,
+								  int* results);
+	
+	// the second halves of install and uninstall, which recover() resumes
+	int		finish_install(Archive* archive, Archive* rollback, void* context);
+	int		finish_uninstall(Archive* archive, void* context);
+	int		finish_uninstall(uint32_t count, Archive** archives, void* context);
+	
+	int		uninstall_check(Archive* archive, bool* skip);
+	int		uninstall_plan(uint32_t count, Archive** archives, void* context);
+	int		uninstall_batch(Archive** archives, uint32_t* count);
+	Archive** find_archives(int count, char** archspecs, uint32_t* total, int** specs);
+	
+	// runs uninstall_file on the files of an archive, looking up what
+	//  supersedes and precedes all of them in a few queries
+	int		uninstall_files(Archive* archive, void* context);
+	
+	// hand a compacted backing store or a download over to the object store
+	int		share(Archive* archive, Digest* fingerprint);
+	int		share_download(const char* path);
 	
 	DarwinupDatabase* m_db;
 	
@@ -177,8 +342,23 @@ protected:
 	char*       m_prefix;
 	char*		m_depot_path;
 	char*		m_database_path;
+	char*		m_log_path;
+	uint32_t    m_engine;   // DB_ENGINE_* of the depot database
+	char*		m_manifest_path;
+	char*		m_daemon_path;
+	char*		m_dirty_path;
 	char*		m_archives_path;
 	char*		m_downloads_path;
+	char*		m_trash_path;
+	char*		m_store_path;  // link to the shared object store, if any
+	char*		m_share_path;  // where share_objects() wants it to point
+	Store*		m_store;
+	Journal*    m_journal;
+	char**      m_fetched_paths;
+	char**      m_fetched_files;
+	int         m_fetched_count;
+	StageJob*   m_staging;   // the roots stage() is extracting
+	uint32_t    m_trash_count;
 	char*       m_build;
 	int		    m_lock_fd;
 	int         m_is_locked;
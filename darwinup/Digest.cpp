@@ -92,6 +92,12 @@ SHA1Digest::SHA1Digest(uint8_t* data, uint32_t size) {
 	digest(m_data, data, size);
 }
 
+SHA1Digest::SHA1Digest(CC_SHA1_CTX* ctx) {
+	m_size = CC_SHA1_DIGEST_LENGTH;
+	CC_SHA1_CTX c = *ctx;
+	CC_SHA1_Final(m_data, &c);
+}
+
 SHA1Digest::~SHA1Digest() {
     
 }
@@ -102,10 +108,7 @@ void SHA1Digest::digest(unsigned char* md, int fd) {
 	
 	ssize_t len;
 	const unsigned int blocklen = 8192;
-	static uint8_t* block = NULL;
-	if (block == NULL) {
-		block = (uint8_t*)malloc(blocklen);
-	}
+	uint8_t block[blocklen]; // files are hashed on several threads at once
 	while(1) {
 		len = read(fd, block, blocklen);
 		if (len == 0) { close(fd); break; }
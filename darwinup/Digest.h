@@ -89,6 +89,7 @@ struct Digest {
 	
 	friend struct Depot;
 	friend struct DarwinupDatabase;
+	friend struct HardLinks;
 };
 
 ////
@@ -107,6 +108,10 @@ struct SHA1Digest : Digest {
 	// Computes the SHA-1 digest of the block of memory.
 	SHA1Digest(uint8_t* data, uint32_t size);
 	
+	// Finishes the SHA-1 digest of data already passed to ctx,
+	// ctx itself is left untouched.
+	SHA1Digest(CC_SHA1_CTX* ctx);
+	
     ~SHA1Digest();
 
 	void	digest(unsigned char* md, int fd);
@@ -0,0 +1,562 @@
+/*
+ * Copyright (c) 2010 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "DirtyLog.h"
+#include "Utils.h"
+
+#if DIRTY_WATCH
+#include <pthread.h>
+#include <CoreServices/CoreServices.h>
+#include <dispatch/dispatch.h>
+#endif
+
+// a record of the log and where it was in the log
+struct DirtyRecord {
+	char        type;
+	const char* path;
+	uint32_t    order;
+};
+
+static int compare_records(const void* a, const void* b) {
+	const DirtyRecord* ra = (const DirtyRecord*)a;
+	const DirtyRecord* rb = (const DirtyRecord*)b;
+	int res = strcmp(ra->path, rb->path);
+	if (res) return res;
+	return (ra->order > rb->order) - (ra->order < rb->order);
+}
+
+static int compare_paths(const void* a, const void* b) {
+	return strcmp(*(const char**)a, *(const char**)b);
+}
+
+DirtyLog::DirtyLog(const char* path, const char* prefix) {
+	m_path = strdup(path);
+	m_prefix = strdup(prefix);
+	m_real_prefix = NULL;
+	m_fd = -1;
+	m_read_time = 0;
+	m_compacted = 0;
+	m_watched = false;
+	m_complete = false;
+	m_changed = NULL;
+	m_count = 0;
+	m_recent_dir = NULL;
+	m_recent = false;
+	m_buffer = NULL;
+	m_buffer_size = 0;
+	m_buffer_max = 0;
+}
+
+DirtyLog::~DirtyLog() {
+	this->flush();
+	if (m_fd != -1) close(m_fd);
+	for (uint32_t i = 0; i < m_count; i++) free(m_changed[i]);
+	free(m_changed);
+	free(m_recent_dir);
+	free(m_buffer);
+	free(m_real_prefix);
+	free(m_prefix);
+	free(m_path);
+}
+
+bool DirtyLog::watched()  { return m_watched; }
+bool DirtyLog::complete() { return m_complete; }
+
+// The log is opened for appending right away, for flush() to use.
+bool DirtyLog::writable() {
+	if (m_fd == -1 && m_watched) m_fd = open(m_path, O_WRONLY | O_APPEND);
+	return m_fd != -1;
+}
+
+// A directory that was renamed, replaced or had to be scanned again 
+// changed as a whole, so the paths above each path are looked up too.
+bool DirtyLog::is_changed(const char* path) {
+	if (!m_complete) return true;
+	char dir[PATH_MAX];
+	if (strlcpy(dir, path, sizeof(dir)) >= sizeof(dir)) return true;
+	char* key = dir;
+	while (true) {
+		if (bsearch(&key, m_changed, m_count, sizeof(char*), compare_paths)) return true;
+		char* slash = strrchr(dir, '/');
+		if (!slash || (slash == dir && dir[1] == '\0')) return false;
+		if (slash == dir) slash++;
+		*slash = '\0';
+	}
+}
+
+static bool changed_since(const char* path, time_t since) {
+	struct stat sb;
+	if (lstat(path, &sb) == -1) return true;
+	return sb.st_ctime >= since;
+}
+
+// Changes reach the log up to DIRTY_LATENCY after they happen, so what 
+// changed shortly before the log was read may not be in it. Files are 
+// mostly looked at in order, which keeps the directories above the last
+// one from being looked at again.
+bool DirtyLog::is_recent(const char* path) {
+	time_t since = m_read_time - DIRTY_WINDOW;
+	char* full;
+	if (join_path(&full, m_prefix, path)) return true;
+	bool res = changed_since(full, since);
+	
+	char* dir = strrchr(full, '/');
+	size_t len = dir ? dir - full : 0;
+	if (!res && dir && m_recent_dir && strlen(m_recent_dir) == len && 
+		strncmp(m_recent_dir, full, len) == 0) {
+		res = m_recent;
+	} else if (!res && dir) {
+		*dir = '\0';
+		free(m_recent_dir);
+		m_recent_dir = strdup(full);
+		// up to and including the prefix
+		size_t top = strlen(m_prefix);
+		while (top > 1 && m_prefix[top - 1] == '/') top--;
+		while (!res) {
+			res = changed_since(full, since);
+			if (strlen(full) <= top) break;
+			char* slash = strrchr(full, '/');
+			if (slash == full) slash++;
+			*slash = '\0';
+		}
+		m_recent = res;
+	}
+	free(full);
+	return res;
+}
+
+// Only whole lines count, a record still being appended is left for 
+// the next reader.
+int DirtyLog::read() {
+	m_watched = false;
+	m_complete = false;
+	m_read_time = time(NULL);
+	
+	int fd = open(m_path, O_RDONLY);
+	if (fd == -1 && errno == ENOENT) return this->load(NULL, 0);
+	if (fd == -1) {
+		perror(m_path);
+		return -1;
+	}
+	
+	// the watcher holds an exclusive lock for as long as it runs
+	if (flock(fd, LOCK_SH | LOCK_NB) == 0) {
+		IF_DEBUG("[dirty] nothing is keeping %s\n", m_path);
+		close(fd);
+		return this->load(NULL, 0);
+	}
+	m_watched = true;
+	
+	struct stat sb;
+	char* data = NULL;
+	ssize_t size = -1;
+	if (fstat(fd, &sb) == 0) {
+		data = (char*)malloc(sb.st_size + 1);
+		if (data) size = pread_all(fd, data, sb.st_size, 0);
+	}
+	close(fd);
+	if (!data || size == -1) {
+		if (!data) fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		else perror(m_path);
+		free(data);
+		return -1;
+	}
+	int res = this->load(data, size);
+	free(data);
+	return res;
+}
+
+// Sets what changed from the records in data, which are overwritten.
+int DirtyLog::load(char* data, size_t size) {
+	for (uint32_t i = 0; i < m_count; i++) free(m_changed[i]);
+	free(m_changed);
+	m_changed = NULL;
+	m_count = 0;
+	m_complete = false;
+	free(m_recent_dir);
+	m_recent_dir = NULL;
+	if (!data) return 0;
+	
+	// only what follows the last baseline or overflow matters
+	char* end = data + size;
+	while (end > data && end[-1] != '\n') end--;
+	char* p = data;
+	char* start = NULL;
+	uint32_t lines = 0;
+	while (p < end) {
+		char* eol = (char*)memchr(p, '\n', end - p);
+		*eol = '\0';
+		if (p[0] == DIRTY_BASELINE) {
+			start = eol + 1;
+			lines = 0;
+		} else if (p[0] == DIRTY_OVERFLOW) {
+			start = NULL;
+		} else {
+			lines++;
+		}
+		p = eol + 1;
+	}
+	if (!start) {
+		IF_DEBUG("[dirty] %s has no baseline\n", m_path);
+		return 0;
+	}
+	
+	// the last record of each path says whether it is changed
+	int res = 0;
+	DirtyRecord* records = (DirtyRecord*)malloc((lines + 1) * sizeof(DirtyRecord));
+	m_changed = (char**)malloc((lines + 1) * sizeof(char*));
+	if (!records || !m_changed) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		res = -1;
+	}
+	uint32_t count = 0;
+	for (p = start; res == 0 && p < end; p += strlen(p) + 1) {
+		if (p[0] != DIRTY_CHANGED && p[0] != DIRTY_CLEAN) continue;
+		records[count].type = p[0];
+		records[count].path = p + 1;
+		records[count].order = count;
+		count++;
+	}
+	if (res == 0) qsort(records, count, sizeof(DirtyRecord), compare_records);
+	for (uint32_t i = 0; res == 0 && i < count; i++) {
+		if (i + 1 < count && strcmp(records[i].path, records[i + 1].path) == 0) continue;
+		if (records[i].type != DIRTY_CHANGED) continue;
+		m_changed[m_count] = strdup(records[i].path);
+		if (!m_changed[m_count]) {
+			fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+			res = -1;
+		} else {
+			m_count++;
+		}
+	}
+	free(records);
+	
+	if (res == 0) m_complete = true;
+	IF_DEBUG("[dirty] %u paths changed since the baseline\n", m_count);
+	return res;
+}
+
+int DirtyLog::record(char type, const char* path) {
+	size_t len = path ? strlen(path) : 0;
+	// a path with a newline in it cannot be told apart from two records
+	if (path && memchr(path, '\n', len)) {
+		type = DIRTY_OVERFLOW;
+		len = 0;
+	}
+	if (m_buffer_size + len + 2 > m_buffer_max) {
+		size_t max = m_buffer_max ? m_buffer_max : DIRTY_BUFFER;
+		while (m_buffer_size + len + 2 > max) max *= 2;
+		char* buffer = (char*)realloc(m_buffer, max);
+		if (!buffer) {
+			fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+			return -1;
+		}
+		m_buffer = buffer;
+		m_buffer_max = max;
+	}
+	m_buffer[m_buffer_size++] = type;
+	if (len) memcpy(m_buffer + m_buffer_size, path, len);
+	m_buffer_size += len;
+	m_buffer[m_buffer_size++] = '\n';
+	
+	if (m_buffer_size >= DIRTY_BUFFER) return this->flush();
+	return 0;
+}
+
+// Each write() appends whole records, so records from the watcher and
+// from readers never end up mixed within a line.
+int DirtyLog::flush() {
+	if (m_buffer_size == 0) return 0;
+	if (m_fd == -1) {
+		// nobody reads a log that is not being kept
+		if (!m_watched) {
+			m_buffer_size = 0;
+			return 0;
+		}
+		m_fd = open(m_path, O_WRONLY | O_APPEND);
+		if (m_fd == -1) {
+			perror(m_path);
+			return -1;
+		}
+	}
+	ssize_t res = write(m_fd, m_buffer, m_buffer_size);
+	m_buffer_size = 0;
+	if (res == -1) {
+		perror(m_path);
+		return -1;
+	}
+	
+	// the watcher replaced the log, and what came too late to be carried
+	// over to the new one is gone
+	struct stat sb;
+	if (fstat(m_fd, &sb) == 0 && sb.st_nlink == 0) {
+		IF_DEBUG("[dirty] %s was replaced\n", m_path);
+		close(m_fd);
+		m_fd = open(m_path, O_WRONLY | O_APPEND);
+		char record[] = { DIRTY_OVERFLOW, '\n' };
+		if (m_fd == -1 || write(m_fd, record, sizeof(record)) == -1) {
+			perror(m_path);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// The new log only gets the paths that are still changed, and replaces 
+// the old one before the records appended to the old one meanwhile are
+// carried over, so every record ends up in the new log or is appended
+// to the old one once it was replaced, which flush() notices.
+int DirtyLog::compact() {
+	struct stat sb;
+	if (m_fd == -1 || fstat(m_fd, &sb) == -1) return -1;
+	if (sb.st_size < DIRTY_COMPACT || sb.st_size < 2 * m_compacted) return 0;
+	
+	int res = 0;
+	char* data = (char*)malloc(sb.st_size + 1);
+	ssize_t size = data ? pread_all(m_fd, data, sb.st_size, 0) : -1;
+	if (!data) fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+	else if (size == -1) perror(m_path);
+	if (size == -1) res = -1;
+	// a record still being appended is carried over with the rest
+	while (size > 0 && data[size - 1] != '\n') size--;
+	if (res == 0) res = this->load(data, size);
+	free(data);
+	if (res) return res;
+	
+	char* tmp_path = NULL;
+	asprintf(&tmp_path, "%s.XXXXXX", m_path);
+	int fd = tmp_path ? mkstemp(tmp_path) : -1;
+	if (fd == -1 || fchmod(fd, 0644) == -1 || flock(fd, LOCK_EX | LOCK_NB) == -1) {
+		perror(tmp_path ? tmp_path : m_path);
+		res = -1;
+	}
+	int old_fd = m_fd;
+	if (res == 0) {
+		m_fd = fd;
+		if (m_complete) {
+			res = this->record(DIRTY_BASELINE, NULL);
+			for (uint32_t i = 0; res == 0 && i < m_count; i++) {
+				res = this->record(DIRTY_CHANGED, m_changed[i]);
+			}
+		} else {
+			res = this->record(DIRTY_OVERFLOW, NULL);
+		}
+		if (res == 0) res = this->flush();
+	}
+	if (res == 0 && rename(tmp_path, m_path) == -1) {
+		perror(m_path);
+		res = -1;
+	}
+	if (res) {
+		m_buffer_size = 0;
+		m_fd = old_fd;
+		if (fd != -1) close(fd);
+		if (tmp_path) unlink(tmp_path);
+		free(tmp_path);
+		return res;
+	}
+	free(tmp_path);
+	
+	off_t offset = size;
+	char buffer[DIRTY_BUFFER];
+	while (res == 0) {
+		ssize_t len = pread_all(old_fd, buffer, sizeof(buffer), offset);
+		if (len <= 0) {
+			if (len == -1) res = -1;
+			break;
+		}
+		res = write_all(m_fd, buffer, len);
+		offset += len;
+	}
+	if (res) perror(m_path);
+	close(old_fd);
+	if (fstat(m_fd, &sb) == 0) m_compacted = sb.st_size;
+	IF_DEBUG("[dirty] rewrote %s to %lld bytes\n", m_path, (long long)m_compacted);
+	return res;
+}
+
+int DirtyLog::baseline() {
+	int res = this->record(DIRTY_BASELINE, NULL);
+	if (res == 0) res = this->flush();
+	return res;
+}
+
+int DirtyLog::changed(const char* path) {
+	return this->record(DIRTY_CHANGED, path);
+}
+
+int DirtyLog::clean(const char* path) {
+	return this->record(DIRTY_CLEAN, path);
+}
+
+int DirtyLog::overflow() {
+	return this->record(DIRTY_OVERFLOW, NULL);
+}
+
+int DirtyLog::event(const char* path, bool dropped) {
+	if (dropped) {
+		IF_DEBUG("[dirty] events were dropped\n");
+		return this->record(DIRTY_OVERFLOW, NULL);
+	}
+	
+	// paths are kept below the prefix, like the depot has them
+	size_t len = strlen(m_real_prefix);
+	if (strncmp(path, m_real_prefix, len) == 0) {
+		path += len - 1;
+	} else if (strncmp(path, m_real_prefix, len - 1) == 0 && path[len - 1] == '\0') {
+		path = "/";
+	} else {
+		return 0;
+	}
+	
+	// the depot changes all the time, and the log is in it
+	if (strncmp(path, "/.DarwinDepot", 13) == 0 && (path[13] == '/' || path[13] == '\0')) {
+		return 0;
+	}
+	
+	// directories to be scanned again may have a slash at the end
+	char dir[PATH_MAX];
+	size_t dir_len = strlen(path);
+	if (dir_len > 1 && path[dir_len - 1] == '/' && dir_len < sizeof(dir)) {
+		memcpy(dir, path, dir_len - 1);
+		dir[dir_len - 1] = '\0';
+		path = dir;
+	}
+	IF_DEBUG("[dirty] %s\n", path);
+	return this->record(DIRTY_CHANGED, path);
+}
+
+#if DIRTY_WATCH
+static void dirty_event(ConstFSEventStreamRef stream, void* info, size_t count, 
+						void* paths, const FSEventStreamEventFlags flags[], 
+						const FSEventStreamEventId ids[]) {
+	DirtyLog* log = (DirtyLog*)info;
+	// a directory to be scanned again is logged like any other path, as
+	// everything below it changed
+	const FSEventStreamEventFlags dropped = 
+		kFSEventStreamEventFlagUserDropped | kFSEventStreamEventFlagKernelDropped | 
+		kFSEventStreamEventFlagRootChanged;
+	for (size_t i = 0; i < count; i++) {
+		log->event(((char**)paths)[i], (flags[i] & dropped) != 0);
+	}
+	// readers appending what they found show up here too
+	log->flush();
+	log->compact();
+}
+#endif
+
+int DirtyLog::watch() {
+#if DIRTY_WATCH
+	// read back by compact()
+	m_fd = open(m_path, O_RDWR | O_APPEND | O_CREAT, 0644);
+	if (m_fd == -1) {
+		perror(m_path);
+		return -1;
+	}
+	if (flock(m_fd, LOCK_EX | LOCK_NB) == -1) {
+		if (errno == EWOULDBLOCK) {
+			fprintf(stderr, "Error: %s is already being kept.\n", m_path);
+		} else {
+			perror(m_path);
+		}
+		return -1;
+	}
+	m_watched = true;
+	
+	char real[PATH_MAX];
+	if (!realpath(m_prefix, real)) {
+		perror(m_prefix);
+		return -1;
+	}
+	join_path(&m_real_prefix, real, "/");
+	
+	// whatever happened while nothing was watching is unknown
+	int res = ftruncate(m_fd, 0);
+	if (res == 0) res = this->record(DIRTY_OVERFLOW, NULL);
+	if (res == 0) res = this->flush();
+	if (res) return res;
+	
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	
+	CFStringRef root = CFStringCreateWithFileSystemRepresentation(NULL, real);
+	CFArrayRef roots = CFArrayCreate(NULL, (const void**)&root, 1, &kCFTypeArrayCallBacks);
+	FSEventStreamContext context = { 0, this, NULL, NULL, NULL };
+	FSEventStreamRef stream = FSEventStreamCreate(NULL, &dirty_event, &context, roots,
+												  kFSEventStreamEventIdSinceNow, 
+												  DIRTY_LATENCY,
+												  kFSEventStreamCreateFlagFileEvents |
+												  kFSEventStreamCreateFlagWatchRoot);
+	dispatch_queue_t queue = dispatch_queue_create("darwinup.dirty", NULL);
+	FSEventStreamSetDispatchQueue(stream, queue);
+	if (!FSEventStreamStart(stream)) {
+		fprintf(stderr, "Error: unable to watch %s for changes.\n", real);
+		res = -1;
+	}
+	
+	if (res == 0) {
+		IF_DEBUG("[dirty] watching %s\n", real);
+		int sig = 0;
+		sigwait(&signals, &sig);
+		IF_DEBUG("[dirty] stopping on signal %d\n", sig);
+		FSEventStreamFlushSync(stream);
+		FSEventStreamStop(stream);
+	}
+	FSEventStreamInvalidate(stream);
+	FSEventStreamRelease(stream);
+	dispatch_release(queue);
+	CFRelease(roots);
+	CFRelease(root);
+	
+	// the log is only good while it is kept, so it is not trusted anymore
+	// once the lock goes away with the descriptor
+	return res;
+#else
+	fprintf(stderr, "Error: this system cannot watch %s for changes.\n", m_prefix);
+	return -1;
+#endif
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2010 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#ifndef _DIRTYLOG_H
+#define _DIRTYLOG_H
+
+#include <Availability.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// each line of the log is one of these followed by a path, if any
+#define DIRTY_CHANGED  '+' // the path changed
+#define DIRTY_CLEAN    '-' // the path was checked, it is as the depot says
+#define DIRTY_BASELINE '!' // everything is checked from here on, the paths
+                           //  that differ follow as changed
+#define DIRTY_OVERFLOW '*' // changes may have been missed
+
+// seconds FSEvents may hold on to changes before passing them on
+#define DIRTY_LATENCY  0.5
+// seconds a change may take to reach the log, with room to spare
+#define DIRTY_WINDOW   2
+// bytes of records written at once
+#define DIRTY_BUFFER   65536
+// bytes the log grows to before the watcher rewrites it
+#define DIRTY_COMPACT  1048576
+
+#if __MAC_OS_X_VERSION_MIN_REQUIRED >= 1070
+#define DIRTY_WATCH    1
+#endif
+
+/**
+ *
+ * Paths below a prefix that changed since the depot last checked them.
+ *
+ *  watch() follows the prefix with FSEvents and appends the paths that
+ *  change to the log for as long as it runs, holding a lock on the log 
+ *  that tells readers the log is being kept. Commands that compare
+ *  installed files with the depot read the log to only check the 
+ *  changed paths, and append what they find so the next one does not 
+ *  have to check them again. Everything is appended, so the watcher and
+ *  any number of readers can share the log without coordination.
+ *
+ *  The log can only be trusted from a baseline on, which is written by
+ *  a command that checks every path. Starting the watcher and dropped 
+ *  events overflow it, until the next baseline. A changed directory
+ *  stands for everything below it.
+ *
+ *  Once the log grew enough the watcher replaces it with one holding
+ *  only the paths still changed. Commands that find the log they were
+ *  appending to replaced overflow the new one.
+ *
+ */
+struct DirtyLog {
+	DirtyLog(const char* path, const char* prefix);
+	~DirtyLog();
+	
+	// reads the log, the paths changed since the baseline are 
+	//  complete() if a watcher is keeping the log and it did not overflow
+	int  read();
+	bool watched();
+	bool complete();
+	// whether path, below the prefix, or a directory above it changed
+	//  since the baseline
+	bool is_changed(const char* path);
+	// whether path or a directory above it changed too recently before 
+	//  read() for the log to have it yet
+	bool is_recent(const char* path);
+	
+	// whether this process can append to the log a watcher is keeping
+	bool writable();
+	// append to the log, the baseline is written out right away and 
+	//  the rest once enough piled up or by flush()
+	int  baseline();
+	int  changed(const char* path);
+	int  clean(const char* path);
+	// for a baseline that could not check every path
+	int  overflow();
+	int  flush();
+	// for the watcher, rewrites the log once it grew enough
+	int  compact();
+	
+	// keeps the log until SIGINT or SIGTERM
+	int  watch();
+	
+	// for the FSEvents callback, path is a full path
+	int  event(const char* path, bool dropped);
+	
+protected:
+
+	int  record(char type, const char* path);
+	int  load(char* data, size_t size);
+	
+	char*     m_path;
+	char*     m_prefix;
+	char*     m_real_prefix; // as FSEvents reports it, while watching
+	int       m_fd;          // open for appending
+	time_t    m_read_time;
+	off_t     m_compacted;   // size of the log when it was last rewritten
+	bool      m_watched;
+	bool      m_complete;
+	char**    m_changed;     // sorted
+	uint32_t  m_count;
+	char*     m_recent_dir;  // the last directory is_recent() looked at
+	bool      m_recent;
+	char*     m_buffer;      // records not written yet
+	size_t    m_buffer_size;
+	size_t    m_buffer_max;
+};
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2010 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Database.h"
+#include "Durability.h"
+#include "Utils.h"
+
+Durability::Durability(uint32_t level) {
+	m_level = level;
+	m_paths = NULL;
+	m_count = 0;
+	m_max = 0;
+	m_next = 0;
+	m_error = 0;
+	pthread_mutex_init(&m_lock, NULL);
+}
+
+Durability::~Durability() {
+	for (uint32_t i = 0; i < m_count; i++) free(m_paths[i]);
+	free(m_paths);
+	pthread_mutex_destroy(&m_lock);
+}
+
+uint32_t Durability::level() { return m_level; }
+
+const char* Durability::level_name(uint32_t level) {
+	switch (level) {
+		case DURABILITY_FAST:     return "fast";
+		case DURABILITY_PARANOID: return "paranoid";
+		default:                  return "batched";
+	}
+}
+
+int Durability::level_value(const char* name, uint32_t* level) {
+	if (strcmp(name, "batched") == 0) {
+		*level = DURABILITY_BATCHED;
+	} else if (strcmp(name, "fast") == 0) {
+		*level = DURABILITY_FAST;
+	} else if (strcmp(name, "paranoid") == 0) {
+		*level = DURABILITY_PARANOID;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+// A symbolic link cannot be opened and a path that was removed is gone,
+// syncing their directory is what makes them durable.
+static int sync_path(const char* path, bool full) {
+	int fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+	if (fd == -1 && (errno == ELOOP || errno == ENOENT || errno == ENOTDIR)) {
+		return 0;
+	}
+	if (fd == -1) {
+		perror(path);
+		return -1;
+	}
+	int res = -1;
+#ifdef F_FULLFSYNC
+	// not every file system supports it
+	if (full) res = fcntl(fd, F_FULLFSYNC);
+#endif
+	if (res == -1) res = fsync(fd);
+	if (res == -1) perror(path);
+	close(fd);
+	return res;
+}
+
+// the directory path is in, which holds its name
+static char* parent_path(const char* path) {
+	const char* slash = strrchr(path, '/');
+	if (!slash) return NULL;
+	if (slash == path) return strdup("/");
+	return strndup(path, slash - path);
+}
+
+int Durability::push(const char* path) {
+	if (m_count >= m_max) {
+		uint32_t max = m_max ? m_max * REALLOC_FACTOR : INITIAL_ROWS;
+		char** paths = (char**)realloc(m_paths, max * sizeof(char*));
+		if (!paths) {
+			fprintf(stderr, "Error: ran out of memory in Durability::push\n");
+			return -1;
+		}
+		m_paths = paths;
+		m_max = max;
+	}
+	m_paths[m_count] = strdup(path);
+	if (!m_paths[m_count]) {
+		fprintf(stderr, "Error: ran out of memory in Durability::push\n");
+		return -1;
+	}
+	m_count++;
+	return 0;
+}
+
+int Durability::add(const char* path) {
+	if (m_level == DURABILITY_FAST) return 0;
+	
+	int res = 0;
+	char* parent = parent_path(path);
+	if (m_level == DURABILITY_PARANOID) {
+		res = sync_path(path, true);
+		if (res == 0 && parent) res = sync_path(parent, true);
+	} else {
+		res = this->push(path);
+		// files are added in order, so siblings share the last directory
+		if (res == 0 && parent && 
+			(m_count < 2 || strcmp(m_paths[m_count - 2], parent) != 0)) {
+			res = this->push(parent);
+		}
+	}
+	free(parent);
+	return res;
+}
+
+static int compare_paths(const void* a, const void* b) {
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+void* Durability::worker(void* arg) {
+	Durability* durability = (Durability*)arg;
+	for (;;) {
+		pthread_mutex_lock(&durability->m_lock);
+		uint32_t i = durability->m_next++;
+		pthread_mutex_unlock(&durability->m_lock);
+		if (i >= durability->m_count) break;
+		if (sync_path(durability->m_paths[i], false)) {
+			pthread_mutex_lock(&durability->m_lock);
+			durability->m_error = -1;
+			pthread_mutex_unlock(&durability->m_lock);
+		}
+	}
+	return NULL;
+}
+
+int Durability::sync() {
+	if (m_count == 0) return 0;
+	
+	// a directory holding many of the files was added once for each
+	qsort(m_paths, m_count, sizeof(char*), compare_paths);
+	uint32_t unique = 1;
+	for (uint32_t i = 1; i < m_count; i++) {
+		if (strcmp(m_paths[i], m_paths[unique - 1]) == 0) {
+			free(m_paths[i]);
+		} else {
+			m_paths[unique++] = m_paths[i];
+		}
+	}
+	m_count = unique;
+	IF_DEBUG("[durability] syncing %u paths\n", m_count);
+	
+	m_next = 0;
+	m_error = 0;
+	pthread_t threads[DURABILITY_THREADS];
+	uint32_t started = 0;
+	while (started < DURABILITY_THREADS && started < m_count &&
+		   pthread_create(&threads[started], NULL, &Durability::worker, this) == 0) {
+		started++;
+	}
+	// sync whatever is left on this thread if no worker could be started
+	Durability::worker(this);
+	for (uint32_t i = 0; i < started; i++) pthread_join(threads[i], NULL);
+	
+	// one full sync flushes the drive cache for all of them
+	int res = m_error;
+	if (res == 0) res = sync_path(m_paths[m_count - 1], true);
+	
+	for (uint32_t i = 0; i < m_count; i++) free(m_paths[i]);
+	m_count = 0;
+	return res;
+}
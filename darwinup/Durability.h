@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2010 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#ifndef _DURABILITY_H
+#define _DURABILITY_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// durability levels, chosen with -s
+#define DURABILITY_BATCHED  0
+#define DURABILITY_FAST     1
+#define DURABILITY_PARANOID 2
+
+#define DURABILITY_THREADS  8
+
+/**
+ *
+ * Files the depot changed on disk that have to be on the disk before
+ *  the database says they were changed.
+ *
+ *  fast      nothing is synced, the system writes files out when it 
+ *            gets to them
+ *  batched   the files and the directories they were renamed into are
+ *            remembered and synced together by sync(), on several 
+ *            threads, followed by one F_FULLFSYNC to flush the drive
+ *  paranoid  every file and its directory are synced with F_FULLFSYNC
+ *            as soon as they are added
+ *
+ */
+struct Durability {
+	Durability(uint32_t level);
+	~Durability();
+	
+	// level names, used on the command line
+	static const char* level_name(uint32_t level);
+	static int         level_value(const char* name, uint32_t* level);
+	uint32_t           level();
+	
+	// path was written, renamed or removed, so its data and its entry 
+	//  in the parent directory have to reach the disk
+	int add(const char* path);
+	
+	// makes everything added so far durable
+	int sync();
+	
+protected:
+
+	static void* worker(void* arg);
+	int          push(const char* path);
+	
+	uint32_t         m_level;
+	char**           m_paths;
+	uint32_t         m_count;
+	uint32_t         m_max;
+	
+	// shared with the workers while sync() runs
+	pthread_mutex_t  m_lock;
+	uint32_t         m_next;
+	int              m_error;
+};
+
+#endif
@@ -68,17 +68,14 @@ File::File(const char* path) {
 	if (path) m_path = strdup(path);
 }
 
-File::File(Archive* archive, FTSENT* ent) {	
-	char path[PATH_MAX];
-	path[0] = 0;
-	ftsent_filename(ent, path, PATH_MAX);
-	m_path = strdup(path);
+File::File(Archive* archive, WalkEntry* ent) {	
+	m_path = strdup(ent->relpath);
 	m_archive = archive;
 	m_info = FILE_INFO_NONE;
-	m_mode = ent->fts_statp->st_mode;
-	m_uid = ent->fts_statp->st_uid;
-	m_gid = ent->fts_statp->st_gid;
-	m_size = ent->fts_statp->st_size;
+	m_mode = ent->st.st_mode;
+	m_uid = ent->st.st_uid;
+	m_gid = ent->st.st_gid;
+	m_size = ent->st.st_size;
 	
 	m_digest = NULL;
 }
@@ -290,14 +287,14 @@ NoEntry::NoEntry(uint64_t serial, Archive* archive, uint32_t info, const char* p
 				 mode_t mode, uid_t uid, gid_t gid, off_t size, Digest* digest) 
 : File(serial, archive, info, path, mode, uid, gid, size, digest) {}
 
-Regular::Regular(Archive* archive, FTSENT* ent) : File(archive, ent) {
-	m_digest = new SHA1Digest(ent->fts_accpath);
+Regular::Regular(Archive* archive, WalkEntry* ent) : File(archive, ent) {
+	m_digest = new SHA1Digest(ent->path);
 }
 
 Regular::Regular(uint64_t serial, Archive* archive, uint32_t info, const char* path, 
 				 mode_t mode, uid_t uid, gid_t gid, off_t size, Digest* digest) 
 : File(serial, archive, info, path, mode, uid, gid, size, digest) {
-	if (digest == NULL || serial == 0) {
+	if (digest == NULL) {
 		m_digest = new SHA1Digest(path);
 	}
 }
@@ -318,8 +315,8 @@ int Regular::remove() {
 	return res;
 }
 
-Symlink::Symlink(Archive* archive, FTSENT* ent) : File(archive, ent) {
-	m_digest = new SHA1DigestSymlink(ent->fts_accpath);
+Symlink::Symlink(Archive* archive, WalkEntry* ent) : File(archive, ent) {
+	m_digest = new SHA1DigestSymlink(ent->path);
 }
 
 Symlink::Symlink(uint64_t serial, Archive* archive, uint32_t info, const char* path,
@@ -363,7 +360,7 @@ int Symlink::install_info(const char* dest) {
 	return res;
 }
 
-Directory::Directory(Archive* archive, FTSENT* ent) : File(archive, ent) {}
+Directory::Directory(Archive* archive, WalkEntry* ent) : File(archive, ent) {}
 
 Directory::Directory(uint64_t serial, Archive* archive, uint32_t info, 
 					 const char* path, mode_t mode, uid_t uid, gid_t gid, off_t size,
@@ -515,35 +512,38 @@ File* FileFactory(uint64_t serial, Archive* archive, uint32_t info, const char*
 	return file;
 }
 
-File* FileFactory(Archive* archive, FTSENT* ent) {
+File* FileFactory(Archive* archive, WalkEntry* ent) {
 	File* file = NULL;
-	switch (ent->fts_info) {
-		case FTS_D:
+	switch (ent->info) {
+		case WALK_D:
 			file = new Directory(archive, ent);
 			break;
-		case FTS_F:
+		case WALK_F:
 			file = new Regular(archive, ent);
 			break;
-		case FTS_SL:
-		case FTS_SLNONE:
+		case WALK_SL:
 			file = new Symlink(archive, ent);
 			break;
-		case FTS_DP:
+		case WALK_DP:
 			break;
-		case FTS_DEFAULT:
-		case FTS_DNR:
+		case WALK_DEFAULT:
+		case WALK_DNR:
 			fprintf(stderr, "%s:%d: could not read directory.  Run as root.\n",
 					__FILE__, __LINE__);
 			break;
 		default:
-			fprintf(stderr, "%s:%d: unexpected fts_info type %d\n", 
-					__FILE__, __LINE__, ent->fts_info);
+			fprintf(stderr, "%s:%d: unexpected walk info type %d\n", 
+					__FILE__, __LINE__, ent->info);
 			break;
 	}
 	return file;
 }
 
 File* FileFactory(const char* path) {
+	return FileFactory(path, NULL);
+}
+
+File* FileFactory(const char* path, Digest* digest) {
 	File* file = NULL;
 	struct stat sb;
 	int res = 0;
@@ -552,22 +552,29 @@ File* FileFactory(const char* path) {
 	res = lstat(path, &sb);
 	if (res == -1 && errno == ENOENT) {
 		// destination does not have a matching node
+		delete digest;
 		return NULL;
 	} else if (force && res == -1 && errno == ENOTDIR) {
 		// some part of destination path does not exist
 		// or is a file. This gets handled by Directory::install 
 		// eventually
 		IF_DEBUG("[factory]    parents do not exist or contain a file\n");
+		delete digest;
 		return NULL;
 	}	
 	if (res == -1) {
 		fprintf(stderr, "%s:%d: %s: %s (%d)\n", 
 				__FILE__, __LINE__, path, strerror(errno), errno);
 		fprintf(stderr, "ERROR: unable to stat %s \n", path);
+		delete digest;
 		return NULL;
 	}
 	
+	if (!S_ISREG(sb.st_mode)) {
+		delete digest;
+		digest = NULL;
+	}
 	file = FileFactory(0, NULL, FILE_INFO_NONE, path, sb.st_mode, sb.st_uid, 
-					   sb.st_gid, sb.st_size, NULL);
+					   sb.st_gid, sb.st_size, digest);
 	return file;
 }
@@ -37,7 +37,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <fts.h>
+#include "Walker.h"
 
 #define FILE_OBJ_CHANGE_ERROR \
 "-----------------------------------------------------------------------------\n" \
@@ -74,6 +74,8 @@ const uint32_t FILE_INFO_BASE_SYSTEM		= 0x0001;	// file was part of base system,
 const uint32_t FILE_INFO_NO_ENTRY		= 0x0002;	// placeholder in the database for non-existent file
 const uint32_t FILE_INFO_INSTALL_DATA		= 0x0010;	// actually install the file
 const uint32_t FILE_INFO_ROLLBACK_DATA		= 0x0020;	// file exists in rollback archive
+const uint32_t FILE_INFO_ROLLBACK_DELTA		= 0x0040;	// rollback data may be a delta against the next file
+const uint32_t FILE_INFO_HARDLINK		= 0x0080;	// one of several links to the same data
 
 //
 // FILE_INFO flags returned by File::compare()
@@ -111,14 +113,17 @@ struct File;
 
 File* FileFactory(uint64_t serial, Archive* archive, uint32_t info, const char* path, mode_t mode, uid_t uid, gid_t gid, off_t size, Digest* digest);
 File* FileFactory(const char* path);
-File* FileFactory(Archive* archive, FTSENT* ent);
+// for a regular file whose data was already digested, the file
+// takes over digest
+File* FileFactory(const char* path, Digest* digest);
+File* FileFactory(Archive* archive, WalkEntry* ent);
 
 
 struct File {
 	File();
 	File(File*);
 	File(const char* path);
-	File(Archive* archive, FTSENT* ent);
+	File(Archive* archive, WalkEntry* ent);
 	File(uint64_t serial, Archive* archive, uint32_t info, const char* path, mode_t mode, uid_t uid, gid_t gid, off_t size, Digest* digest);
 	virtual ~File();
 
@@ -223,7 +228,7 @@ struct NoEntry : File {
 //  NOTE: Extended attributes are not detected or preserved.
 ////
 struct Regular : File {
-	Regular(Archive* archive, FTSENT* ent);
+	Regular(Archive* archive, WalkEntry* ent);
 	Regular(uint64_t serial, Archive* archive, uint32_t info, const char* path, mode_t mode, uid_t uid, gid_t gid, off_t size, Digest* digest);
 	virtual int remove();
 };
@@ -233,7 +238,7 @@ struct Regular : File {
 //  Digest is of the target obtained via readlink(2).
 ////
 struct Symlink : File {
-	Symlink(Archive* archive, FTSENT* ent);
+	Symlink(Archive* archive, WalkEntry* ent);
 	Symlink(uint64_t serial, Archive* archive, uint32_t info, const char* path, mode_t mode, uid_t uid, gid_t gid, off_t size, Digest* digest);
 	virtual int install_info(const char* dest);
 	virtual int remove();
@@ -244,7 +249,7 @@ struct Symlink : File {
 //  Digest is null.
 ////
 struct Directory : File {
-	Directory(Archive* archive, FTSENT* ent);
+	Directory(Archive* archive, WalkEntry* ent);
 	Directory(uint64_t serial, Archive* archive, uint32_t info, const char* path, mode_t mode, uid_t uid, gid_t gid, off_t size, Digest* digest);
 	virtual int install(const char* prefix, const char* dest, bool uninstall);
 	virtual int dirrename(const char* prefix, const char* dest, bool uninstall);
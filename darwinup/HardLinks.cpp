@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2010 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#include "HardLinks.h"
+#include "Digest.h"
+#include "File.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+HardLinks::HardLinks() {
+	memset(m_buckets, 0, sizeof(m_buckets));
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_hashed, NULL);
+}
+
+HardLinks::~HardLinks() {
+	for (uint32_t i = 0; i < HARDLINKS_BUCKETS; i++) {
+		HardLink* link = m_buckets[i];
+		while (link) {
+			HardLink* next = link->next;
+			for (uint32_t j = 0; j < link->count; j++) {
+				delete link->members[j].file;
+			}
+			free(link->members);
+			delete link->digest;
+			free(link->path);
+			free(link);
+			link = next;
+		}
+	}
+	pthread_cond_destroy(&m_hashed);
+	pthread_mutex_destroy(&m_lock);
+}
+
+// called with m_lock held
+HardLink* HardLinks::find(struct stat* st) {
+	uint32_t bucket = (uint32_t)(st->st_ino ^ st->st_dev) % HARDLINKS_BUCKETS;
+	HardLink* link = m_buckets[bucket];
+	while (link && (link->ino != st->st_ino || link->dev != st->st_dev)) {
+		link = link->next;
+	}
+	if (!link) {
+		link = (HardLink*)calloc(1, sizeof(HardLink));
+		if (!link) return NULL;
+		link->dev = st->st_dev;
+		link->ino = st->st_ino;
+		link->nlink = st->st_nlink;
+		link->next = m_buckets[bucket];
+		m_buckets[bucket] = link;
+	}
+	return link;
+}
+
+HardLink* HardLinks::group(struct stat* st) {
+	if (!S_ISREG(st->st_mode) || st->st_nlink < 2) return NULL;
+	pthread_mutex_lock(&m_lock);
+	HardLink* link = this->find(st);
+	pthread_mutex_unlock(&m_lock);
+	return link;
+}
+
+Digest* HardLinks::digest(const char* path, struct stat* st) {
+	if (!S_ISREG(st->st_mode) || st->st_nlink < 2) return new SHA1Digest(path);
+	
+	pthread_mutex_lock(&m_lock);
+	HardLink* link = this->find(st);
+	while (link && link->hashing) pthread_cond_wait(&m_hashed, &m_lock);
+	if (link && !link->digest) {
+		// hash the first link without holding up the other groups
+		link->hashing = true;
+		pthread_mutex_unlock(&m_lock);
+		Digest* digest = new SHA1Digest(path);
+		pthread_mutex_lock(&m_lock);
+		link->digest = digest;
+		link->hashing = false;
+		pthread_cond_broadcast(&m_hashed);
+	}
+	SHA1Digest* copy = new SHA1Digest();
+	if (link) {
+		copy->m_size = link->digest->m_size;
+		memcpy(copy->m_data, link->digest->m_data, link->digest->m_size);
+	}
+	pthread_mutex_unlock(&m_lock);
+	
+	if (!link) {
+		delete copy;
+		return new SHA1Digest(path);
+	}
+	return copy;
+}
+
+const char* HardLinks::remember(const char* path, struct stat* st) {
+	HardLink* link = this->group(st);
+	if (!link) return NULL;
+	if (link->path) return link->path;
+	link->path = strdup(path);
+	return NULL;
+}
+
+HardLink* HardLinks::first() {
+	for (uint32_t i = 0; i < HARDLINKS_BUCKETS; i++) {
+		if (m_buckets[i]) return m_buckets[i];
+	}
+	return NULL;
+}
+
+HardLink* HardLinks::next(HardLink* link) {
+	if (link->next) return link->next;
+	uint32_t bucket = (uint32_t)(link->ino ^ link->dev) % HARDLINKS_BUCKETS;
+	for (uint32_t i = bucket + 1; i < HARDLINKS_BUCKETS; i++) {
+		if (m_buckets[i]) return m_buckets[i];
+	}
+	return NULL;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2010 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#ifndef _HARDLINKS_H
+#define _HARDLINKS_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+struct Digest;
+struct File;
+
+#define HARDLINKS_BUCKETS 256
+
+// a link of a hard link group that analyze_file() is holding on to
+struct HardLinkMember {
+	File*    file;
+	char     state;   // as analyze_file() would print it
+	uint64_t carry;   // serial of the file it was to be carried from
+};
+
+// the regular files that share one inode
+struct HardLink {
+	HardLink*       next;     // in its bucket
+	dev_t           dev;
+	ino_t           ino;
+	nlink_t         nlink;    // links the inode has
+	Digest*         digest;   // NULL until the first link is hashed
+	bool            hashing;  // the first link is being hashed
+	char*           path;     // of the first link, for backups
+	
+	// for analyze_file(), which only runs on one thread
+	HardLinkMember* members;
+	uint32_t        count;
+	bool            install;  // some link has to be installed
+	bool            split;    // the installed links are different inodes
+	bool            has_actual;
+	dev_t           actual_dev;
+	ino_t           actual_ino;
+};
+
+/**
+ *
+ * Regular files with more than one link, grouped by (dev, ino) so that
+ *  a group is hashed once, stored once and installed as links again.
+ *
+ */
+struct HardLinks {
+	HardLinks();
+	~HardLinks();
+	
+	// the group of the inode st describes, added if it is new,
+	//  NULL for a file with a single link
+	HardLink* group(struct stat* st);
+	
+	// digest of the file at path, the links of a group after the first
+	//  get a copy of the first one's digest, safe to call on any thread
+	Digest*   digest(const char* path, struct stat* st);
+	
+	// path of the first link of the group of st that was remembered, 
+	//  or NULL after remembering path for the ones to come
+	const char* remember(const char* path, struct stat* st);
+	
+	// each group, in no particular order
+	HardLink* first();
+	HardLink* next(HardLink* link);
+	
+protected:
+
+	HardLink*        find(struct stat* st);
+	
+	HardLink*        m_buckets[HARDLINKS_BUCKETS];
+	pthread_mutex_t  m_lock;
+	pthread_cond_t   m_hashed;   // a group's digest was filled in
+};
+
+#endif
@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2010 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "Archive.h"
+#include "Durability.h"
+#include "Journal.h"
+#include "Utils.h"
+
+Journal::Journal(const char* path) {
+	m_path = strdup(path);
+	m_fd = -1;
+	m_pending = JOURNAL_NONE;
+	uuid_clear(m_archive);
+	uuid_clear(m_rollback);
+	m_uninstalls = NULL;
+	m_uninstall_count = 0;
+	m_file = NULL;
+	m_serials = new SerialSet();
+	m_carried = new SerialSet();
+	m_count = 0;
+	m_exit_after = 0;
+}
+
+Journal::~Journal() {
+	if (m_fd != -1) close(m_fd);
+	free(m_path);
+	free(m_file);
+	free(m_uninstalls);
+	delete m_serials;
+	delete m_carried;
+}
+
+char        Journal::pending()          { return m_pending; }
+uuid_t*     Journal::pending_archive()  { return &m_archive; }
+uuid_t*     Journal::pending_rollback() { return &m_rollback; }
+const char* Journal::pending_path()     { return m_file; }
+SerialSet*  Journal::pending_serials()  { return m_serials; }
+SerialSet*  Journal::pending_carried()  { return m_carried; }
+
+uuid_t* Journal::pending_uninstalls(uint32_t* count) {
+	*count = m_uninstall_count;
+	return m_uninstalls;
+}
+
+int Journal::open() {
+	if (m_fd != -1) return 0;
+	
+	m_fd = ::open(m_path, O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (m_fd == -1) {
+		perror(m_path);
+		return -1;
+	}
+	
+#ifdef DARWINUP_TEST_HOOKS
+	// the test suite simulates a crash by having the process stop 
+	// right after the journal records that many steps
+	const char* exit_after = getenv("DARWINUP_JOURNAL_EXIT");
+	if (exit_after) m_exit_after = strtoul(exit_after, NULL, 10);
+#endif
+	
+	struct stat sb;
+	if (fstat(m_fd, &sb) == -1) {
+		perror(m_path);
+		return -1;
+	}
+	if (sb.st_size == 0) return 0;
+	
+	char* data = (char*)malloc(sb.st_size);
+	if (!data) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		return -1;
+	}
+	ssize_t size = pread(m_fd, data, sb.st_size, 0);
+	int res = 0;
+	if (size == -1) {
+		perror(m_path);
+		res = -1;
+	}
+	if (res == 0) res = this->parse(data, size);
+	free(data);
+	return res;
+}
+
+static int parse_uuid(const char* p, const char* end, uuid_t uuid) {
+	char uuidstr[37];
+	if (end - p < 36) return -1;
+	memcpy(uuidstr, p, 36);
+	uuidstr[36] = 0;
+	return uuid_parse(uuidstr, uuid);
+}
+
+// A command that was interrupted in the middle of a write leaves an
+// incomplete record at the end, which is ignored along with anything
+// after it.
+int Journal::parse(char* data, size_t size) {
+	char* p = data;
+	char* end = data + size;
+	while (p < end) {
+		char* eol = (char*)memchr(p, '\n', end - p);
+		if (!eol) break;
+		
+		if (p[0] == JOURNAL_INSTALL && eol - p == 75) {
+			if (parse_uuid(p + 2, eol, m_archive)) break;
+			if (parse_uuid(p + 39, eol, m_rollback)) break;
+			m_pending = JOURNAL_INSTALL;
+			free(m_file);
+			m_file = NULL;
+			m_carried->count = 0;
+		} else if (p[0] == JOURNAL_MOVE && eol - p == 1) {
+			if (m_pending != JOURNAL_INSTALL) break;
+			m_pending = JOURNAL_MOVE;
+			free(m_file);
+			m_file = NULL;
+		} else if (p[0] == JOURNAL_UNINSTALL && eol - p == 38) {
+			uuid_t uuid;
+			if (parse_uuid(p + 2, eol, uuid)) break;
+			// consecutive uninstall records are archives uninstalled together
+			if (m_pending != JOURNAL_UNINSTALL || m_file) m_uninstall_count = 0;
+			uuid_t* uninstalls = (uuid_t*)realloc(m_uninstalls, 
+											(m_uninstall_count + 1) * sizeof(uuid_t));
+			if (!uninstalls) {
+				fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+				return -1;
+			}
+			m_uninstalls = uninstalls;
+			uuid_copy(m_uninstalls[m_uninstall_count++], uuid);
+			uuid_copy(m_archive, m_uninstalls[0]);
+			uuid_clear(m_rollback);
+			m_pending = JOURNAL_UNINSTALL;
+			free(m_file);
+			m_file = NULL;
+		} else if (p[0] == JOURNAL_CARRY && m_pending == JOURNAL_INSTALL) {
+			char* s = p + 1;
+			while (s < eol && *s == ' ') {
+				uint64_t serial = strtoull(s, &s, 10);
+				if (serial) m_carried->append(serial);
+			}
+			if (s != eol) break;
+		} else if (p[0] == JOURNAL_FILE && m_pending != JOURNAL_NONE) {
+			// the path may contain newlines, so go by its length
+			char* s = p + 2;
+			uint64_t serial = strtoull(s, &s, 10);
+			size_t length = strtoul(s, &s, 10);
+			if (*s != ' ' || (size_t)(end - s) < length + 2) break;
+			eol = s + 1 + length;
+			if (*eol != '\n') break;
+			free(m_file);
+			m_file = strndup(s + 1, length);
+			if (serial) m_serials->add(serial);
+		} else {
+			break;
+		}
+		p = eol + 1;
+	}
+	if (m_pending != JOURNAL_NONE) {
+		IF_DEBUG("[journal] interrupted %c, last file %s\n", m_pending, 
+				 m_file ? m_file : "(none)");
+	}
+	return 0;
+}
+
+int Journal::append(const char* record, size_t size, bool sync) {
+	if (m_fd == -1) return 0;
+	
+	// the record goes out in a single write, so a crash can only 
+	// ever leave the last one incomplete
+	if (write_all(m_fd, record, size)) {
+		perror(m_path);
+		return -1;
+	}
+	if (sync && fsync(m_fd) == -1) {
+		perror(m_path);
+		return -1;
+	}
+	
+#ifdef DARWINUP_TEST_HOOKS
+	if (m_exit_after && ++m_count == m_exit_after) _exit(1);
+#endif
+	return 0;
+}
+
+int Journal::begin_install(Archive* archive, Archive* rollback) {
+	char record[80];
+	char uuidstr[37];
+	char rollbackstr[37];
+	uuid_unparse_upper(archive->uuid(), uuidstr);
+	uuid_unparse_upper(rollback->uuid(), rollbackstr);
+	int len = snprintf(record, sizeof(record), "%c %s %s\n", 
+					   JOURNAL_INSTALL, uuidstr, rollbackstr);
+	return this->append(record, len, true);
+}
+
+int Journal::begin_move() {
+	char record[2] = { JOURNAL_MOVE, '\n' };
+	return this->append(record, sizeof(record), true);
+}
+
+int Journal::begin_uninstall(Archive* archive) {
+	char record[40];
+	char uuidstr[37];
+	uuid_unparse_upper(archive->uuid(), uuidstr);
+	int len = snprintf(record, sizeof(record), "%c %s\n", 
+					   JOURNAL_UNINSTALL, uuidstr);
+	return this->append(record, len, true);
+}
+
+// Files are not synced one at a time unless the durability is paranoid.
+// After a power loss the last few records may be missing, which 
+// Depot::recover() copes with by checking the stage for the files that follow.
+int Journal::file(const char* path, uint64_t serial) {
+	extern uint32_t durability;
+	if (m_fd == -1) return 0;
+	char* record = NULL;
+	size_t length = strlen(path);
+	int len = asprintf(&record, "%c %llu %lu %s\n", JOURNAL_FILE, 
+					   (unsigned long long)serial, (unsigned long)length, path);
+	if (len == -1) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		return -1;
+	}
+	int res = this->append(record, len, durability == DURABILITY_PARANOID);
+	free(record);
+	return res;
+}
+
+// Written before begin_move(), which syncs it.
+int Journal::carry(SerialSet* serials) {
+	if (m_fd == -1 || serials->count == 0) return 0;
+	size_t size = 3 + 21 * (size_t)serials->count;
+	char* record = (char*)malloc(size);
+	if (!record) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		return -1;
+	}
+	size_t len = 0;
+	record[len++] = JOURNAL_CARRY;
+	for (uint32_t i = 0; i < serials->count; i++) {
+		len += snprintf(record + len, size - len, " %llu", 
+						(unsigned long long)serials->values[i]);
+	}
+	record[len++] = '\n';
+	int res = this->append(record, len, false);
+	free(record);
+	return res;
+}
+
+int Journal::commit() {
+	m_pending = JOURNAL_NONE;
+	m_uninstall_count = 0;
+	free(m_file);
+	m_file = NULL;
+	m_serials->count = 0;
+	m_carried->count = 0;
+	if (m_fd == -1) return 0;
+	if (ftruncate(m_fd, 0) == -1 || fsync(m_fd) == -1) {
+		perror(m_path);
+		return -1;
+	}
+	return 0;
+}
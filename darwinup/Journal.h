@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2010 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <uuid/uuid.h>
+
+#include "SerialSet.h"
+
+#define JOURNAL_NONE      ' '
+#define JOURNAL_INSTALL   'I'
+#define JOURNAL_MOVE      'M'
+#define JOURNAL_UNINSTALL 'U'
+#define JOURNAL_FILE      'F'
+#define JOURNAL_CARRY     'C'
+
+struct Archive;
+
+/**
+ *
+ * Intent journal of the command that is changing the depot.
+ *
+ *  Before install and uninstall touch anything outside of the depot
+ *  database they append a record saying what they are about to do:
+ *
+ *    I <archive uuid> <rollback uuid>   an install is starting
+ *    M                                  backups are done, moving files
+ *    U <archive uuid>                   an uninstall is starting, one
+ *                                       record per archive when several
+ *                                       are uninstalled together
+ *    F <serial> <length> <path>         about to back up, install or
+ *                                       uninstall path, serial is the
+ *                                       rollback record it makes obsolete
+ *    C <serial> <serial> ...            an upgrade hands these files of the
+ *                                       archive it replaces over to the
+ *                                       new archive once it is activated
+ *
+ *  The journal is emptied once the command is done. Whatever is still
+ *  in it when the depot is next opened for writing tells Depot::recover()
+ *  which file to pick up from.
+ *
+ */
+struct Journal {
+	Journal(const char* path);
+	~Journal();
+	
+	// reads what an interrupted command left behind and opens the 
+	//  journal for appending
+	int open();
+	
+	int begin_install(Archive* archive, Archive* rollback);
+	int begin_move();
+	int begin_uninstall(Archive* archive);
+	int file(const char* path, uint64_t serial);
+	int carry(SerialSet* serials);
+	// the command is done, empties the journal
+	int commit();
+	
+	// JOURNAL_INSTALL, JOURNAL_MOVE or JOURNAL_UNINSTALL if an interrupted
+	//  command left something in the journal, JOURNAL_NONE otherwise
+	char        pending();
+	uuid_t*     pending_archive();
+	uuid_t*     pending_rollback();
+	// every archive of an interrupted uninstall, the first is pending_archive()
+	uuid_t*     pending_uninstalls(uint32_t* count);
+	// the last file the interrupted command started on, or NULL
+	const char* pending_path();
+	// rollback records made obsolete by the interrupted command
+	SerialSet*  pending_serials();
+	// files the interrupted install was handing over to its archive
+	SerialSet*  pending_carried();
+	
+protected:
+
+	int         append(const char* record, size_t size, bool sync);
+	int         parse(char* data, size_t size);
+	
+	char*       m_path;
+	int         m_fd;
+	char        m_pending;
+	uuid_t      m_archive;
+	uuid_t      m_rollback;
+	uuid_t*     m_uninstalls;
+	uint32_t    m_uninstall_count;
+	char*       m_file;
+	SerialSet*  m_serials;
+	SerialSet*  m_carried;
+	uint32_t    m_count;
+	uint32_t    m_exit_after; // for test builds, see Journal::open()
+};
+
+#endif
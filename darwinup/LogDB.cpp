@@ -0,0 +1,1552 @@
+/*
+ * Copyright (c) 2010 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "LogDB.h"
+
+#define LOG_RECORD_HEADER 5        // type byte and payload length
+#define LOG_NULL_STRING   0xFFFFFFFF
+#define LOG_BUCKETS       1024
+
+static uint32_t log_read_u32(const uint8_t* data) {
+	return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | 
+	       ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+/**
+ * decoding of record payloads, all integers are little endian
+ */
+struct LogReader {
+	const uint8_t* data;
+	uint32_t       size;
+	uint32_t       pos;
+	bool           error;
+};
+
+static bool log_need(LogReader* r, uint32_t size) {
+	if (r->error || r->size - r->pos < size) {
+		r->error = true;
+		return false;
+	}
+	return true;
+}
+
+static uint32_t log_get_u32(LogReader* r) {
+	if (!log_need(r, 4)) return 0;
+	uint32_t value = log_read_u32(r->data + r->pos);
+	r->pos += 4;
+	return value;
+}
+
+static uint64_t log_get_u64(LogReader* r) {
+	uint64_t low = log_get_u32(r);
+	uint64_t high = log_get_u32(r);
+	return low | (high << 32);
+}
+
+// returns a pointer into the payload, NULL for an empty value
+static const uint8_t* log_get_bytes(LogReader* r, uint32_t* size) {
+	*size = log_get_u32(r);
+	if (*size == 0 || !log_need(r, *size)) {
+		*size = 0;
+		return NULL;
+	}
+	const uint8_t* bytes = r->data + r->pos;
+	r->pos += *size;
+	return bytes;
+}
+
+// returns a copy of the string, NULL for a NULL string
+static char* log_get_string(LogReader* r) {
+	uint32_t size = log_get_u32(r);
+	if (size == LOG_NULL_STRING || !log_need(r, size)) return NULL;
+	char* str = (char*)malloc(size + 1);
+	memcpy(str, r->data + r->pos, size);
+	str[size] = 0;
+	r->pos += size;
+	return str;
+}
+
+static int log_compare_paths(const void* a, const void* b) {
+	return strcmp((*(LogFile**)a)->path->path, (*(LogFile**)b)->path->path);
+}
+
+static int log_compare_paths_reverse(const void* a, const void* b) {
+	return strcmp((*(LogFile**)b)->path->path, (*(LogFile**)a)->path->path);
+}
+
+static bool log_name_is(const char* name, const char* other) {
+	return name && strcmp(name, other) == 0;
+}
+
+
+DarwinupLogDatabase::DarwinupLogDatabase(const char* path, bool writable) 
+	: DarwinupDatabase(path, false) {
+	extern uint32_t db_profile;
+	m_profile = db_profile;
+	
+	m_fd = -1;
+	m_log_size = 0;
+	m_in_transaction = false;
+	
+	m_pending = NULL;
+	m_pending_size = 0;
+	m_pending_max = 0;
+	m_record_start = 0;
+	m_record_count = 0;
+	m_buffer_error = false;
+	
+	m_undo = NULL;
+	m_undo_size = 0;
+	m_undo_max = 0;
+	m_undo_start = 0;
+	m_undo_lost = false;
+	m_begin_archive_seq = 0;
+	m_begin_file_seq = 0;
+	m_begin_path_seq = 0;
+	m_begin_record_count = 0;
+	
+	m_archive_seq = 0;
+	m_file_seq = 0;
+	m_path_seq = 0;
+	
+	m_archives = NULL;
+	m_archive_count = 0;
+	m_archive_max = 0;
+	
+	m_files = NULL;
+	m_file_count = 0;
+	m_file_max = 0;
+	m_file_dead = 0;
+	
+	m_path_buckets = NULL;
+	m_path_bucket_count = 0;
+	m_paths = NULL;
+	m_path_max = 0;
+	m_path_count = 0;
+	
+	// commands that only read share the depot lock, so they must 
+	// leave the log as it is
+	m_readonly = !writable;
+	this->open_log();
+}
+
+DarwinupLogDatabase::~DarwinupLogDatabase() {
+	this->unload();
+	free(m_pending);
+	free(m_undo);
+	if (m_fd != -1) close(m_fd);
+}
+
+bool DarwinupLogDatabase::is_connected() {
+	return m_fd != -1;
+}
+
+int DarwinupLogDatabase::open_log() {
+	if (!m_readonly) m_fd = open(m_path, O_RDWR | O_CREAT, 0644);
+	if (m_readonly || (m_fd == -1 && (errno == EACCES || errno == EROFS))) {
+		m_readonly = true;
+		m_fd = open(m_path, O_RDONLY);
+	}
+	if (m_fd == -1) {
+		fprintf(stderr, "Error: unable to open log at: %s: %s\n", 
+				m_path, strerror(errno));
+		return DB_ERROR;
+	}
+	
+	int res = this->load();
+	if (res) {
+		close(m_fd);
+		m_fd = -1;
+		return res;
+	}
+	
+	uint32_t live = m_path_count + m_archive_count + m_file_count - m_file_dead;
+	if (!m_readonly && m_record_count > LOG_COMPACT_MIN && 
+		m_record_count > LOG_COMPACT_FACTOR * live) {
+		IF_DEBUG("Compacting log with %u records for %u rows\n", m_record_count, live);
+		res = this->compact();
+	}
+	
+	return res;
+}
+
+int DarwinupLogDatabase::load() {
+	struct stat sb;
+	if (fstat(m_fd, &sb) == -1) {
+		perror(m_path);
+		return DB_ERROR;
+	}
+	
+	m_path_bucket_count = LOG_BUCKETS;
+	m_path_buckets = (LogPath**)calloc(m_path_bucket_count, sizeof(LogPath*));
+	
+	if (sb.st_size == 0) {
+		// brand new log
+		if (m_readonly) {
+			fprintf(stderr, "Error: the log at %s is empty.\n", m_path);
+			return DB_ERROR;
+		}
+		if (pwrite_all(m_fd, (const uint8_t*)LOG_MAGIC, LOG_MAGIC_SIZE, 0) ||
+			fsync(m_fd)) {
+			perror(m_path);
+			return DB_ERROR;
+		}
+		m_log_size = LOG_MAGIC_SIZE;
+		return DB_OK;
+	}
+	
+	uint8_t* data = (uint8_t*)malloc(sb.st_size);
+	if (!data || pread_all(m_fd, data, sb.st_size, 0) != sb.st_size) {
+		fprintf(stderr, "Error: unable to read log at: %s\n", m_path);
+		free(data);
+		return DB_ERROR;
+	}
+	if (sb.st_size < LOG_MAGIC_SIZE || memcmp(data, LOG_MAGIC, LOG_MAGIC_SIZE)) {
+		fprintf(stderr, "Error: %s is not a darwinup log.\n", m_path);
+		free(data);
+		return DB_ERROR;
+	}
+	
+	// find the end of the last complete transaction
+	off_t size = sb.st_size;
+	off_t pos = LOG_MAGIC_SIZE;
+	off_t valid_end = pos;
+	uint32_t hash = FNV1A_INIT;
+	while (size - pos >= LOG_RECORD_HEADER) {
+		uint8_t type = data[pos];
+		uint32_t length = log_read_u32(data + pos + 1);
+		if (size - pos - LOG_RECORD_HEADER < length) break;
+		if (type == LOG_COMMIT) {
+			if (length != 4 || log_read_u32(data + pos + LOG_RECORD_HEADER) != hash) break;
+			valid_end = pos + LOG_RECORD_HEADER + length;
+			hash = FNV1A_INIT;
+		} else {
+			hash = fnv1a_hash(data + pos, LOG_RECORD_HEADER + length, hash);
+		}
+		pos += LOG_RECORD_HEADER + length;
+	}
+	
+	// replay it
+	int res = DB_OK;
+	pos = LOG_MAGIC_SIZE;
+	while (res == DB_OK && pos < valid_end) {
+		uint8_t type = data[pos];
+		uint32_t length = log_read_u32(data + pos + 1);
+		if (type != LOG_COMMIT) {
+			res = this->apply_record(type, data + pos + LOG_RECORD_HEADER, length);
+			m_record_count++;
+		}
+		pos += LOG_RECORD_HEADER + length;
+	}
+	free(data);
+	if (res) {
+		fprintf(stderr, "Error: unable to replay log at: %s\n", m_path);
+		return res;
+	}
+	
+	if (valid_end < size) {
+		fprintf(stderr, "Warning: ignoring an incomplete transaction at the "
+				"end of the log.\n");
+		if (!m_readonly && ftruncate(m_fd, valid_end)) {
+			perror(m_path);
+			return DB_ERROR;
+		}
+	}
+	m_log_size = valid_end;
+	
+	return DB_OK;
+}
+
+void DarwinupLogDatabase::unload() {
+	for (uint32_t i = 0; i < m_archive_count; i++) {
+		free(m_archives[i].name);
+		free(m_archives[i].build);
+		free(m_archives[i].fingerprint);
+	}
+	free(m_archives);
+	m_archives = NULL;
+	m_archive_count = 0;
+	m_archive_max = 0;
+	
+	for (uint32_t i = 0; i < m_file_count; i++) {
+		free(m_files[i].digest);
+	}
+	free(m_files);
+	m_files = NULL;
+	m_file_count = 0;
+	m_file_max = 0;
+	m_file_dead = 0;
+	
+	for (uint64_t i = 0; i < m_path_max; i++) {
+		if (m_paths[i]) {
+			free(m_paths[i]->path);
+			free(m_paths[i]->files);
+			free(m_paths[i]);
+		}
+	}
+	free(m_paths);
+	m_paths = NULL;
+	m_path_max = 0;
+	m_path_count = 0;
+	free(m_path_buckets);
+	m_path_buckets = NULL;
+	m_path_bucket_count = 0;
+	
+	m_archive_seq = 0;
+	m_file_seq = 0;
+	m_path_seq = 0;
+	m_record_count = 0;
+}
+
+int DarwinupLogDatabase::compact() {
+	// paths no file refers to anymore are left out
+	for (uint64_t i = 0; i < m_path_max; i++) {
+		if (m_paths[i] && !m_paths[i]->file_count) this->forget_path(m_paths[i]);
+	}
+	
+	m_pending_size = 0;
+	int res = this->put_sequences();
+	for (uint64_t i = 0; res == DB_OK && i < m_path_max; i++) {
+		if (m_paths[i]) res = this->put_path(m_paths[i]);
+	}
+	for (uint32_t i = 0; res == DB_OK && i < m_archive_count; i++) {
+		res = this->put_archive(&m_archives[i]);
+	}
+	for (uint32_t i = 0; res == DB_OK && i < m_file_count; i++) {
+		if (m_files[i].path) res = this->put_file(&m_files[i]);
+	}
+	if (res) return res;
+	uint32_t hash = fnv1a_hash(m_pending, m_pending_size, FNV1A_INIT);
+	this->begin_record(LOG_COMMIT);
+	this->put_u32(hash);
+	this->end_record();
+	
+	// write a new log next to the old one, then swap them
+	char* tmp_path;
+	asprintf(&tmp_path, "%s.tmp", m_path);
+	int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 ||
+		pwrite_all(fd, (const uint8_t*)LOG_MAGIC, LOG_MAGIC_SIZE, 0) ||
+		pwrite_all(fd, m_pending, m_pending_size, LOG_MAGIC_SIZE) ||
+		fsync(fd) ||
+		rename(tmp_path, m_path)) {
+		perror(tmp_path);
+		if (fd != -1) close(fd);
+		unlink(tmp_path);
+		free(tmp_path);
+		m_pending_size = 0;
+		return DB_ERROR;
+	}
+	free(tmp_path);
+	
+	close(m_fd);
+	m_fd = fd;
+	m_log_size = LOG_MAGIC_SIZE + m_pending_size;
+	m_record_count = m_path_count + m_archive_count + m_file_count - m_file_dead;
+	m_pending_size = 0;
+	
+	return DB_OK;
+}
+
+int DarwinupLogDatabase::begin_transaction() {
+	if (m_in_transaction) {
+		fprintf(stderr, "Error: cannot start a transaction within a transaction\n");
+		return DB_ERROR;
+	}
+	m_in_transaction = true;
+	m_undo_size = 0;
+	m_undo_lost = false;
+	m_begin_archive_seq = m_archive_seq;
+	m_begin_file_seq = m_file_seq;
+	m_begin_path_seq = m_path_seq;
+	m_begin_record_count = m_record_count;
+	return DB_OK;
+}
+
+int DarwinupLogDatabase::rollback_transaction() {
+	if (!m_in_transaction) {
+		fprintf(stderr, "Error: cannot rollback - no transaction is active\n");
+		return DB_ERROR;
+	}
+	m_in_transaction = false;
+	m_pending_size = 0;
+	this->clear_last_archive();
+	return this->undo();
+}
+
+int DarwinupLogDatabase::commit_transaction() {
+	if (!m_in_transaction) {
+		fprintf(stderr, "Error: cannot commit - no transaction is active\n");
+		return DB_ERROR;
+	}
+	m_in_transaction = false;
+	m_undo_size = 0;
+	return this->write_pending();
+}
+
+int DarwinupLogDatabase::write_pending() {
+	if (!m_pending_size) return DB_OK;
+	
+	uint32_t hash = fnv1a_hash(m_pending, m_pending_size, FNV1A_INIT);
+	this->begin_record(LOG_COMMIT);
+	this->put_u32(hash);
+	this->end_record();
+	
+	int res = pwrite_all(m_fd, m_pending, m_pending_size, m_log_size);
+	if (res == 0 && m_profile != DB_PROFILE_BULK) res = fsync(m_fd);
+	if (res == 0) m_log_size += m_pending_size;
+	m_pending_size = 0;
+	if (res) {
+		perror(m_path);
+		// forget about the partial transaction
+		if (ftruncate(m_fd, m_log_size)) perror(m_path);
+		this->clear_last_archive();
+		this->unload();
+		this->load();
+		return DB_ERROR;
+	}
+	
+	return DB_OK;
+}
+
+int DarwinupLogDatabase::reserve(uint32_t size) {
+	if (m_pending_size + size <= m_pending_max) return DB_OK;
+	uint32_t max = m_pending_max ? m_pending_max : 4096;
+	while (max < m_pending_size + size) max *= REALLOC_FACTOR;
+	uint8_t* pending = (uint8_t*)realloc(m_pending, max);
+	if (!pending) {
+		fprintf(stderr, "Error: ran out of memory growing the log buffer\n");
+		m_buffer_error = true;
+		return DB_ERROR;
+	}
+	m_pending = pending;
+	m_pending_max = max;
+	return DB_OK;
+}
+
+void DarwinupLogDatabase::begin_record(uint8_t type) {
+	m_record_start = m_pending_size;
+	this->put_u8(type);
+	this->put_u32(0); // length is filled in by end_record()
+}
+
+void DarwinupLogDatabase::end_record() {
+	uint32_t length = m_pending_size - m_record_start - LOG_RECORD_HEADER;
+	uint8_t* p = m_pending + m_record_start + 1;
+	p[0] = length & 0xff;
+	p[1] = (length >> 8) & 0xff;
+	p[2] = (length >> 16) & 0xff;
+	p[3] = (length >> 24) & 0xff;
+}
+
+void DarwinupLogDatabase::put_u8(uint8_t value) {
+	if (this->reserve(1)) return;
+	m_pending[m_pending_size++] = value;
+}
+
+void DarwinupLogDatabase::put_u32(uint32_t value) {
+	if (this->reserve(4)) return;
+	for (int i = 0; i < 4; i++) {
+		m_pending[m_pending_size++] = (value >> (i * 8)) & 0xff;
+	}
+}
+
+void DarwinupLogDatabase::put_u64(uint64_t value) {
+	this->put_u32((uint32_t)(value & 0xffffffff));
+	this->put_u32((uint32_t)(value >> 32));
+}
+
+void DarwinupLogDatabase::put_bytes(const uint8_t* data, uint32_t size) {
+	if (!data) size = 0;
+	this->put_u32(size);
+	if (!size || this->reserve(size)) return;
+	memcpy(m_pending + m_pending_size, data, size);
+	m_pending_size += size;
+}
+
+void DarwinupLogDatabase::put_string(const char* str) {
+	if (!str) {
+		this->put_u32(LOG_NULL_STRING);
+		return;
+	}
+	uint32_t size = (uint32_t)strlen(str);
+	this->put_u32(size);
+	if (!size || this->reserve(size)) return;
+	memcpy(m_pending + m_pending_size, str, size);
+	m_pending_size += size;
+}
+
+int DarwinupLogDatabase::put_sequences() {
+	this->begin_record(LOG_SEQUENCES);
+	this->put_u64(m_archive_seq);
+	this->put_u64(m_file_seq);
+	this->put_u64(m_path_seq);
+	this->end_record();
+	return DB_OK;
+}
+
+int DarwinupLogDatabase::put_path(LogPath* path) {
+	this->begin_record(LOG_PATH);
+	this->put_u64(path->serial);
+	this->put_string(path->path);
+	this->end_record();
+	return DB_OK;
+}
+
+int DarwinupLogDatabase::put_archive(LogArchive* archive) {
+	this->begin_record(LOG_ARCHIVE);
+	this->put_u64(archive->serial);
+	this->put_bytes(archive->uuid, sizeof(uuid_t));
+	this->put_string(archive->name);
+	this->put_u64(archive->date_added);
+	this->put_u64(archive->active);
+	this->put_u64(archive->info);
+	this->put_string(archive->build);
+	this->put_bytes(archive->fingerprint, archive->fingerprint_size);
+	this->end_record();
+	return DB_OK;
+}
+
+int DarwinupLogDatabase::put_file(LogFile* file) {
+	this->begin_record(LOG_FILE);
+	this->put_u64(file->serial);
+	this->put_u64(file->archive);
+	this->put_u64(file->info);
+	this->put_u64(file->mode);
+	this->put_u64(file->uid);
+	this->put_u64(file->gid);
+	this->put_u64(file->size);
+	this->put_bytes(file->digest, file->digest_size);
+	this->put_u64(file->path->serial);
+	this->end_record();
+	return DB_OK;
+}
+
+int DarwinupLogDatabase::apply_last_record() {
+	if (m_readonly) {
+		fprintf(stderr, "Error: unable to write to log at: %s\n", m_path);
+		m_pending_size = m_record_start;
+		return DB_ERROR;
+	}
+	if (m_in_transaction) {
+		this->record_undo(m_pending[m_record_start], 
+						  m_pending + m_record_start + LOG_RECORD_HEADER,
+						  m_pending_size - m_record_start - LOG_RECORD_HEADER);
+	}
+	int res = this->apply_record(m_pending[m_record_start], 
+								 m_pending + m_record_start + LOG_RECORD_HEADER,
+								 m_pending_size - m_record_start - LOG_RECORD_HEADER);
+	if (res) {
+		m_pending_size = m_record_start;
+		return res;
+	}
+	m_record_count++;
+	
+	if (!m_in_transaction) res = this->write_pending();
+	return res;
+}
+
+int DarwinupLogDatabase::apply_record(uint8_t type, const uint8_t* data, uint32_t size) {
+	LogReader r = { data, size, 0, false };
+	uint64_t serial;
+	uint64_t value;
+	uint32_t length;
+	const uint8_t* bytes;
+	LogArchive* archive;
+	LogFile* file;
+	LogPath* path;
+	
+	switch (type) {
+		case LOG_SEQUENCES:
+			value = log_get_u64(&r);
+			if (value > m_archive_seq) m_archive_seq = value;
+			value = log_get_u64(&r);
+			if (value > m_file_seq) m_file_seq = value;
+			value = log_get_u64(&r);
+			if (value > m_path_seq) m_path_seq = value;
+			break;
+			
+		case LOG_PATH:
+			serial = log_get_u64(&r);
+			if (r.error || !serial || (serial < m_path_max && m_paths[serial])) {
+				r.error = true;
+				break;
+			}
+			if (serial >= m_path_max) {
+				uint64_t max = m_path_max ? m_path_max : LOG_BUCKETS;
+				while (max <= serial) max *= REALLOC_FACTOR;
+				m_paths = (LogPath**)realloc(m_paths, max * sizeof(LogPath*));
+				if (!m_paths) {
+					fprintf(stderr, "Error: ran out of memory adding a path\n");
+					return DB_ERROR;
+				}
+				memset(&m_paths[m_path_max], 0, (max - m_path_max) * sizeof(LogPath*));
+				m_path_max = max;
+			}
+			if (m_path_count >= m_path_bucket_count * 2) {
+				// grow the hash table
+				uint32_t count = m_path_bucket_count * REALLOC_FACTOR;
+				LogPath** buckets = (LogPath**)calloc(count, sizeof(LogPath*));
+				if (!buckets) {
+					fprintf(stderr, "Error: ran out of memory adding a path\n");
+					return DB_ERROR;
+				}
+				for (uint64_t i = 0; i < m_path_max; i++) {
+					if (!m_paths[i]) continue;
+					m_paths[i]->next = buckets[m_paths[i]->hash % count];
+					buckets[m_paths[i]->hash % count] = m_paths[i];
+				}
+				free(m_path_buckets);
+				m_path_buckets = buckets;
+				m_path_bucket_count = count;
+			}
+			path = (LogPath*)calloc(1, sizeof(LogPath));
+			path->serial = serial;
+			path->path = log_get_string(&r);
+			if (!path->path) {
+				free(path);
+				r.error = true;
+				break;
+			}
+			path->hash = fnv1a_hash((const uint8_t*)path->path, strlen(path->path), 
+									FNV1A_INIT);
+			path->next = m_path_buckets[path->hash % m_path_bucket_count];
+			m_path_buckets[path->hash % m_path_bucket_count] = path;
+			m_paths[serial] = path;
+			m_path_count++;
+			if (serial > m_path_seq) m_path_seq = serial;
+			break;
+			
+		case LOG_ARCHIVE:
+			serial = log_get_u64(&r);
+			bytes = log_get_bytes(&r, &length);
+			if (r.error || length != sizeof(uuid_t)) {
+				r.error = true;
+				break;
+			}
+			archive = this->find_archive(serial);
+			if (archive) {
+				free(archive->name);
+				free(archive->build);
+				free(archive->fingerprint);
+			} else {
+				if (m_archive_count >= m_archive_max) {
+					m_archive_max = m_archive_max ? m_archive_max * REALLOC_FACTOR : INITIAL_ROWS;
+					m_archives = (LogArchive*)realloc(m_archives, 
+													  m_archive_max * sizeof(LogArchive));
+					if (!m_archives) {
+						fprintf(stderr, "Error: ran out of memory adding an archive\n");
+						return DB_ERROR;
+					}
+				}
+				// keep archives sorted by serial
+				uint32_t i = m_archive_count;
+				while (i > 0 && m_archives[i - 1].serial > serial) i--;
+				memmove(&m_archives[i + 1], &m_archives[i], 
+						(m_archive_count - i) * sizeof(LogArchive));
+				m_archive_count++;
+				archive = &m_archives[i];
+				archive->serial = serial;
+			}
+			memcpy(archive->uuid, bytes, sizeof(uuid_t));
+			archive->name = log_get_string(&r);
+			archive->date_added = log_get_u64(&r);
+			archive->active = log_get_u64(&r);
+			archive->info = log_get_u64(&r);
+			archive->build = log_get_string(&r);
+			archive->fingerprint = NULL;
+			archive->fingerprint_size = 0;
+			// logs written before fingerprints end here
+			if (r.pos < r.size) bytes = log_get_bytes(&r, &length);
+			else length = 0;
+			if (length) {
+				archive->fingerprint = (uint8_t*)malloc(length);
+				memcpy(archive->fingerprint, bytes, length);
+				archive->fingerprint_size = length;
+			}
+			if (serial > m_archive_seq) m_archive_seq = serial;
+			break;
+			
+		case LOG_ARCHIVE_DEL:
+			serial = log_get_u64(&r);
+			archive = this->find_archive(serial);
+			if (archive) {
+				free(archive->name);
+				free(archive->build);
+				free(archive->fingerprint);
+				uint32_t i = (uint32_t)(archive - m_archives);
+				memmove(&m_archives[i], &m_archives[i + 1], 
+						(m_archive_count - i - 1) * sizeof(LogArchive));
+				m_archive_count--;
+			}
+			break;
+			
+		case LOG_FILE:
+			serial = log_get_u64(&r);
+			file = this->find_file(serial);
+			if (!file) {
+				if (m_file_count >= m_file_max) {
+					m_file_max = m_file_max ? m_file_max * REALLOC_FACTOR : LOG_BUCKETS;
+					m_files = (LogFile*)realloc(m_files, m_file_max * sizeof(LogFile));
+					if (!m_files) {
+						fprintf(stderr, "Error: ran out of memory adding a file\n");
+						return DB_ERROR;
+					}
+				}
+				// keep files sorted by serial, which is almost always an append
+				uint32_t i = m_file_count;
+				while (i > 0 && m_files[i - 1].serial > serial) i--;
+				if (i > 0 && m_files[i - 1].serial == serial) {
+					// reuse the slot of a deleted file
+					i--;
+					m_file_dead--;
+				} else {
+					memmove(&m_files[i + 1], &m_files[i], 
+							(m_file_count - i) * sizeof(LogFile));
+					m_file_count++;
+				}
+				file = &m_files[i];
+				file->serial = serial;
+				file->path = NULL;
+				file->digest = NULL;
+			}
+			if (file->path) this->unlink_file(file->path, serial);
+			free(file->digest);
+			file->archive = log_get_u64(&r);
+			file->info = log_get_u64(&r);
+			file->mode = log_get_u64(&r);
+			file->uid = log_get_u64(&r);
+			file->gid = log_get_u64(&r);
+			file->size = log_get_u64(&r);
+			bytes = log_get_bytes(&r, &length);
+			file->digest = NULL;
+			file->digest_size = length;
+			if (length) {
+				file->digest = (uint8_t*)malloc(length);
+				memcpy(file->digest, bytes, length);
+			}
+			value = log_get_u64(&r);
+			file->path = (value && value < m_path_max) ? m_paths[value] : NULL;
+			if (r.error || !file->path) {
+				// leave it deleted
+				file->path = NULL;
+				m_file_dead++;
+				r.error = true;
+				break;
+			}
+			this->link_file(file->path, serial);
+			if (serial > m_file_seq) m_file_seq = serial;
+			break;
+			
+		case LOG_FILE_DEL:
+			serial = log_get_u64(&r);
+			file = this->find_file(serial);
+			if (file) this->remove_file(file);
+			this->pack_files();
+			break;
+			
+		case LOG_FILES_DEL:
+			serial = log_get_u64(&r);
+			for (uint32_t i = 0; i < m_file_count; i++) {
+				if (m_files[i].path && m_files[i].archive == serial) {
+					this->remove_file(&m_files[i]);
+				}
+			}
+			this->pack_files();
+			break;
+			
+		case LOG_PATH_DEL:
+			serial = log_get_u64(&r);
+			if (!r.error && serial < m_path_max && m_paths[serial]) {
+				this->forget_path(m_paths[serial]);
+			}
+			break;
+			
+		default:
+			r.error = true;
+			break;
+	}
+	
+	if (r.error) {
+		fprintf(stderr, "Error: invalid log record of type %u\n", type);
+		return DB_ERROR;
+	}
+	return DB_OK;
+}
+
+// the undo records are encoded with the same functions as the log, 
+// into their own buffer
+void DarwinupLogDatabase::swap_undo() {
+	uint8_t* buffer = m_pending;
+	uint32_t size = m_pending_size;
+	uint32_t max = m_pending_max;
+	uint32_t start = m_record_start;
+	m_pending = m_undo;
+	m_pending_size = m_undo_size;
+	m_pending_max = m_undo_max;
+	m_record_start = m_undo_start;
+	m_undo = buffer;
+	m_undo_size = size;
+	m_undo_max = max;
+	m_undo_start = start;
+}
+
+void DarwinupLogDatabase::record_undo(uint8_t type, const uint8_t* data, uint32_t size) {
+	LogReader r = { data, size, 0, false };
+	uint64_t serial = type == LOG_SEQUENCES ? 0 : log_get_u64(&r);
+	LogArchive* archive;
+	LogFile* file;
+	
+	m_buffer_error = false;
+	this->swap_undo();
+	switch (type) {
+		case LOG_PATH:
+			this->begin_record(LOG_PATH_DEL);
+			this->put_u64(serial);
+			this->end_record();
+			break;
+			
+		case LOG_ARCHIVE:
+		case LOG_ARCHIVE_DEL:
+			archive = this->find_archive(serial);
+			if (archive) {
+				this->put_archive(archive);
+			} else if (type == LOG_ARCHIVE) {
+				this->begin_record(LOG_ARCHIVE_DEL);
+				this->put_u64(serial);
+				this->end_record();
+			}
+			break;
+			
+		case LOG_FILE:
+		case LOG_FILE_DEL:
+			file = this->find_file(serial);
+			if (file) {
+				this->put_file(file);
+			} else if (type == LOG_FILE) {
+				this->begin_record(LOG_FILE_DEL);
+				this->put_u64(serial);
+				this->end_record();
+			}
+			break;
+			
+		case LOG_FILES_DEL:
+			for (uint32_t i = 0; i < m_file_count; i++) {
+				if (m_files[i].path && m_files[i].archive == serial) {
+					this->put_file(&m_files[i]);
+				}
+			}
+			break;
+	}
+	this->swap_undo();
+	if (m_buffer_error) m_undo_lost = true;
+}
+
+int DarwinupLogDatabase::undo() {
+	int res = DB_OK;
+	uint32_t count = 0;
+	for (uint32_t pos = 0; pos < m_undo_size; count++) {
+		pos += LOG_RECORD_HEADER + log_read_u32(m_undo + pos + 1);
+	}
+	uint32_t* offsets = (uint32_t*)malloc((count + 1) * sizeof(uint32_t));
+	if (!offsets || m_undo_lost) res = DB_ERROR;
+	
+	for (uint32_t pos = 0, i = 0; res == DB_OK && i < count; i++) {
+		offsets[i] = pos;
+		pos += LOG_RECORD_HEADER + log_read_u32(m_undo + pos + 1);
+	}
+	for (uint32_t i = count; res == DB_OK && i > 0; i--) {
+		const uint8_t* record = m_undo + offsets[i - 1];
+		res = this->apply_record(record[0], record + LOG_RECORD_HEADER,
+								 log_read_u32(record + 1));
+	}
+	free(offsets);
+	m_undo_size = 0;
+	
+	if (res == DB_OK) {
+		m_archive_seq = m_begin_archive_seq;
+		m_file_seq = m_begin_file_seq;
+		m_path_seq = m_begin_path_seq;
+		m_record_count = m_begin_record_count;
+		return DB_OK;
+	}
+	
+	// rebuild the depot as it was at the last commit
+	this->unload();
+	return this->load();
+}
+
+LogArchive* DarwinupLogDatabase::find_archive(uint64_t serial) {
+	uint32_t low = 0;
+	uint32_t high = m_archive_count;
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+		if (m_archives[mid].serial < serial) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	if (low < m_archive_count && m_archives[low].serial == serial) {
+		return &m_archives[low];
+	}
+	return NULL;
+}
+
+LogFile* DarwinupLogDatabase::find_file(uint64_t serial) {
+	uint32_t low = 0;
+	uint32_t high = m_file_count;
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+		if (m_files[mid].serial < serial) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	if (low < m_file_count && m_files[low].serial == serial && m_files[low].path) {
+		return &m_files[low];
+	}
+	return NULL;
+}
+
+LogPath* DarwinupLogDatabase::find_path(const char* path) {
+	if (!path || !m_path_bucket_count) return NULL;
+	uint32_t hash = fnv1a_hash((const uint8_t*)path, strlen(path), FNV1A_INIT);
+	LogPath* p = m_path_buckets[hash % m_path_bucket_count];
+	while (p) {
+		if (p->hash == hash && strcmp(p->path, path) == 0) return p;
+		p = p->next;
+	}
+	return NULL;
+}
+
+LogPath* DarwinupLogDatabase::intern_path(const char* path) {
+	LogPath* p = this->find_path(path);
+	if (p) return p;
+	
+	LogPath tmp;
+	tmp.serial = m_path_seq + 1;
+	tmp.path = (char*)path;
+	this->put_path(&tmp);
+	if (this->apply_last_record()) {
+		fprintf(stderr, "Error: unable to insert path %s\n", path);
+		return NULL;
+	}
+	return m_paths[tmp.serial];
+}
+
+LogFile* DarwinupLogDatabase::find_file_in_archive(LogPath* path, uint64_t archive) {
+	for (uint32_t i = 0; i < path->file_count; i++) {
+		LogFile* file = this->find_file(path->files[i]);
+		if (file && file->archive == archive) return file;
+	}
+	return NULL;
+}
+
+void DarwinupLogDatabase::link_file(LogPath* path, uint64_t serial) {
+	if (path->file_count >= path->file_max) {
+		path->file_max = path->file_max ? path->file_max * REALLOC_FACTOR : 2;
+		path->files = (uint64_t*)realloc(path->files, path->file_max * sizeof(uint64_t));
+	}
+	path->files[path->file_count++] = serial;
+}
+
+void DarwinupLogDatabase::forget_path(LogPath* path) {
+	LogPath** link = &m_path_buckets[path->hash % m_path_bucket_count];
+	while (*link != path) link = &(*link)->next;
+	*link = path->next;
+	m_paths[path->serial] = NULL;
+	m_path_count--;
+	free(path->path);
+	free(path->files);
+	free(path);
+}
+
+void DarwinupLogDatabase::unlink_file(LogPath* path, uint64_t serial) {
+	for (uint32_t i = 0; i < path->file_count; i++) {
+		if (path->files[i] == serial) {
+			path->files[i] = path->files[--path->file_count];
+			return;
+		}
+	}
+}
+
+void DarwinupLogDatabase::remove_file(LogFile* file) {
+	this->unlink_file(file->path, file->serial);
+	free(file->digest);
+	file->digest = NULL;
+	file->path = NULL;
+	m_file_dead++;
+}
+
+void DarwinupLogDatabase::pack_files() {
+	if (m_file_dead < LOG_BUCKETS || m_file_dead < m_file_count / 2) return;
+	uint32_t live = 0;
+	for (uint32_t i = 0; i < m_file_count; i++) {
+		if (m_files[i].path) m_files[live++] = m_files[i];
+	}
+	m_file_count = live;
+	m_file_dead = 0;
+}
+
+uint8_t* DarwinupLogDatabase::archive_result(LogArchive* archive) {
+	uint8_t* data = m_archives_table->alloc_result();
+	if (!data) return NULL;
+	
+	uint8_t* uuid = (uint8_t*)malloc(sizeof(uuid_t));
+	memcpy(uuid, archive->uuid, sizeof(uuid_t));
+	char* name = archive->name ? strdup(archive->name) : NULL;
+	char* build = archive->build ? strdup(archive->build) : NULL;
+	uint8_t* fingerprint = NULL;
+	if (archive->fingerprint_size) {
+		fingerprint = (uint8_t*)malloc(archive->fingerprint_size);
+		memcpy(fingerprint, archive->fingerprint, archive->fingerprint_size);
+	}
+	
+	memcpy(&data[this->archive_offset(0)], &archive->serial, sizeof(uint64_t));
+	memcpy(&data[this->archive_offset(1)], &uuid, sizeof(uint8_t*));
+	memcpy(&data[this->archive_offset(2)], &name, sizeof(char*));
+	memcpy(&data[this->archive_offset(3)], &archive->date_added, sizeof(uint64_t));
+	memcpy(&data[this->archive_offset(4)], &archive->active, sizeof(uint64_t));
+	memcpy(&data[this->archive_offset(5)], &archive->info, sizeof(uint64_t));
+	memcpy(&data[this->archive_offset(6)], &build, sizeof(char*));
+	memcpy(&data[this->archive_offset(7)], &fingerprint, sizeof(uint8_t*));
+	
+	return data;
+}
+
+uint8_t* DarwinupLogDatabase::file_result(LogFile* file) {
+	uint8_t* data = m_files_table->alloc_result();
+	if (!data) return NULL;
+
+	uint8_t* digest = NULL;
+	if (file->digest_size) {
+		digest = (uint8_t*)malloc(file->digest_size);
+		memcpy(digest, file->digest, file->digest_size);
+	}
+	char* path = strdup(file->path->path);
+	
+	memcpy(&data[this->file_offset(0)], &file->serial, sizeof(uint64_t));
+	memcpy(&data[this->file_offset(1)], &file->archive, sizeof(uint64_t));
+	memcpy(&data[this->file_offset(2)], &file->info, sizeof(uint64_t));
+	memcpy(&data[this->file_offset(3)], &file->mode, sizeof(uint64_t));
+	memcpy(&data[this->file_offset(4)], &file->uid, sizeof(uint64_t));
+	memcpy(&data[this->file_offset(5)], &file->gid, sizeof(uint64_t));
+	memcpy(&data[this->file_offset(6)], &file->size, sizeof(uint64_t));
+	memcpy(&data[this->file_offset(7)], &digest, sizeof(uint8_t*));
+	memcpy(&data[this->file_offset(8)], &path, sizeof(char*));
+	memcpy(&data[this->file_offset(9)], &file->path->serial, sizeof(uint64_t));
+	
+	return data;
+}
+
+uint64_t DarwinupLogDatabase::count_files(Archive* archive, const char* path) {
+	LogPath* p = this->find_path(path);
+	if (p && this->find_file_in_archive(p, archive->serial())) return 1;
+	return 0;
+}
+
+uint64_t DarwinupLogDatabase::count_archives(bool include_rollbacks) {
+	if (include_rollbacks) return m_archive_count;
+	uint64_t count = 0;
+	for (uint32_t i = 0; i < m_archive_count; i++) {
+		if (m_archives[i].name && !log_name_is(m_archives[i].name, "<Rollback>")) count++;
+	}
+	return count;
+}
+
+// every record for a row that has since been replaced or deleted is 
+// unused until the log is compacted
+int DarwinupLogDatabase::storage_usage(uint64_t* bytes, uint64_t* units, uint64_t* unused) {
+	uint32_t live = m_path_count + m_archive_count + m_file_count - m_file_dead;
+	*bytes = m_log_size;
+	*units = m_record_count;
+	*unused = m_record_count > live ? m_record_count - live : 0;
+	return DB_OK;
+}
+
+// compact() leaves them out
+int DarwinupLogDatabase::delete_unused_paths() {
+	return DB_OK;
+}
+
+// the log can only be compacted all at once, which takes about as long
+// as replaying it did
+int DarwinupLogDatabase::vacuum(uint32_t seconds) {
+	uint64_t bytes, units, unused;
+	this->storage_usage(&bytes, &units, &unused);
+	if (m_readonly || unused == 0) return DB_OK;
+	IF_DEBUG("Compacting log with %u records for %llu rows\n", m_record_count, units - unused);
+	return this->compact();
+}
+
+int DarwinupLogDatabase::get_archives(uint8_t*** data, uint32_t* count, bool include_rollbacks) {
+	// same as name != '' or name != '<Rollback>' in SQL
+	const char* exclude = include_rollbacks ? "" : "<Rollback>";
+	*count = 0;
+	*data = (uint8_t**)calloc(m_archive_count + 1, sizeof(uint8_t*));
+	if (!*data) return DB_ERROR;
+	for (uint32_t i = m_archive_count; i > 0; i--) {
+		LogArchive* archive = &m_archives[i - 1];
+		if (!archive->name || log_name_is(archive->name, exclude)) continue;
+		(*data)[(*count)++] = this->archive_result(archive);
+	}
+	if (*count) return (DB_OK | DB_FOUND);
+	return DB_OK;
+}
+
+int DarwinupLogDatabase::get_archive(uint8_t** data, uuid_t uuid) {
+	*data = NULL;
+	for (uint32_t i = 0; i < m_archive_count; i++) {
+		if (memcmp(m_archives[i].uuid, uuid, sizeof(uuid_t)) == 0) {
+			*data = this->archive_result(&m_archives[i]);
+			return (DB_FOUND | DB_OK);
+		}
+	}
+	return DB_OK;
+}
+
+int DarwinupLogDatabase::get_archive(uint8_t** data, uint64_t serial) {
+	*data = NULL;
+	LogArchive* archive = this->find_archive(serial);
+	if (!archive) return DB_OK;
+	*data = this->archive_result(archive);
+	return (DB_FOUND | DB_OK);
+}
+
+int DarwinupLogDatabase::get_archive(uint8_t** data, const char* name) {
+	*data = NULL;
+	for (uint32_t i = 0; i < m_archive_count; i++) {
+		if (log_name_is(m_archives[i].name, name)) {
+			*data = this->archive_result(&m_archives[i]);
+			return (DB_FOUND | DB_OK);
+		}
+	}
+	return DB_OK;
+}
+
+int DarwinupLogDatabase::get_archive(uint8_t** data, archive_keyword_t keyword) {
+	// the lowest serial wins a tie on date_added, like the SQLite engine
+	LogArchive* found = NULL;
+	for (uint32_t i = 0; i < m_archive_count; i++) {
+		LogArchive* archive = &m_archives[i];
+		if (!archive->name || log_name_is(archive->name, "<Rollback>")) continue;
+		if (!found ||
+			(keyword == DEPOT_ARCHIVE_OLDEST && archive->date_added < found->date_added) ||
+			(keyword != DEPOT_ARCHIVE_OLDEST && archive->date_added > found->date_added)) {
+			found = archive;
+		}
+	}
+	*data = NULL;
+	if (!found) return DB_OK;
+	*data = this->archive_result(found);
+	return (DB_FOUND | DB_OK);
+}
+
+int DarwinupLogDatabase::get_inactive_archive_serials(uint64_t** serials, uint32_t* count) {
+	*count = 0;
+	*serials = (uint64_t*)malloc((m_archive_count + 1) * sizeof(uint64_t));
+	if (!*serials) return DB_ERROR;
+	for (uint32_t i = 0; i < m_archive_count; i++) {
+		if (m_archives[i].active == 0) (*serials)[(*count)++] = m_archives[i].serial;
+	}
+	if (*count) return (DB_OK | DB_FOUND);
+	return DB_OK;
+}
+
+int DarwinupLogDatabase::set_archive_active(uint64_t serial, uint64_t* active) {
+	this->clear_last_archive();
+	LogArchive* archive = this->find_archive(serial);
+	if (!archive) return DB_OK;
+	LogArchive tmp = *archive;
+	tmp.active = *active;
+	this->put_archive(&tmp);
+	return this->apply_last_record();
+}
+
+int DarwinupLogDatabase::update_archive(uint64_t serial, uuid_t uuid, const char* name,
+										time_t date_added, uint32_t active, uint64_t info,
+										const char* build, Digest* fingerprint) {
+	this->clear_last_archive();
+	if (!this->find_archive(serial)) return DB_OK;
+	LogArchive tmp;
+	tmp.serial = serial;
+	memcpy(tmp.uuid, uuid, sizeof(uuid_t));
+	tmp.name = (char*)name;
+	tmp.date_added = (uint64_t)date_added;
+	tmp.active = active;
+	tmp.info = info;
+	tmp.build = (char*)build;
+	tmp.fingerprint = fingerprint ? fingerprint->data() : NULL;
+	tmp.fingerprint_size = fingerprint ? fingerprint->size() : 0;
+	this->put_archive(&tmp);
+	return this->apply_last_record();
+}
+
+uint64_t DarwinupLogDatabase::insert_archive(uuid_t uuid, uint64_t info, const char* name, 
+											 time_t date_added, const char* build) {
+	LogArchive tmp;
+	tmp.serial = m_archive_seq + 1;
+	memcpy(tmp.uuid, uuid, sizeof(uuid_t));
+	tmp.name = (char*)name;
+	tmp.date_added = (uint64_t)date_added;
+	tmp.active = 0;
+	tmp.info = info;
+	tmp.build = (char*)build;
+	tmp.fingerprint = NULL;
+	tmp.fingerprint_size = 0;
+	this->put_archive(&tmp);
+	if (this->apply_last_record()) {
+		fprintf(stderr, "Error: unable to insert archive %s\n", name);
+		return 0;
+	}
+	return tmp.serial;
+}
+
+int DarwinupLogDatabase::delete_empty_archives() {
+	bool* used = (bool*)calloc(m_archive_count + 1, sizeof(bool));
+	if (!used) return DB_ERROR;
+	for (uint32_t i = 0; i < m_file_count; i++) {
+		if (!m_files[i].path) continue;
+		LogArchive* archive = this->find_archive(m_files[i].archive);
+		if (archive) used[archive - m_archives] = true;
+	}
+	
+	uint32_t count = 0;
+	uint64_t* serials = (uint64_t*)malloc((m_archive_count + 1) * sizeof(uint64_t));
+	for (uint32_t i = 0; i < m_archive_count; i++) {
+		if (!used[i]) serials[count++] = m_archives[i].serial;
+	}
+	free(used);
+	
+	int res = DB_OK;
+	for (uint32_t i = 0; res == DB_OK && i < count; i++) {
+		res = this->delete_archive(serials[i]);
+	}
+	free(serials);
+	return res;
+}
+
+int DarwinupLogDatabase::delete_archive(uint64_t serial) {
+	this->clear_last_archive();
+	if (!this->find_archive(serial)) return DB_OK;
+	this->begin_record(LOG_ARCHIVE_DEL);
+	this->put_u64(serial);
+	this->end_record();
+	return this->apply_last_record();
+}
+
+int DarwinupLogDatabase::get_next_file(uint8_t** data, File* file, file_starseded_t star) {
+	*data = NULL;
+	LogPath* path = this->find_path(file->path());
+	if (!path) return DB_OK;
+	
+	// closest archive before (preceded) or after (superseded) the file's
+	uint64_t archive = file->archive()->serial();
+	LogFile* found = NULL;
+	for (uint32_t i = 0; i < path->file_count; i++) {
+		LogFile* other = this->find_file(path->files[i]);
+		if (!other) continue;
+		if (star == FILE_SUPERSEDED) {
+			if (other->archive > archive && (!found || other->archive < found->archive)) {
+				found = other;
+			}
+		} else {
+			if (other->archive < archive && (!found || other->archive > found->archive)) {
+				found = other;
+			}
+		}
+	}
+	if (!found) return DB_OK;
+	*data = this->file_result(found);
+	return (DB_FOUND | DB_OK);
+}
+
+int DarwinupLogDatabase::get_file_serials(uint64_t** serials, uint32_t* count) {
+	*count = 0;
+	*serials = (uint64_t*)malloc((m_file_count + 1) * sizeof(uint64_t));
+	if (!*serials) return DB_ERROR;
+	for (uint32_t i = 0; i < m_file_count; i++) {
+		if (m_files[i].path) (*serials)[(*count)++] = m_files[i].serial;
+	}
+	if (*count) return (DB_OK | DB_FOUND);
+	return DB_OK;
+}
+
+int DarwinupLogDatabase::get_file_serial_from_archive(Archive* archive, const char* path, 
+													  uint64_t** serial) {
+	*serial = (uint64_t*)malloc(sizeof(uint64_t));
+	if (!*serial) return DB_ERROR;
+	LogPath* p = this->find_path(path);
+	LogFile* file = p ? this->find_file_in_archive(p, archive->serial()) : NULL;
+	if (!file) return DB_OK;
+	**serial = file->serial;
+	return (DB_FOUND | DB_OK);
+}
+
+// the files of an archive sorted by path
+LogFile** DarwinupLogDatabase::archive_files(uint64_t archive, bool reverse, uint32_t* count) {
+	*count = 0;
+	LogFile** files = (LogFile**)malloc((m_file_count + 1) * sizeof(LogFile*));
+	if (!files) return NULL;
+	for (uint32_t i = 0; i < m_file_count; i++) {
+		if (m_files[i].path && m_files[i].archive == archive) files[(*count)++] = &m_files[i];
+	}
+	qsort(files, *count, sizeof(LogFile*), 
+		  reverse ? log_compare_paths_reverse : log_compare_paths);
+	return files;
+}
+
+int DarwinupLogDatabase::get_files(uint8_t*** data, uint32_t* count, Archive* archive, bool reverse) {
+	uint32_t found = 0;
+	LogFile** files = this->archive_files(archive->serial(), reverse, &found);
+	if (!files) return DB_ERROR;
+	
+	*count = found;
+	*data = (uint8_t**)calloc(found + 1, sizeof(uint8_t*));
+	if (!*data) {
+		free(files);
+		return DB_ERROR;
+	}
+	for (uint32_t i = 0; i < found; i++) {
+		(*data)[i] = this->file_result(files[i]);
+	}
+	free(files);
+	
+	if (*count) return (DB_OK | DB_FOUND);
+	return DB_OK;
+}
+
+int DarwinupLogDatabase::get_uninstall_plan(uint8_t*** data, uint8_t*** preceding, 
+											uint8_t** superseded, uint32_t* count, 
+											Archive* archive) {
+	uint64_t serial = archive->serial();
+	uint32_t found = 0;
+	LogFile** files = this->archive_files(serial, true, &found);
+	*data = (uint8_t**)calloc(found + 1, sizeof(uint8_t*));
+	*preceding = (uint8_t**)calloc(found + 1, sizeof(uint8_t*));
+	*superseded = (uint8_t*)calloc(found + 1, sizeof(uint8_t));
+	if (!files || !*data || !*preceding || !*superseded) {
+		free(files);
+		return DB_ERROR;
+	}
+	
+	*count = found;
+	for (uint32_t i = 0; i < found; i++) {
+		LogPath* path = files[i]->path;
+		LogFile* before = NULL;
+		for (uint32_t j = 0; j < path->file_count; j++) {
+			LogFile* other = this->find_file(path->files[j]);
+			if (!other) continue;
+			if (other->archive > serial) (*superseded)[i] = 1;
+			if (other->archive < serial && (!before || other->archive > before->archive)) {
+				before = other;
+			}
+		}
+		(*data)[i] = this->file_result(files[i]);
+		if (before) (*preceding)[i] = this->file_result(before);
+	}
+	free(files);
+	
+	if (*count) return (DB_OK | DB_FOUND);
+	return DB_OK;
+}
+
+int DarwinupLogDatabase::get_path_files(uint8_t*** data, uint32_t* count, Archive* archive) {
+	uint32_t found = 0;
+	LogFile** files = this->archive_files(archive->serial(), true, &found);
+	if (!files) return DB_ERROR;
+	
+	*count = 0;
+	uint32_t total = 0;
+	for (uint32_t i = 0; i < found; i++) total += files[i]->path->file_count;
+	*data = (uint8_t**)calloc(total + 1, sizeof(uint8_t*));
+	if (!*data) {
+		free(files);
+		return DB_ERROR;
+	}
+	for (uint32_t i = 0; i < found; i++) {
+		LogPath* path = files[i]->path;
+		for (uint32_t j = 0; j < path->file_count; j++) {
+			LogFile* other = this->find_file(path->files[j]);
+			if (other) (*data)[(*count)++] = this->file_result(other);
+		}
+	}
+	free(files);
+	
+	if (*count) return (DB_OK | DB_FOUND);
+	return DB_OK;
+}
+
+int DarwinupLogDatabase::get_current_files(uint8_t*** data, uint32_t* count) {
+	LogFile** files = (LogFile**)malloc((m_path_count + 1) * sizeof(LogFile*));
+	if (!files) return DB_ERROR;
+	
+	uint32_t found = 0;
+	for (uint64_t i = 0; i < m_path_max; i++) {
+		LogPath* path = m_paths[i];
+		if (!path) continue;
+		LogFile* current = NULL;
+		for (uint32_t j = 0; j < path->file_count; j++) {
+			LogFile* other = this->find_file(path->files[j]);
+			if (!other || (current && other->archive < current->archive)) continue;
+			LogArchive* archive = this->find_archive(other->archive);
+			if (archive && archive->active && 
+				!INFO_TEST(archive->info, ARCHIVE_INFO_ROLLBACK)) {
+				current = other;
+			}
+		}
+		if (current) files[found++] = current;
+	}
+	qsort(files, found, sizeof(LogFile*), log_compare_paths);
+	
+	*count = found;
+	*data = (uint8_t**)calloc(found + 1, sizeof(uint8_t*));
+	if (!*data) {
+		free(files);
+		return DB_ERROR;
+	}
+	for (uint32_t i = 0; i < found; i++) {
+		(*data)[i] = this->file_result(files[i]);
+	}
+	free(files);
+	
+	if (*count) return (DB_OK | DB_FOUND);
+	return DB_OK;
+}
+
+int DarwinupLogDatabase::update_file(uint64_t serial, Archive* archive, uint64_t info, 
+									 mode_t mode, uid_t uid, gid_t gid, Digest* digest, 
+									 const char* path) {
+	if (!this->find_file(serial)) return DB_OK;
+	LogPath* p = this->intern_path(path);
+	if (!p) return DB_ERROR;
+	LogFile* other = this->find_file_in_archive(p, archive->serial());
+	if (other && other->serial != serial) {
+		fprintf(stderr, "Error: unable to update file with serial %llu and path %s: "
+				"archive %llu already has that path\n", 
+				serial, path, archive->serial());
+		return DB_ERROR;
+	}
+	
+	LogFile tmp;
+	tmp.serial = serial;
+	tmp.archive = archive->serial();
+	tmp.info = info;
+	tmp.mode = mode;
+	tmp.uid = uid;
+	tmp.gid = gid;
+	tmp.size = 0;
+	tmp.digest = digest ? digest->data() : NULL;
+	tmp.digest_size = digest ? digest->size() : 0;
+	tmp.path = p;
+	this->put_file(&tmp);
+	return this->apply_last_record();
+}
+
+uint64_t DarwinupLogDatabase::insert_file(uint64_t info, mode_t mode, uid_t uid, gid_t gid, 
+										  off_t size, Digest* digest, Archive* archive, 
+										  const char* path) {
+	LogPath* p = this->intern_path(path);
+	if (!p) return 0;
+	if (this->find_file_in_archive(p, archive->serial())) {
+		fprintf(stderr, "Error: unable to insert file at %s: archive %llu already "
+				"has that path\n", path, archive->serial());
+		return 0;
+	}
+	
+	LogFile tmp;
+	tmp.serial = m_file_seq + 1;
+	tmp.archive = archive->serial();
+	tmp.info = info;
+	tmp.mode = mode;
+	tmp.uid = uid;
+	tmp.gid = gid;
+	tmp.size = size;
+	tmp.digest = digest ? digest->data() : NULL;
+	tmp.digest_size = digest ? digest->size() : 0;
+	tmp.path = p;
+	this->put_file(&tmp);
+	if (this->apply_last_record()) {
+		fprintf(stderr, "Error: unable to insert file at %s\n", path);
+		return 0;
+	}
+	return tmp.serial;
+}
+
+int DarwinupLogDatabase::delete_file(uint64_t serial) {
+	if (!this->find_file(serial)) return DB_OK;
+	this->begin_record(LOG_FILE_DEL);
+	this->put_u64(serial);
+	this->end_record();
+	return this->apply_last_record();
+}
+
+int DarwinupLogDatabase::delete_files(uint64_t* serials, uint32_t count) {
+	int res = DB_OK;
+	for (uint32_t i = 0; res == DB_OK && i < count; i++) {
+		res = this->delete_file(serials[i]);
+	}
+	return res;
+}
+
+int DarwinupLogDatabase::move_files(uint64_t* serials, uint32_t count, Archive* archive, 
+									uint64_t info) {
+	int res = DB_OK;
+	for (uint32_t i = 0; res == DB_OK && i < count; i++) {
+		LogFile* file = this->find_file(serials[i]);
+		if (!file) continue;
+		LogFile tmp = *file;
+		tmp.archive = archive->serial();
+		tmp.info = info;
+		this->put_file(&tmp);
+		res = this->apply_last_record();
+	}
+	return res;
+}
+
+int DarwinupLogDatabase::delete_files(Archive* archive) {
+	this->begin_record(LOG_FILES_DEL);
+	this->put_u64(archive->serial());
+	this->end_record();
+	return this->apply_last_record();
+}
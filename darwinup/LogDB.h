@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2010 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+
+#ifndef _LOGDB_H
+#define _LOGDB_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <uuid/uuid.h>
+
+#include "DB.h"
+
+// first bytes of every log file
+#define LOG_MAGIC      "DUPLOG01"
+#define LOG_MAGIC_SIZE 8
+
+// record types, each record is a type byte, a 32-bit payload
+//  length and the payload
+#define LOG_SEQUENCES    'S' // last serials handed out
+#define LOG_PATH         'P' // intern a path
+#define LOG_ARCHIVE      'A' // insert or replace an archive
+#define LOG_ARCHIVE_DEL  'a' // delete an archive
+#define LOG_FILE         'F' // insert or replace a file
+#define LOG_FILE_DEL     'f' // delete a file
+#define LOG_FILES_DEL    'D' // delete every file in an archive
+#define LOG_COMMIT       'C' // end of a transaction, with a checksum
+#define LOG_PATH_DEL     'p' // forget a path, only to undo a transaction
+
+// rewrite the log when it holds this many more records than live rows
+#define LOG_COMPACT_FACTOR 2
+#define LOG_COMPACT_MIN    4096
+
+struct LogArchive {
+	uint64_t serial;
+	uuid_t   uuid;
+	char*    name;
+	uint64_t date_added;
+	uint64_t active;
+	uint64_t info;
+	char*    build;
+	uint8_t* fingerprint;
+	uint32_t fingerprint_size;
+};
+
+struct LogPath {
+	uint64_t  serial;
+	char*     path;
+	uint32_t  hash;
+	LogPath*  next;     // hash chain
+	uint64_t* files;    // serials of the files with this path
+	uint32_t  file_count;
+	uint32_t  file_max;
+};
+
+struct LogFile {
+	uint64_t serial;
+	uint64_t archive;
+	uint64_t info;
+	uint64_t mode;
+	uint64_t uid;
+	uint64_t gid;
+	uint64_t size;
+	uint8_t* digest;
+	uint32_t digest_size;
+	LogPath* path;      // NULL once deleted
+};
+
+/**
+ *
+ * Log-structured storage engine for darwinup.
+ *
+ * Every change is appended to a single log file as a record and
+ *  the whole depot is kept in memory, where it is rebuilt by
+ *  replaying the log on connect. Records made inside a transaction
+ *  are buffered and written with one write() when it commits, so
+ *  installing a root costs one sequential write instead of a
+ *  B-tree update per file. A transaction that was not completely
+ *  written is ignored (and truncated away) by the next replay.
+ *  Each record applied in a transaction first saves the records that
+ *  undo it, which a rollback applies in reverse order.
+ *
+ * Uses the schema from DarwinupDatabase to hand out result records,
+ *  but never opens a SQLite database.
+ *
+ */
+struct DarwinupLogDatabase : DarwinupDatabase {
+	DarwinupLogDatabase(const char* path, bool writable);
+	virtual ~DarwinupLogDatabase();
+	
+	bool     is_connected();
+	int      begin_transaction();
+	int      rollback_transaction();
+	int      commit_transaction();
+	
+	uint64_t count_files(Archive* archive, const char* path);
+	uint64_t count_archives(bool include_rollbacks);
+	int      storage_usage(uint64_t* bytes, uint64_t* units, uint64_t* unused);
+	int      vacuum(uint32_t seconds);
+	int      delete_unused_paths();
+	
+	// Archives
+	int      get_archives(uint8_t*** data, uint32_t* count, bool include_rollbacks);
+	int      get_archive(uint8_t** data, uuid_t uuid);
+	int      get_archive(uint8_t** data, uint64_t serial);
+	int      get_archive(uint8_t** data, const char* name);
+	int      get_archive(uint8_t** data, archive_keyword_t keyword);
+	int      get_inactive_archive_serials(uint64_t** serials, uint32_t* count);
+	int      update_archive(uint64_t serial, uuid_t uuid, const char* name,
+							time_t date_added, uint32_t active, uint64_t info,
+							const char* build, Digest* fingerprint);
+	uint64_t insert_archive(uuid_t uuid, uint64_t info, const char* name, 
+							time_t date, const char* build);
+	int      delete_empty_archives();
+	int      delete_archive(uint64_t serial);
+	
+	// Files
+	int      get_next_file(uint8_t** data, File* file, file_starseded_t star);
+	int      get_file_serials(uint64_t** serials, uint32_t* count);
+	int      get_file_serial_from_archive(Archive* archive, const char* path, 
+										  uint64_t** serial);
+	int      get_files(uint8_t*** data, uint32_t* count, Archive* archive, bool reverse);
+	int      get_uninstall_plan(uint8_t*** files, uint8_t*** preceding, 
+								uint8_t** superseded, uint32_t* count, Archive* archive);
+	int      get_path_files(uint8_t*** data, uint32_t* count, Archive* archive);
+	int      get_current_files(uint8_t*** data, uint32_t* count);
+	int      update_file(uint64_t serial, Archive* archive, uint64_t info, mode_t mode,
+						 uid_t uid, gid_t gid, Digest* digest, const char* path);
+	uint64_t insert_file(uint64_t info, mode_t mode, uid_t uid, gid_t gid,
+						 off_t size, Digest* digest, Archive* archive, const char* path);
+	int      delete_file(uint64_t serial);
+	int      delete_files(Archive* archive);
+	int      delete_files(uint64_t* serials, uint32_t count);
+	int      move_files(uint64_t* serials, uint32_t count, Archive* archive, 
+						uint64_t info);
+
+protected:
+
+	int      set_archive_active(uint64_t serial, uint64_t* active);
+
+	// open the log, creating it if needed, and replay it
+	int      open_log();
+	int      load();
+	void     unload();
+	// rewrite the log with only the live rows
+	int      compact();
+	
+	// record encoding, into m_pending
+	void     begin_record(uint8_t type);
+	void     end_record();
+	int      reserve(uint32_t size);
+	void     put_u8(uint8_t value);
+	void     put_u32(uint32_t value);
+	void     put_u64(uint64_t value);
+	void     put_bytes(const uint8_t* data, uint32_t size);
+	void     put_string(const char* str);
+	int      put_archive(LogArchive* archive);
+	int      put_path(LogPath* path);
+	int      put_file(LogFile* file);
+	int      put_sequences();
+	
+	// apply the record just encoded at the end of m_pending,
+	//  and write it out if we are not in a transaction
+	int      apply_last_record();
+	// append m_pending to the log as one transaction
+	int      write_pending();
+	// apply one record to the in-memory depot
+	int      apply_record(uint8_t type, const uint8_t* data, uint32_t size);
+	
+	// undo records, encoded like m_pending into m_undo
+	void     swap_undo();
+	void     record_undo(uint8_t type, const uint8_t* data, uint32_t size);
+	// apply the undo records of the transaction, last one first
+	int      undo();
+	
+	// in-memory lookups
+	LogArchive* find_archive(uint64_t serial);
+	LogFile*    find_file(uint64_t serial);
+	LogPath*    find_path(const char* path);
+	LogPath*    intern_path(const char* path);
+	LogFile*    find_file_in_archive(LogPath* path, uint64_t archive);
+	LogFile**   archive_files(uint64_t archive, bool reverse, uint32_t* count);
+	void        link_file(LogPath* path, uint64_t serial);
+	void        unlink_file(LogPath* path, uint64_t serial);
+	void        remove_file(LogFile* file);
+	void        forget_path(LogPath* path);
+	// drop deleted files from m_files once there are enough of them
+	void        pack_files();
+	
+	// convert to Table result records
+	uint8_t*    archive_result(LogArchive* archive);
+	uint8_t*    file_result(LogFile* file);
+	
+	int              m_fd;
+	off_t            m_log_size;
+	bool             m_in_transaction;
+	
+	uint8_t*         m_pending;
+	uint32_t         m_pending_size;
+	uint32_t         m_pending_max;
+	uint32_t         m_record_start;
+	uint32_t         m_record_count;
+	bool             m_buffer_error;  // reserve() failed since it was cleared
+	
+	uint8_t*         m_undo;
+	uint32_t         m_undo_size;
+	uint32_t         m_undo_max;
+	uint32_t         m_undo_start;
+	bool             m_undo_lost;     // some undo records could not be saved
+	// as they were when the transaction began
+	uint64_t         m_begin_archive_seq;
+	uint64_t         m_begin_file_seq;
+	uint64_t         m_begin_path_seq;
+	uint32_t         m_begin_record_count;
+	
+	uint64_t         m_archive_seq;
+	uint64_t         m_file_seq;
+	uint64_t         m_path_seq;
+	
+	LogArchive*      m_archives;
+	uint32_t         m_archive_count;
+	uint32_t         m_archive_max;
+	
+	LogFile*         m_files;
+	uint32_t         m_file_count;  // including deleted files
+	uint32_t         m_file_max;
+	uint32_t         m_file_dead;
+	
+	LogPath**        m_path_buckets;
+	uint32_t         m_path_bucket_count;
+	LogPath**        m_paths;       // indexed by serial
+	uint64_t         m_path_max;
+	uint32_t         m_path_count;
+	
+};
+
+#endif
@@ -0,0 +1,594 @@
+/*
+ * Copyright (c) 2010 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "Depot.h"
+#include "Manifest.h"
+#include "Utils.h"
+
+#define SQLITE_HEADER        "SQLite format 3"
+#define SQLITE_COUNTER_OFFSET 24
+
+/**
+ * growable tables and a deduplicated string pool for Manifest::write()
+ */
+struct ManifestWriter {
+	ManifestWriter() {
+		archives = NULL;
+		archive_count = 0;
+		archive_max = 0;
+		files = NULL;
+		file_count = 0;
+		file_max = 0;
+		strings = NULL;
+		strings_size = 0;
+		strings_max = 0;
+		slots = NULL;
+		slot_count = 0;
+		slot_used = 0;
+	}
+	
+	~ManifestWriter() {
+		free(archives);
+		free(files);
+		free(strings);
+		free(slots);
+	}
+	
+	ManifestArchive* add_archive() {
+		if (archive_count >= archive_max) {
+			archive_max = archive_max ? archive_max * REALLOC_FACTOR : INITIAL_ROWS;
+			archives = (ManifestArchive*)realloc(archives, archive_max * sizeof(ManifestArchive));
+			if (!archives) return NULL;
+		}
+		ManifestArchive* archive = &archives[archive_count++];
+		memset(archive, 0, sizeof(ManifestArchive));
+		return archive;
+	}
+	
+	ManifestFile* add_file() {
+		if (file_count >= file_max) {
+			file_max = file_max ? file_max * REALLOC_FACTOR : 1024;
+			files = (ManifestFile*)realloc(files, file_max * sizeof(ManifestFile));
+			if (!files) return NULL;
+		}
+		ManifestFile* file = &files[file_count++];
+		memset(file, 0, sizeof(ManifestFile));
+		return file;
+	}
+	
+	// returns the offset of str in the pool, adding it if needed
+	uint32_t add_string(const char* str) {
+		if (!str) return MANIFEST_NO_STRING;
+		size_t len = strlen(str);
+		uint32_t hash = fnv1a_hash((const uint8_t*)str, len, FNV1A_INIT);
+		
+		if (slot_used * 2 >= slot_count && this->grow_slots()) return MANIFEST_NO_STRING;
+		uint32_t i = hash & (slot_count - 1);
+		while (slots[i]) {
+			// slots hold offset + 1 so zero means empty
+			if (strcmp(strings + slots[i] - 1, str) == 0) return slots[i] - 1;
+			i = (i + 1) & (slot_count - 1);
+		}
+		
+		if (strings_size + len + 1 > strings_max) {
+			while (strings_size + len + 1 > strings_max) {
+				strings_max = strings_max ? strings_max * REALLOC_FACTOR : 4096;
+			}
+			strings = (char*)realloc(strings, strings_max);
+			if (!strings) return MANIFEST_NO_STRING;
+		}
+		uint32_t offset = strings_size;
+		memcpy(strings + offset, str, len + 1);
+		strings_size += len + 1;
+		slots[i] = offset + 1;
+		slot_used++;
+		return offset;
+	}
+	
+	int grow_slots() {
+		uint32_t count = slot_count ? slot_count * REALLOC_FACTOR : 1024;
+		uint32_t* grown = (uint32_t*)calloc(count, sizeof(uint32_t));
+		if (!grown) return -1;
+		for (uint32_t i = 0; i < slot_count; i++) {
+			if (!slots[i]) continue;
+			const char* str = strings + slots[i] - 1;
+			uint32_t j = fnv1a_hash((const uint8_t*)str, strlen(str), FNV1A_INIT) & (count - 1);
+			while (grown[j]) j = (j + 1) & (count - 1);
+			grown[j] = slots[i];
+		}
+		free(slots);
+		slots = grown;
+		slot_count = count;
+		return 0;
+	}
+	
+	ManifestArchive* archives;
+	uint32_t         archive_count;
+	uint32_t         archive_max;
+	ManifestFile*    files;
+	uint32_t         file_count;
+	uint32_t         file_max;
+	char*            strings;
+	uint32_t         strings_size;
+	uint32_t         strings_max;
+	uint32_t*        slots;
+	uint32_t         slot_count;
+	uint32_t         slot_used;
+};
+
+
+Manifest::Manifest() {
+	m_data = NULL;
+	m_size = 0;
+	m_header = NULL;
+	m_archives = NULL;
+	m_files = NULL;
+	m_strings = NULL;
+}
+
+Manifest::~Manifest() {
+	this->close();
+}
+
+int Manifest::stamp(const char* db_path, ManifestStamp* stamp) {
+	struct stat sb;
+	if (stat(db_path, &sb) == -1) return DEPOT_ERROR;
+	
+	memset(stamp, 0, sizeof(ManifestStamp));
+	stamp->inode = sb.st_ino;
+	stamp->size = sb.st_size;
+	stamp->mtime = sb.st_mtime;
+	
+	// SQLite bumps the change counter in its header on every commit,
+	// which catches changes within the same second and file size
+	int fd = ::open(db_path, O_RDONLY);
+	if (fd == -1) return DEPOT_ERROR;
+	uint8_t header[SQLITE_COUNTER_OFFSET + 4];
+	if (pread(fd, header, sizeof(header), 0) == sizeof(header) &&
+		memcmp(header, SQLITE_HEADER, sizeof(SQLITE_HEADER)) == 0) {
+		uint8_t* c = &header[SQLITE_COUNTER_OFFSET];
+		stamp->counter = ((uint32_t)c[0] << 24) | ((uint32_t)c[1] << 16) | 
+		                 ((uint32_t)c[2] << 8) | (uint32_t)c[3];
+	}
+	::close(fd);
+	
+	return DEPOT_OK;
+}
+
+int Manifest::open(const char* path, const char* db_path) {
+	this->close();
+	
+	ManifestStamp current;
+	if (Manifest::stamp(db_path, &current)) return DEPOT_ERROR;
+	
+	int fd = ::open(path, O_RDONLY);
+	if (fd == -1) return DEPOT_ERROR;
+	struct stat sb;
+	if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(ManifestHeader)) {
+		::close(fd);
+		return DEPOT_ERROR;
+	}
+	void* data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (data == MAP_FAILED) return DEPOT_ERROR;
+	m_data = (uint8_t*)data;
+	m_size = sb.st_size;
+	
+	m_header = (ManifestHeader*)m_data;
+	if (memcmp(m_header->magic, MANIFEST_MAGIC, sizeof(m_header->magic)) ||
+		m_header->version != MANIFEST_VERSION ||
+		m_header->size != m_size) {
+		IF_DEBUG("ignoring manifest with a bad header\n");
+		this->close();
+		return DEPOT_ERROR;
+	}
+	if (memcmp(&m_header->stamp, &current, sizeof(ManifestStamp))) {
+		IF_DEBUG("ignoring manifest older than the database\n");
+		this->close();
+		return DEPOT_ERROR;
+	}
+	
+	uint64_t size = sizeof(ManifestHeader) + 
+	                (uint64_t)m_header->archive_count * sizeof(ManifestArchive) +
+	                (uint64_t)m_header->file_count * sizeof(ManifestFile) +
+	                m_header->strings_size;
+	if (size != m_size ||
+		m_header->checksum != fnv1a_hash(m_data + sizeof(ManifestHeader), 
+										 m_size - sizeof(ManifestHeader), FNV1A_INIT)) {
+		IF_DEBUG("ignoring corrupt manifest\n");
+		this->close();
+		return DEPOT_ERROR;
+	}
+	
+	m_archives = (ManifestArchive*)(m_data + sizeof(ManifestHeader));
+	m_files = (ManifestFile*)(m_archives + m_header->archive_count);
+	m_strings = (const char*)(m_files + m_header->file_count);
+	
+	// every string must be terminated inside the pool
+	if (m_header->strings_size && m_strings[m_header->strings_size - 1] != 0) {
+		IF_DEBUG("ignoring corrupt manifest\n");
+		this->close();
+		return DEPOT_ERROR;
+	}
+	for (uint32_t i = 0; i < m_header->archive_count; i++) {
+		if (m_archives[i].first_file > m_header->file_count ||
+			m_archives[i].file_count > m_header->file_count - m_archives[i].first_file) {
+			IF_DEBUG("ignoring corrupt manifest\n");
+			this->close();
+			return DEPOT_ERROR;
+		}
+	}
+	
+	return DEPOT_OK;
+}
+
+void Manifest::close() {
+	if (m_data) munmap(m_data, m_size);
+	m_data = NULL;
+	m_size = 0;
+	m_header = NULL;
+	m_archives = NULL;
+	m_files = NULL;
+	m_strings = NULL;
+}
+
+bool Manifest::is_current(const char* path, const char* db_path) {
+	ManifestStamp current;
+	if (Manifest::stamp(db_path, &current)) return false;
+	
+	ManifestHeader header;
+	int fd = ::open(path, O_RDONLY);
+	if (fd == -1) return false;
+	ssize_t size = pread(fd, &header, sizeof(header), 0);
+	::close(fd);
+	
+	return (size == sizeof(header) &&
+			memcmp(header.magic, MANIFEST_MAGIC, sizeof(header.magic)) == 0 &&
+			header.version == MANIFEST_VERSION &&
+			memcmp(&header.stamp, &current, sizeof(ManifestStamp)) == 0);
+}
+
+int Manifest::write(const char* path, const char* db_path, DarwinupDatabase* db) {
+	int res = DEPOT_OK;
+	uint8_t** archlist;
+	uint32_t count = 0;
+	
+	int found = db->get_archives(&archlist, &count, true);
+	if (found & DB_ERROR) return DEPOT_ERROR;
+	
+	// archives without a name are not listed by get_archives(),
+	// leave depots that have any to the database
+	if (db->count_archives(true) != count) {
+		for (uint32_t i = 0; i < count; i++) db->free_archive(archlist[i]);
+		free(archlist);
+		return DEPOT_ERROR;
+	}
+	
+	ManifestWriter writer;
+	for (uint32_t i = 0; i < count; i++) {
+		Archive* archive = res == DEPOT_OK ? db->make_archive(archlist[i]) : NULL;
+		if (!archive) {
+			if (res == DEPOT_OK) db->free_archive(archlist[i]);
+			res = DEPOT_ERROR;
+			continue;
+		}
+		
+		ManifestArchive* entry = writer.add_archive();
+		if (!entry) {
+			delete archive;
+			res = DEPOT_ERROR;
+			continue;
+		}
+		entry->serial = archive->serial();
+		entry->date_added = archive->date_installed();
+		memcpy(entry->uuid, archive->uuid(), sizeof(entry->uuid));
+		entry->name = writer.add_string(archive->name());
+		entry->build = writer.add_string(archive->build());
+		entry->first_file = writer.file_count;
+		
+		uint8_t** filelist;
+		uint32_t filecount = 0;
+		found = db->get_files(&filelist, &filecount, archive, false);
+		if (found & DB_ERROR) res = DEPOT_ERROR;
+		for (uint32_t j = 0; j < filecount; j++) {
+			File* file = res == DEPOT_OK ? db->make_file(filelist[j]) : NULL;
+			if (!file) {
+				if (res == DEPOT_OK) db->free_file(filelist[j]);
+				res = DEPOT_ERROR;
+				continue;
+			}
+			ManifestFile* fentry = writer.add_file();
+			if (fentry) {
+				fentry->info = file->info();
+				fentry->mode = file->mode();
+				fentry->uid = file->uid();
+				fentry->gid = file->gid();
+				fentry->path = writer.add_string(file->path());
+				Digest* digest = file->digest();
+				if (digest) {
+					uint32_t size = digest->size();
+					if (size > sizeof(fentry->digest)) size = sizeof(fentry->digest);
+					memcpy(fentry->digest, digest->data(), size);
+					fentry->has_digest = 1;
+				}
+			}
+			if (!fentry || fentry->path == MANIFEST_NO_STRING) res = DEPOT_ERROR;
+			delete file;
+		}
+		free(filelist);
+		entry->file_count = writer.file_count - entry->first_file;
+		delete archive;
+	}
+	free(archlist);
+	if (res) return res;
+	
+	ManifestHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+	header.version = MANIFEST_VERSION;
+	header.archive_count = writer.archive_count;
+	header.file_count = writer.file_count;
+	header.strings_size = writer.strings_size;
+	header.size = sizeof(header) + 
+	              (uint64_t)writer.archive_count * sizeof(ManifestArchive) +
+	              (uint64_t)writer.file_count * sizeof(ManifestFile) +
+	              writer.strings_size;
+	uint32_t checksum = FNV1A_INIT;
+	checksum = fnv1a_hash((uint8_t*)writer.archives, 
+						  writer.archive_count * sizeof(ManifestArchive), checksum);
+	checksum = fnv1a_hash((uint8_t*)writer.files, 
+						  writer.file_count * sizeof(ManifestFile), checksum);
+	checksum = fnv1a_hash((uint8_t*)writer.strings, writer.strings_size, checksum);
+	header.checksum = checksum;
+	if (Manifest::stamp(db_path, &header.stamp)) return DEPOT_ERROR;
+	
+	// write next to the manifest and rename so readers never see half of one,
+	// commands that share the depot lock may be writing one at the same time
+	char* tmp_path;
+	asprintf(&tmp_path, "%s.XXXXXX", path);
+	int fd = mkstemp(tmp_path);
+	FILE* f = NULL;
+	if (fd != -1 && fchmod(fd, 0644) == 0) f = fdopen(fd, "w");
+	if (!f) {
+		IF_DEBUG("unable to write manifest %s: %s\n", tmp_path, strerror(errno));
+		if (fd != -1) {
+			::close(fd);
+			unlink(tmp_path);
+		}
+		free(tmp_path);
+		return DEPOT_ERROR;
+	}
+	if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+		(writer.archive_count && 
+		 fwrite(writer.archives, sizeof(ManifestArchive), writer.archive_count, f) 
+		 != writer.archive_count) ||
+		(writer.file_count && 
+		 fwrite(writer.files, sizeof(ManifestFile), writer.file_count, f) 
+		 != writer.file_count) ||
+		(writer.strings_size && 
+		 fwrite(writer.strings, writer.strings_size, 1, f) != 1)) {
+		res = DEPOT_ERROR;
+	}
+	if (fclose(f)) res = DEPOT_ERROR;
+	if (res == DEPOT_OK && rename(tmp_path, path)) res = DEPOT_ERROR;
+	if (res) {
+		IF_DEBUG("unable to write manifest %s: %s\n", path, strerror(errno));
+		unlink(tmp_path);
+	}
+	free(tmp_path);
+	
+	return res;
+}
+
+bool Manifest::handles(int argc, char** argv) {
+	if (argc < 1) return false;
+	if (!(strcmp(argv[0], "list") == 0 ||
+		  (strcmp(argv[0], "files") == 0 && argc > 1) ||
+		  (strcmp(argv[0], "dump") == 0 && argc == 1))) {
+		return false;
+	}
+	// superseded needs to look at the files on disk
+	for (int i = 1; i < argc; i++) {
+		if (strncasecmp(argv[i], "superseded", 10) == 0 && strlen(argv[i]) == 10) {
+			return false;
+		}
+	}
+	return true;
+}
+
+const char* Manifest::string(uint32_t offset) {
+	if (offset >= m_header->strings_size) return NULL;
+	return m_strings + offset;
+}
+
+bool Manifest::is_rollback(ManifestArchive* archive) {
+	const char* name = this->string(archive->name);
+	return name && strcmp(name, "<Rollback>") == 0;
+}
+
+// same lookups as Depot::get_archive()
+ManifestArchive* Manifest::archive(const char* arg) {
+	uint32_t count = m_header->archive_count;
+	
+	uuid_t uuid;
+	if (uuid_parse(arg, uuid) == 0) {
+		for (uint32_t i = 0; i < count; i++) {
+			if (memcmp(m_archives[i].uuid, uuid, sizeof(uuid_t)) == 0) return &m_archives[i];
+		}
+		return NULL;
+	}
+	
+	uint64_t serial; 
+	char* endptr = NULL;
+	serial = strtoull(arg, &endptr, 0);
+	if (serial && (*arg != '\0') && (*endptr == '\0')) {
+		for (uint32_t i = 0; i < count; i++) {
+			if (m_archives[i].serial == serial) return &m_archives[i];
+		}
+		return NULL;
+	}
+	
+	// archives are newest first, walk them by increasing serial so
+	// the lowest serial wins ties like it does in the database
+	bool oldest = strncasecmp("oldest", arg, 6) == 0;
+	bool newest = strncasecmp("newest", arg, 6) == 0;
+	ManifestArchive* found = NULL;
+	for (uint32_t i = count; i > 0; i--) {
+		ManifestArchive* archive = &m_archives[i - 1];
+		if (oldest || newest) {
+			if (this->is_rollback(archive)) continue;
+			if (!found ||
+				(oldest && archive->date_added < found->date_added) ||
+				(newest && archive->date_added > found->date_added)) {
+				found = archive;
+			}
+		} else {
+			const char* name = this->string(archive->name);
+			if (name && strcmp(name, arg) == 0) return archive;
+		}
+	}
+	return found;
+}
+
+void Manifest::print_archive(ManifestArchive* archive) {
+	char uuid[37];
+	uuid_unparse_upper(archive->uuid, uuid);
+	
+	char date[100];
+	struct tm local;
+	time_t seconds = (time_t)archive->date_added;
+	localtime_r(&seconds, &local);
+	strftime(date, sizeof(date), "%b %e %H:%M", &local);
+	
+	const char* build = this->string(archive->build);
+	fprintf(stdout, "%-6llu %-36s  %-12s  %-7s  %s\n", 
+			archive->serial, uuid, date, (build?build:""), this->string(archive->name));
+}
+
+void Manifest::print_files(ManifestArchive* archive) {
+	extern uint32_t verbosity;
+	static const char* hexabet = "0123456789abcdef";
+	
+	hr();
+	ManifestFile* file = &m_files[archive->first_file];
+	for (uint32_t i = 0; i < archive->file_count; i++, file++) {
+		if (verbosity & VERBOSE_DEBUG) fprintf(stdout, "%04llx ", file->info);
+		
+		char mode_str[12];
+		strmode(file->mode, mode_str);
+		
+		char dig[2 * sizeof(file->digest) + 1];
+		for (uint32_t j = 0; j < sizeof(file->digest); j++) {
+			dig[2*j] = file->has_digest ? hexabet[(file->digest[j] & 0xF0) >> 4] : ' ';
+			dig[2*j+1] = file->has_digest ? hexabet[(file->digest[j] & 0x0F)] : ' ';
+		}
+		dig[sizeof(dig) - 1] = 0;
+		
+		fprintf(stdout, "%s % 4d % 4d %s %s\n", mode_str, (int)file->uid, (int)file->gid, 
+				dig, this->string(file->path));
+	}
+	hr();
+	fprintf(stdout, "\n");
+}
+
+int Manifest::list(int count, char** args) {
+	extern uint32_t verbosity;
+	bool rollbacks = verbosity & VERBOSE_DEBUG;
+	
+	Depot::archive_header();
+	for (int i = 0; i < (count ? count : 1); i++) {
+		uint32_t listed = 0;
+		if (count == 0 || (strncasecmp(args[i], "all", 3) == 0 && strlen(args[i]) == 3)) {
+			for (uint32_t j = 0; j < m_header->archive_count; j++) {
+				if (!rollbacks && this->is_rollback(&m_archives[j])) continue;
+				this->print_archive(&m_archives[j]);
+				listed++;
+			}
+			if (listed || count == 0) continue;
+		}
+		ManifestArchive* archive = this->archive(args[i]);
+		if (archive) this->print_archive(archive);
+	}
+	return DEPOT_OK;
+}
+
+int Manifest::files(const char* archspec) {
+	extern uint32_t verbosity;
+	bool all = strncasecmp(archspec, "all", 3) == 0 && strlen(archspec) == 3;
+	
+	for (uint32_t i = 0; i < m_header->archive_count; i++) {
+		ManifestArchive* archive = &m_archives[i];
+		if (all) {
+			if (!(verbosity & VERBOSE_DEBUG) && this->is_rollback(archive)) continue;
+		} else {
+			archive = this->archive(archspec);
+			if (!archive) break;
+		}
+		if (verbosity & VERBOSE_DEBUG) {
+			char uuid[37];
+			uuid_unparse_upper(archive->uuid, uuid);
+			fprintf(stdout, "Found archive: %s\n", uuid);
+		}
+		Depot::archive_header();
+		this->print_archive(archive);
+		this->print_files(archive);
+		if (!all) return DEPOT_OK;
+	}
+	
+	if (!all) {
+		fprintf(stdout, "Archive not found: %s\n", archspec);
+		return DEPOT_ERROR;
+	}
+	return DEPOT_OK;
+}
+
+int Manifest::dump() {
+	extern uint32_t verbosity;
+	verbosity = 0xFFFFFFFF; // dump is intrinsically a debug command
+	Depot::archive_header();
+	for (uint32_t i = 0; i < m_header->archive_count; i++) {
+		this->print_archive(&m_archives[i]);
+		this->print_files(&m_archives[i]);
+	}
+	return DEPOT_OK;
+}
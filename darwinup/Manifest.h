@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2010 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+
+#ifndef _MANIFEST_H
+#define _MANIFEST_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "DB.h"
+
+#define MANIFEST_MAGIC     "DUPMAN01"
+#define MANIFEST_VERSION   1
+#define MANIFEST_NO_STRING 0xFFFFFFFF
+
+// state of the depot database a manifest was written from
+struct ManifestStamp {
+	uint64_t inode;
+	uint64_t size;
+	uint64_t mtime;
+	uint64_t counter;   // SQLite file change counter, 0 for a log
+};
+
+struct ManifestHeader {
+	char          magic[8];
+	uint32_t      version;
+	uint32_t      checksum;       // of everything after the header
+	uint64_t      size;           // of the whole manifest
+	ManifestStamp stamp;
+	uint32_t      archive_count;
+	uint32_t      file_count;
+	uint32_t      strings_size;
+	uint32_t      reserved;
+};
+
+// strings are offsets into the string pool at the end of the manifest
+struct ManifestArchive {
+	uint64_t serial;
+	uint64_t date_added;
+	uint8_t  uuid[16];
+	uint32_t name;
+	uint32_t build;
+	uint32_t first_file;
+	uint32_t file_count;
+};
+
+struct ManifestFile {
+	uint64_t info;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t path;
+	uint8_t  digest[20];
+	uint32_t has_digest;
+};
+
+/**
+ *
+ * Read-only snapshot of the depot database.
+ *
+ * After darwinup modifies the depot it writes every archive (newest
+ *  first) and its files (sorted by path) into a single file that
+ *  list, files and dump can mmap and print from without connecting
+ *  to the database or allocating anything. The manifest records the
+ *  inode, size, mtime and SQLite change counter of the database, and
+ *  is ignored as soon as any of them differ.
+ *
+ */
+struct Manifest {
+	Manifest();
+	~Manifest();
+	
+	// map the manifest at path if it is current for the database at db_path
+	int  open(const char* path, const char* db_path);
+	void close();
+	
+	// cheap check of the header alone, without validating the contents
+	static bool is_current(const char* path, const char* db_path);
+	
+	// write a manifest of everything in db, which lives at db_path
+	static int write(const char* path, const char* db_path, DarwinupDatabase* db);
+	
+	// true if the command line arguments can be answered from a manifest
+	static bool handles(int argc, char** argv);
+	
+	// same output as the Depot commands of the same name
+	int  list(int count, char** args);
+	int  files(const char* archspec);
+	int  dump();
+	
+protected:
+
+	static int  stamp(const char* db_path, ManifestStamp* stamp);
+	
+	ManifestArchive* archive(const char* arg);
+	const char*      string(uint32_t offset);
+	bool             is_rollback(ManifestArchive* archive);
+	void             print_archive(ManifestArchive* archive);
+	void             print_files(ManifestArchive* archive);
+	
+	uint8_t*           m_data;
+	size_t             m_size;
+	ManifestHeader*    m_header;
+	ManifestArchive*   m_archives;
+	ManifestFile*      m_files;
+	const char*        m_strings;
+};
+
+#endif
@@ -56,9 +56,13 @@ int SerialSet::add(uint64_t value) {
 	}
 
 	// Otherwise, append it to the end of the set
+	return this->append(value);
+}
+
+int SerialSet::append(uint64_t value) {
 	this->count++;
 	if (this->count > this->capacity) {
-		this->capacity += 10;
+		this->capacity = this->capacity ? this->capacity * 2 : 10;
 		this->values = (uint64_t*)realloc(this->values, this->capacity * sizeof(uint64_t));
 		assert(this->values != NULL);
 	}
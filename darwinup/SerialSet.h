@@ -42,6 +42,8 @@ struct SerialSet {
 	~SerialSet();
 	
 	int add(uint64_t value);
+	// add a value the caller knows is not in the set yet
+	int append(uint64_t value);
 
 	uint32_t capacity;
 	uint32_t count;
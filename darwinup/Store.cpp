@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2010 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "Store.h"
+#include "Utils.h"
+
+Store::Store(const char* path) {
+	m_path = strdup(path);
+	m_lock_fd = -1;
+}
+
+Store::~Store() {
+	this->unlock();
+	free(m_path);
+}
+
+const char* Store::path() { return m_path; }
+
+int Store::lock() {
+	m_lock_fd = open(m_path, O_RDONLY);
+	if (m_lock_fd == -1) {
+		perror(m_path);
+		return -1;
+	}
+	fcntl(m_lock_fd, F_SETFD, FD_CLOEXEC);
+	if (flock(m_lock_fd, LOCK_EX) == -1) {
+		perror(m_path);
+		this->unlock();
+		return -1;
+	}
+	return 0;
+}
+
+void Store::unlock() {
+	if (m_lock_fd != -1) close(m_lock_fd);
+	m_lock_fd = -1;
+}
+
+int Store::share(const char* path, const char* name) {
+	char* objpath = NULL;
+	char* tmppath = NULL;
+	join_path(&objpath, m_path, name);
+	asprintf(&tmppath, "%s.share", path);
+	if (!objpath || !tmppath) {
+		fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+		free(objpath);
+		free(tmppath);
+		return -1;
+	}
+	
+	int res = this->lock();
+	struct stat sb;
+	if (res == 0 && lstat(objpath, &sb) == 0) {
+		// another depot has it, drop our copy for a link to theirs
+		IF_DEBUG("[store] sharing %s as %s\n", path, name);
+		unlink(tmppath);
+		res = link(objpath, tmppath);
+		if (res == 0) res = rename(tmppath, path);
+		if (res) unlink(tmppath);
+	} else if (res == 0) {
+		IF_DEBUG("[store] adding %s as %s\n", path, name);
+		res = link(path, objpath);
+	}
+	if (res && m_lock_fd != -1) {
+		fprintf(stderr, "Warning: unable to share %s through %s: %s\n", 
+				path, m_path, strerror(errno));
+	}
+	this->unlock();
+	
+	free(objpath);
+	free(tmppath);
+	return res;
+}
+
+int Store::collect() {
+	int res = this->lock();
+	DIR* dir = res == 0 ? opendir(m_path) : NULL;
+	if (res == 0 && !dir) {
+		perror(m_path);
+		res = -1;
+	}
+	
+	struct dirent* dp;
+	uint32_t removed = 0;
+	while (dir && (dp = readdir(dir)) != NULL) {
+		if (dp->d_name[0] == '.') continue;
+		char* objpath = NULL;
+		join_path(&objpath, m_path, dp->d_name);
+		struct stat sb;
+		// only the store's own link is left
+		if (objpath && lstat(objpath, &sb) == 0 && 
+			S_ISREG(sb.st_mode) && sb.st_nlink == 1) {
+			IF_DEBUG("[store] collecting %s\n", dp->d_name);
+			if (unlink(objpath) == 0) removed++;
+		}
+		free(objpath);
+	}
+	if (dir) closedir(dir);
+	this->unlock();
+	
+	if (removed) IF_DEBUG("[store] collected %u objects\n", removed);
+	return res;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2010 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#ifndef _STORE_H
+#define _STORE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ *
+ * Object store shared by the depots of several prefixes on one volume.
+ *
+ *  Each object is a file named after a hash of its content: a compacted
+ *  backing store is named after the fingerprint of the files in it, a
+ *  download after the digest of its data. A depot keeps a hard link to
+ *  every object it uses in place of its own copy, so the link count of
+ *  an object is the number of depots referencing it, plus one for the
+ *  store. Objects are never written to once they are in the store.
+ *
+ *  The store directory is flock(2)ed while objects are added or
+ *  collected, so depots in different prefixes can use it at once.
+ *
+ */
+struct Store {
+	Store(const char* path);
+	~Store();
+	
+	const char* path();
+	
+	// Replaces the file at path with a link to the object called name,
+	//  adding the file to the store as that object if it is not there
+	//  yet. The file is left alone if it cannot be shared.
+	int share(const char* path, const char* name);
+	
+	// Deletes the objects no depot links to anymore.
+	int collect();
+	
+protected:
+
+	int         lock();
+	void        unlock();
+
+	char*       m_path;
+	int         m_lock_fd;
+};
+
+#endif
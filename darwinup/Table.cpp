@@ -47,6 +47,7 @@ Table::Table(const char* name) {
 	m_result_count  = 0;
 	m_results       = (uint8_t**)malloc(sizeof(uint8_t*) * m_result_max);
 	m_name          = strdup(name);
+	m_view          = NULL;
 	m_create_sql    = NULL;
 	m_custom_create_sql    = NULL;
 	m_insert_sql    = NULL;
@@ -73,6 +74,7 @@ Table::~Table() {
 	free(m_results);
 	
 	free(m_name);
+	free(m_view);
 
 	free(m_create_sql);
 	free(m_custom_create_sql);
@@ -99,6 +101,16 @@ int Table::set_custom_create(const char* sql) {
 	return this->m_custom_create_sql == 0;
 }
 
+int Table::set_view(const char* name) {
+	this->m_view = strdup(name);
+	return this->m_view == 0;
+}
+
+const char* Table::source() {
+	if (m_view) return m_view;
+	return m_name;
+}
+
 int Table::add_column(Column* c, uint32_t schema_version) {
 	// accumulate offsets for columns in m_columns_size
 	c->m_offset = this->m_columns_size;
@@ -162,6 +174,7 @@ int Table::free_result(uint8_t* result) {
 				m_results[m_result_count-1] = NULL;
 			}
 			m_result_count--;
+			break;
 		}
 	}
 	return 0;
@@ -358,7 +371,7 @@ sqlite3_stmt* Table::del(sqlite3* db) {
 sqlite3_stmt** Table::count(sqlite3* db, uint32_t count, va_list args) {
 	__alloc_stmt_query;
 	strlcpy(query, "SELECT count(*) FROM ", size);
-	__check_and_cat(m_name);
+	__check_and_cat(this->source());
 	__check_and_cat(" WHERE 1");
 	this->where_va_columns(count, query, size, &used, args);
 	strlcat(query, ";", size);
@@ -372,7 +385,7 @@ sqlite3_stmt** Table::get_column(sqlite3* db, Column* value_column, uint32_t cou
 	strlcpy(query, "SELECT ", size);
 	__check_and_cat(value_column->name());
 	__check_and_cat(" FROM ");
-	__check_and_cat(m_name);
+	__check_and_cat(this->source());
 	__check_and_cat(" WHERE 1");
 	this->where_va_columns(count, query, size, &used, args);
 	strlcat(query, ";", size);
@@ -384,7 +397,7 @@ sqlite3_stmt** Table::get_column(sqlite3* db, Column* value_column, uint32_t cou
 sqlite3_stmt** Table::get_row(sqlite3* db, uint32_t count, va_list args) {
 	__alloc_stmt_query;
 	strlcpy(query, "SELECT * FROM ", size);
-	__check_and_cat(m_name);
+	__check_and_cat(this->source());
 	__check_and_cat(" WHERE 1");
 	this->where_va_columns(count, query, size, &used, args);
 	strlcat(query, ";", size);
@@ -397,7 +410,7 @@ sqlite3_stmt** Table::get_row_ordered(sqlite3* db, Column* order_by, int order,
 									 uint32_t count, va_list args) {
 	__alloc_stmt_query;
 	strlcpy(query, "SELECT * FROM ", size);
-	__check_and_cat(m_name);
+	__check_and_cat(this->source());
 	__check_and_cat(" WHERE 1");
 	this->where_va_columns(count, query, size, &used, args);
 	__check_and_cat(" ORDER BY ");
@@ -48,6 +48,10 @@ struct Table {
 
 	// Add custom SQL to table initialization
 	int            set_custom_create(const char* sql);
+	// Read rows from a view with the same columns instead of the table
+	int            set_view(const char* name);
+	// name of the table or view that SELECT queries read from
+	const char*    source();
 	
 	// Column handling
 	int            add_column(Column*, uint32_t schema_version);
@@ -108,6 +112,7 @@ protected:
 	void           dump_results(FILE* f);	
 	
 	char*          m_name;
+	char*          m_view;
 	uint32_t       m_version; // schema version this was added
 
 	char*          m_create_sql;
@@ -30,28 +30,12 @@
  * @APPLE_BSD_LICENSE_HEADER_END@
  */
 
+#include "Digest.h"
 #include "Utils.h"
+#include "Walker.h"
 
 extern char** environ;
 
-int fts_compare(const FTSENT **a, const FTSENT **b) {
-	return strcmp((*a)->fts_name, (*b)->fts_name);
-}
-
-size_t ftsent_filename(FTSENT* ent, char* filename, size_t bufsiz) {
-	if (ent == NULL) return 0;
-	if (ent->fts_level > 1) {
-		bufsiz = ftsent_filename(ent->fts_parent, filename, bufsiz);
-	}
-	strlcat(filename, "/", bufsiz);
-	bufsiz -= 1;
-	if (ent->fts_name) {
-		strlcat(filename, ent->fts_name, bufsiz);
-		bufsiz -= strlen(ent->fts_name);
-	}
-	return bufsiz;
-}
-
 int mkdir_p(const char* path) {
         int res;
 
@@ -75,31 +59,28 @@ int mkdir_p(const char* path) {
         return res;
 }
 
-int remove_directory(const char* directory) {
-	int res = 0;
-	const char* path_argv[] = { directory, NULL };
-	FTS* fts = fts_open((char**)path_argv, FTS_PHYSICAL | FTS_COMFOLLOW | FTS_XDEV, fts_compare);
-	FTSENT* ent = fts_read(fts); // throw away the entry for the DSTROOT itself
-	while (res == 0 && (ent = fts_read(fts)) != NULL) {
-		switch (ent->fts_info) {
-			case FTS_D:
-				break;
-			case FTS_F:
-			case FTS_SL:
-			case FTS_SLNONE:
-			case FTS_DEFAULT:
-				res = unlink(ent->fts_accpath);
-				break;
-			case FTS_DP:
-				res = rmdir(ent->fts_accpath);
-				break;
-			default:
-				fprintf(stderr, "%s:%d: unexpected fts_info type %d\n", __FILE__, __LINE__, ent->fts_info);
-				break;
-		}
+static int remove_entry(WalkEntry* ent, void* context) {
+	switch (ent->info) {
+		case WALK_D:
+			return 0;
+		case WALK_F:
+		case WALK_SL:
+		case WALK_DEFAULT:
+			if (ent->level == 0) return 0; // the root itself
+			return unlink(ent->path);
+		case WALK_DP:
+			return rmdir(ent->path);
+		case WALK_NS:
+			if (ent->level == 0) return 0; // nothing to remove
+		default:
+			fprintf(stderr, "%s:%d: unexpected walk info type %d\n", __FILE__, __LINE__, ent->info);
+			return 0;
 	}
-	fts_close(fts);
-	return res;
+}
+
+int remove_directory(const char* directory) {
+	Walker walker(directory);
+	return walker.walk(&remove_entry, NULL);
 }
 
 int is_directory(const char* path) {
@@ -189,14 +170,33 @@ int exec_with_args_pipe(const char** args, int fd) {
 int exec_with_args_fa(const char** args, posix_spawn_file_actions_t* fa) {
 	int res = 0;
 	pid_t pid;
-	int status;
 	
+	res = spawn_with_args(args, fa, &pid);
+	if (res == 0) res = wait_for_pid(pid);
+	
+	IF_DEBUG("Done: %s \n", args[0]);
+	
+	return res;
+}
+
+int spawn_with_args(const char** args, posix_spawn_file_actions_t* fa, pid_t* pid) {
+	int res = 0;
+
 	IF_DEBUG("Spawn: %s \n", args[0]);
 		
-	res = posix_spawn(&pid, args[0], fa, NULL, (char**)args, environ);
-	if (res != 0) fprintf(stderr, "Error: Failed to spawn %s: %s (%d)\n", args[0], strerror(res), res);
+	res = posix_spawn(pid, args[0], fa, NULL, (char**)args, environ);
+	if (res != 0) {
+		fprintf(stderr, "Error: Failed to spawn %s: %s (%d)\n", args[0], strerror(res), res);
+		return -1;
+	}
 	
-	IF_DEBUG("Running: %s on pid %d \n", args[0], (int)pid);
+	IF_DEBUG("Running: %s on pid %d \n", args[0], (int)*pid);
+	return 0;
+}
+
+int wait_for_pid(pid_t pid) {
+	int res = 0;
+	int status;
 
 	do {
 		res = waitpid(pid, &status, 0);
@@ -208,9 +208,54 @@ int exec_with_args_fa(const char** args, posix_spawn_file_actions_t* fa) {
 			res = -1;
 		}
 	}
+	return res;
+}
+
+int exec_pipeline(const char** first, const char** second) {
+	int res = 0;
+	int fds[2];
+	pid_t pids[2];
+	posix_spawn_file_actions_t fa[2];
 	
-	IF_DEBUG("Done: %s \n", args[0]);
+	if (pipe(fds) == -1) {
+		perror("pipe");
+		return -1;
+	}
+	// other threads may be spawning too, keep the pipe out of their children
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
 	
+	posix_spawn_file_actions_init(&fa[0]);
+	posix_spawn_file_actions_adddup2(&fa[0], fds[1], 1);
+	posix_spawn_file_actions_addclose(&fa[0], fds[0]);
+	posix_spawn_file_actions_addclose(&fa[0], fds[1]);
+	posix_spawn_file_actions_init(&fa[1]);
+	posix_spawn_file_actions_adddup2(&fa[1], fds[0], 0);
+	posix_spawn_file_actions_addclose(&fa[1], fds[0]);
+	posix_spawn_file_actions_addclose(&fa[1], fds[1]);
+
+	res = spawn_with_args(first, &fa[0], &pids[0]);
+	bool first_running = (res == 0);
+	if (res == 0) res = spawn_with_args(second, &fa[1], &pids[1]);
+	if (res && first_running) kill(pids[0], SIGTERM);
+	
+	// only the children may hold the pipe now, so each one sees the
+	// other one exit
+	close(fds[0]);
+	close(fds[1]);
+	posix_spawn_file_actions_destroy(&fa[0]);
+	posix_spawn_file_actions_destroy(&fa[1]);
+	
+	if (res == 0) {
+		int res1 = wait_for_pid(pids[0]);
+		int res2 = wait_for_pid(pids[1]);
+		res = res1 ? res1 : res2;
+	} else if (first_running) {
+		wait_for_pid(pids[0]);
+	}
+	
+	IF_DEBUG("Done: %s | %s \n", first[0], second[0]);
+
 	return res;
 }
 
@@ -249,21 +294,153 @@ int join_path(char **out, const char *p1, const char *p2) {
 	return 0;
 }
 
-char* fetch_url(const char* srcpath, const char* dstpath) {
-	extern uint32_t verbosity;
-	char* localfile;
-	int res = join_path(&localfile, dstpath, basename((char*)srcpath));
-	if (res || !localfile) return NULL;
+// Copies the last component of path into name, like basename(3) but
+// safe to call from several threads.
+static void last_component(const char* path, char* name, size_t size) {
+	size_t len = strlen(path);
+	while (len > 1 && path[len - 1] == '/') len--;
+	size_t start = len;
+	while (start > 0 && path[start - 1] != '/') start--;
+	if (start == len && len > 0) start--; // path is "/"
+	if (len - start + 1 < size) size = len - start + 1;
+	strlcpy(name, path + start, size);
+}
+
+// Copies the value of header into value if line is that header.
+static void header_value(const char* line, const char* header, 
+						 char* value, size_t size) {
+	size_t len = strlen(header);
+	if (strncasecmp(line, header, len) || line[len] != ':') return;
+	line += len + 1;
+	while (*line == ' ' || *line == '\t') line++;
+	strlcpy(value, line, size);
+}
+
+// Asks the server which version of srcpath it has, returns its ETag or
+// its modification date and size, or NULL if it offers neither.
+static char* url_validator(const char* srcpath, const char* dstpath) {
+	char* headers = NULL;
+	char* validator = NULL;
+	
+	asprintf(&headers, "%s/.headers.XXXXXX", dstpath);
+	if (!headers) return NULL;
+	int fd = mkstemp(headers);
+	if (fd == -1) {
+		free(headers);
+		return NULL;
+	}
+	close(fd);
 	
 	const char* args[] = {
 		"/usr/bin/curl",
-		(verbosity ? "-v" : "-s"),
+		"-s", "-f", "-I",
 		"-L", srcpath,
+		"-o", headers,
+		NULL
+	};
+	FILE* f = NULL;
+	if (exec_with_args(args) == 0) f = fopen(headers, "r");
+	if (f) {
+		char line[1024];
+		char etag[512] = "";
+		char modified[128] = "";
+		char length[32] = "";
+		while (fgets(line, sizeof(line), f)) {
+			line[strcspn(line, "\r\n")] = 0;
+			if (strncmp(line, "HTTP/", 5) == 0) {
+				// every redirect starts a new set of headers
+				etag[0] = modified[0] = length[0] = 0;
+			}
+			header_value(line, "ETag", etag, sizeof(etag));
+			header_value(line, "Last-Modified", modified, sizeof(modified));
+			header_value(line, "Content-Length", length, sizeof(length));
+		}
+		fclose(f);
+		if (etag[0]) {
+			asprintf(&validator, "etag %s", etag);
+		} else if (modified[0]) {
+			asprintf(&validator, "modified %s length %s", modified, length);
+		}
+	}
+	unlink(headers);
+	free(headers);
+	return validator;
+}
+
+static int download_url(const char* srcpath, const char* localfile) {
+	extern uint32_t verbosity;
+	const char* args[] = {
+		"/usr/bin/curl",
+		(verbosity ? "-v" : "-s"),
+		"-f", "-L", srcpath,
 		"-o", localfile,
 		NULL
 	};
-	if (res == 0) res = exec_with_args(args);
+	return exec_with_args(args);
+}
+
+char* fetch_url(const char* srcpath, const char* dstpath) {
+	char name[PATH_MAX];
+	char* localfile = NULL;
+	int res = 0;
+	
+	last_component(srcpath, name, sizeof(name));
+	
+	// Downloads the server can tell apart are kept in a directory named
+	// after the URL and the version of it, so a root that has not changed
+	// is only downloaded once.
+	char* validator = url_validator(srcpath, dstpath);
+	if (!validator) {
+		res = join_path(&localfile, dstpath, name);
+		// the last download may be shared through an object store, 
+		// so it is replaced rather than written over
+		if (res == 0) unlink(localfile);
+		if (res == 0) res = download_url(srcpath, localfile);
+		if (res == 0) return localfile;
+		free(localfile);
+		return NULL;
+	}
+	IF_DEBUG("%s is version: %s\n", srcpath, validator);
+	
+	char* key = NULL;
+	char* cachedir = NULL;
+	asprintf(&key, "%s\n%s", srcpath, validator);
+	free(validator);
+	if (!key) return NULL;
+	SHA1Digest digest((uint8_t*)key, strlen(key));
+	free(key);
+	char* hex = digest.string();
+	res = join_path(&cachedir, dstpath, hex);
+	free(hex);
+	if (res == 0) res = join_path(&localfile, cachedir, name);
+	
+	if (res == 0 && is_regular_file(localfile)) {
+		IF_DEBUG("using cached download %s\n", localfile);
+		// keep it from going stale
+		utimes(cachedir, NULL);
+		free(cachedir);
+		return localfile;
+	}
+	
+	// download next to the cache and move the whole directory in place,
+	// so the cache never has a partial file in it
+	char* tmpdir = NULL;
+	char* tmpfile = NULL;
+	if (res == 0) asprintf(&tmpdir, "%s/.download.XXXXXX", dstpath);
+	if (!tmpdir || !mkdtemp(tmpdir)) res = -1;
+	if (res == 0) res = join_path(&tmpfile, tmpdir, name);
+	if (res == 0) res = download_url(srcpath, tmpfile);
+	if (res == 0) {
+		res = rename(tmpdir, cachedir);
+		// somebody else got there first
+		if (res && is_regular_file(localfile)) res = 0;
+	}
+	if (tmpdir) remove_directory(tmpdir);
+	free(tmpdir);
+	free(tmpfile);
+	free(cachedir);
 	if (res == 0) return localfile;
+	free(localfile);
 	return NULL;
 }
 
@@ -278,8 +455,9 @@ char* fetch_userhost(const char* srcpath, const char* dstpath) {
 
 	// make sure dstpath ends in basename of cleansrc for consistent rsync behavior
 	char* cleandst;
-	char* srccopy = strdup(cleansrc); // basename might modify input, so make a copy
-	res = join_path(&cleandst, dstpath, basename(srccopy));
+	char name[PATH_MAX];
+	last_component(cleansrc, name, sizeof(name));
+	res = join_path(&cleandst, dstpath, name);
 	if (res != 0) return NULL;
 
 	IF_DEBUG("rsync -a --delete %s %s %s \n", 
@@ -295,8 +473,9 @@ char* fetch_userhost(const char* srcpath, const char* dstpath) {
 	};
 
 	if (res == 0) res = exec_with_args(args);
-	free(srccopy);
 	free(cleansrc);
+	// rsync only copies what changed, keep the copy from going stale
+	if (res == 0) utimes(cleandst, NULL);
 	if (res == 0) return cleandst;
 	return NULL;	
 }
@@ -519,7 +698,68 @@ void __data_hex(FILE* f, uint8_t* data, uint32_t size) {
 	fprintf(f, "\n");
 }
 
+uint32_t fnv1a_hash(const uint8_t* data, size_t size, uint32_t hash) {
+	for (size_t i = 0; i < size; i++) {
+		hash ^= data[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+int read_all(int fd, void* buf, size_t size) {
+	uint8_t* p = (uint8_t*)buf;
+	while (size) {
+		ssize_t n = read(fd, p, size);
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+int write_all(int fd, const void* buf, size_t size) {
+	const uint8_t* p = (const uint8_t*)buf;
+	while (size) {
+		ssize_t n = write(fd, p, size);
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+ssize_t pread_all(int fd, void* buf, size_t size, off_t offset) {
+	size_t len = 0;
+	while (len < size) {
+		ssize_t n = pread(fd, (uint8_t*)buf + len, size - len, offset + len);
+		if (n == -1 && errno == EINTR) continue;
+		if (n == -1) return -1;
+		if (n == 0) break;
+		len += n;
+	}
+	return len;
+}
+
+int pwrite_all(int fd, const void* buf, size_t size, off_t offset) {
+	const uint8_t* p = (const uint8_t*)buf;
+	while (size) {
+		ssize_t n = pwrite(fd, p, size, offset);
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		p += n;
+		size -= n;
+		offset += n;
+	}
+	return 0;
+}
+
 void hr() {
-	fprintf(stdout, "=============================================="
+	hr(stdout);
+}
+
+void hr(FILE* stream) {
+	fprintf(stream, "=============================================="
 			"=======================================\n");	
 }
@@ -36,7 +36,6 @@
 #include <Availability.h>
 #include <stdint.h>
 #include <sys/types.h>
-#include <fts.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <assert.h>
@@ -47,8 +46,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
 #include <spawn.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 
 const uint32_t VERBOSE		    = 0x1;
@@ -58,8 +59,6 @@ const uint32_t VERBOSE_SQL      = 0x4;
 #define IF_DEBUG(...) do { extern uint32_t verbosity; if (verbosity & VERBOSE_DEBUG) fprintf(stderr, "DEBUG: " __VA_ARGS__); } while (0)
 #define IF_SQL(...) do { extern uint32_t verbosity; if (verbosity & VERBOSE_SQL) fprintf(stderr, "DEBUG: " __VA_ARGS__); } while (0)
 
-int fts_compare(const FTSENT **a, const FTSENT **b);
-size_t ftsent_filename(FTSENT* ent, char* filename, size_t bufsiz);
 int mkdir_p(const char* path);
 int remove_directory(const char* path);
 int is_directory(const char* path);
@@ -72,6 +71,11 @@ int has_suffix(const char* str, const char* sfx);
 int exec_with_args(const char** args);
 int exec_with_args_pipe(const char** args, int fd);
 int exec_with_args_fa(const char** args, posix_spawn_file_actions_t* fa);
+int spawn_with_args(const char** args, posix_spawn_file_actions_t* fa, pid_t* pid);
+int wait_for_pid(pid_t pid);
+
+// runs first | second, returns the exit status of the first one that failed
+int exec_pipeline(const char** first, const char** second);
 
 int join_path(char** out, const char* p1, const char* p2);
 int compact_slashes(char* orig, int slashes);
@@ -90,8 +94,21 @@ int tell_finder_to_restart();
 
 void __data_hex(FILE* f, uint8_t* data, uint32_t size);
 
+// 32-bit FNV-1a, start with FNV1A_INIT or the hash of the preceding data
+#define FNV1A_INIT 2166136261U
+uint32_t fnv1a_hash(const uint8_t* data, size_t size, uint32_t hash);
+
+// read or write exactly size bytes, returning -1 on an error or when
+// the data ends first
+int read_all(int fd, void* buf, size_t size);
+int write_all(int fd, const void* buf, size_t size);
+int pwrite_all(int fd, const void* buf, size_t size, off_t offset);
+// returns how much was read, which is less than size at the end of the file
+ssize_t pread_all(int fd, void* buf, size_t size, off_t offset);
+
 // print a horizontal line to stdout
 void hr();
+void hr(FILE* stream);
 
 inline bool INFO_TEST(uint64_t word, uint64_t flag) { return ((word & flag) != 0); }
 inline uint64_t INFO_SET(uint64_t word, uint64_t flag) { return (word | flag); }
@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2010 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Utils.h"
+#include "Walker.h"
+
+// count == 0 reads dir, otherwise prepares count of its children from first
+struct WalkTask {
+	WalkEntry* dir;
+	uint32_t   first;
+	uint32_t   count;
+};
+
+// workers take from the tail of their own queue and steal from the head
+// of everyone else's, so stolen work tends to be large subtrees
+struct WalkQueue {
+	WalkTask* tasks;
+	uint32_t  head;
+	uint32_t  tail;
+	uint32_t  max;
+};
+
+struct WalkWorker {
+	Walker*   walker;
+	uint32_t  queue;
+	pthread_t thread;
+};
+
+static int walk_compare(const void* a, const void* b) {
+	return strcmp((*(WalkEntry**)a)->name, (*(WalkEntry**)b)->name);
+}
+
+static int walk_info(struct stat* st) {
+	if (S_ISDIR(st->st_mode)) return WALK_D;
+	if (S_ISREG(st->st_mode)) return WALK_F;
+	if (S_ISLNK(st->st_mode)) return WALK_SL;
+	return WALK_DEFAULT;
+}
+
+
+Walker::Walker(const char* root) {
+	m_root = strdup(root);
+	// children are joined to the root with a single slash
+	m_root_len = strlen(m_root);
+	while (m_root_len > 0 && m_root[m_root_len - 1] == '/') m_root_len--;
+	m_dev = 0;
+	m_max_level = INT_MAX;
+	
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	m_thread_count = cpus > WALK_MAX_THREADS ? WALK_MAX_THREADS : (cpus > 1 ? cpus : 0);
+	
+	m_prepare = NULL;
+	m_release = NULL;
+	m_prepare_context = NULL;
+	
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_work, NULL);
+	pthread_cond_init(&m_ready, NULL);
+	m_queues = NULL;
+	m_queue_count = 0;
+	m_next_queue = 0;
+	m_done = false;
+	m_path[0] = 0;
+}
+
+Walker::~Walker() {
+	free(m_root);
+	pthread_mutex_destroy(&m_lock);
+	pthread_cond_destroy(&m_work);
+	pthread_cond_destroy(&m_ready);
+}
+
+void Walker::threads(uint32_t count) {
+	m_thread_count = count > WALK_MAX_THREADS ? WALK_MAX_THREADS : count;
+}
+
+void Walker::max_level(int level) {
+	m_max_level = level;
+}
+
+void Walker::prepare(WalkFunc func, WalkFunc release, void* context) {
+	m_prepare = func;
+	m_release = release;
+	m_prepare_context = context;
+}
+
+int Walker::walk(WalkFunc func, void* context) {
+	int res = 0;
+	
+	WalkEntry* root = (WalkEntry*)calloc(1, sizeof(WalkEntry));
+	if (!root) return -1;
+	root->own_path = strdup(m_root);
+	root->path = root->own_path;
+	root->relpath = root->path + m_root_len;
+	root->name = strdup(m_root);
+	// the root is followed if it is a symlink, like FTS_COMFOLLOW
+	if (stat(root->path, &root->st) == -1 && lstat(root->path, &root->st) == -1) {
+		root->info = WALK_NS;
+		root->error = errno;
+	} else {
+		root->info = walk_info(&root->st);
+	}
+	m_dev = root->st.st_dev;
+	
+	m_queue_count = m_thread_count + 1;
+	m_queues = (WalkQueue*)calloc(m_queue_count, sizeof(WalkQueue));
+	WalkWorker* workers = (WalkWorker*)calloc(m_thread_count + 1, sizeof(WalkWorker));
+	if (!m_queues || !workers) {
+		fprintf(stderr, "Error: ran out of memory in Walker::walk\n");
+		free(m_queues);
+		free(workers);
+		this->free_entry(root);
+		return -1;
+	}
+	m_done = false;
+	
+	if (root->info == WALK_D && m_max_level > 0) {
+		root->descend = true;
+		this->push(0, root, 0, 0);
+	} else {
+		if (m_prepare) m_prepare(root, m_prepare_context);
+		root->ready = true;
+	}
+	
+	uint32_t started = 0;
+	for (uint32_t i = 0; i < m_thread_count; i++) {
+		workers[i].walker = this;
+		workers[i].queue = i + 1;
+		if (pthread_create(&workers[i].thread, NULL, &Walker::worker, &workers[i])) break;
+		started++;
+	}
+	
+	this->wait_ready(root);
+	res = this->visit(root, func, context);
+	
+	pthread_mutex_lock(&m_lock);
+	m_done = true;
+	pthread_cond_broadcast(&m_work);
+	pthread_mutex_unlock(&m_lock);
+	for (uint32_t i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	
+	// anything left over was never visited because func stopped the walk
+	this->free_entry(root);
+	for (uint32_t i = 0; i < m_queue_count; i++) free(m_queues[i].tasks);
+	free(m_queues);
+	m_queues = NULL;
+	free(workers);
+	
+	return res;
+}
+
+void* Walker::worker(void* arg) {
+	WalkWorker* worker = (WalkWorker*)arg;
+	Walker* walker = worker->walker;
+	
+	pthread_mutex_lock(&walker->m_lock);
+	while (!walker->m_done) {
+		if (!walker->run_one(worker->queue)) {
+			pthread_cond_wait(&walker->m_work, &walker->m_lock);
+		}
+	}
+	pthread_mutex_unlock(&walker->m_lock);
+	return NULL;
+}
+
+// called with m_lock held, returns false if there was nothing to do
+bool Walker::run_one(uint32_t queue) {
+	WalkTask task;
+	WalkQueue* own = &m_queues[queue];
+	if (own->tail > own->head) {
+		task = own->tasks[--own->tail];
+	} else {
+		uint32_t i;
+		for (i = 1; i < m_queue_count; i++) {
+			WalkQueue* other = &m_queues[(queue + i) % m_queue_count];
+			if (other->tail > other->head) {
+				task = other->tasks[other->head++];
+				break;
+			}
+		}
+		if (i == m_queue_count) return false;
+	}
+	
+	pthread_mutex_unlock(&m_lock);
+	if (task.count == 0) {
+		this->scan(queue, task.dir);
+	} else {
+		this->prepare_children(task.dir, task.first, task.count);
+	}
+	pthread_mutex_lock(&m_lock);
+	return true;
+}
+
+// called with m_lock held
+void Walker::push(uint32_t queue, WalkEntry* dir, uint32_t first, uint32_t count) {
+	WalkQueue* q = &m_queues[queue];
+	if (q->head == q->tail) {
+		q->head = 0;
+		q->tail = 0;
+	}
+	if (q->tail >= q->max) {
+		q->max = q->max ? q->max * 2 : 64;
+		q->tasks = (WalkTask*)realloc(q->tasks, q->max * sizeof(WalkTask));
+		assert(q->tasks != NULL);
+	}
+	q->tasks[q->tail].dir = dir;
+	q->tasks[q->tail].first = first;
+	q->tasks[q->tail].count = count;
+	q->tail++;
+}
+
+void Walker::scan(uint32_t queue, WalkEntry* dir) {
+	char path[PATH_MAX];
+	size_t len = strlcpy(path, dir->path, sizeof(path));
+	DIR* dirp = NULL;
+	if (len < sizeof(path) - 1) {
+		if (len == 0 || path[len - 1] != '/') path[len++] = '/';
+		path[len] = 0;
+		dirp = opendir(dir->path);
+	} else {
+		errno = ENAMETOOLONG;
+	}
+	if (dirp) {
+		struct dirent* dp;
+		while ((dp = readdir(dirp)) != NULL) {
+			if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0) continue;
+			
+			WalkEntry* child = (WalkEntry*)calloc(1, sizeof(WalkEntry));
+			assert(child != NULL);
+			child->parent = dir;
+			child->name = strdup(dp->d_name);
+			child->level = dir->level + 1;
+			if (strlcpy(path + len, child->name, sizeof(path) - len) >= sizeof(path) - len) {
+				child->info = WALK_NS;
+				child->error = ENAMETOOLONG;
+			} else if (lstat(path, &child->st) == -1) {
+				child->info = WALK_NS;
+				child->error = errno;
+			} else {
+				child->info = walk_info(&child->st);
+			}
+			if (child->info == WALK_D) {
+				child->own_path = strdup(path);
+				child->path = child->own_path;
+				child->relpath = child->path + m_root_len;
+				// do not cross devices, like FTS_XDEV
+				child->descend = (child->st.st_dev == m_dev && 
+								  child->level < m_max_level);
+			}
+			
+			if (dir->child_count >= dir->child_max) {
+				dir->child_max = dir->child_max ? dir->child_max * 2 : 16;
+				dir->children = (WalkEntry**)realloc(dir->children, 
+													 dir->child_max * sizeof(WalkEntry*));
+				assert(dir->children != NULL);
+			}
+			dir->children[dir->child_count++] = child;
+		}
+		closedir(dirp);
+		qsort(dir->children, dir->child_count, sizeof(WalkEntry*), walk_compare);
+	} else {
+		dir->info = WALK_DNR;
+		dir->error = errno;
+	}
+	
+	if (m_prepare) m_prepare(dir, m_prepare_context);
+	
+	pthread_mutex_lock(&m_lock);
+	// pushed in reverse so this thread continues with the first ones,
+	// which are the ones the walk needs next
+	for (uint32_t i = dir->child_count; i > 0; i--) {
+		if (dir->children[i - 1]->descend) this->push(queue, dir->children[i - 1], 0, 0);
+	}
+	for (uint32_t i = dir->child_count; i > 0; ) {
+		uint32_t count = i % WALK_PREPARE_BATCH ? i % WALK_PREPARE_BATCH : WALK_PREPARE_BATCH;
+		i -= count;
+		if (m_prepare) {
+			this->push(queue, dir, i, count);
+		} else {
+			for (uint32_t j = i; j < i + count; j++) {
+				if (!dir->children[j]->descend) dir->children[j]->ready = true;
+			}
+		}
+	}
+	dir->ready = true;
+	pthread_cond_broadcast(&m_work);
+	pthread_cond_broadcast(&m_ready);
+	pthread_mutex_unlock(&m_lock);
+}
+
+void Walker::prepare_children(WalkEntry* dir, uint32_t first, uint32_t count) {
+	char path[PATH_MAX];
+	size_t len = strlcpy(path, dir->path, sizeof(path));
+	if (len < sizeof(path) - 1 && (len == 0 || path[len - 1] != '/')) path[len++] = '/';
+	path[len] = 0;
+	
+	for (uint32_t i = first; i < first + count; i++) {
+		WalkEntry* child = dir->children[i];
+		if (child->descend) continue; // prepared by its own scan
+		if (!child->own_path) {
+			strlcpy(path + len, child->name, sizeof(path) - len);
+			child->path = path;
+			child->relpath = path + m_root_len;
+		}
+		m_prepare(child, m_prepare_context);
+		if (!child->own_path) {
+			child->path = NULL;
+			child->relpath = NULL;
+		}
+	}
+	
+	pthread_mutex_lock(&m_lock);
+	for (uint32_t i = first; i < first + count; i++) {
+		if (!dir->children[i]->descend) dir->children[i]->ready = true;
+	}
+	pthread_cond_broadcast(&m_ready);
+	pthread_mutex_unlock(&m_lock);
+}
+
+// the calling thread helps out with queued work while it waits
+void Walker::wait_ready(WalkEntry* ent) {
+	pthread_mutex_lock(&m_lock);
+	while (!ent->ready) {
+		if (!this->run_one(0)) pthread_cond_wait(&m_ready, &m_lock);
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+int Walker::visit(WalkEntry* ent, WalkFunc func, void* context) {
+	int res = func(ent, context);
+	ent->data = NULL; // belongs to func now
+	if (res || ent->info != WALK_D) return res;
+	
+	if (ent->descend) {
+		// build the paths of files in one buffer, each directory below
+		// this one starts with the same prefix so it survives the recursion
+		size_t len = (ent->path == m_path) ? strlen(m_path) :
+			strlcpy(m_path, ent->path, sizeof(m_path));
+		if (len < sizeof(m_path) - 1 && (len == 0 || m_path[len - 1] != '/')) {
+			m_path[len++] = '/';
+		}
+		m_path[len] = 0;
+		
+		for (uint32_t i = 0; i < ent->child_count; i++) {
+			WalkEntry* child = ent->children[i];
+			this->wait_ready(child);
+			if (!child->own_path) {
+				strlcpy(m_path + len, child->name, sizeof(m_path) - len);
+				child->path = m_path;
+				child->relpath = m_path + m_root_len;
+			}
+			res = this->visit(child, func, context);
+			if (!child->own_path) {
+				child->path = NULL;
+				child->relpath = NULL;
+			}
+			// workers may still be busy below a walk that was stopped,
+			// walk() cleans up after them
+			if (res) return res;
+			this->free_entry(child);
+			ent->children[i] = NULL;
+		}
+	}
+	
+	ent->info = WALK_DP;
+	res = func(ent, context);
+	ent->info = WALK_D;
+	return res;
+}
+
+// only called once no worker can be using ent
+void Walker::free_entry(WalkEntry* ent) {
+	for (uint32_t i = 0; i < ent->child_count; i++) {
+		if (ent->children[i]) this->free_entry(ent->children[i]);
+	}
+	if (ent->data && m_release) m_release(ent, m_prepare_context);
+	free(ent->children);
+	free(ent->own_path);
+	free(ent->name);
+	free(ent);
+}
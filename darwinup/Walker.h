@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2010 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+
+#ifndef _WALKER_H
+#define _WALKER_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// WalkEntry info, in the spirit of fts_info
+#define WALK_D       1   // directory, visited before its children
+#define WALK_DP      2   // directory, visited after its children
+#define WALK_F       3   // regular file
+#define WALK_SL      4   // symbolic link
+#define WALK_DEFAULT 5   // anything else
+#define WALK_DNR     6   // directory that could not be read
+#define WALK_NS      7   // no stat information
+
+#define WALK_MAX_THREADS   8
+#define WALK_PREPARE_BATCH 64
+
+struct WalkEntry {
+	WalkEntry*  parent;
+	char*       path;       // full path, for files only valid during a callback
+	const char* relpath;    // path below the root, "" for the root itself
+	char*       name;
+	int         level;      // 0 for the root
+	int         info;       // WALK_*
+	int         error;      // errno for WALK_DNR and WALK_NS
+	struct stat st;
+	void*       data;       // for the prepare callback to pass along to visit
+	
+	// private to the Walker
+	char*       own_path;   // path of a directory or the root
+	WalkEntry** children;
+	uint32_t    child_count;
+	uint32_t    child_max;
+	bool        descend;
+	bool        ready;
+};
+
+typedef int (*WalkFunc)(WalkEntry* ent, void* context);
+
+struct WalkTask;
+struct WalkQueue;
+
+/**
+ *
+ * Parallel replacement for fts(3) with FTS_PHYSICAL | FTS_COMFOLLOW | 
+ *  FTS_XDEV and names sorted with strcmp.
+ *
+ * Worker threads read and lstat directories ahead of the walk and 
+ *  optionally run a prepare callback on every entry, such as hashing 
+ *  a file. Each worker keeps its own queue and steals from the others
+ *  when it runs out. The visit callback still sees every entry on the
+ *  calling thread in exactly the order fts would return them.
+ *
+ */
+struct Walker {
+	Walker(const char* root);
+	virtual ~Walker();
+	
+	// number of worker threads, 0 walks on the calling thread only
+	void threads(uint32_t count);
+	
+	// do not descend below level, like fts_children() for level 1
+	void max_level(int level);
+	
+	// run func on a worker thread for each entry before it is visited,
+	// release is called for entries prepared but never visited
+	void prepare(WalkFunc func, WalkFunc release, void* context);
+	
+	// calls func for every entry, stops and returns the result if non-zero
+	int  walk(WalkFunc func, void* context);
+
+protected:
+	
+	static void* worker(void* arg);
+	
+	int   visit(WalkEntry* ent, WalkFunc func, void* context);
+	void  wait_ready(WalkEntry* ent);
+	bool  run_one(uint32_t queue);
+	void  scan(uint32_t queue, WalkEntry* dir);
+	void  prepare_children(WalkEntry* dir, uint32_t first, uint32_t count);
+	void  push(uint32_t queue, WalkEntry* dir, uint32_t first, uint32_t count);
+	void  free_entry(WalkEntry* ent);
+	
+	char*            m_root;
+	size_t           m_root_len;
+	dev_t            m_dev;
+	int              m_max_level;
+	uint32_t         m_thread_count;
+	
+	WalkFunc         m_prepare;
+	WalkFunc         m_release;
+	void*            m_prepare_context;
+	
+	pthread_mutex_t  m_lock;
+	pthread_cond_t   m_work;     // a task was queued
+	pthread_cond_t   m_ready;    // an entry became ready
+	WalkQueue*       m_queues;   // 0 belongs to the calling thread
+	uint32_t         m_queue_count;
+	uint32_t         m_next_queue;
+	bool             m_done;
+	
+	char             m_path[PATH_MAX];
+};
+
+#endif
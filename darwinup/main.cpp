@@ -40,9 +40,12 @@
 #include <limits.h>
 
 #include "Archive.h"
+#include "Daemon.h"
 #include "Depot.h"
+#include "Durability.h"
 #include "Utils.h"
 #include "DB.h"
+#include "Manifest.h"
 
 
 void usage(char* progname) {
@@ -50,35 +53,49 @@ void usage(char* progname) {
 	fprintf(stderr, "version: 36                                                    \n");
 	fprintf(stderr, "                                                               \n");
 	fprintf(stderr, "options:                                                       \n");
+	fprintf(stderr, "          -c        store rollback copies as deltas against    \n");
+	fprintf(stderr, "                    the files installed over them              \n");
 #if __MAC_OS_X_VERSION_MIN_REQUIRED >= 1060
 	fprintf(stderr, "          -d        disable helpful automation                 \n");	
 #endif
+	fprintf(stderr, "          -e NAME   storage engine: sqlite (default) or log    \n");
 	fprintf(stderr, "          -f        force operation to succeed at all costs    \n");
 	fprintf(stderr, "          -n        dry run                                    \n");
+	fprintf(stderr, "          -o DIR    share backing stores with other prefixes   \n");
+	fprintf(stderr, "                    through the object store in DIR            \n");
 	fprintf(stderr, "          -p DIR    operate on roots under DIR (default: /)    \n");
 #if __MAC_OS_X_VERSION_MIN_REQUIRED >= 1060
 	fprintf(stderr, "          -r        gracefully restart when finished           \n");	
 #endif
+	fprintf(stderr, "          -s NAME   durability: batched (default), fast or     \n");
+	fprintf(stderr, "                    paranoid                                   \n");
+	fprintf(stderr, "          -t NAME   database profile: safe (default) or bulk   \n");
 	fprintf(stderr, "          -v        verbose (use -vv for extra verbosity)      \n");
 	fprintf(stderr, "                                                               \n");
 	fprintf(stderr, "commands:                                                      \n");
+	fprintf(stderr, "          daemon                                               \n");
 	fprintf(stderr, "          files      <archive>                                 \n");
+	fprintf(stderr, "          gc         [seconds]                                 \n");
 	fprintf(stderr, "          install    <path>                                    \n");
 	fprintf(stderr, "          list       [archive]                                 \n");
 	fprintf(stderr, "          rename     <archive> <name>                          \n");
+	fprintf(stderr, "          stats      [json]                                    \n");
+	fprintf(stderr, "          status                                               \n");
 	fprintf(stderr, "          uninstall  <archive>                                 \n");
 	fprintf(stderr, "          upgrade    <path>                                    \n");
 	fprintf(stderr, "          verify     <archive>                                 \n");
+	fprintf(stderr, "          watch                                                \n");
 	fprintf(stderr, "                                                               \n");
 	fprintf(stderr, "<path> is one of:                                              \n");
 	fprintf(stderr, "          /path/to/local/dir-or-file                           \n");
 	fprintf(stderr, "          user@host:/path/to/remote/dir-or-file                \n");
 	fprintf(stderr, "          http[s]://host/path/to/remote/file                   \n");
+	fprintf(stderr, "          - (an uncompressed tar stream on the standard input) \n");
 	fprintf(stderr, "                                                               \n");
 	fprintf(stderr, "Files must be in one of the supported archive formats:         \n");
 	fprintf(stderr, "          cpio, cpio.gz, cpio.bz2                              \n");
 	fprintf(stderr, "          pax, pax.gz, pax.bz2                                 \n");
-	fprintf(stderr, "          tar, tar.gz, tar.bz2                                 \n");
+	fprintf(stderr, "          tar, tar.gz, tar.bz2, tar.xz, tar.zst                \n");
 #if __MAC_OS_X_VERSION_MIN_REQUIRED >= 1060	
 	fprintf(stderr, "          xar, zip                                             \n");
 #else
@@ -102,11 +119,35 @@ void usage(char* progname) {
 uint32_t verbosity;
 uint32_t force;
 uint32_t dryrun;
+uint32_t db_profile;
+uint32_t db_engine;
+uint32_t durability;
+uint32_t rollback_deltas;
 
+// whether root is the destination path itself, with or without a trailing slash
+static bool is_destination(const char* path, const char* root) {
+	return (strncmp(path, root, strlen(root)) == 0 
+			&& (strlen(path) == strlen(root) 
+				|| strlen(path) - 1 == strlen(root)));
+}
 
-int main(int argc, char* argv[]) {
+
+// runs one command line, either directly from main() or in a
+// process forked by the daemon to run a command for a client
+int darwinup_main(int argc, char* argv[]) {
 	char* progname = strdup(basename(argv[0]));      
+	int orig_argc = argc;
+	char** orig_argv = argv;
+	
+	if (Daemon::served_depot()) {
+		// start over from the options the client passed
+		verbosity = force = dryrun = db_profile = db_engine = durability = 0;
+		rollback_deltas = 0;
+		optind = 1;
+		optreset = 1;
+	}
 	char* path = NULL;
+	char* store = NULL;
 	bool disable_automation = false;
 #if __MAC_OS_X_VERSION_MIN_REQUIRED >= 1060
 	bool restart = false;
@@ -114,14 +155,27 @@ int main(int argc, char* argv[]) {
 	
 	int ch;
 #if __MAC_OS_X_VERSION_MIN_REQUIRED >= 1060
-	while ((ch = getopt(argc, argv, "dfnp:rvh")) != -1) {
+	while ((ch = getopt(argc, argv, "cde:fno:p:rs:t:vh")) != -1) {
 #else
-	while ((ch = getopt(argc, argv, "dfnp:vh")) != -1) {
+	while ((ch = getopt(argc, argv, "cde:fno:p:s:t:vh")) != -1) {
 #endif
 		switch (ch) {
+		case 'c':
+				rollback_deltas = 1;
+				break;
 		case 'd':
 				disable_automation = true;
 				break;
+		case 'e':
+				if (strcmp(optarg, "sqlite") == 0) {
+					db_engine = DB_ENGINE_SQLITE;
+				} else if (strcmp(optarg, "log") == 0) {
+					db_engine = DB_ENGINE_LOG;
+				} else {
+					fprintf(stderr, "Error: -e option must be one of: sqlite, log\n");
+					exit(4);
+				}
+				break;
 		case 'f':
 				force = 1;
 				break;
@@ -129,6 +183,13 @@ int main(int argc, char* argv[]) {
 				dryrun = 1;
 				disable_automation = true;
 				break;
+		case 'o':
+				if (optarg[0] != '/') {
+					fprintf(stderr, "Error: -o option must be an absolute path\n");
+					exit(4);
+				}
+				store = optarg;
+				break;
 		case 'p':
 				if (optarg[0] != '/') {
 					fprintf(stderr, "Error: -p option must be an absolute path\n");
@@ -145,6 +206,23 @@ int main(int argc, char* argv[]) {
 				restart = true;
 				break;
 #endif
+		case 's':
+				if (Durability::level_value(optarg, &durability)) {
+					fprintf(stderr, "Error: -s option must be one of: %s, %s, %s\n",
+							Durability::level_name(DURABILITY_BATCHED),
+							Durability::level_name(DURABILITY_FAST),
+							Durability::level_name(DURABILITY_PARANOID));
+					exit(4);
+				}
+				break;
+		case 't':
+				if (Database::profile_value(optarg, &db_profile)) {
+					fprintf(stderr, "Error: -t option must be one of: %s, %s\n",
+							Database::profile_name(DB_PROFILE_SAFE),
+							Database::profile_name(DB_PROFILE_BULK));
+					exit(4);
+				}
+				break;
 		case 'v':
 				verbosity <<= 1;
 				verbosity |= VERBOSE;
@@ -164,6 +242,11 @@ int main(int argc, char* argv[]) {
 	if (dryrun) IF_DEBUG("option: dry run\n");
 	if (force)  IF_DEBUG("option: forcing operations\n");
 	if (disable_automation) IF_DEBUG("option: helpful automation disabled\n");
+	if (db_engine)  IF_DEBUG("option: storage engine is log\n");
+	if (db_profile) IF_DEBUG("option: database profile is %s\n", 
+							 Database::profile_name(db_profile));
+	if (durability) IF_DEBUG("option: durability is %s\n", 
+							 Durability::level_name(durability));
 #if __MAC_OS_X_VERSION_MIN_REQUIRED >= 1060
     if (restart) IF_DEBUG("option: restart when finished\n");
 #endif
@@ -173,9 +256,53 @@ int main(int argc, char* argv[]) {
 	} else {
 		IF_DEBUG("option: path is %s\n", path);
 	}
+	if (store) IF_DEBUG("option: object store is %s\n", store);
 
-	Depot* depot = new Depot(path);
+	Depot* depot = Daemon::served_depot();
+	if (!depot) depot = new Depot(path);
+	if (store) depot->share_objects(store);
+	Manifest manifest;
+	
+	if (strcmp(argv[0], "daemon") == 0) {
+		if (argc != 1) usage(progname);
+		if (depot->initialize(true)) exit(19);
+		Daemon daemon(depot, &darwinup_main);
+		res = daemon.serve();
+		free(path);
+		exit(res);
+	}
+	
+	// keeps the dirty log for status and verify while it runs
+	if (strcmp(argv[0], "watch") == 0) {
+		if (argc != 1) usage(progname);
+		if (depot->initialize(false)) exit(21);
+		res = depot->watch();
+		free(path);
+		exit(res);
+	}
+	
+	// hand the command to a daemon serving this depot if one is running
+	if (!Daemon::served_depot()) {
+		res = Daemon::forward(depot->daemon_path(), orig_argc, orig_argv);
+		if (res != DAEMON_UNAVAILABLE) exit(res);
+		res = 0;
+	}
 		
+	// read-only commands print straight from the manifest when it is current
+	if (Manifest::handles(argc, argv) && depot->open_manifest(&manifest) == DEPOT_OK) {
+		if (strcmp(argv[0], "list") == 0) {
+			res = manifest.list(argc-1, (char**)(argv+1));
+		} else if (strcmp(argv[0], "dump") == 0) {
+			res = manifest.dump();
+		} else {
+			for (int i = 1; i < argc && res == 0; i++) {
+				res = manifest.files(argv[i]);
+			}
+		}
+		free(path);
+		exit(res);
+	}
+	
 	// list handles args optional and in special ways
 	if (strcmp(argv[0], "list") == 0) {
 		res = depot->initialize(false);
@@ -193,11 +320,29 @@ int main(int argc, char* argv[]) {
 			exit(6);
 		}
 		if (res == 0) depot->list(argc-1, (char**)(argv+1));
+	} else if (strcmp(argv[0], "stats") == 0) {
+		bool json = (argc == 2 && strcmp(argv[1], "json") == 0);
+		if (argc > 2 || (argc == 2 && !json)) usage(progname);
+		if (depot->initialize(false)) exit(11);
+		res = depot->stats(json);
+	} else if (strcmp(argv[0], "gc") == 0) {
+		uint32_t seconds = GC_VACUUM_SECONDS;
+		if (argc > 2) usage(progname);
+		if (argc == 2) {
+			char* end = NULL;
+			seconds = strtoul(argv[1], &end, 10);
+			if (!*argv[1] || *end) usage(progname);
+		}
+		if (depot->initialize(true)) exit(20);
+		res = depot->gc(seconds);
 	} else if (argc == 1) {
 		// other commands which take no arguments
 		if (strcmp(argv[0], "dump") == 0) {
 			if (depot->initialize(false)) exit(11);
 			depot->dump();
+		} else if (strcmp(argv[0], "status") == 0) {
+			if (depot->initialize(false)) exit(11);
+			res = depot->status();
 		} else {
 			fprintf(stderr, "Error: unknown command: '%s' \n", argv[0]);
 			usage(progname);
@@ -207,10 +352,12 @@ int main(int argc, char* argv[]) {
 		for (int i = 1; i < argc && res == 0; i++) {
 			if (strcmp(argv[0], "install") == 0) {
 				if (i==1 && depot->initialize(true)) exit(13);
+				if (i==1) {
+					depot->prune_downloads();
+					depot->prefetch(argc - 1, argv + 1);
+				}
 				// gaurd against installing paths ontop of themselves
-				if (strncmp(path, argv[i], strlen(argv[i])) == 0 
-					&& (strlen(path) == strlen(argv[i]) 
-						|| strlen(path) - 1 == strlen(argv[i]))) {
+				if (is_destination(path, argv[i])) {
 					if (strncmp(path, "/", 1) == 0 && strlen(path) == 1) {
 						fprintf(stderr, "Error: You provided '/' as a path to a root. "
 								"If you meant to specify a destination of '/', then you "
@@ -223,28 +370,39 @@ int main(int argc, char* argv[]) {
 					}
 					res = DEPOT_ERROR;
 				}							
+				// the next root is extracted while this one is installed
+				if (res == 0 && i + 1 < argc && !is_destination(path, argv[i + 1])) {
+					depot->stage(argv[i + 1]);
+				}
 				if (res == 0) res = depot->install(argv[i]);
 			} else if (strcmp(argv[0], "upgrade") == 0) {
 				if (i==1 && depot->initialize(true)) exit(14);
+				if (i==1) {
+					depot->prune_downloads();
+					depot->prefetch(argc - 1, argv + 1);
+				}
 				// find most recent matching archive by name
 				Archive* old = depot->get_archive(basename(argv[i]));
 				if (!old) {
 					fprintf(stderr, "Error: unable to find a matching root to upgrade.\n");
 					res = 5;
 				}
-				// install new archive
-				if (res == 0) res = depot->install(argv[i]);
-				// uninstall old archive
-				if (res == 0) res = depot->uninstall(old);
+				// install new archive in place of the old one
+				if (res == 0) res = depot->upgrade(argv[i], old);
 			} else if (strcmp(argv[0], "files") == 0) {
 				if (i==1 && depot->initialize(false)) exit(12);
-				res = depot->process_archive(argv[0], argv[i]);
+				// every archive is handled at once
+				res = depot->process_archives(argv[0], argc - 1, argv + 1);
+				break;
 			} else if (strcmp(argv[0], "uninstall") == 0) {
 				if (i==1 && depot->initialize(true)) exit(15);
-				res = depot->process_archive(argv[0], argv[i]);
+				// every archive is uninstalled at once
+				res = depot->uninstall_archives(argc - 1, argv + 1);
+				break;
 			} else if (strcmp(argv[0], "verify") == 0) {
 				if (i==1 && depot->initialize(true)) exit(16);
-				res = depot->process_archive(argv[0], argv[i]);
+				res = depot->process_archives(argv[0], argc - 1, argv + 1);
+				break;
 			} else if (strcmp(argv[0], "rename") == 0) {
 				if (i==1 && depot->initialize(true)) exit(17);
 				if ((i+1) >= argc) {
@@ -293,7 +451,16 @@ int main(int argc, char* argv[]) {
 #endif
 	}
 	
+	if (depot->is_initialized() && !dryrun) depot->update_manifest();
+	
+	// trees moved to the trash are deleted in the background
+	if (depot->is_initialized()) depot->empty_trash();
+	
 	free(path);
 	exit(res);
 	return res;
 }
+
+int main(int argc, char* argv[]) {
+	return darwinup_main(argc, argv);
+}
@@ -0,0 +1,121 @@
+#!/bin/bash
+set -e
+pushd $(dirname $0) >> /dev/null
+
+#
+# Benchmarks for darwinup
+#
+# Not run by run-all-tests.sh. Usage:
+#   run-benchmarks.sh [number of files] [extra darwinup options]
+#                     [megabytes of archive data]
+#
+PREFIX=/tmp/benchmark/darwinup
+DEST=$PREFIX/dest
+ROOT=$PREFIX/bigroot
+DATAROOT=$PREFIX/dataroot
+NFILES=${1:-100000}
+DATAMB=${3:-256}
+FILESPERDIR=1000
+
+DARWINUP="darwinup -d $2 -p $DEST "
+
+# run a command and print how long it took in seconds
+function now {
+	perl -MTime::HiRes=time -e 'printf "%.3f", time'
+}
+
+function timed {
+	local START=$(now)
+	"$@" > /dev/null
+	local END=$(now)
+	echo "$START $END" | awk '{printf "%.3f", $2 - $1}'
+}
+
+echo "INFO: Cleaning up benchmark area ..."
+rm -rf $PREFIX
+mkdir -p $DEST $ROOT $DATAROOT
+
+echo "INFO: Generating a root with $NFILES files ..."
+D=0
+while [ $((D * FILESPERDIR)) -lt $NFILES ];
+do
+	mkdir -p $ROOT/dir$D
+	pushd $ROOT/dir$D >> /dev/null
+	N=$((NFILES - D * FILESPERDIR))
+	if [ $N -gt $FILESPERDIR ]; then N=$FILESPERDIR; fi
+	seq 1 $N | xargs touch
+	popd >> /dev/null
+	D=$((D + 1))
+done
+
+echo "========== BENCHMARK: storage engines and database profiles =========="
+for E in sqlite log;
+do
+	for P in safe bulk;
+	do
+		INSTALL=$(timed $DARWINUP -e $E -t $P install $ROOT)
+		SIZE=$(cat $DEST/.DarwinDepot/Database-V100 $DEST/.DarwinDepot/Log-V1 2> /dev/null | wc -c | xargs)
+		LIST=$(timed $DARWINUP list)
+		FILES=$(timed $DARWINUP files bigroot)
+		UNINSTALL=$(timed $DARWINUP -t $P uninstall bigroot)
+		echo "RESULT: engine=$E profile=$P files=$NFILES install=${INSTALL}s list=${LIST}s files=${FILES}s uninstall=${UNINSTALL}s dbsize=$SIZE"
+		rm -rf $DEST/.DarwinDepot
+	done
+done
+
+echo "========== BENCHMARK: uninstall =========="
+for E in sqlite log;
+do
+	$DARWINUP -e $E install $ROOT > /dev/null
+	UNINSTALL=$(timed $DARWINUP uninstall bigroot)
+	# -vvv traces every SQL statement darwinup runs
+	$DARWINUP install $ROOT > /dev/null
+	QUERIES=$($DARWINUP -vvv uninstall bigroot 2>&1 > /dev/null | grep -c '^\[SQL\]' || true)
+	echo "RESULT: engine=$E files=$NFILES uninstall=${UNINSTALL}s queries=$QUERIES"
+	rm -rf $DEST/.DarwinDepot
+done
+
+echo "INFO: Generating archives of $DATAMB MB in each format ..."
+for M in $(seq 1 $DATAMB);
+do
+	# base64 compresses about as well as a typical root
+	head -c 786432 /dev/urandom | base64 > $DATAROOT/data$M
+done
+tar cf $PREFIX/dataroot.tar -C $DATAROOT .
+FORMATS="tar"
+gzip -c $PREFIX/dataroot.tar > $PREFIX/dataroot.tar.gz && FORMATS="$FORMATS tar.gz"
+bzip2 -c $PREFIX/dataroot.tar > $PREFIX/dataroot.tar.bz2 && FORMATS="$FORMATS tar.bz2"
+if [ -x "$(which xz)" ]; then
+	xz -c $PREFIX/dataroot.tar > $PREFIX/dataroot.tar.xz && FORMATS="$FORMATS tar.xz"
+fi
+if [ -x "$(which zstd)" ]; then
+	zstd -q -c $PREFIX/dataroot.tar > $PREFIX/dataroot.tar.zst && FORMATS="$FORMATS tar.zst"
+fi
+
+echo "========== BENCHMARK: archive formats =========="
+for F in $FORMATS;
+do
+	INSTALL=$(timed $DARWINUP install $PREFIX/dataroot.$F)
+	UNINSTALL=$(timed $DARWINUP uninstall dataroot.$F)
+	SIZE=$(cat $PREFIX/dataroot.$F | wc -c | xargs)
+	echo "RESULT: format=$F megabytes=$DATAMB install=${INSTALL}s uninstall=${UNINSTALL}s size=$SIZE"
+done
+rm -rf $DEST/.DarwinDepot
+
+echo "========== BENCHMARK: several roots =========="
+# one command extracts each root while the one before it is installed
+ROOTS=""
+for R in 1 2 3 4;
+do
+	cp $PREFIX/dataroot.tar.gz $PREFIX/dataroot$R.tar.gz
+	ROOTS="$ROOTS $PREFIX/dataroot$R.tar.gz"
+done
+EACH=$(timed bash -c "for R in $ROOTS; do $DARWINUP install \$R; done")
+$DARWINUP uninstall all > /dev/null
+TOGETHER=$(timed $DARWINUP install $ROOTS)
+$DARWINUP uninstall all > /dev/null
+echo "RESULT: roots=4 megabytes=$DATAMB each=${EACH}s together=${TOGETHER}s"
+rm -rf $DEST/.DarwinDepot
+
+popd >> /dev/null
+echo "INFO: Done benchmarking!"
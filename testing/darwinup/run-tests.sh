@@ -14,6 +14,7 @@ DESTTAR=dest.tar.gz
 HASXAR=$(darwinup 2>&1 | grep xar | wc -l)
 HAS386=$(file `which darwinup` | grep i386 | wc -l)
 HASX64=$(file `which darwinup` | grep x86_64 | wc -l)
+HASHOOKS=$(grep -c DARWINUP_JOURNAL_EXIT `which darwinup` || true)
 
 DARWINUP="darwinup $1 -p $DEST "
 DIFF="diff -x .DarwinDepot -x broken -qru"
@@ -99,7 +100,19 @@ fi
 
 echo "========== TEST: Test uninstall build check safety =========="
 $DARWINUP install $PREFIX/root2
-sqlite3 $DEST/.DarwinDepot/Database-V100 "UPDATE archives SET osbuild = '$(sw_vers -buildVersion)X'"
+if [ -f $DEST/.DarwinDepot/Database-V100 ]; then
+	sqlite3 $DEST/.DarwinDepot/Database-V100 "UPDATE archives SET osbuild = '$(sw_vers -buildVersion)X'"
+else
+	# the log cannot be edited, so install again as if the destination
+	# was another build instead
+	$DARWINUP uninstall root2
+	mkdir -p $DEST/System/Library/CoreServices
+	sed "s|>$(sw_vers -buildVersion)<|>$(sw_vers -buildVersion)X<|" \
+		/System/Library/CoreServices/SystemVersion.plist \
+		> $DEST/System/Library/CoreServices/SystemVersion.plist
+	$DARWINUP install $PREFIX/root2
+	rm -rf $DEST/System
+fi
 set +e
 $DARWINUP uninstall root2
 if [ $? -eq 0 ]; then exit 1; fi
@@ -134,6 +147,70 @@ do
 	$DIFF $ORIG $DEST 2>&1
 done
 
+echo "========== TEST: Archive formats are detected from their contents =========="
+$DARWINUP install $PREFIX/root2
+REF=$($DARWINUP files newest | grep '^[-dl]')
+$DARWINUP uninstall newest
+# a suffix that lies, no suffix at all, and xz and zstd compression
+tar czf $PREFIX/gzipped.tar.bz2 -C $PREFIX/root2 .
+tar cf $PREFIX/plaintar -C $PREFIX/root2 .
+tar cJf $PREFIX/root2.tar.xz -C $PREFIX/root2 .
+ARCHIVES="gzipped.tar.bz2 plaintar root2.tar.xz"
+if [ -x "$(which zstd)" ]; then
+	tar cf - -C $PREFIX/root2 . | zstd -q > $PREFIX/zstd-without-suffix
+	ARCHIVES="$ARCHIVES zstd-without-suffix"
+fi
+for R in $ARCHIVES;
+do
+	$DARWINUP install $PREFIX/$R
+	FILES=$($DARWINUP files newest | grep '^[-dl]')
+	test "$REF" == "$FILES"
+	$DARWINUP uninstall newest
+	echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+	$DIFF $ORIG $DEST 2>&1
+done
+
+if [ -x "$(which python3)" ]; then
+	echo "========== TEST: Remote roots are fetched in parallel and cached =========="
+	mkdir -p $PREFIX/http
+	cp root.tar.gz root2.tar.gz $PREFIX/http/
+	PORT=$((20000 + RANDOM % 20000))
+	pushd $PREFIX/http >> /dev/null
+	python3 -m http.server $PORT --bind 127.0.0.1 2> $PREFIX/http.log &
+	SERVER=$!
+	popd >> /dev/null
+	for I in $(seq 1 100);
+	do
+		if curl -s -o /dev/null http://127.0.0.1:$PORT/; then break; fi
+		sleep 0.1
+	done
+	URL=http://127.0.0.1:$PORT
+	$DARWINUP install $URL/root.tar.gz $URL/root2.tar.gz
+	$DARWINUP uninstall root2.tar.gz
+	$DARWINUP uninstall root.tar.gz
+	echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+	$DIFF $ORIG $DEST 2>&1
+	# nothing is downloaded the second time
+	$DARWINUP install $URL/root.tar.gz $URL/root2.tar.gz
+	C=$(grep -c '"GET /root' $PREFIX/http.log)
+	test "$C" == "2"
+	$DARWINUP uninstall root2.tar.gz
+	$DARWINUP uninstall root.tar.gz
+	# a root that changed on the server is downloaded again
+	cp root3.tar.gz $PREFIX/http/root2.tar.gz
+	touch -t 203001010000 $PREFIX/http/root2.tar.gz
+	$DARWINUP install $URL/root2.tar.gz
+	C=$(grep -c '"GET /root' $PREFIX/http.log)
+	test "$C" == "3"
+	C=$($DARWINUP files newest | grep -c '/root3/c.txt$')
+	test "$C" == "1"
+	$DARWINUP uninstall newest
+	kill $SERVER
+	wait $SERVER || true
+	echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+	$DIFF $ORIG $DEST 2>&1
+fi
+
 echo "========== TEST: Multiple argument test ==========";
 $DARWINUP install $PREFIX/root{,2,3}
 LINES=$($DARWINUP list | wc -l)
@@ -142,6 +219,11 @@ if [ $LINES -lt 5 ]; then
 	exit 1;
 fi
 $DARWINUP uninstall all
+# the root extracted ahead of one that fails is thrown away
+! $DARWINUP install $PREFIX/root $PREFIX/rep_file_dir $PREFIX/root2
+test "$($DARWINUP list | grep -c root)" == "1"
+test -z "$(find $DEST/.DarwinDepot/Archives -mindepth 1 -type d)"
+$DARWINUP uninstall all
 echo "DIFF: diffing original test files to dest (should be no diffs) ..."
 $DIFF $ORIG $DEST 2>&1
 
@@ -348,6 +430,579 @@ $DARWINUP uninstall all
 echo "DIFF: diffing original test files to dest (should be no diffs) ..."
 $DIFF $ORIG $DEST 2>&1
 
+echo "========== TEST: Paths are stored once =========="
+$DARWINUP install $PREFIX/root
+$DARWINUP install $PREFIX/root
+if [ -f $DEST/.DarwinDepot/Database-V100 ]; then
+	C=$(sqlite3 $DEST/.DarwinDepot/Database-V100 "SELECT count(*) FROM files WHERE path IS NOT NULL")
+	test "$C" == "0"
+	C=$(sqlite3 $DEST/.DarwinDepot/Database-V100 "SELECT count(*) FROM files")
+	P=$(sqlite3 $DEST/.DarwinDepot/Database-V100 "SELECT count(*) FROM files_paths")
+	test "$C" == "$P"
+fi
+C=$($DARWINUP files newest | grep -Ev '^Found' | wc -l | xargs)
+test "$C" == "11"
+$DARWINUP uninstall all
+# the paths only the uninstalled files had are gone too
+if [ -f $DEST/.DarwinDepot/Database-V100 ]; then
+	C=$(sqlite3 $DEST/.DarwinDepot/Database-V100 "SELECT count(*) FROM paths WHERE serial NOT IN (SELECT path_id FROM files)")
+	test "$C" == "0"
+fi
+echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+$DIFF $ORIG $DEST 2>&1
+
+if [ -f $DEST/.DarwinDepot/Log-V1 ]; then
+	echo "========== TEST: Log survives a torn write =========="
+	$DARWINUP install $PREFIX/root2
+	BEFORE=$($DARWINUP list)
+	# a transaction cut off in the middle is ignored and truncated
+	printf 'F\377\377\000\000garbage' >> $DEST/.DarwinDepot/Log-V1
+	AFTER=$($DARWINUP list)
+	test "$BEFORE" == "$AFTER"
+	$DARWINUP uninstall root2
+	echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+	$DIFF $ORIG $DEST 2>&1
+fi
+
+echo "========== TEST: Roots are analyzed in the same order every time =========="
+FIRST=$($DARWINUP install $PREFIX/300dirs.tbz2 | grep '^[A-Z?!] ')
+$DARWINUP uninstall 300dirs.tbz2
+SECOND=$($DARWINUP install $PREFIX/300dirs.tbz2 | grep '^[A-Z?!] ')
+$DARWINUP uninstall 300dirs.tbz2
+test "$FIRST" == "$SECOND"
+C=$(echo "$FIRST" | head -3 | xargs)
+test "$C" == "A /300dirs A /300dirs/1 A /300dirs/1/00.dir"
+echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+$DIFF $ORIG $DEST 2>&1
+
+echo "========== TEST: Removed trees are emptied from the trash =========="
+function trash_is_empty {
+	for I in $(seq 1 100);
+	do
+		C=$(ls $DEST/.DarwinDepot/Trash | wc -l | xargs)
+		if [ "$C" == "0" ]; then return 0; fi
+		sleep 0.1
+	done
+	return 1
+}
+$DARWINUP install $PREFIX/root
+$DARWINUP uninstall root
+trash_is_empty
+C=$(find $DEST/.DarwinDepot/Archives -mindepth 1 -type d | wc -l | xargs)
+test "$C" == "0"
+# leftovers are deleted by the next install or uninstall, commands that
+# only read leave them
+mkdir -p $DEST/.DarwinDepot/Trash/leftover/dir
+touch $DEST/.DarwinDepot/Trash/leftover/dir/file
+$DARWINUP list
+sleep 1
+test -f $DEST/.DarwinDepot/Trash/leftover/dir/file
+$DARWINUP install $PREFIX/root2
+$DARWINUP uninstall root2
+trash_is_empty
+echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+$DIFF $ORIG $DEST 2>&1
+
+echo "========== TEST: Interrupted installs and uninstalls are recovered =========="
+# DARWINUP_JOURNAL_EXIT stops darwinup right after the journal records
+# that many steps, as if it had crashed there. Only test builds have it.
+if [ $HASHOOKS -gt 0 ]; then
+	mkdir -p $PREFIX/journalroot/journal
+	echo new > $PREFIX/journalroot/journal.txt
+	seq 1 3 | (cd $PREFIX/journalroot/journal && xargs touch)
+	echo old > $DEST/journal.txt
+	# nothing was recorded yet, only the journal is cleared
+	! DARWINUP_JOURNAL_EXIT=1 $DARWINUP install $PREFIX/journalroot
+	! $DARWINUP uninstall nothere
+	test ! -s $DEST/.DarwinDepot/Journal-V1
+	test -z "$($DARWINUP list | grep journalroot)"
+	test "$(cat $DEST/journal.txt)" == "old"
+	# still backing up journal.txt, the install is undone
+	! DARWINUP_JOURNAL_EXIT=2 $DARWINUP install $PREFIX/journalroot
+	$DARWINUP install $PREFIX/root | tee $PREFIX/recover.log
+	grep -q "Rolling back interrupted install of journalroot" $PREFIX/recover.log
+	test -z "$($DARWINUP list | grep journalroot)"
+	test "$(cat $DEST/journal.txt)" == "old"
+	$DARWINUP uninstall root
+	# once files are being moved the install is finished instead
+	! DARWINUP_JOURNAL_EXIT=5 $DARWINUP install $PREFIX/journalroot
+	$DARWINUP rename journalroot recovered | tee $PREFIX/recover.log
+	grep -q "Finishing interrupted install of journalroot" $PREFIX/recover.log
+	$DIFF $PREFIX/journalroot/journal $DEST/journal
+	test "$(cat $DEST/journal.txt)" == "new"
+	test ! -s $DEST/.DarwinDepot/Journal-V1
+	# an uninstall is always finished
+	! DARWINUP_JOURNAL_EXIT=3 $DARWINUP uninstall recovered
+	$DARWINUP install $PREFIX/root | tee $PREFIX/recover.log
+	grep -q "Finishing interrupted uninstall of recovered" $PREFIX/recover.log
+	test -z "$($DARWINUP list | grep recovered)"
+	test "$(cat $DEST/journal.txt)" == "old"
+	$DARWINUP uninstall root
+	test ! -s $DEST/.DarwinDepot/Journal-V1
+	rm $DEST/journal.txt
+fi
+echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+$DIFF $ORIG $DEST 2>&1
+
+echo "========== TEST: Installs are durable before they are recorded =========="
+echo old > $DEST/journal.txt
+if [ $HASHOOKS -gt 0 ]; then
+	# every level recovers an install interrupted while files are being moved
+	for L in fast batched paranoid; do
+		! DARWINUP_JOURNAL_EXIT=5 $DARWINUP -s $L install $PREFIX/journalroot
+		$DARWINUP -s $L rename journalroot recovered | tee $PREFIX/recover.log
+		grep -q "Finishing interrupted install of journalroot" $PREFIX/recover.log
+		$DIFF $PREFIX/journalroot/journal $DEST/journal
+		test "$(cat $DEST/journal.txt)" == "new"
+		test ! -s $DEST/.DarwinDepot/Journal-V1
+		$DARWINUP -s $L uninstall recovered
+		test "$(cat $DEST/journal.txt)" == "old"
+	done
+fi
+# only the batched level collects files to sync together
+$DARWINUP -vv -s batched install $PREFIX/root 2>&1 | tee $PREFIX/sync.log
+grep -q "\[durability\] syncing" $PREFIX/sync.log
+$DARWINUP -vv -s fast install $PREFIX/root2 2>&1 | tee $PREFIX/sync.log
+! grep -q "\[durability\]" $PREFIX/sync.log
+! $DARWINUP -s sometimes list
+$DARWINUP uninstall all
+rm $DEST/journal.txt
+echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+$DIFF $ORIG $DEST 2>&1
+
+echo "========== TEST: Manifest matches the database =========="
+$DARWINUP install $PREFIX/root
+$DARWINUP install $PREFIX/root2
+test -f $DEST/.DarwinDepot/Manifest-V1
+FAST=$($DARWINUP list; $DARWINUP files all; $DARWINUP dump)
+# a directory in its place keeps the manifest from being used or written
+cp $DEST/.DarwinDepot/Manifest-V1 $PREFIX/Manifest-V1.old
+rm $DEST/.DarwinDepot/Manifest-V1
+mkdir $DEST/.DarwinDepot/Manifest-V1
+SLOW=$($DARWINUP list; $DARWINUP files all; $DARWINUP dump)
+rmdir $DEST/.DarwinDepot/Manifest-V1
+test "$FAST" == "$SLOW"
+# a stale manifest is ignored
+$DARWINUP uninstall root2
+cp $PREFIX/Manifest-V1.old $DEST/.DarwinDepot/Manifest-V1
+C=$($DARWINUP list | grep -c root2 || true)
+test "$C" == "0"
+$DARWINUP uninstall all
+echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+$DIFF $ORIG $DEST 2>&1
+
+echo "========== TEST: Read-only commands run on several archives at a time =========="
+for R in $ROOTS;
+do
+	$DARWINUP install $PREFIX/$R
+done
+rm $DEST/.DarwinDepot/Manifest-V1
+mkdir $DEST/.DarwinDepot/Manifest-V1
+# the same as going through the archives one at a time
+for C in files verify;
+do
+	ALL=$($DARWINUP $C all)
+	EACH=$(for S in $($DARWINUP list | awk 'NR > 2 { print $1 }'); do $DARWINUP $C $S; done)
+	test "$ALL" == "$EACH"
+done
+! $DARWINUP files root nothere root2 > $PREFIX/files.log
+tail -1 $PREFIX/files.log | grep -q "Archive not found: nothere"
+rmdir $DEST/.DarwinDepot/Manifest-V1
+$DARWINUP uninstall all
+echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+$DIFF $ORIG $DEST 2>&1
+
+echo "========== TEST: Several archives are uninstalled together =========="
+# the same result as uninstalling them one at a time
+for R in $ROOTS;
+do
+	$DARWINUP install $PREFIX/$R
+done
+EACH=$(for R in root3 root2; do $DARWINUP uninstall $R; done | grep -v "^Uninstalled")
+rm -rf $PREFIX/together
+mkdir $PREFIX/together
+tar cf - -C $DEST --exclude ./.DarwinDepot . | tar xf - -C $PREFIX/together
+$DARWINUP uninstall all
+for R in $ROOTS;
+do
+	$DARWINUP install $PREFIX/$R
+done
+ALL=$($DARWINUP uninstall root3 root2 | grep -v "^Uninstalled")
+test "$ALL" == "$EACH"
+$DIFF $PREFIX/together $DEST
+$DARWINUP uninstall all
+if [ $HASHOOKS -gt 0 ]; then
+	# an interrupted one is finished for all of them
+	for R in $ROOTS;
+	do
+		$DARWINUP install $PREFIX/$R
+	done
+	! DARWINUP_JOURNAL_EXIT=5 $DARWINUP uninstall root3 root2 root
+	! $DARWINUP uninstall nothere > $PREFIX/recover.log
+	grep -q "Finishing interrupted uninstall of root3" $PREFIX/recover.log
+	grep -q "Finishing interrupted uninstall of root" $PREFIX/recover.log
+	test -z "$($DARWINUP list | grep root)"
+	test ! -s $DEST/.DarwinDepot/Journal-V1
+fi
+echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+$DIFF $ORIG $DEST 2>&1
+
+echo "========== TEST: Upgrades only change files that differ =========="
+rm -rf $PREFIX/upgrade
+mkdir -p $PREFIX/upgrade/old $PREFIX/upgrade/new
+cp -R $PREFIX/root2 $PREFIX/upgrade/old/root2
+cp -R $PREFIX/root2 $PREFIX/upgrade/new/root2
+echo "changed" > $PREFIX/upgrade/new/root2/a/file_a.txt
+chmod 600 $PREFIX/upgrade/new/root2/c.txt
+rm -rf $PREFIX/upgrade/new/root2/e
+mkdir $PREFIX/upgrade/new/root2/n
+echo "new" > $PREFIX/upgrade/new/root2/n/file_n.txt
+# the same result as installing the new root on its own
+$DARWINUP install $PREFIX/upgrade/new/root2
+FILES=$($DARWINUP files root2 | grep '^[-dl]')
+rm -rf $PREFIX/upgraded
+mkdir $PREFIX/upgraded
+tar cf - -C $DEST --exclude ./.DarwinDepot . | tar xf - -C $PREFIX/upgraded
+$DARWINUP uninstall root2
+$DARWINUP install $PREFIX/upgrade/old/root2
+$DARWINUP upgrade $PREFIX/upgrade/new/root2
+C=$($DARWINUP list | grep -c root2)
+test "$C" == "1"
+UPGRADED=$($DARWINUP files root2 | grep '^[-dl]')
+test "$UPGRADED" == "$FILES"
+$DIFF $PREFIX/upgraded $DEST
+$DARWINUP uninstall root2
+if [ $HASHOOKS -gt 0 ]; then
+	# an interrupted one is finished once files are being moved
+	$DARWINUP install $PREFIX/upgrade/old/root2
+	OLD=$($DARWINUP list | grep root2 | awk '{print $1}')
+	! DARWINUP_JOURNAL_EXIT=4 $DARWINUP upgrade $PREFIX/upgrade/new/root2
+	! $DARWINUP uninstall nothere > $PREFIX/recover.log
+	grep -q "Finishing interrupted install of root2" $PREFIX/recover.log
+	$DARWINUP uninstall $OLD
+	UPGRADED=$($DARWINUP files root2 | grep '^[-dl]')
+	test "$UPGRADED" == "$FILES"
+	$DIFF $PREFIX/upgraded $DEST
+	$DARWINUP uninstall root2
+fi
+echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+$DIFF $ORIG $DEST 2>&1
+
+echo "========== TEST: Roots are streamed from the standard input =========="
+# the same result as installing the directory
+$DARWINUP install $PREFIX/root2
+FILES=$($DARWINUP files root2 | grep '^[-dl]')
+rm -rf $PREFIX/streamed
+mkdir $PREFIX/streamed
+tar cf - -C $DEST --exclude ./.DarwinDepot . | tar xf - -C $PREFIX/streamed
+$DARWINUP uninstall root2
+tar cf - -C $PREFIX/root2 . | $DARWINUP install -
+STREAMED=$($DARWINUP files - | grep '^[-dl]')
+test "$STREAMED" == "$FILES"
+$DIFF $PREFIX/streamed $DEST
+# files the stream left unchanged are restored from its backing store
+tar cf - -C $PREFIX/root2 . | $DARWINUP install -
+$DARWINUP install $PREFIX/root
+$DARWINUP uninstall root
+$DIFF $PREFIX/streamed $DEST
+$DARWINUP uninstall all
+# a stream that was cut short is not installed
+! (tar cf - -C $PREFIX/root2 . | head -c 2048 | $DARWINUP install -)
+test -z "$($DARWINUP list | grep -- ' -$')"
+# nothing is written through a symlink the stream put where a directory goes
+mkdir -p $PREFIX/outside $PREFIX/evil/link $PREFIX/evil/dir/evil
+echo outside > $PREFIX/outside/foo
+ln -s $PREFIX/outside $PREFIX/evil/link/evil
+echo evil > $PREFIX/evil/dir/evil/foo
+tar cf $PREFIX/evil.tar -C $PREFIX/evil/link ./evil
+tar rf $PREFIX/evil.tar -C $PREFIX/evil/dir ./evil/foo
+! $DARWINUP install - < $PREFIX/evil.tar
+test "$(cat $PREFIX/outside/foo)" == "outside"
+if [ -x "$(which python3)" ]; then
+	# and no hard link goes through one either
+	python3 -c "import tarfile; t = tarfile.open('$PREFIX/evil.tar', 'w'); \
+a = tarfile.TarInfo('evil'); a.type = tarfile.SYMTYPE; a.linkname = '$PREFIX/outside'; \
+t.addfile(a); b = tarfile.TarInfo('evil_link'); b.type = tarfile.LNKTYPE; \
+b.linkname = 'evil/foo'; t.addfile(b); t.close()"
+	! $DARWINUP install - < $PREFIX/evil.tar
+	test "$(ls -l $PREFIX/outside/foo | awk '{print $2}')" == "1"
+fi
+test ! -e $DEST/evil
+test -z "$($DARWINUP list | grep -- ' -$')"
+echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+$DIFF $ORIG $DEST 2>&1
+
+echo "========== TEST: Reinstalling an unchanged root =========="
+$DARWINUP install $PREFIX/root
+LIST=$($DARWINUP list)
+$DARWINUP install $PREFIX/root | grep -q "^No changes"
+test "$($DARWINUP list)" == "$LIST"
+$DARWINUP -n install $PREFIX/root | grep -q "^No changes"
+# a file that was only touched is still the same
+touch $DEST/c.txt
+$DARWINUP install $PREFIX/root | grep -q "^No changes"
+# a file that changed since is installed again
+chmod 600 $DEST/c.txt
+$DARWINUP install $PREFIX/root | grep -q "^U /c.txt"
+test "$($DARWINUP list | grep -c ' root$')" == "2"
+# as is a root with files installed over it
+$DARWINUP install $PREFIX/root
+$DARWINUP install $PREFIX/root3
+$DARWINUP install $PREFIX/root | grep -q "^U /c.txt"
+$DARWINUP uninstall all
+chmod 644 $DEST/c.txt
+# a root with files linked to each other is recognized too
+cp -Rp $PREFIX/root $PREFIX/linked
+echo linked > $PREFIX/linked/d.txt
+ln $PREFIX/linked/d.txt $PREFIX/linked/e.txt
+$DARWINUP install $PREFIX/linked
+$DARWINUP install $PREFIX/linked | grep -q "^No changes"
+test "$($DARWINUP list | grep -c ' linked$')" == "1"
+$DARWINUP uninstall all
+echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+$DIFF $ORIG $DEST 2>&1
+
+echo "========== TEST: Depots share backing stores through an object store =========="
+STORE=$PREFIX/store
+DEST2=$PREFIX/dest2
+DEST3=$PREFIX/dest3
+DARWINUP2=${DARWINUP/-p $DEST /-p $DEST2 }
+DARWINUP3=${DARWINUP/-p $DEST /-p $DEST3 }
+function store_holds {
+	for I in $(seq 1 100);
+	do
+		C=$(find $STORE -type f | wc -l | xargs)
+		if [ "$C" == "$1" ]; then return 0; fi
+		sleep 0.1
+	done
+	return 1
+}
+cp -Rp $ORIG $DEST2
+cp -Rp $ORIG $DEST3
+$DARWINUP2 -o $STORE install $PREFIX/root
+$DARWINUP3 -o $STORE install $PREFIX/root
+# the root and its rollback are stored once, linked from both depots
+C=$(find $STORE -type f | wc -l | xargs)
+test "$C" == "2"
+C=$(find $STORE -type f -links 3 | wc -l | xargs)
+test "$C" == "2"
+# the depots remember the store
+$DARWINUP2 install $PREFIX/root2
+$DARWINUP3 install $PREFIX/root2
+C=$(find $STORE -type f -links 3 | wc -l | xargs)
+test "$C" == "3"
+# the second depot expands backing stores the first one compacted
+$DARWINUP3 uninstall all
+$DIFF $ORIG $DEST3 2>&1
+C=$(find $STORE -type f | wc -l | xargs)
+test "$C" == "3"
+# objects go away with the last depot linking to them, the rollback
+# of the base system stays
+$DARWINUP2 uninstall all
+$DIFF $ORIG $DEST2 2>&1
+store_holds 1
+C=$(find $STORE -type f -links 3 | wc -l | xargs)
+test "$C" == "1"
+rm -rf $DEST2 $DEST3 $STORE
+
+echo "========== TEST: Stats describe the depot =========="
+C=$($DARWINUP stats json | grep '"roots"')
+test "$C" == '  "roots": 0,'
+$DARWINUP install $PREFIX/root
+$DARWINUP install $PREFIX/root2
+$DARWINUP stats | tee $PREFIX/stats.log
+grep -q "^Archives: .*(2 roots" $PREFIX/stats.log
+grep -q " root2$" $PREFIX/stats.log
+grep -q "^Largest: " $PREFIX/stats.log
+$DARWINUP stats json | tee $PREFIX/stats.log
+grep -q '"roots": 2,' $PREFIX/stats.log
+grep -q '"name": "root2", "rollback": false' $PREFIX/stats.log
+grep -q '"engine": "' $PREFIX/stats.log
+# the same archives are counted either way
+C=$(grep -c '"serial"' $PREFIX/stats.log)
+test "$C" == "$($DARWINUP stats | grep -c '^[0-9]')"
+! $DARWINUP stats xml
+$DARWINUP uninstall all
+echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+$DIFF $ORIG $DEST 2>&1
+
+echo "========== TEST: Hard links are installed as links =========="
+mkdir -p $DEST/hardlink $ORIG/hardlink
+echo "base data" > $DEST/hardlink/a
+ln $DEST/hardlink/a $DEST/hardlink/b
+cp -Rp $DEST/hardlink/ $ORIG/
+mkdir -p $PREFIX/hardlinks/hardlink $PREFIX/hardlinks2/hardlink
+echo "root data" > $PREFIX/hardlinks/hardlink/a
+ln $PREFIX/hardlinks/hardlink/a $PREFIX/hardlinks/hardlink/b
+ln $PREFIX/hardlinks/hardlink/a $PREFIX/hardlinks/hardlink/c
+echo "base data" > $PREFIX/hardlinks2/hardlink/a
+ln $PREFIX/hardlinks2/hardlink/a $PREFIX/hardlinks2/hardlink/b
+$DARWINUP install $PREFIX/hardlinks
+[ $DEST/hardlink/a -ef $DEST/hardlink/b ]
+[ $DEST/hardlink/a -ef $DEST/hardlink/c ]
+$DARWINUP files newest | grep -q "hardlink/c"
+$DARWINUP uninstall newest
+[ $DEST/hardlink/a -ef $DEST/hardlink/b ]
+$DIFF $ORIG $DEST 2>&1
+# links that were broken apart are linked again, even with the same data
+cp $DEST/hardlink/a $DEST/hardlink/a.copy
+mv $DEST/hardlink/a.copy $DEST/hardlink/a
+$DARWINUP install $PREFIX/hardlinks2 | grep -q "^U /hardlink/a$"
+[ $DEST/hardlink/a -ef $DEST/hardlink/b ]
+$DARWINUP uninstall newest
+$DIFF $ORIG $DEST 2>&1
+rm -rf $DEST/hardlink $ORIG/hardlink
+echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+$DIFF $ORIG $DEST 2>&1
+
+echo "========== TEST: Rollback copies are stored as deltas =========="
+for F in a b c; do
+	seq 1 12000 > $DEST/big_$F.txt
+	cp $DEST/big_$F.txt $ORIG/big_$F.txt
+	mkdir -p $PREFIX/delta_${F}1 $PREFIX/delta_${F}2
+	sed 's/^5000$/five thousand/' $DEST/big_$F.txt > $PREFIX/delta_${F}1/big_$F.txt
+	sed 's/^7000$/seven thousand/' $DEST/big_$F.txt > $PREFIX/delta_${F}2/big_$F.txt
+done
+# the rollback copy keeps its mode through the delta
+chmod 600 $DEST/big_a.txt
+$DARWINUP -c install $PREFIX/delta_a1 | tee $PREFIX/delta.log
+grep -q "^Rollback deltas saved [0-9]* bytes$" $PREFIX/delta.log
+$DARWINUP uninstall delta_a1
+$DIFF $ORIG $DEST 2>&1
+test "$(ls -l $DEST/big_a.txt | cut -c1-10)" == "-rw-------"
+# the file a delta was made against is uninstalled first
+$DARWINUP -c install $PREFIX/delta_b1 | grep -q "^Rollback deltas saved"
+$DARWINUP -c install $PREFIX/delta_b2 > $PREFIX/delta.log
+! grep -q "^Rollback deltas saved" $PREFIX/delta.log
+$DARWINUP uninstall delta_b1
+cmp $PREFIX/delta_b2/big_b.txt $DEST/big_b.txt
+$DARWINUP uninstall delta_b2
+$DIFF $ORIG $DEST 2>&1
+# and both at once
+$DARWINUP -c install $PREFIX/delta_c1 | grep -q "^Rollback deltas saved"
+$DARWINUP install $PREFIX/delta_c2
+$DARWINUP uninstall delta_c1 delta_c2
+$DIFF $ORIG $DEST 2>&1
+$DARWINUP uninstall all
+for F in a b c; do
+	rm $DEST/big_$F.txt $ORIG/big_$F.txt
+done
+echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+$DIFF $ORIG $DEST 2>&1
+
+echo "========== TEST: status and verify only compare what changed =========="
+$DARWINUP install $PREFIX/root
+test -z "$($DARWINUP status)"
+echo changed >> $DEST/c.txt
+$DARWINUP status | grep -q "^M /c.txt$"
+rm $DEST/a/file_a.txt
+mkdir $DEST/a/file_a.txt
+rm -rf $DEST/b
+$DARWINUP status > $PREFIX/status.log
+grep -q "^T /a/file_a.txt$" $PREFIX/status.log
+grep -q "^R /b$" $PREFIX/status.log
+grep -q "^R /b/file_b$" $PREFIX/status.log
+test "$(wc -l < $PREFIX/status.log | xargs)" == "4"
+rmdir $DEST/a/file_a.txt
+cp -Rp $PREFIX/root/a/file_a.txt $DEST/a/
+cp -Rp $PREFIX/root/b $DEST/
+$DARWINUP status | grep -q "^M /c.txt$"
+$DARWINUP uninstall newest
+$DARWINUP install $PREFIX/root
+$DARWINUP watch &
+WATCH=$!
+sleep 2
+! $DARWINUP watch
+# the first status after the watcher started still looks at everything
+test -z "$($DARWINUP status)"
+echo changed >> $DEST/c.txt
+sleep 2
+$DARWINUP status | grep -q "^M /c.txt$"
+$DARWINUP verify newest | grep -q "^R .* /c.txt$"
+# a directory put in place of another one changed everything below it
+cp -Rp $DEST/a $PREFIX/a.new
+echo different > $PREFIX/a.new/file_a.txt
+mv $DEST/a $PREFIX/a.old
+mv $PREFIX/a.new $DEST/a
+sleep 2
+$DARWINUP status | grep -q "^M /a/file_a.txt$"
+$DARWINUP verify newest | grep -q "^R .* /a/file_a.txt$"
+rm -rf $DEST/a
+mv $PREFIX/a.old $DEST/a
+kill $WATCH
+wait $WATCH
+$DARWINUP status | grep -q "^M /c.txt$"
+$DARWINUP uninstall newest
+cp $ORIG/c.txt $DEST/c.txt
+echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+$DIFF $ORIG $DEST 2>&1
+
+echo "========== TEST: gc removes what the depot no longer needs =========="
+$DARWINUP install $PREFIX/root
+LIST=$($DARWINUP list)
+echo orphan > $DEST/.DarwinDepot/Archives/orphan.tar.bz2
+mkdir $DEST/.DarwinDepot/Downloads/.download.test
+echo partial > $DEST/.DarwinDepot/Downloads/.download.test/root.tar
+$DARWINUP -n gc | tee $PREFIX/gc.log
+grep -q "Archives/orphan.tar.bz2$" $PREFIX/gc.log
+grep -q "Downloads/.download.test$" $PREFIX/gc.log
+grep -q "^[0-9]* bytes reclaimable$" $PREFIX/gc.log
+test -f $DEST/.DarwinDepot/Archives/orphan.tar.bz2
+test -d $DEST/.DarwinDepot/Downloads/.download.test
+$DARWINUP gc 1 | tee $PREFIX/gc.log
+grep -q "^[0-9]* bytes reclaimed$" $PREFIX/gc.log
+test ! -e $DEST/.DarwinDepot/Archives/orphan.tar.bz2
+test ! -e $DEST/.DarwinDepot/Downloads/.download.test
+test "$LIST" == "$($DARWINUP list)"
+# nothing is left to collect
+C=$($DARWINUP gc | grep -c "Archives/\|Downloads/" || true)
+test "$C" == "0"
+! $DARWINUP gc soon
+$DARWINUP uninstall all
+echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+$DIFF $ORIG $DEST 2>&1
+
+echo "========== TEST: Commands run through the daemon =========="
+$DARWINUP install $PREFIX/root
+DIRECT=$($DARWINUP list; $DARWINUP files all)
+$DARWINUP daemon &
+DAEMON=$!
+while [ ! -S $DEST/.DarwinDepot/Daemon-V1 ]; do sleep 0.1; done
+SERVED=$($DARWINUP list; $DARWINUP files all)
+test "$DIRECT" == "$SERVED"
+! $DARWINUP daemon
+if [ -x "$(which python3)" ]; then
+	# a client that never sends its request holds up nobody
+	python3 -c "import socket, time; s = socket.socket(socket.AF_UNIX); \
+s.connect('$DEST/.DarwinDepot/Daemon-V1'); time.sleep(30)" &
+	IDLE=$!
+	sleep 1
+	test "$DIRECT" == "$($DARWINUP list; $DARWINUP files all)"
+	kill -0 $IDLE
+	kill $IDLE
+	wait $IDLE || true
+fi
+$DARWINUP install $PREFIX/root2 &
+FIRST=$!
+$DARWINUP install $PREFIX/root3 &
+SECOND=$!
+wait $FIRST
+wait $SECOND
+C=$($DARWINUP list | grep -c root2)
+test "$C" == "1"
+C=$($DARWINUP list | grep -c root3)
+test "$C" == "1"
+set +e
+$DARWINUP files nonexistent
+if [ $? -ne 255 ]; then exit 1; fi
+set -e
+$DARWINUP uninstall all
+kill $DAEMON
+wait $DAEMON || true
+test ! -e $DEST/.DarwinDepot/Daemon-V1
+echo "DIFF: diffing original test files to dest (should be no diffs) ..."
+$DIFF $ORIG $DEST 2>&1
+
 echo "========== TEST: Modify /System/Library/Extensions =========="
 mkdir -p $DEST/System/Library/Extensions/Foo.kext
 BEFORE=$(ls -Tld $DEST/System/Library/Extensions/ | awk '{print $6$7$8$9}');
@@ -9,4 +9,7 @@ do
 	fi
 done
 
+# darwinup again on a depot using the log storage engine
+darwinup/run-tests.sh "-e log"
+
 echo "INFO: All testing completed!"